@@ -0,0 +1,83 @@
+#include "ast.hh"
+
+#include <cstring>
+
+const char* Arena::copy(const char* str) {
+  std::size_t size = std::strlen(str) + 1;
+  char* copy = static_cast<char*>(allocate(size, 1));
+
+  std::memcpy(copy, str, size);
+  return copy;
+}
+
+void Arena::clear() {
+  m_chunks.clear();
+  m_used = 0;
+  m_size = 0;
+}
+
+void* Arena::allocate(std::size_t size, std::size_t align) {
+  std::size_t offset = (m_used + align - 1) & ~(align - 1);
+
+  if (offset + size > m_size) {
+    // Oversized requests get a chunk of their own.
+    m_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+    m_chunks.emplace_back(new char[m_size]);
+    offset = 0;
+  }
+
+  m_used = offset + size;
+  return m_chunks.back().get() + offset;
+}
+
+namespace ast {
+
+bool is_literal(const Expr* expr) {
+  switch (expr->kind) {
+    case ExprKind::Integer:
+    case ExprKind::Number:
+    case ExprKind::Bool:
+    case ExprKind::String:
+    case ExprKind::Symbol:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool is_trivial(const Expr* expr) {
+  return is_literal(expr) || expr->kind == ExprKind::Local;
+}
+
+bool equal(const Expr* a, const Expr* b) {
+  if (a->kind != b->kind) return false;
+
+  switch (a->kind) {
+    case ExprKind::Integer: return a->integer == b->integer;
+    // Bitwise, so that 0.0 and -0.0 differ.
+    case ExprKind::Number: return std::memcmp(&a->number, &b->number, sizeof(double)) == 0;
+    case ExprKind::Bool: return a->boolean == b->boolean;
+    case ExprKind::String:
+    case ExprKind::Symbol:
+      return std::strcmp(a->name, b->name) == 0;
+    case ExprKind::Local: return a->local == b->local;
+    case ExprKind::Unary: return a->op == b->op && equal(a->a, b->a);
+    case ExprKind::Binary: return a->op == b->op && equal(a->a, b->a) && equal(a->b, b->b);
+    default: return false;
+  }
+}
+
+std::size_t cost(const Expr* expr) {
+  std::size_t total = 1;
+
+  if (expr->a) total += cost(expr->a);
+  if (expr->b) total += cost(expr->b);
+
+  for (const Expr* item = expr->list; item; item = item->next) {
+    total += cost(item);
+  }
+
+  return total;
+}
+
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for the syntax tree. Nodes are plain structs that are
+// never destroyed one by one, the whole tree goes away with clear().
+class Arena {
+public:
+  Arena() = default;
+  Arena(const Arena&) = delete;
+  Arena& operator =(const Arena&) = delete;
+  Arena(Arena&&) = default;
+  Arena& operator =(Arena&&) = default;
+
+  // A zero initialized T.
+  template<typename T>
+  T* make() {
+    static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+    return new (allocate(sizeof(T), alignof(T))) T();
+  }
+
+  template<typename T>
+  T* make_array(std::size_t count) {
+    static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+    T* array = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+
+    for (std::size_t i = 0; i < count; ++i) {
+      new (array + i) T();
+    }
+
+    return array;
+  }
+
+  const char* copy(const char* str);
+
+  // Frees every object.
+  void clear();
+
+private:
+  static const std::size_t CHUNK_SIZE = 32 * 1024;
+
+  void* allocate(std::size_t size, std::size_t align);
+
+  std::vector<std::unique_ptr<char[]>> m_chunks;
+  // Bytes used and size of the last chunk.
+  std::size_t m_used { 0 };
+  std::size_t m_size { 0 };
+};
+
+// Syntax tree built by the Compiler, rewritten by the optimizer passes and
+// lowered to bytecode. Names are resolved while parsing: every local
+// variable is a Local the uses point at, anything else is a global.
+namespace ast {
+
+struct Local {
+  const char* name;
+
+  // Stack slot relative to the frame, assigned when the code is lowered.
+  std::size_t slot;
+};
+
+enum class ExprKind : std::uint8_t {
+  Integer,
+  Number,
+  Bool,
+  String,
+  Symbol,
+
+  Local,
+  Global,
+
+  Unary,       // op a
+  Binary,      // a op b
+  And,         // a and b, short-circuits
+  Or,          // a or b, short-circuits
+
+  Call,        // a(list)
+  Intrinsic,   // op(list)
+  Index,       // a[b]
+  Property,    // a.name
+  Array,       // [list]
+  Object,      // {list}, a list of Fields
+  Field,       // name: a
+
+  // Evaluates a and keeps a copy of the value in local, the optimizer
+  // inserts it for values that are used again.
+  Tee,
+};
+
+struct Expr {
+  ExprKind kind;
+
+  // Instruction of Unary, Binary and Intrinsic nodes, arith is the
+  // operator of map() or the function of a math intrinsic.
+  std::uint8_t op;
+  std::uint8_t arith;
+
+  // Binary: both operands are known to be numbers, lowered to the
+  // unchecked instruction. Set by passes::infer_types().
+  bool numeric;
+
+  // Line the instruction is attributed to.
+  std::size_t line;
+
+  union {
+    std::int64_t integer;
+    double number;
+    bool boolean;
+
+    // String and Symbol values, Global, Property and Field names.
+    const char* name;
+
+    // Local and Tee
+    Local* local;
+  };
+
+  Expr* a;
+  Expr* b;
+
+  // Arguments and elements, linked through next.
+  Expr* list;
+  std::size_t count;
+  Expr* next;
+
+  // Inline cache site of Property and Field. Nodes lowered twice, like
+  // loop conditions, share one.
+  bool has_site;
+  std::size_t site;
+};
+
+enum class StmtKind : std::uint8_t {
+  Expression,    // a;
+  Print,         // print a;
+  Let,           // let local = a; a is null without an initializer
+  Global,        // let name = a; at the top level
+  Assign,        // local or name op= a, op is 0 for plain '='
+  StoreIndex,    // a[b] = c;
+  StoreProperty, // a.name = c;
+  Block,         // { body }
+  If,            // if a { body } else orelse
+  While,         // while a { body } else orelse
+  For,           // for local in a..b step c { body }
+  Break,
+  Continue,
+  Return,        // return a; a is null for 'return;'
+  Function,      // function name(params) { body }
+};
+
+struct Stmt {
+  StmtKind kind;
+
+  // Arithmetic instruction of a compound assignment.
+  std::uint8_t op;
+
+  std::size_t line;
+
+  Local* local;
+  const char* name;
+
+  Expr* a;
+  Expr* b;
+  Expr* c;
+
+  // Statements of Block and Function, a Block for If, While and For.
+  Stmt* body;
+  // A Block, or an If for 'else if'.
+  Stmt* orelse;
+  Stmt* next;
+
+  // Parameters of a Function.
+  Local** params;
+  std::size_t count;
+};
+
+bool is_literal(const Expr* expr);
+
+// Evaluating the expression has no effects and can't fail: literals and
+// local variables.
+bool is_trivial(const Expr* expr);
+
+// Structural equality of expressions built from literals, locals and
+// arithmetic.
+bool equal(const Expr* a, const Expr* b);
+
+// Number of instructions the expression lowers to.
+std::size_t cost(const Expr* expr);
+
+}
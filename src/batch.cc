@@ -0,0 +1,84 @@
+#include "batch.hh"
+#include "compiler.hh"
+#include "output.hh"
+#include "scheduler.hh"
+#include "thread_pool.hh"
+#include "virtual_machine.hh"
+
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sysexits.h>
+
+namespace {
+
+struct Result {
+  bool done { false };
+  int status { EX_OK };
+  Output output { Output::Target::Memory };
+};
+
+}
+
+int run_batch(const std::vector<std::string>& paths, bool jit, int level, Bytecode::Format format,
+    Cache* cache, std::int64_t quantum, std::size_t threads) {
+  ThreadPool pool(threads);
+  Scheduler scheduler(threads, quantum);
+
+  std::vector<Compiler> compilers(pool.size());
+  std::vector<Result> results(paths.size());
+
+  for (Compiler& compiler : compilers) {
+    compiler.set_cache(cache);
+    compiler.set_level(level);
+    compiler.set_format(format);
+  }
+
+  std::mutex mutex;
+  std::size_t flushed = 0;
+  bool failed = false;
+
+  auto finish = [&](std::size_t i, int status) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    results[i].done = true;
+    results[i].status = status;
+
+    // Write out every finished script that isn't waiting for an earlier one.
+    for (; flushed < results.size() && results[flushed].done; ++flushed) {
+      Result& result = results[flushed];
+
+      std::cout << result.output.str() << std::flush;
+      std::cerr << paths[flushed] << ": " << result.status << "\n";
+
+      failed = failed || result.status != EX_OK;
+      result.output.clear();
+    }
+  };
+
+  // Scripts are compiled on the pool and then run as scheduler tasks.
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    pool.submit([&, i](std::size_t worker) {
+      Bytecode code;
+      Compiler& compiler = compilers[worker];
+
+      compiler.set_output(results[i].output.stream());
+
+      if (!compiler.from_file(paths[i].c_str(), code)) {
+        finish(i, EX_SOFTWARE);
+        return;
+      }
+
+      Program program = std::make_shared<const Bytecode>(std::move(code));
+
+      scheduler.spawn(program, results[i].output, jit, [&, i](VirtualMachine::Status status) {
+        finish(i, status == VirtualMachine::Status::Finished ? EX_OK : EX_SOFTWARE);
+      });
+    });
+  }
+
+  pool.wait();
+  scheduler.wait();
+
+  return failed ? EX_SOFTWARE : EX_OK;
+}
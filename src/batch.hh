@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "virtual_machine.hh"
+
+class Cache;
+
+// Runs many scripts concurrently. Scripts are compiled on a thread pool,
+// every worker keeps its own compiler and reuses it for all scripts it
+// picks up, and are then run on a Scheduler, time sliced into quantums of
+// instructions. Output of a script is buffered and written to stdout in
+// input order, once the scripts before it are done. The exit code of each script is reported on stderr. The
+// compilation cache, if any, is shared by all workers.
+//
+// Returns EX_OK if every script succeeded, EX_SOFTWARE otherwise.
+int run_batch(const std::vector<std::string>& paths, bool jit, int level, Bytecode::Format format,
+    Cache* cache, std::int64_t quantum, std::size_t threads = 0);
@@ -0,0 +1,394 @@
+#include "c_emitter.hh"
+#include "value.hh"
+#include "virtual_machine.hh"
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+
+bool CEmitter::emit(const Bytecode& code, std::ostream& os) {
+  const std::vector<std::uint8_t>& text = code.get_code();
+
+  if (code.get_format() != Bytecode::Format::Stack) {
+    std::cerr << "--emit-c: only stack code can be translated\n";
+    return false;
+  }
+
+  auto read_qword = [&](std::size_t address) {
+    QwordToBytes qtb;
+    std::copy(text.begin() + address, text.begin() + address + 8, qtb.bytes);
+    return qtb.qword;
+  };
+
+  m_globals.clear();
+  m_symbols.clear();
+
+  std::size_t n_consts = 0;
+  std::vector<std::size_t> return_sites;
+
+  for (std::size_t address = 0; address < text.size();
+       address += VirtualMachine::instruction_size(text[address])) {
+    switch (text[address]) {
+      case VirtualMachine::Call:
+        return_sites.push_back(address + 2);
+        break;
+      case VirtualMachine::AllocGlobal:
+      case VirtualMachine::StoreGlobal:
+      case VirtualMachine::LoadGlobal:
+        m_globals.emplace(text[address + 1], m_globals.size());
+        // fallthrough
+      case VirtualMachine::Constant16:
+      case VirtualMachine::BinaryConst:
+        n_consts = std::max(n_consts, (std::size_t) text[address + 1] + 1);
+        break;
+      case VirtualMachine::IncLocal:
+      case VirtualMachine::BinaryLocalConst:
+        n_consts = std::max(n_consts, (std::size_t) text[address + 2] + 1);
+        break;
+    }
+  }
+
+  os << "/* Generated by dukkha --emit-c. */\n"
+     << "#define DUKKHA_C_RUNTIME\n"
+     << "#include \"runtime.h\"\n\n"
+     << "#pragma GCC diagnostic ignored \"-Wunused-label\"\n\n";
+
+  for (std::size_t i = 0; i < n_consts; ++i) {
+    const Value& value = code.get_const(i);
+
+    if (value.is(ValueType::Symbol) && !m_symbols.count(value.as_symbol())) {
+      os << "static const char SYM" << m_symbols.size() << "[] = "
+         << quote(SymbolTable::name(value.as_symbol())) << ";\n";
+      m_symbols.emplace(value.as_symbol(), m_symbols.size());
+    }
+  }
+
+  if (!m_symbols.empty()) {
+    os << "\n";
+  }
+
+  if (n_consts > 0) {
+    os << "static const du_value K[" << n_consts << "] = {\n";
+
+    for (std::size_t i = 0; i < n_consts; ++i) {
+      os << "  ";
+      emit_const(code.get_const(i), os);
+      os << ",\n";
+    }
+
+    os << "};\n\n";
+  }
+
+  if (!m_globals.empty()) {
+    std::vector<std::size_t> names(m_globals.size());
+
+    for (const auto& global : m_globals) {
+      names[global.second] = global.first;
+    }
+
+    os << "static du_global G[" << names.size() << "] = {\n";
+
+    for (auto name : names) {
+      os << "  { " << quote(code.get_const(name).as_string()) << ", false, { DU_NULL, { 0 } } },\n";
+    }
+
+    os << "};\n\n";
+  }
+
+  const std::vector<Function>& functions = code.get_functions();
+  bool calls = !functions.empty() || !return_sites.empty();
+
+  if (functions.empty()) {
+    os << "static const du_function* const FN = NULL;\n\n";
+  } else {
+    os << "static const du_function FN[" << functions.size() << "] = {\n";
+
+    for (const auto& function : functions) {
+      os << "  { " << quote(function.name) << ", " << (int) function.arity << " },\n";
+    }
+
+    os << "};\n\n";
+  }
+
+  os << "int main(void) {\n"
+     << "  static du_value S[1024];\n"
+     << "  du_value* sp = S;\n"
+     << "  du_value* fp = S;\n"
+     << "  (void) fp;\n";
+
+  // Calls push a frame with the address of the return site and go through
+  // du_enter, Return pops it and goes through du_return.
+  if (calls) {
+    os << "  static du_frame F[256];\n"
+       << "  int fc = 0;\n"
+       << "  int64_t fn = 0;\n"
+       << "  size_t ret = 0;\n";
+  }
+
+  os << "\n";
+
+  for (std::size_t address = 0; address < text.size(); ) {
+    std::uint8_t op = text[address];
+    std::size_t size = VirtualMachine::instruction_size(op);
+    std::size_t next = address + size;
+
+    // Runtime errors are reported at the same line and offset as the VM,
+    // which reports the address of the next instruction.
+    std::ostringstream loc;
+    loc << code.get_line(next - 1) << ", " << next;
+
+    auto global = [&]() {
+      return "&G[" + std::to_string(m_globals.at(text[address + 1])) + "]";
+    };
+
+    auto label = [&]() {
+      return "L" + std::to_string(read_qword(address + 1));
+    };
+
+    auto binary = [&](const char* fn) {
+      os << "sp[-2] = " << fn << "(sp[-2], sp[-1], " << loc.str() << "); sp--;";
+    };
+
+    // Numeric operands can't fail, there's no location to report.
+    auto numeric = [&](const char* fn) {
+      os << "sp[-2] = " << fn << "(sp[-2], sp[-1]); sp--;";
+    };
+
+    // Superinstructions: the operand expressions and op, their last
+    // operand.
+    auto fused = [&](const std::string& a, const std::string& b, const char* dest) {
+      std::string call;
+
+      switch (text[next - 1]) {
+        case VirtualMachine::Add: call = "du_add(" + a + ", " + b + ", " + loc.str() + ")"; break;
+        case VirtualMachine::Subtract: call = "du_sub(" + a + ", " + b + ", " + loc.str() + ")"; break;
+        case VirtualMachine::Multiply: call = "du_mul(" + a + ", " + b + ", " + loc.str() + ")"; break;
+        case VirtualMachine::Divide: call = "du_div(" + a + ", " + b + ", " + loc.str() + ")"; break;
+        case VirtualMachine::Exp: call = "du_exp(" + a + ", " + b + ", " + loc.str() + ")"; break;
+        case VirtualMachine::Equal: call = "du_equal(" + a + ", " + b + ", " + loc.str() + ")"; break;
+        case VirtualMachine::Greater: call = "du_greater(" + a + ", " + b + ", " + loc.str() + ")"; break;
+        case VirtualMachine::Less: call = "du_less(" + a + ", " + b + ", " + loc.str() + ")"; break;
+        case VirtualMachine::AddNum: call = "du_add_num(" + a + ", " + b + ")"; break;
+        case VirtualMachine::SubNum: call = "du_sub_num(" + a + ", " + b + ")"; break;
+        case VirtualMachine::MulNum: call = "du_mul_num(" + a + ", " + b + ")"; break;
+        case VirtualMachine::DivNum: call = "du_div_num(" + a + ", " + b + ")"; break;
+        case VirtualMachine::LessNum: call = "du_less_num(" + a + ", " + b + ")"; break;
+        default: call = "du_greater_num(" + a + ", " + b + ")"; break;
+      }
+
+      os << dest << " = " << call << ";";
+    };
+
+    auto local = [&](std::size_t operand) {
+      return "fp[" + std::to_string(text[address + operand]) + "]";
+    };
+
+    auto constant = [&](std::size_t operand) {
+      return "K[" + std::to_string(text[address + operand]) + "]";
+    };
+
+    os << "L" << address << ": ";
+
+    switch (op) {
+      case VirtualMachine::Return:
+        if (calls) {
+          os << "if (fc == 0) return 0; fc--; fp[-1] = sp[-1]; sp = fp; fp = F[fc].fp; ret = F[fc].ret; "
+             << "goto du_return;";
+        } else {
+          os << "return 0;";
+        }
+        break;
+      case VirtualMachine::Constant16: os << "*sp++ = K[" << (std::size_t) text[address + 1] << "];"; break;
+      case VirtualMachine::Pop: os << "sp--;"; break;
+      case VirtualMachine::Negate: os << "sp[-1] = du_neg(sp[-1], " << loc.str() << ");"; break;
+      case VirtualMachine::Add: binary("du_add"); break;
+      case VirtualMachine::Subtract: binary("du_sub"); break;
+      case VirtualMachine::Multiply: binary("du_mul"); break;
+      case VirtualMachine::Divide: binary("du_div"); break;
+      case VirtualMachine::Exp: binary("du_exp"); break;
+      case VirtualMachine::Not: os << "sp[-1] = du_not(sp[-1], " << loc.str() << ");"; break;
+      case VirtualMachine::And: binary("du_and"); break;
+      case VirtualMachine::Or: binary("du_or"); break;
+      case VirtualMachine::Equal: binary("du_equal"); break;
+      case VirtualMachine::Greater: binary("du_greater"); break;
+      case VirtualMachine::Less: binary("du_less"); break;
+      case VirtualMachine::AddNum: numeric("du_add_num"); break;
+      case VirtualMachine::SubNum: numeric("du_sub_num"); break;
+      case VirtualMachine::MulNum: numeric("du_mul_num"); break;
+      case VirtualMachine::DivNum: numeric("du_div_num"); break;
+      case VirtualMachine::LessNum: numeric("du_less_num"); break;
+      case VirtualMachine::GreaterNum: numeric("du_greater_num"); break;
+      case VirtualMachine::Print: os << "du_print(*--sp, FN);"; break;
+      case VirtualMachine::LoadNull: os << "*sp++ = du_null();"; break;
+      case VirtualMachine::AllocGlobal:
+        os << "du_alloc_global(" << global() << ", " << loc.str() << ");";
+        break;
+      case VirtualMachine::StoreGlobal:
+        os << "sp--; du_store_global(" << global() << ", *sp, " << loc.str() << ");";
+        break;
+      case VirtualMachine::LoadGlobal:
+        os << "*sp = du_load_global(" << global() << ", " << loc.str() << "); sp++;";
+        break;
+      case VirtualMachine::StoreLocal: os << "fp[" << (std::size_t) text[address + 1] << "] = sp[-1];"; break;
+      case VirtualMachine::LoadLocal: os << "*sp++ = fp[" << (std::size_t) text[address + 1] << "];"; break;
+      case VirtualMachine::PopLocal: os << "fp[" << (std::size_t) text[address + 1] << "] = *--sp;"; break;
+      case VirtualMachine::IncLocal: {
+        std::string local = "fp[" + std::to_string(text[address + 1]) + "]";
+        os << local << " = du_add(" << local << ", K[" << (std::size_t) text[address + 2] << "], "
+           << loc.str() << ");";
+        break;
+      }
+      case VirtualMachine::AddStoreLocal:
+      case VirtualMachine::SubStoreLocal:
+      case VirtualMachine::MulStoreLocal:
+      case VirtualMachine::DivStoreLocal: {
+        const char* fn = op == VirtualMachine::AddStoreLocal ? "du_add" :
+                         op == VirtualMachine::SubStoreLocal ? "du_sub" :
+                         op == VirtualMachine::MulStoreLocal ? "du_mul" : "du_div";
+        std::string local = "fp[" + std::to_string(text[address + 1]) + "]";
+        os << "sp--; " << local << " = " << fn << "(" << local << ", *sp, " << loc.str() << ");";
+        break;
+      }
+      case VirtualMachine::Call: {
+        std::size_t argc = text[address + 1];
+
+        os << "fn = du_callee(sp[-" << argc + 1 << "], " << argc << ", FN, " << loc.str() << "); "
+           << "if (fc == 256) du_error(" << loc.str() << ", \"Stack overflow\\n\"); "
+           << "F[fc].ret = " << next << "; F[fc].fp = fp; fc++; fp = sp - " << argc << "; goto du_enter;";
+        break;
+      }
+      case VirtualMachine::TailCall: {
+        std::size_t argc = text[address + 1];
+
+        os << "fn = du_callee(sp[-" << argc + 1 << "], " << argc << ", FN, " << loc.str() << "); "
+           << "memmove(fp - 1, sp - " << argc + 1 << ", " << argc + 1 << " * sizeof(du_value)); "
+           << "sp = fp + " << argc << "; goto du_enter;";
+        break;
+      }
+      case VirtualMachine::Jump: os << "goto " << label() << ";"; break;
+      case VirtualMachine::JumpIfFalse: os << "if (!(--sp)->as.boolean) goto " << label() << ";"; break;
+      case VirtualMachine::JumpIfTrue: os << "if ((--sp)->as.boolean) goto " << label() << ";"; break;
+      case VirtualMachine::JumpIfFalseKeep:
+        os << "if (!du_keep_bool(sp[-1], \"and\", " << loc.str() << ")) goto " << label() << ";";
+        break;
+      case VirtualMachine::JumpIfTrueKeep:
+        os << "if (du_keep_bool(sp[-1], \"or\", " << loc.str() << ")) goto " << label() << ";";
+        break;
+      case VirtualMachine::ForPrep:
+        os << "*sp++ = du_bool(du_for_prep(fp + " << (std::size_t) text[address + 1] << ", "
+           << loc.str() << "));";
+        break;
+      case VirtualMachine::ForLoop:
+        os << "if (du_for_loop(fp + " << (std::size_t) text[address + 9] << ")) goto " << label() << ";";
+        break;
+      case VirtualMachine::BinaryLocalConst:
+        fused(local(1), constant(2), "*sp");
+        os << " sp++;";
+        break;
+      case VirtualMachine::BinaryLocals:
+        fused(local(1), local(2), "*sp");
+        os << " sp++;";
+        break;
+      case VirtualMachine::BinaryConst:
+        fused("sp[-1]", constant(1), "sp[-1]");
+        break;
+      case VirtualMachine::Math:
+        os << "sp[-1] = du_math(sp[-1], " << (int) text[address + 1] << ", " << loc.str() << ");";
+        break;
+      case VirtualMachine::Math2:
+        os << "sp[-2] = du_math2(sp[-2], sp[-1], " << (int) text[address + 1] << ", " << loc.str()
+           << "); sp--;";
+        break;
+      default:
+        std::cerr << "--emit-c: unsupported instruction " << (std::size_t) op
+                  << " at $" << address << "\n";
+        return false;
+    }
+
+    os << "\n";
+    address = next;
+  }
+
+  if (calls) {
+    os << "\ndu_enter:\n  switch (fn) {\n";
+
+    for (std::size_t i = 0; i < functions.size(); ++i) {
+      os << "    case " << i << ": goto L" << functions[i].entry << ";\n";
+    }
+
+    os << "  }\n  return 70;\n\ndu_return:\n  switch (ret) {\n";
+
+    for (auto site : return_sites) {
+      os << "    case " << site << ": goto L" << site << ";\n";
+    }
+
+    os << "  }\n  return 70;\n";
+  }
+
+  os << "}\n";
+
+  return true;
+}
+
+void CEmitter::emit_const(const Value& value, std::ostream& os) {
+  switch (value.getType()) {
+    case ValueType::Integer:
+      if (value.as_integer() == INT64_MIN) {
+        os << "{ DU_INTEGER, { .integer = INT64_MIN } }";
+      } else {
+        os << "{ DU_INTEGER, { .integer = INT64_C(" << value.as_integer() << ") } }";
+      }
+      break;
+    case ValueType::Number: {
+      double number = value.as_number();
+
+      if (std::isnan(number)) {
+        os << "{ DU_NUMBER, { .number = NAN } }";
+      } else if (std::isinf(number)) {
+        os << "{ DU_NUMBER, { .number = " << (number < 0 ? "-" : "") << "INFINITY } }";
+      } else {
+        // Hexadecimal floats round-trip exactly.
+        char buffer[64];
+        std::snprintf(buffer, sizeof(buffer), "%a", number);
+        os << "{ DU_NUMBER, { .number = " << buffer << " } }";
+      }
+      break;
+    }
+    case ValueType::Bool:
+      os << "{ DU_BOOL, { .boolean = " << (value.as_bool() ? "true" : "false") << " } }";
+      break;
+    case ValueType::String:
+      os << "{ DU_STRING, { .string = " << quote(value.as_string()) << " } }";
+      break;
+    case ValueType::Function:
+      os << "{ DU_FUNCTION, { .integer = " << value.as_function() << " } }";
+      break;
+    case ValueType::Symbol:
+      os << "{ DU_SYMBOL, { .string = SYM" << m_symbols.at(value.as_symbol()) << " } }";
+      break;
+    default:
+      os << "{ DU_NULL, { 0 } }";
+      break;
+  }
+}
+
+std::string CEmitter::quote(const std::string& str) {
+  std::string quoted = "\"";
+
+  for (unsigned char ch : str) {
+    if (ch == '"' || ch == '\\') {
+      quoted += '\\';
+      quoted += ch;
+    } else if (ch < 0x20 || ch >= 0x7f) {
+      char buffer[8];
+      std::snprintf(buffer, sizeof(buffer), "\\%03o", ch);
+      quoted += buffer;
+    } else {
+      quoted += ch;
+    }
+  }
+
+  return quoted + "\"";
+}
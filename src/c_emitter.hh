@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+class Bytecode;
+class Value;
+
+// Translates a compiled program into a standalone C translation unit for
+// `dukkha --emit-c`. Every instruction gets a label, jumps become gotos and
+// the value stack is a du_value array. Value operations are implemented by
+// the runtime in runtime.h, which shares its numeric kernels with the VM.
+//
+// The generated file is built with:
+//
+//   cc -O2 -I <dukkha>/src program.c -lm
+class CEmitter {
+public:
+  bool emit(const Bytecode& code, std::ostream& os);
+
+private:
+  void emit_const(const Value& value, std::ostream& os);
+  std::string quote(const std::string& str);
+
+  // Constant index of a global's name -> index in the generated G array.
+  std::unordered_map<std::size_t, std::size_t> m_globals;
+
+  // Symbol -> index of its generated SYM name. Symbols are compared by
+  // the address of their name.
+  std::unordered_map<std::uint32_t, std::size_t> m_symbols;
+};
@@ -0,0 +1,281 @@
+#include "cache.hh"
+#include "compiler.hh"
+#include "verifier.hh"
+#include "virtual_machine.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char ENTRY_MAGIC[4] = { 'D', 'U', 'K', 'C' };
+static const char* const ENTRY_SUFFIX = ".duc";
+static const char* const TEMP_SUFFIX = ".tmp";
+
+// Temporary files older than this belong to a writer that died.
+static const time_t STALE_TEMP_SECONDS = 60 * 60;
+
+struct EntryHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint64_t key;
+  std::uint64_t source_size;
+  std::uint64_t image_hash;
+};
+
+static std::uint64_t fnv1a(const void* data, std::size_t size, std::uint64_t hash = 14695981039346656037ull) {
+  const std::uint8_t* bytes = static_cast<const std::uint8_t*>(data);
+
+  for (std::size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+
+  return hash;
+}
+
+static std::uint64_t source_key(const std::string& source, int level, Bytecode::Format format) {
+  std::uint32_t version = Compiler::VERSION;
+  std::uint64_t hash = fnv1a(&version, sizeof(version));
+
+  hash = fnv1a(&level, sizeof(level), hash);
+  hash = fnv1a(&format, sizeof(format), hash);
+
+  return fnv1a(source.data(), source.size(), hash);
+}
+
+static bool ends_with(const std::string& str, const char* suffix) {
+  std::size_t len = std::strlen(suffix);
+  return str.size() >= len && str.compare(str.size() - len, len, suffix) == 0;
+}
+
+// mkdir -p
+static bool make_directories(const std::string& path) {
+  for (std::size_t i = 1; i <= path.size(); ++i) {
+    if (i != path.size() && path[i] != '/') continue;
+
+    std::string prefix = path.substr(0, i);
+
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+  }
+
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+Cache::Cache(const std::string& directory, std::uint64_t max_size)
+  : m_directory(directory), m_max_size(max_size) {
+  m_usable = !m_directory.empty() && make_directories(m_directory);
+}
+
+std::string Cache::default_directory() {
+  const char* xdg = std::getenv("XDG_CACHE_HOME");
+
+  if (xdg != nullptr && xdg[0] == '/') {
+    return std::string(xdg) + "/dukkha";
+  }
+
+  const char* home = std::getenv("HOME");
+
+  if (home != nullptr && home[0] != '\0') {
+    return std::string(home) + "/.cache/dukkha";
+  }
+
+  return "";
+}
+
+bool Cache::usable() const {
+  return m_usable;
+}
+
+std::string Cache::entry_path(std::uint64_t key) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx", (unsigned long long) key);
+
+  return m_directory + "/" + name + ENTRY_SUFFIX;
+}
+
+bool Cache::load(const std::string& source, int level, Bytecode::Format format, Bytecode& code) {
+  if (!m_usable) {
+    m_misses++;
+    return false;
+  }
+
+  std::uint64_t key = source_key(source, level, format);
+  std::string path = entry_path(key);
+
+  std::ifstream stream(path, std::ios::binary);
+  std::stringstream contents;
+
+  contents << stream.rdbuf();
+  std::string entry = contents.str();
+
+  EntryHeader header;
+
+  if (!stream || entry.size() < sizeof(header)) {
+    m_misses++;
+    return false;
+  }
+
+  std::memcpy(&header, entry.data(), sizeof(header));
+
+  const char* image = entry.data() + sizeof(header);
+  std::size_t image_size = entry.size() - sizeof(header);
+
+  // A matching key with a different source size is a hash collision, a
+  // mismatching image hash is a corrupted file. Both are plain misses, the
+  // entry gets replaced by the following store(). Images are verified
+  // like freshly compiled code, one that doesn't pass is a miss as well.
+  bool valid = std::equal(header.magic, header.magic + 4, ENTRY_MAGIC) &&
+               header.version == Compiler::VERSION &&
+               header.key == key &&
+               header.source_size == source.size() &&
+               header.image_hash == fnv1a(image, image_size);
+
+  std::istringstream in(std::string(image, image_size));
+  std::ostringstream errors;
+
+  if (!valid || !code.read(in) || code.get_format() != format || !Verifier(code, errors).verify()) {
+    code.clear();
+    m_misses++;
+    return false;
+  }
+
+  // Entries are evicted by mtime, so a hit makes this one the most
+  // recently used.
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+
+  m_hits++;
+  return true;
+}
+
+void Cache::store(const std::string& source, int level, const Bytecode& code) {
+  if (!m_usable) return;
+
+  static std::atomic<std::uint64_t> temp_counter { 0 };
+
+  std::uint64_t key = source_key(source, level, code.get_format());
+  std::string path = entry_path(key);
+
+  std::ostringstream image;
+  code.write(image);
+  std::string bytes = image.str();
+
+  EntryHeader header;
+  std::memcpy(header.magic, ENTRY_MAGIC, sizeof(header.magic));
+  header.version = Compiler::VERSION;
+  header.key = key;
+  header.source_size = source.size();
+  header.image_hash = fnv1a(bytes.data(), bytes.size());
+
+  std::string temp = path + "." + std::to_string(getpid()) + "." +
+    std::to_string(temp_counter++) + TEMP_SUFFIX;
+
+  {
+    std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(bytes.data(), bytes.size());
+    out.close();
+
+    if (!out) {
+      std::remove(temp.c_str());
+      return;
+    }
+  }
+
+  // rename() replaces the entry atomically, concurrent writers of the same
+  // key write identical contents so it doesn't matter who wins.
+  if (std::rename(temp.c_str(), path.c_str()) != 0) {
+    std::remove(temp.c_str());
+    return;
+  }
+
+  evict(path);
+}
+
+void Cache::evict(const std::string& keep) {
+  struct Entry {
+    std::string path;
+    std::uint64_t size;
+    std::uint64_t mtime;
+  };
+
+  DIR* dir = opendir(m_directory.c_str());
+
+  if (dir == nullptr) return;
+
+  std::vector<Entry> entries;
+  std::uint64_t total = 0;
+  time_t now = time(nullptr);
+
+  while (dirent* item = readdir(dir)) {
+    std::string name = item->d_name;
+    bool temp = ends_with(name, TEMP_SUFFIX);
+
+    if (!temp && !ends_with(name, ENTRY_SUFFIX)) continue;
+
+    std::string path = m_directory + "/" + name;
+    struct stat st;
+
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+    if (temp) {
+      if (now - st.st_mtime > STALE_TEMP_SECONDS) std::remove(path.c_str());
+      continue;
+    }
+
+    total += st.st_size;
+
+    // The entry that was just stored is never evicted, even if it is
+    // larger than the whole cache.
+    if (path == keep) continue;
+
+    std::uint64_t mtime = (std::uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+    entries.push_back({ path, (std::uint64_t) st.st_size, mtime });
+  }
+
+  closedir(dir);
+
+  if (total <= m_max_size) return;
+
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+    return a.mtime < b.mtime;
+  });
+
+  // Other processes may be evicting at the same time, an entry that is
+  // already gone still counts as freed.
+  for (const Entry& entry : entries) {
+    if (total <= m_max_size) break;
+
+    if (unlink(entry.path.c_str()) == 0) {
+      m_evictions++;
+    }
+
+    total -= entry.size;
+  }
+}
+
+std::uint64_t Cache::hits() const {
+  return m_hits;
+}
+
+std::uint64_t Cache::misses() const {
+  return m_misses;
+}
+
+std::uint64_t Cache::evictions() const {
+  return m_evictions;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "virtual_machine.hh"
+
+// Content-addressed on-disk cache of compiled programs.
+//
+// Entries are keyed on a hash of the source bytes, the optimization level,
+// the bytecode format and the compiler version, so an unchanged script is never lexed or compiled twice. Every
+// entry is written to a temporary file and renamed into place, readers
+// either see a complete entry or none, which makes the cache safe to share
+// between any number of processes. Hits touch the entry's mtime; once the
+// directory grows past its size bound the least recently used entries are
+// evicted.
+class Cache {
+public:
+  static const std::uint64_t DEFAULT_MAX_SIZE = 64 * 1024 * 1024;
+
+  explicit Cache(const std::string& directory, std::uint64_t max_size = DEFAULT_MAX_SIZE);
+
+  // $XDG_CACHE_HOME/dukkha, ~/.cache/dukkha if XDG_CACHE_HOME isn't set, or
+  // an empty string if neither location is known.
+  static std::string default_directory();
+
+  // False if the cache directory couldn't be created, in which case the
+  // cache misses on every lookup and stores nothing.
+  bool usable() const;
+
+  // Programs compiled at different optimization levels or to different
+  // formats are different entries, store() takes the format from code.
+  bool load(const std::string& source, int level, Bytecode::Format format, Bytecode& code);
+  void store(const std::string& source, int level, const Bytecode& code);
+
+  std::uint64_t hits() const;
+  std::uint64_t misses() const;
+  std::uint64_t evictions() const;
+
+private:
+  std::string entry_path(std::uint64_t key) const;
+  void evict(const std::string& keep);
+
+  std::string m_directory;
+  std::uint64_t m_max_size;
+  bool m_usable { false };
+
+  std::atomic<std::uint64_t> m_hits { 0 };
+  std::atomic<std::uint64_t> m_misses { 0 };
+  std::atomic<std::uint64_t> m_evictions { 0 };
+};
@@ -1,172 +1,392 @@
 #include "compiler.hh"
+#include "cache.hh"
 #include "lexer.hh"
+#include "lowering.hh"
+#include "optimizer.hh"
+#include "register_lowering.hh"
+#include "runtime.h"
+#include "verifier.hh"
 #include "virtual_machine.hh"
 
+#include <algorithm>
 #include <cstdint>
+#include <fstream>
 #include <iostream>
-#include <math.h>
+#include <sstream>
 #include <string>
 
-Compiler::Compiler() {
+using ast::Expr;
+using ast::ExprKind;
+using ast::Stmt;
+using ast::StmtKind;
+
+Compiler::Compiler() : m_out(&std::cout) {
+}
+
+void Compiler::set_output(std::ostream& out) {
+  m_out = &out;
 }
 
 bool Compiler::from_file(const char* path, Bytecode& bytecode) {
-  m_lexer.from_file(path);
+  std::ifstream stream(path, std::ios::binary);
+
+  if (!stream) {
+    reset();
+    *m_out << "Error: can't read '" << path << "'\n";
+    return false;
+  }
+
+  std::stringstream source;
+  source << stream.rdbuf();
+
+  return from_source(source.str(), bytecode);
+}
+
+bool Compiler::from_source(const std::string& source, Bytecode& bytecode) {
+  reset();
+
+  if (m_cache != nullptr && m_cache->load(source, m_level, m_format, bytecode)) {
+    return true;
+  }
+
+  m_lexer.from_source(source.c_str());
   m_cursor = m_lexer.next();
 
-  bool result = compile();
+  Bytecode code;
+  bool result = compile(code);
+
+  // The tree isn't needed past lowering.
+  m_arena.clear();
 
   if (result) {
-    bytecode = m_code;
+    if (m_cache != nullptr) m_cache->store(source, m_level, code);
+
+    bytecode = code;
     return true;
   } else {
     return false;
   }
 }
 
-bool Compiler::compile() {
-  m_had_error = false;
+void Compiler::set_cache(Cache* cache) {
+  m_cache = cache;
+}
+
+void Compiler::set_level(int level) {
+  m_level = level < 0 ? 0 : level > MAX_LEVEL ? MAX_LEVEL : level;
+}
+
+void Compiler::set_format(Bytecode::Format format) {
+  m_format = format;
+}
+
+void Compiler::reset() {
+  m_arena.clear();
+  m_prev = Token();
+  m_cursor = Token();
   m_block_depth = 0;
+  m_loops = 0;
+  m_locals.clear();
+  m_in_function = false;
+  m_had_error = false;
+}
+
+bool Compiler::compile(Bytecode& code) {
+  Stmt* program = nullptr;
+  Stmt** tail = &program;
 
   while (m_cursor.type != TokenType::EndOfFile) {
-    declaration();
+    *tail = declaration();
+    tail = &(*tail)->next;
   }
 
-  emit_byte(VirtualMachine::Return);
+  if (m_had_error) return false;
+
+  PassManager::for_level(m_level).run(program, m_arena);
+
+  bool lowered;
+
+  if (m_format == Bytecode::Format::Register) {
+    lowered = RegisterLowering(code, *m_out).lower(program);
+  } else {
+    Lowering lowering(code, *m_out);
+    lowering.set_superinstructions(m_level >= 1);
+    lowered = lowering.lower(program);
+  }
 
-  return !m_had_error;
+  return lowered && Verifier(code, *m_out).verify();
 }
 
-void Compiler::declaration() {
+Stmt* Compiler::declaration() {
   if (m_cursor.type == TokenType::Let) {
     advance();
-    variable_declaration();
+    return variable_declaration();
+  } else if (m_cursor.type == TokenType::Function) {
+    advance();
+    return function_declaration();
   } else if (m_cursor.type == TokenType::LeftCurly) {
     advance();
-    block();
+    return block();
   } else {
-    statement();
+    return statement();
   }
 }
 
-void Compiler::block() {
+// The cursor is past the '{'. The line of a block is the line of its '}'.
+Stmt* Compiler::block() {
+  Stmt* block = make_stmt(StmtKind::Block);
+  Stmt** tail = &block->body;
+
   enter_block();
 
   while (m_cursor.type != TokenType::RightCurly &&
          m_cursor.type != TokenType::EndOfFile)  {
-    declaration();
+    *tail = declaration();
+    tail = &(*tail)->next;
   }
 
   consume(TokenType::RightCurly, "'}' expected");
   leave_block();
+
+  block->line = m_prev.line;
+  return block;
 }
 
-void Compiler::variable_declaration() {
+Stmt* Compiler::variable_declaration() {
   consume(TokenType::Identifer, "variable name expeceted");
 
   bool global_scope = m_block_depth == 0;
+  std::string name = m_prev.type == TokenType::Identifer ? m_prev.as_string : "";
 
-  Value name = Value(m_prev.as_string);
-  std::size_t pname = 0;
-
-  if (global_scope) {
-    pname = resolve_string(name.as_string());
-    emit_byte(VirtualMachine::AllocGlobal);
-    emit_byte(pname);
-  } else {
+  if (!global_scope) {
     for (const auto& local : m_locals) {
-      if (local.depth == m_block_depth && local.name == name.as_string()) {
+      if (local.depth == m_block_depth && local.name == name) {
         error(m_prev, "Redefinition of a local variable");
       }
     }
   }
 
+  Stmt* stmt = make_stmt(global_scope ? StmtKind::Global : StmtKind::Let);
+
   if (m_cursor.type == TokenType::Eq) {
     advance();
-    expression();
-  } else {
-    emit_byte(VirtualMachine::LoadNull);
+    stmt->a = expression();
   }
 
+  stmt->line = m_prev.line;
+
+  // The initializer can't see the variable it initializes.
   if (global_scope) {
-    emit_byte(VirtualMachine::StoreGlobal);
-    emit_byte(pname);
+    stmt->name = m_arena.copy(name.c_str());
   } else {
-    emit_byte(VirtualMachine::StoreLocal);
-    emit_byte(m_locals.size());
-
-    m_locals.push_back((LocalVar) {
-        .depth = m_block_depth,
-        .stack_offset = m_locals.size(),
-        .name = name.as_string()
-        });
+    stmt->local = declare_local(name);
   }
 
   consume(TokenType::Semicolon, "';' expeceted");
+
+  return stmt;
 }
 
-void Compiler::expression() {
-  logical_or();
+// Functions are globals, declared at the top level. Arguments are the
+// first locals of the body.
+Stmt* Compiler::function_declaration() {
+  consume(TokenType::Identifer, "function name expected");
+
+  if (m_block_depth > 0) {
+    error(m_prev, "Functions can only be declared at the top level");
+  }
+
+  Stmt* function = make_stmt(StmtKind::Function);
+  function->name = m_arena.copy(property_name().c_str());
+
+  std::vector<LocalVar> enclosing_locals;
+  std::size_t enclosing_loops = 0;
+
+  std::swap(m_locals, enclosing_locals);
+  std::swap(m_loops, enclosing_loops);
+
+  enter_block();
+
+  consume(TokenType::LeftRound, "'(' expected");
+
+  std::vector<ast::Local*> params;
+
+  while (m_cursor.type == TokenType::Identifer) {
+    advance();
+
+    for (const auto& local : m_locals) {
+      if (local.name == m_prev.as_string) {
+        error(m_prev, "Duplicate parameter name");
+      }
+    }
+
+    params.push_back(declare_local(m_prev.as_string));
+
+    if (m_cursor.type != TokenType::Comma) break;
+    advance();
+  }
+
+  consume(TokenType::RightRound, "')' expected");
+
+  if (params.size() > UINT8_MAX) {
+    error(m_prev, "Too many parameters");
+  }
+
+  function->count = params.size();
+  function->params = m_arena.make_array<ast::Local*>(params.size());
+  std::copy(params.begin(), params.end(), function->params);
+
+  consume(TokenType::LeftCurly, "'{' expected");
+
+  m_in_function = true;
+
+  Stmt** tail = &function->body;
+
+  while (m_cursor.type != TokenType::RightCurly &&
+         m_cursor.type != TokenType::EndOfFile)  {
+    *tail = declaration();
+    tail = &(*tail)->next;
+  }
+
+  consume(TokenType::RightCurly, "'}' expected");
+
+  m_in_function = false;
+  m_block_depth--;
+
+  std::swap(m_locals, enclosing_locals);
+  std::swap(m_loops, enclosing_loops);
+
+  return function;
+}
+
+Expr* Compiler::expression() {
+  return logical_or();
 }
 
-void Compiler::statement() {
+struct CompoundAssignment {
+  TokenType token;
+  VirtualMachine::Instruction op;
+};
+
+// 'x op= y;'
+static const CompoundAssignment COMPOUND_ASSIGNMENTS[] = {
+  { TokenType::PlusEq, VirtualMachine::Add },
+  { TokenType::MinusEq, VirtualMachine::Subtract },
+  { TokenType::StarEq, VirtualMachine::Multiply },
+  { TokenType::SlashEq, VirtualMachine::Divide },
+};
+
+static bool is_assignment(TokenType type) {
+  for (const CompoundAssignment& compound : COMPOUND_ASSIGNMENTS) {
+    if (type == compound.token) return true;
+  }
+
+  return type == TokenType::Eq;
+}
+
+Stmt* Compiler::statement() {
   if (m_cursor.type == TokenType::Print) {
     advance();
-    print();
-  } else if (m_cursor.type == TokenType::Identifer) {
+    return print();
+  } else if (m_cursor.type == TokenType::Identifer && is_assignment(m_lexer.peek().type)) {
     advance();
-    variable_assignment();
+    return variable_assignment();
   } else if (m_cursor.type == TokenType::If) {
     advance();
-    if_statement();
+    return if_statement();
   } else if (m_cursor.type == TokenType::While) {
     advance();
-    while_statement();
+    return while_statement();
+  } else if (m_cursor.type == TokenType::For) {
+    advance();
+    return for_statement();
   } else if (m_cursor.type == TokenType::Continue || m_cursor.type == TokenType::Break) {
     advance();
-    loop_control_statement();
-  } else {
-    expression();
-    consume(TokenType::Semicolon, "';' expected");
+    return loop_control_statement();
+  } else if (m_cursor.type == TokenType::Return) {
+    advance();
+    return return_statement();
   }
-}
 
-void Compiler::variable_assignment() {
-  const std::string& name = m_prev.as_string;
-  std::size_t pname = resolve_string(name);
+  Expr* expr = expression();
+
+  // 'a[i] = x;' and 'o.x = y;' are parsed as loads up to the '=', the
+  // load becomes a store.
+  if (m_cursor.type == TokenType::Eq &&
+      (expr->kind == ExprKind::Index || expr->kind == ExprKind::Property)) {
+    advance();
+
+    Stmt* stmt = make_stmt(expr->kind == ExprKind::Index ? StmtKind::StoreIndex
+                                                         : StmtKind::StoreProperty);
+    stmt->a = expr->a;
+    stmt->b = expr->b;
+    stmt->name = expr->name;
+    stmt->c = expression();
+
+    consume(TokenType::Semicolon, "';' expected");
 
-  consume(TokenType::Eq, "'=' expected");
+    stmt->line = m_prev.line;
+    return stmt;
+  }
 
-  expression();
+  Stmt* stmt = make_stmt(StmtKind::Expression);
+  stmt->a = expr;
 
   consume(TokenType::Semicolon, "';' expected");
 
-  emit_byte(VirtualMachine::StoreGlobal);
-  emit_byte(pname);
+  stmt->line = m_prev.line;
+  return stmt;
 }
 
-void Compiler::print() {
-  expression();
-  emit_byte(VirtualMachine::Print);
+Stmt* Compiler::variable_assignment() {
+  std::string name = m_prev.as_string;
+  Stmt* stmt = make_stmt(StmtKind::Assign);
+
+  for (const CompoundAssignment& compound : COMPOUND_ASSIGNMENTS) {
+    if (m_cursor.type == compound.token) stmt->op = compound.op;
+  }
+
+  advance();
+
+  for (auto local = m_locals.rbegin(); local != m_locals.rend(); ++local) {
+    if (local->name == name) {
+      stmt->local = local->local;
+      break;
+    }
+  }
+
+  if (stmt->local == nullptr) {
+    stmt->name = m_arena.copy(name.c_str());
+  }
+
+  stmt->a = expression();
   consume(TokenType::Semicolon, "';' expected");
+
+  stmt->line = m_prev.line;
+  return stmt;
 }
 
-void Compiler::if_statement() {
-  expression();
-  consume(TokenType::LeftCurly, "'{' expected");
+Stmt* Compiler::print() {
+  Stmt* stmt = make_stmt(StmtKind::Print);
 
-  std::vector<std::size_t> endif_jumps;
-  std::size_t next_block_target = 0;
+  stmt->a = expression();
+  stmt->line = m_prev.line;
+
+  consume(TokenType::Semicolon, "';' expected");
+  return stmt;
+}
 
-  emit_byte(VirtualMachine::JumpIfFalse);
-  next_block_target = emit_qword(0);
+// 'else if' chains are nested in orelse.
+Stmt* Compiler::if_statement() {
+  Stmt* stmt = make_stmt(StmtKind::If);
 
-  block();
+  stmt->a = expression();
+  consume(TokenType::LeftCurly, "'{' expected");
 
-  emit_byte(VirtualMachine::Jump);
-  endif_jumps.push_back(emit_qword(0));
+  stmt->line = m_prev.line;
+  stmt->body = block();
 
-  m_code.set_qword(next_block_target, m_code.get_code().size());
+  Stmt** orelse = &stmt->orelse;
 
   while (m_cursor.type == TokenType::Else) {
     advance();
@@ -174,108 +394,138 @@ void Compiler::if_statement() {
     if (m_cursor.type == TokenType::If) {
       advance();
 
-      expression();
-
-      emit_byte(VirtualMachine::JumpIfFalse);
-      next_block_target = emit_qword(0);
+      Stmt* next = make_stmt(StmtKind::If);
+      next->a = expression();
+      next->line = m_prev.line;
 
       consume(TokenType::LeftCurly, "'{' expected");
-      block();
-
-      emit_byte(VirtualMachine::Jump);
-      endif_jumps.push_back(emit_qword(0));
+      next->body = block();
 
-      m_code.set_qword(next_block_target, m_code.get_code().size());
+      *orelse = next;
+      orelse = &next->orelse;
     } else {
       consume(TokenType::LeftCurly, "'{' expected");
-      block();
+      *orelse = block();
       break;
     }
   }
 
-  for (auto address : endif_jumps) {
-    m_code.set_qword(address, m_code.get_code().size());
-  }
+  return stmt;
 }
 
-void Compiler::while_statement() {
-  m_inside_loop = true;
-
-  // IP if we want to continue.
-  m_loop_continue = m_code.get_code().size();
-  expression();
+Stmt* Compiler::while_statement() {
+  Stmt* stmt = make_stmt(StmtKind::While);
 
-  emit_byte(VirtualMachine::JumpIfFalse);
-  std::size_t loop_else_target = emit_qword(0);
+  stmt->a = expression();
+  stmt->line = m_prev.line;
 
   consume(TokenType::LeftCurly, "'{' expected");
 
-  block();
-
-  emit_byte(VirtualMachine::Jump);
-  emit_qword(m_loop_continue);
-
-  m_code.set_qword(loop_else_target, m_code.get_code().size());
-
-  m_inside_loop = false;
+  m_loops++;
+  stmt->body = block();
+  m_loops--;
 
   if (m_cursor.type == TokenType::Else) {
     advance();
     consume(TokenType::LeftCurly, "'{' expected");
-    block();
+    stmt->orelse = block();
   }
 
-  for (auto addr : m_break_jumps) {
-    m_code.set_qword(addr, m_code.get_code().size());
+  return stmt;
+}
+
+Stmt* Compiler::for_statement() {
+  consume(TokenType::Identifer, "variable name expected");
+  std::string name = property_name();
+
+  consume(TokenType::In, "'in' expected");
+
+  Stmt* stmt = make_stmt(StmtKind::For);
+
+  enter_block();
+
+  stmt->a = expression();
+  consume(TokenType::DotDot, "'..' expected");
+  stmt->b = expression();
+
+  // 'step' is only a keyword after the range.
+  if (m_cursor.type == TokenType::Identifer && std::string(m_cursor.as_string) == "step") {
+    advance();
+    stmt->c = expression();
   }
 
-  m_break_jumps.clear();
+  stmt->line = m_prev.line;
+  stmt->local = declare_local(name);
+
+  consume(TokenType::LeftCurly, "'{' expected");
+
+  m_loops++;
+  stmt->body = block();
+  m_loops--;
+
+  leave_block();
+
+  return stmt;
 }
 
-void Compiler::loop_control_statement() {
-  if (!m_inside_loop) {
+Stmt* Compiler::loop_control_statement() {
+  Stmt* stmt = make_stmt(m_prev.type == TokenType::Break ? StmtKind::Break : StmtKind::Continue);
+
+  if (m_loops == 0) {
     error(m_prev, "Control statement outside loop");
-    return;
+    return stmt;
+  }
+
+  consume(TokenType::Semicolon, "';' expected");
+  return stmt;
+}
+
+Stmt* Compiler::return_statement() {
+  if (!m_in_function) {
+    error(m_prev, "'return' outside function");
   }
 
-  if (m_prev.type == TokenType::Break) {
-    emit_byte(VirtualMachine::Jump);
-    m_break_jumps.push_back(emit_qword(0));
-  } else if (m_prev.type == TokenType::Continue) {
-    emit_byte(VirtualMachine::Jump);
-    emit_qword(m_loop_continue);
+  Stmt* stmt = make_stmt(StmtKind::Return);
+
+  if (m_cursor.type != TokenType::Semicolon) {
+    stmt->a = expression();
   }
 
   consume(TokenType::Semicolon, "';' expected");
+
+  stmt->line = m_prev.line;
+  return stmt;
 }
 
-void Compiler::logical_or() {
-  logical_and();
+Expr* Compiler::logical_or() {
+  Expr* expr = logical_and();
 
   while (m_cursor.type == TokenType::Or) {
     advance();
-    logical_and();
-    emit_byte(VirtualMachine::Or);
+    expr = make_operator(ExprKind::Or, 0, expr, logical_and());
   }
+
+  return expr;
 }
 
-void Compiler::logical_and() {
-  logical_not();
+Expr* Compiler::logical_and() {
+  Expr* expr = logical_not();
 
   while (m_cursor.type == TokenType::And) {
     advance();
-    logical_not();
-    emit_byte(VirtualMachine::And);
+    expr = make_operator(ExprKind::And, 0, expr, logical_not());
   }
+
+  return expr;
 }
 
-void Compiler::logical_not() {
+Expr* Compiler::logical_not() {
   if (m_cursor.type == TokenType::Not) {
-    comparison();
-    emit_byte(VirtualMachine::Not);
-  } else {
-    comparison();
+    advance();
+    return make_operator(ExprKind::Unary, VirtualMachine::Not, comparison());
   }
+
+  return comparison();
 }
 
 bool is_comparison_op(TokenType type) {
@@ -292,143 +542,346 @@ bool is_comparison_op(TokenType type) {
   }
 }
 
-void Compiler::comparison() {
-  addition();
+// 'a != b', 'a >= b' and 'a <= b' are the negations of 'a == b', 'a < b'
+// and 'a > b'.
+Expr* Compiler::comparison() {
+  Expr* expr = addition();
 
   while (is_comparison_op(m_cursor.type)) {
     TokenType op = m_cursor.type;
 
     advance();
-    addition();
+    Expr* right = addition();
 
     switch (op) {
       case TokenType::EqEq:
-        emit_byte(VirtualMachine::Equal);
+        expr = make_operator(ExprKind::Binary, VirtualMachine::Equal, expr, right);
         break;
       case TokenType::BangEq:
-        emit_byte(VirtualMachine::Equal);
-        emit_byte(VirtualMachine::Not);
+        expr = make_operator(ExprKind::Binary, VirtualMachine::Equal, expr, right);
+        expr = make_operator(ExprKind::Unary, VirtualMachine::Not, expr);
         break;
       case TokenType::GreaterEq:
-        emit_byte(VirtualMachine::Less);
-        emit_byte(VirtualMachine::Not);
+        expr = make_operator(ExprKind::Binary, VirtualMachine::Less, expr, right);
+        expr = make_operator(ExprKind::Unary, VirtualMachine::Not, expr);
         break;
       case TokenType::LessEq:
-        emit_byte(VirtualMachine::Greater);
-        emit_byte(VirtualMachine::Not);
+        expr = make_operator(ExprKind::Binary, VirtualMachine::Greater, expr, right);
+        expr = make_operator(ExprKind::Unary, VirtualMachine::Not, expr);
         break;
       case TokenType::Greater:
-        emit_byte(VirtualMachine::Greater);
+        expr = make_operator(ExprKind::Binary, VirtualMachine::Greater, expr, right);
         break;
       case TokenType::Less:
-        emit_byte(VirtualMachine::Less);
+        expr = make_operator(ExprKind::Binary, VirtualMachine::Less, expr, right);
         break;
       default: break;
     }
   }
-}
 
-void Compiler::addition() {
-  // TODO: assert?
-  multiplication();
+  return expr;
+}
 
-  VirtualMachine::Instruction op {};
+Expr* Compiler::addition() {
+  Expr* expr = multiplication();
 
   while (m_cursor.type == TokenType::Plus || m_cursor.type == TokenType::Minus) {
-    switch (m_cursor.type) {
-      case TokenType::Plus: op = VirtualMachine::Add; break;
-      case TokenType::Minus: op = VirtualMachine::Subtract; break;
-      default: error(m_cursor, "Unexpected token.");
-    }
+    VirtualMachine::Instruction op =
+        m_cursor.type == TokenType::Plus ? VirtualMachine::Add : VirtualMachine::Subtract;
 
     advance();
-    multiplication();
-
-    emit_byte(op);
+    expr = make_operator(ExprKind::Binary, op, expr, multiplication());
   }
-}
 
-void Compiler::multiplication() {
-  unary();
+  return expr;
+}
 
-  VirtualMachine::Instruction op {};
+Expr* Compiler::multiplication() {
+  Expr* expr = unary();
 
   while (m_cursor.type == TokenType::Slash || m_cursor.type == TokenType::Star) {
-    switch (m_cursor.type) {
-      case TokenType::Star: op = VirtualMachine::Multiply; break;
-      case TokenType::Slash: op = VirtualMachine::Divide; break;
-      default: error(m_cursor, "Unexpected token.");
-    }
+    VirtualMachine::Instruction op =
+        m_cursor.type == TokenType::Star ? VirtualMachine::Multiply : VirtualMachine::Divide;
 
     advance();
-    unary();
-    emit_byte(op);
+    expr = make_operator(ExprKind::Binary, op, expr, unary());
   }
+
+  return expr;
 }
 
-void Compiler::exp() {
-  arbitrary();
+Expr* Compiler::exp() {
+  Expr* expr = call();
 
   while (m_cursor.type == TokenType::StarStar) {
     advance();
-    arbitrary();
-    emit_byte(VirtualMachine::Exp);
+    expr = make_operator(ExprKind::Binary, VirtualMachine::Exp, expr, call());
   }
+
+  return expr;
 }
 
-void Compiler::unary() {
+Expr* Compiler::unary() {
   if (m_cursor.type == TokenType::Minus) {
     advance();
-    exp();
-    emit_byte(VirtualMachine::Negate);
-  } else {
-    exp();
+    return make_operator(ExprKind::Unary, VirtualMachine::Negate, exp());
+  }
+
+  return exp();
+}
+
+Expr* Compiler::call() {
+  Expr* expr = arbitrary();
+
+  while (m_cursor.type == TokenType::LeftRound || m_cursor.type == TokenType::LeftSquare ||
+         m_cursor.type == TokenType::Dot) {
+    if (m_cursor.type == TokenType::LeftSquare) {
+      advance();
+      Expr* index = expression();
+      consume(TokenType::RightSquare, "']' expected");
+
+      expr = make_operator(ExprKind::Index, 0, expr, index);
+      continue;
+    }
+
+    if (m_cursor.type == TokenType::Dot) {
+      advance();
+      consume(TokenType::Identifer, "property name expected");
+
+      expr = make_operator(ExprKind::Property, 0, expr);
+      expr->name = m_arena.copy(property_name().c_str());
+      continue;
+    }
+
+    advance();
+
+    Expr* call = make_operator(ExprKind::Call, 0, expr);
+    Expr** tail = &call->list;
+
+    while (m_cursor.type != TokenType::RightRound && m_cursor.type != TokenType::EndOfFile) {
+      *tail = expression();
+      tail = &(*tail)->next;
+      call->count++;
+
+      if (m_cursor.type != TokenType::Comma) break;
+      advance();
+    }
+
+    consume(TokenType::RightRound, "')' expected");
+
+    if (call->count > UINT8_MAX) {
+      error(m_prev, "Too many arguments");
+    }
+
+    call->line = m_prev.line;
+    expr = call;
   }
+
+  return expr;
 }
 
-void Compiler::arbitrary() {
+Expr* Compiler::arbitrary() {
+  Expr* expr = nullptr;
+
   switch (m_cursor.type) {
-    case TokenType::NumberLiteral: {
-      std::size_t pa = m_code.push_const(m_cursor.as_number);
-      emit_byte(VirtualMachine::Constant16);
-      emit_byte(pa);
-      advance();
+    case TokenType::NumberLiteral:
+      expr = make_expr(ExprKind::Number);
+      expr->number = m_cursor.as_number;
+      break;
+    case TokenType::IntegerLiteral:
+      expr = make_expr(ExprKind::Integer);
+      expr->integer = m_cursor.as_integer;
       break;
-    }
     case TokenType::LeftRound:
       advance();
-      expression();
+      expr = expression();
       consume(TokenType::RightRound, "')' expected");
+      return expr;
+    case TokenType::StringLiteral:
+      expr = make_expr(ExprKind::String);
+      expr->name = m_arena.copy(m_cursor.as_string);
       break;
-    case TokenType::StringLiteral: {
-      std::size_t pa = resolve_string(m_cursor.as_string);
-      emit_byte(VirtualMachine::Constant16);
-      emit_byte(pa);
-      advance();
+    case TokenType::SymbolLiteral:
+      expr = make_expr(ExprKind::Symbol);
+      expr->name = m_arena.copy(m_cursor.as_string);
       break;
-    }
-    case TokenType::True: {
-      std::size_t pa = m_code.push_const(true);
-      emit_byte(VirtualMachine::Constant16);
-      emit_byte(pa);
-      advance();
+    case TokenType::True:
+    case TokenType::False:
+      expr = make_expr(ExprKind::Bool);
+      expr->boolean = m_cursor.type == TokenType::True;
       break;
-    }
-    case TokenType::False: {
-      std::size_t pa = m_code.push_const(false);
-      emit_byte(VirtualMachine::Constant16);
-      emit_byte(pa);
+    case TokenType::LeftSquare:
       advance();
-      break;
-    }
-    case TokenType::Identifer: {
-      resolve_variable(m_cursor.as_string);
+      return array_literal();
+    case TokenType::LeftCurly:
       advance();
+      return object_literal();
+    case TokenType::Identifer:
+      if (m_lexer.peek().type == TokenType::LeftRound) {
+        expr = intrinsic(m_cursor.as_string);
+        if (expr) return expr;
+      }
+
+      expr = resolve_variable(m_cursor.as_string);
       break;
-    }
     default:
       error(m_cursor, "invalid syntax");
+
+      // Never lowered, the program has an error.
+      return make_expr(ExprKind::Bool);
+  }
+
+  advance();
+  return expr;
+}
+
+Expr* Compiler::array_literal() {
+  Expr* array = make_expr(ExprKind::Array);
+  Expr** tail = &array->list;
+
+  while (m_cursor.type != TokenType::RightSquare && m_cursor.type != TokenType::EndOfFile) {
+    *tail = expression();
+    tail = &(*tail)->next;
+    array->count++;
+
+    if (m_cursor.type != TokenType::Comma) break;
+    advance();
+  }
+
+  consume(TokenType::RightSquare, "']' expected");
+
+  if (array->count > UINT8_MAX) {
+    error(m_prev, "Too many elements in array literal");
+  }
+
+  array->line = m_prev.line;
+  return array;
+}
+
+// A list of Fields, each one initializes a property of the new object.
+Expr* Compiler::object_literal() {
+  Expr* object = make_expr(ExprKind::Object);
+  Expr** tail = &object->list;
+
+  while (m_cursor.type != TokenType::RightCurly && m_cursor.type != TokenType::EndOfFile) {
+    consume(TokenType::Identifer, "property name expected");
+    const char* name = m_arena.copy(property_name().c_str());
+
+    consume(TokenType::Colon, "':' expected");
+
+    Expr* field = make_operator(ExprKind::Field, 0, expression());
+    field->name = name;
+
+    *tail = field;
+    tail = &field->next;
+
+    if (m_cursor.type != TokenType::Comma) break;
+    advance();
+  }
+
+  consume(TokenType::RightCurly, "'}' expected");
+
+  return object;
+}
+
+struct Intrinsic {
+  const char* name;
+  VirtualMachine::Instruction op;
+  std::size_t arity;
+
+  // Operand of Math and Math2.
+  std::uint8_t function;
+};
+
+// Built-in functions compiled to a single instruction. They are looked up
+// before globals, so they can't be redefined, but locals shadow them.
+// min() and max() of an array and of two numbers are told apart by the
+// number of arguments, the entry with more of them comes right after.
+static const Intrinsic INTRINSICS[] = {
+  { "len", VirtualMachine::Length, 1, 0 },
+  { "sum", VirtualMachine::Sum, 1, 0 },
+  { "min", VirtualMachine::Min, 1, 0 },
+  { "min", VirtualMachine::Math2, 2, DU_MATH_MIN },
+  { "max", VirtualMachine::Max, 1, 0 },
+  { "max", VirtualMachine::Math2, 2, DU_MATH_MAX },
+  { "fill", VirtualMachine::Fill, 2, 0 },
+  { "push", VirtualMachine::Append, 2, 0 },
+  { "map", VirtualMachine::Map, 3, 0 },
+  { "sqrt", VirtualMachine::Math, 1, DU_MATH_SQRT },
+  { "floor", VirtualMachine::Math, 1, DU_MATH_FLOOR },
+  { "ceil", VirtualMachine::Math, 1, DU_MATH_CEIL },
+  { "round", VirtualMachine::Math, 1, DU_MATH_ROUND },
+  { "abs", VirtualMachine::Math, 1, DU_MATH_ABS },
+  { "log", VirtualMachine::Math, 1, DU_MATH_LOG },
+  { "exp", VirtualMachine::Math, 1, DU_MATH_EXP },
+  { "sin", VirtualMachine::Math, 1, DU_MATH_SIN },
+  { "cos", VirtualMachine::Math, 1, DU_MATH_COS },
+  { "tan", VirtualMachine::Math, 1, DU_MATH_TAN },
+  { "atan", VirtualMachine::Math, 1, DU_MATH_ATAN },
+};
+
+// Parses a call of the intrinsic name, the cursor is on the name.
+// Returns nullptr if name isn't one.
+Expr* Compiler::intrinsic(const std::string& name) {
+  for (const LocalVar& local : m_locals) {
+    if (local.name == name) return nullptr;
+  }
+
+  const Intrinsic* found = nullptr;
+  const Intrinsic* end = INTRINSICS + sizeof(INTRINSICS) / sizeof(INTRINSICS[0]);
+
+  for (const Intrinsic* intrinsic = INTRINSICS; intrinsic != end && !found; ++intrinsic) {
+    if (name == intrinsic->name) found = intrinsic;
   }
+
+  if (found == nullptr) return nullptr;
+
+  advance();
+  consume(TokenType::LeftRound, "'(' expected");
+
+  Expr* expr = make_expr(ExprKind::Intrinsic);
+  expr->arith = VirtualMachine::Add;
+
+  Expr** tail = &expr->list;
+
+  for (std::size_t i = 0; i < found->arity; ++i) {
+    if (i > 0) consume(TokenType::Comma, "',' expected");
+
+    // The operator of map() is part of the instruction.
+    if (found->op == VirtualMachine::Map && i == 1) {
+      std::string op = m_cursor.type == TokenType::StringLiteral ? m_cursor.as_string : "";
+
+      if (op == "+") expr->arith = VirtualMachine::Add;
+      else if (op == "-") expr->arith = VirtualMachine::Subtract;
+      else if (op == "*") expr->arith = VirtualMachine::Multiply;
+      else if (op == "/") expr->arith = VirtualMachine::Divide;
+      else error(m_cursor, "map() expects one of '+', '-', '*' or '/'");
+
+      advance();
+      continue;
+    }
+
+    *tail = expression();
+    tail = &(*tail)->next;
+    expr->count++;
+
+    bool more = found + 1 != end && name == found[1].name;
+
+    if (i + 1 == found->arity && more && m_cursor.type == TokenType::Comma) {
+      found++;
+    }
+  }
+
+  expr->op = found->op;
+
+  if (found->op == VirtualMachine::Math || found->op == VirtualMachine::Math2) {
+    expr->arith = found->function;
+  }
+
+  consume(TokenType::RightRound, "')' expected");
+
+  expr->line = m_prev.line;
+  return expr;
 }
 
 void Compiler::enter_block() {
@@ -438,38 +891,31 @@ void Compiler::enter_block() {
 void Compiler::leave_block() {
   while (!m_locals.empty() && m_locals.back().depth == m_block_depth) {
     m_locals.pop_back();
-    emit_byte(VirtualMachine::Pop);
   }
 
   m_block_depth--;
 }
 
-void Compiler::resolve_variable(const std::string& name) {
-  for (auto local = m_locals.rbegin(); local != m_locals.rend(); ++local) {
-    if (local->name == name && local->depth <= m_block_depth) {
-      emit_byte(VirtualMachine::LoadLocal);
-      emit_byte(local->stack_offset);
-
-      return;
-    }
-  }
+ast::Local* Compiler::declare_local(const std::string& name) {
+  ast::Local* local = m_arena.make<ast::Local>();
+  local->name = m_arena.copy(name.c_str());
 
-  std::size_t pname = resolve_string(name);
-  emit_byte(VirtualMachine::LoadGlobal);
-  emit_byte(pname);
+  m_locals.push_back((LocalVar) { .depth = m_block_depth, .name = name, .local = local });
+  return local;
 }
 
-
-std::size_t Compiler::resolve_string(const std::string& name) {
-  auto it = m_strings.find(name);
-
-  if (it == m_strings.end()) {
-    std::size_t address = m_code.push_const(name);
-    m_strings[name] = address;
-    return address;
+Expr* Compiler::resolve_variable(const std::string& name) {
+  for (auto local = m_locals.rbegin(); local != m_locals.rend(); ++local) {
+    if (local->name == name) {
+      Expr* expr = make_expr(ExprKind::Local);
+      expr->local = local->local;
+      return expr;
+    }
   }
 
-  return it->second;
+  Expr* expr = make_expr(ExprKind::Global);
+  expr->name = m_arena.copy(name.c_str());
+  return expr;
 }
 
 void Compiler::advance() {
@@ -486,16 +932,37 @@ void Compiler::consume(TokenType type, const char* msg) {
   }
 }
 
-std::size_t Compiler::emit_byte(std::uint8_t byte) {
-  return m_code.push_byte(byte, m_prev.line);
+// Nodes are attributed to the line of the last token consumed, callers
+// move the line where the instruction belongs elsewhere.
+Stmt* Compiler::make_stmt(StmtKind kind) {
+  Stmt* stmt = m_arena.make<Stmt>();
+  stmt->kind = kind;
+  stmt->line = m_prev.line;
+  return stmt;
+}
+
+Expr* Compiler::make_expr(ExprKind kind) {
+  Expr* expr = m_arena.make<Expr>();
+  expr->kind = kind;
+  expr->line = m_prev.line;
+  return expr;
+}
+
+Expr* Compiler::make_operator(ExprKind kind, std::uint8_t op, Expr* a, Expr* b) {
+  Expr* expr = make_expr(kind);
+  expr->op = op;
+  expr->a = a;
+  expr->b = b;
+  return expr;
 }
 
-std::size_t Compiler::emit_qword(std::size_t qword) {
-  return m_code.push_qword(qword, m_prev.line);
+// Name of the identifier just consumed, empty after a syntax error.
+std::string Compiler::property_name() const {
+  return m_prev.type == TokenType::Identifer ? m_prev.as_string : "";
 }
 
 void Compiler::error(const Token& at, const char* msg) {
   m_had_error = true;
-  std::cout << "Error at: " << at.line << ":"
+  *m_out << "Error at: " << at.line << ":"
             << at.position << " - " << msg << "\n";
 }
@@ -1,89 +1,105 @@
 #pragma once
 
 #include <cstdint>
-#include <functional>
 #include <unordered_map>
 #include <vector>
 
+#include "ast.hh"
 #include "lexer.hh"
 #include "virtual_machine.hh"
 
 class Bytecode;
+class Cache;
 
 struct LocalVar {
   std::size_t depth { 0 };
-  std::size_t stack_offset { 0 };
   std::string name {};
-
-  bool operator ==(const LocalVar& b) const {
-    return depth == b.depth &&
-           stack_offset == b.stack_offset &&
-           name == b.name;
-  }
+  ast::Local* local { nullptr };
 };
 
-namespace std {
-
-  template<>
-  struct hash<LocalVar> {
-    std::size_t operator()(const LocalVar& lv) {
-      return std::hash<std::string>()(lv.name) ^
-             std::hash<std::size_t>()(lv.stack_offset) ^
-             std::hash<std::size_t>()(lv.depth);
-    }
-  };
-
-}
-
+// Parses a program into a syntax tree, runs the optimizer passes of the
+// selected level over it and lowers it to bytecode.
 class Compiler {
 public:
+  // Bumped whenever the emitted bytecode changes, invalidates every entry
+  // of the compilation cache.
+  static const std::uint32_t VERSION = 12;
+
+  static const int DEFAULT_LEVEL = 1;
+  static const int MAX_LEVEL = 2;
+
   Compiler();
   ~Compiler() = default;
 
+  // Compilers can be reused, every call starts from a clean state.
   bool from_file(const char* path, Bytecode& bytecode);
+  bool from_source(const std::string& source, Bytecode& bytecode);
 
-private:
-  bool compile();
-
-  void declaration();
-  void block();
-  void variable_declaration();
-
-  void statement();
-  void variable_assignment();
+  // Looks up sources in the cache before compiling them and stores what
+  // was compiled. The cache can be shared between compilers.
+  void set_cache(Cache* cache);
 
-  void print();
-  void if_statement();
-  void while_statement();
-  void loop_control_statement();
+  // Stream compile errors are written to, std::cout by default.
+  void set_output(std::ostream& out);
 
-  void expression();
+  // Optimization level, 0 to MAX_LEVEL. See PassManager::for_level().
+  void set_level(int level);
 
-  void logical_or();
-  void logical_and();
-  void logical_not();
-  void comparison();
+  // Instruction set programs are lowered to, stack code by default.
+  void set_format(Bytecode::Format format);
 
-  void addition();
-  void multiplication();
-  void exp();
-  void unary();
-  void arbitrary();
+private:
+  bool compile(Bytecode& code);
+  void reset();
+
+  ast::Stmt* declaration();
+  ast::Stmt* block();
+  ast::Stmt* variable_declaration();
+  ast::Stmt* function_declaration();
+
+  ast::Stmt* statement();
+  ast::Stmt* variable_assignment();
+
+  ast::Stmt* print();
+  ast::Stmt* if_statement();
+  ast::Stmt* while_statement();
+  ast::Stmt* for_statement();
+  ast::Stmt* loop_control_statement();
+  ast::Stmt* return_statement();
+
+  ast::Expr* expression();
+
+  ast::Expr* logical_or();
+  ast::Expr* logical_and();
+  ast::Expr* logical_not();
+  ast::Expr* comparison();
+
+  ast::Expr* addition();
+  ast::Expr* multiplication();
+  ast::Expr* exp();
+  ast::Expr* unary();
+  ast::Expr* call();
+  ast::Expr* arbitrary();
+  ast::Expr* array_literal();
+  ast::Expr* object_literal();
+  ast::Expr* intrinsic(const std::string& name);
 
   void enter_block();
   void leave_block();
-  void resolve_variable(const std::string& name);
-  std::size_t resolve_string(const std::string& name);
+  ast::Local* declare_local(const std::string& name);
+  ast::Expr* resolve_variable(const std::string& name);
 
   void error(const Token& at, const char* msg);
 
   void advance();
   void consume(TokenType type, const char* msg);
 
-  std::size_t emit_byte(std::uint8_t byte);
-  std::size_t emit_qword(std::size_t qword);
+  ast::Stmt* make_stmt(ast::StmtKind kind);
+  ast::Expr* make_expr(ast::ExprKind kind);
+  ast::Expr* make_operator(ast::ExprKind kind, std::uint8_t op, ast::Expr* a, ast::Expr* b = nullptr);
+  std::string property_name() const;
 
-  Bytecode m_code {};
+  Arena m_arena;
 
   Token m_prev {};
   Token m_cursor {};
@@ -91,14 +107,19 @@ private:
   Lexer m_lexer;
 
   std::size_t m_block_depth { 0 };
-  bool m_inside_loop { false };
+  // Loops around the statement being parsed.
+  std::size_t m_loops { 0 };
 
-  std::vector<std::size_t> m_break_jumps;
-  std::size_t m_loop_continue {0 };
+  bool m_in_function { false };
 
-  // (depth, name) -> stack offset
+  // Locals in scope, innermost last.
   std::vector<LocalVar> m_locals;
-  std::unordered_map<std::string, std::size_t> m_strings;
+
+  int m_level { DEFAULT_LEVEL };
+  Bytecode::Format m_format { Bytecode::Format::Stack };
 
   bool m_had_error { false };
+
+  std::ostream* m_out;
+  Cache* m_cache { nullptr };
 };
@@ -0,0 +1,393 @@
+#include "daemon.hh"
+#include "compiler.hh"
+#include "output.hh"
+#include "scheduler.hh"
+#include "thread_pool.hh"
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sysexits.h>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+enum Request : std::uint8_t {
+  REQUEST_PATH,
+  REQUEST_SOURCE,
+};
+
+}
+
+// Larger requests are refused rather than allocated.
+static const std::uint64_t MAX_REQUEST_SIZE = 64 * 1024 * 1024;
+
+// Programs kept compiled at most, the cache starts over once there are more.
+static const std::size_t MAX_PROGRAMS = 4096;
+
+// A client that doesn't send its request in time is dropped.
+static const time_t REQUEST_TIMEOUT_SECONDS = 5;
+
+static bool read_all(int fd, void* data, std::size_t size) {
+  char* bytes = static_cast<char*>(data);
+
+  while (size > 0) {
+    ssize_t count = ::read(fd, bytes, size);
+
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return false;
+
+    bytes += count;
+    size -= count;
+  }
+
+  return true;
+}
+
+static bool write_all(int fd, const void* data, std::size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+
+  while (size > 0) {
+    ssize_t count = ::write(fd, bytes, size);
+
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0) return false;
+
+    bytes += count;
+    size -= count;
+  }
+
+  return true;
+}
+
+static bool socket_address(const std::string& path, sockaddr_un& address) {
+  if (path.size() >= sizeof(address.sun_path)) return false;
+
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  return true;
+}
+
+// A connected socket, -1 if nobody is listening on path.
+static int connect_to(const std::string& path) {
+  sockaddr_un address;
+  if (!socket_address(path, address)) return -1;
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+    ::close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+std::string default_socket() {
+  const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+
+  if (runtime != nullptr && runtime[0] == '/') {
+    return std::string(runtime) + "/dukkha.sock";
+  }
+
+  return "/tmp/dukkha-" + std::to_string(::getuid()) + ".sock";
+}
+
+namespace {
+
+// A connection and the output of its script, which is streamed to it.
+struct Job {
+  explicit Job(int fd) : fd(fd), output(fd, Output::Target::Framed) {}
+
+  int fd;
+  Output output;
+};
+
+class Server {
+public:
+  Server(bool jit, int level, Bytecode::Format format, Cache* cache, std::int64_t quantum);
+
+  // Takes over the connection fd, its job is started on the pool.
+  void accept(int fd);
+
+private:
+  // Reads the job's request, compiles it and spawns it.
+  void start(Job* job, std::size_t worker);
+
+  struct Entry {
+    // Modification time and size of the file, unused for sources.
+    timespec mtime;
+    off_t size;
+
+    Program program;
+  };
+
+  // The cached program of path or source, compiled if there isn't one.
+  // nullptr after writing the compile errors to the job's output.
+  Program compile(Job* job, Request kind, const std::string& text, std::size_t worker);
+
+  // Ends the output, sends the exit status and closes the connection.
+  void finish(Job* job, int status);
+
+  bool m_jit;
+
+  ThreadPool m_pool;
+  Scheduler m_scheduler;
+  std::vector<Compiler> m_compilers;
+
+  std::mutex m_mutex;
+  std::unordered_map<std::string, Entry> m_paths;
+  std::unordered_map<std::string, Program> m_sources;
+};
+
+Server::Server(bool jit, int level, Bytecode::Format format, Cache* cache, std::int64_t quantum)
+  : m_jit(jit), m_scheduler(0, quantum), m_compilers(m_pool.size()) {
+  for (Compiler& compiler : m_compilers) {
+    compiler.set_cache(cache);
+    compiler.set_level(level);
+    compiler.set_format(format);
+  }
+}
+
+void Server::accept(int fd) {
+  Job* job = new Job(fd);
+
+  m_pool.submit([this, job](std::size_t worker) {
+    start(job, worker);
+  });
+}
+
+void Server::start(Job* job, std::size_t worker) {
+  std::uint8_t kind;
+  std::uint64_t size;
+
+  if (!read_all(job->fd, &kind, sizeof(kind)) || kind > REQUEST_SOURCE ||
+      !read_all(job->fd, &size, sizeof(size)) || size > MAX_REQUEST_SIZE) {
+    ::close(job->fd);
+    delete job;
+    return;
+  }
+
+  std::string text(size, '\0');
+
+  if (size > 0 && !read_all(job->fd, &text[0], size)) {
+    ::close(job->fd);
+    delete job;
+    return;
+  }
+
+  Program program = compile(job, (Request) kind, text, worker);
+
+  if (!program) {
+    finish(job, EX_SOFTWARE);
+    return;
+  }
+
+  m_scheduler.spawn(program, job->output, m_jit, [this, job](VirtualMachine::Status status) {
+    finish(job, status == VirtualMachine::Status::Finished ? EX_OK : EX_SOFTWARE);
+  });
+}
+
+Program Server::compile(Job* job, Request kind, const std::string& text, std::size_t worker) {
+  struct stat info;
+  bool exists = kind == REQUEST_PATH && ::stat(text.c_str(), &info) == 0;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (kind == REQUEST_SOURCE) {
+      auto found = m_sources.find(text);
+      if (found != m_sources.end()) return found->second;
+    } else if (exists) {
+      auto found = m_paths.find(text);
+
+      if (found != m_paths.end() && found->second.size == info.st_size &&
+          found->second.mtime.tv_sec == info.st_mtim.tv_sec &&
+          found->second.mtime.tv_nsec == info.st_mtim.tv_nsec) {
+        return found->second.program;
+      }
+    }
+  }
+
+  Bytecode code;
+  Compiler& compiler = m_compilers[worker];
+
+  compiler.set_output(job->output.stream());
+
+  bool compiled = kind == REQUEST_SOURCE ?
+    compiler.from_source(text, code) : compiler.from_file(text.c_str(), code);
+
+  if (!compiled) return nullptr;
+
+  Program program = std::make_shared<const Bytecode>(std::move(code));
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  if (m_paths.size() + m_sources.size() >= MAX_PROGRAMS) {
+    m_paths.clear();
+    m_sources.clear();
+  }
+
+  if (kind == REQUEST_SOURCE) {
+    m_sources[text] = program;
+  } else if (exists) {
+    m_paths[text] = (Entry) { info.st_mtim, info.st_size, program };
+  }
+
+  return program;
+}
+
+void Server::finish(Job* job, int status) {
+  std::uint32_t end = 0;
+  std::uint8_t code = (std::uint8_t) status;
+
+  job->output.flush();
+
+  // The client may be gone already, there's nobody to report that to.
+  if (write_all(job->fd, &end, sizeof(end))) {
+    write_all(job->fd, &code, sizeof(code));
+  }
+
+  // The output is empty, destroying it doesn't write to the closed socket.
+  ::close(job->fd);
+  delete job;
+}
+
+}
+
+int run_server(const std::string& socket, bool jit, int level, Bytecode::Format format,
+    Cache* cache, std::int64_t quantum) {
+  sockaddr_un address;
+
+  if (!socket_address(socket, address)) {
+    std::cerr << "Error: socket path '" << socket << "' is too long\n";
+    return EX_OSERR;
+  }
+
+  // A socket nobody answers on was left behind by a server that died.
+  int other = connect_to(socket);
+
+  if (other >= 0) {
+    ::close(other);
+    std::cerr << "Error: a server is already listening on '" << socket << "'\n";
+    return EX_UNAVAILABLE;
+  }
+
+  ::unlink(socket.c_str());
+
+  int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  // Only the user running the server may connect.
+  mode_t mask = ::umask(0077);
+  bool bound = listener >= 0 &&
+    ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+  ::umask(mask);
+
+  if (!bound || ::listen(listener, SOMAXCONN) < 0) {
+    std::cerr << "Error: can't listen on '" << socket << "': " << std::strerror(errno) << "\n";
+    if (listener >= 0) ::close(listener);
+    return EX_OSERR;
+  }
+
+  // Clients that hang up early must not take the server down with them.
+  std::signal(SIGPIPE, SIG_IGN);
+
+  Server server(jit, level, format, cache, quantum);
+
+  while (true) {
+    int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) continue;
+
+      std::cerr << "Error: accept failed: " << std::strerror(errno) << "\n";
+      ::close(listener);
+      return EX_OSERR;
+    }
+
+    timeval timeout { REQUEST_TIMEOUT_SECONDS, 0 };
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    server.accept(fd);
+  }
+}
+
+int run_client(const std::string& socket, const std::string& path) {
+  std::string text;
+  Request kind = REQUEST_SOURCE;
+
+  if (path == "-") {
+    char buffer[64 * 1024];
+    ssize_t count;
+
+    while ((count = ::read(STDIN_FILENO, buffer, sizeof(buffer))) != 0) {
+      if (count < 0 && errno == EINTR) continue;
+      if (count < 0) break;
+
+      text.append(buffer, count);
+    }
+  } else {
+    // The server has its own working directory.
+    char resolved[PATH_MAX];
+
+    if (::realpath(path.c_str(), resolved) == nullptr) {
+      std::cout << "Error: can't read '" << path << "'\n";
+      return EX_SOFTWARE;
+    }
+
+    text = resolved;
+    kind = REQUEST_PATH;
+  }
+
+  int fd = connect_to(socket);
+
+  if (fd < 0) {
+    std::cerr << "Error: no server is listening on '" << socket << "'\n";
+    return EX_UNAVAILABLE;
+  }
+
+  std::uint8_t request = kind;
+  std::uint64_t size = text.size();
+
+  if (!write_all(fd, &request, sizeof(request)) || !write_all(fd, &size, sizeof(size)) ||
+      !write_all(fd, text.data(), text.size())) {
+    ::close(fd);
+    return EX_PROTOCOL;
+  }
+
+  std::vector<char> frame;
+  std::uint32_t length;
+  std::uint8_t status;
+
+  while (read_all(fd, &length, sizeof(length))) {
+    if (length == 0) {
+      bool ended = read_all(fd, &status, sizeof(status));
+
+      ::close(fd);
+      return ended ? status : EX_PROTOCOL;
+    }
+
+    frame.resize(length);
+
+    if (!read_all(fd, frame.data(), length)) break;
+
+    write_all(STDOUT_FILENO, frame.data(), length);
+  }
+
+  ::close(fd);
+  return EX_PROTOCOL;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "virtual_machine.hh"
+
+class Cache;
+
+// `dukkha --serve`: a long-lived server that runs scripts for `dukkha
+// --client` over a Unix domain socket. Short scripts then don't pay for
+// process startup and compilation on every run.
+//
+// Every connection carries one job. The client sends a kind byte, 0 for a
+// path and 1 for source, followed by the 64-bit size and the bytes of an
+// absolute path or of a script's source. The server streams what the
+// script prints and its errors back in frames, a 32-bit size followed by as
+// many bytes. An empty frame ends them, followed by the exit status as one
+// byte. Integers are in the machine's byte order, server and client run on
+// the same machine.
+//
+// Requests are read and compiled on a thread pool and run time sliced on a
+// Scheduler. Compiled programs stay in memory, keyed on the path and the
+// file's modification time and size, or on the source. Symbols stay
+// interned for the life of the process.
+
+// $XDG_RUNTIME_DIR/dukkha.sock, or /tmp/dukkha-<uid>.sock if it isn't set.
+std::string default_socket();
+
+// Serves until the process is killed. Returns EX_UNAVAILABLE if another
+// server is listening on socket, EX_OSERR if it can't be set up.
+int run_server(const std::string& socket, bool jit, int level, Bytecode::Format format,
+    Cache* cache, std::int64_t quantum);
+
+// Runs the script at path on the server, or the source read from stdin if
+// path is "-", and writes its output to stdout. Returns the script's exit
+// status, EX_UNAVAILABLE if no server is listening.
+int run_client(const std::string& socket, const std::string& path);
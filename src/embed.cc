@@ -0,0 +1,22 @@
+#include "embed.hh"
+
+#include <memory>
+
+Program compile(const std::string& source, std::ostream& errors, int level,
+    Bytecode::Format format) {
+  Compiler compiler;
+  compiler.set_output(errors);
+  compiler.set_level(level);
+  compiler.set_format(format);
+
+  std::shared_ptr<Bytecode> code = std::make_shared<Bytecode>();
+
+  if (!compiler.from_source(source, *code)) return nullptr;
+
+  return code;
+}
+
+bool run(VirtualMachine& vm, Program program) {
+  vm.load(program);
+  return vm.run() == VirtualMachine::Status::Finished;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+
+#include "compiler.hh"
+#include "virtual_machine.hh"
+
+// Entry points for hosts embedding Dukkha. Scripts are compiled from memory
+// into a Program, which can be run on any number of VMs. Hosts expose their
+// own functions to scripts with VirtualMachine::define() and redirect what
+// scripts print with VirtualMachine::set_output():
+//
+//   static void twice(VirtualMachine& vm, Arguments args, Value& result, void*) {
+//     result = args[0].as_integer() * 2;
+//   }
+//
+//   VirtualMachine vm;
+//   vm.define("twice", 1, twice);
+//
+//   Program program = compile("print(twice(21));", std::cerr);
+//   if (program) run(vm, program);
+
+// Compiles source, returns nullptr after writing the compile errors to
+// errors. Neither the filesystem nor the compilation cache is used.
+Program compile(const std::string& source, std::ostream& errors,
+    int level = Compiler::DEFAULT_LEVEL, Bytecode::Format format = Bytecode::Format::Stack);
+
+// Runs program to completion on vm, returns false if it failed. Runtime
+// errors go to the VM's output. Globals, natives included, stay defined
+// for the next program run on the VM until it is reset.
+bool run(VirtualMachine& vm, Program program);
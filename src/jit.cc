@@ -0,0 +1,1037 @@
+#include "jit.hh"
+#include "runtime.h"
+#include "value.hh"
+#include "virtual_machine.hh"
+
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <type_traits>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define DUKKHA_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+Jit::~Jit() {
+  reset();
+}
+
+bool Jit::supported() {
+#ifdef DUKKHA_JIT
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Jit::reset() {
+#ifdef DUKKHA_JIT
+  for (const auto& page : m_pages) {
+    munmap(page.address, page.size);
+  }
+#endif
+
+  m_pages.clear();
+  m_traces.clear();
+  m_counters.clear();
+}
+
+const std::uint8_t* Jit::backedge(VirtualMachine* vm,
+    const std::uint8_t* branch, const std::uint8_t* target) {
+  auto trace = m_traces.find(target);
+
+  if (trace == m_traces.end()) {
+    if (++m_counters[branch] < HOT_LOOP_ITERATIONS) {
+      return nullptr;
+    }
+
+    trace = m_traces.emplace(target, Trace()).first;
+
+    if (!compile(vm, branch, target, trace->second)) {
+      // Leave the empty trace behind so the loop isn't retried.
+      trace->second.entry = nullptr;
+      return nullptr;
+    }
+  }
+
+  Trace& t = trace->second;
+
+  if (t.entry == nullptr) {
+    return nullptr;
+  }
+
+  if (t.bailouts > MAX_BAILOUTS && t.bailouts * 4 > t.entries) {
+    // The loop isn't type stable, the interpreter is faster.
+    t.entry = nullptr;
+    return nullptr;
+  }
+
+  t.entries++;
+
+  return t.entry(vm, &vm->m_sp, vm->m_fp, &vm->m_fuel);
+}
+
+// Executes the instruction at ip in the interpreter. Returns the new stack
+// pointer or nullptr if the VM halted.
+Value* Jit::step(VirtualMachine* vm, Value* sp, const std::uint8_t* ip) {
+  vm->m_sp = sp;
+  vm->m_ip = ip + 1;
+  vm->dispatch(*ip);
+
+  return vm->m_halt ? nullptr : vm->m_sp;
+}
+
+#ifdef DUKKHA_JIT
+
+namespace {
+
+enum Reg : std::uint8_t {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R8 = 8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum Cond : std::uint8_t {
+  CC_O = 0x0, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+  CC_L = 0xC, CC_LE = 0xE, CC_G = 0xF
+};
+
+// Just enough of an x86-64 assembler for the JIT. Memory operands are
+// always [base + disp32], base must not be RSP or R12.
+class Assembler {
+public:
+  std::vector<std::uint8_t> code;
+
+  std::size_t size() const {
+    return code.size();
+  }
+
+  void byte(std::uint8_t b) {
+    code.push_back(b);
+  }
+
+  void dword(std::uint32_t d) {
+    for (int i = 0; i < 4; ++i) byte(d >> (8 * i));
+  }
+
+  void qword(std::uint64_t q) {
+    for (int i = 0; i < 8; ++i) byte(q >> (8 * i));
+  }
+
+  void patch_rel32(std::size_t at, std::size_t target) {
+    std::int32_t rel = (std::int32_t) (target - (at + 4));
+    std::memcpy(&code[at], &rel, 4);
+  }
+
+  void rex(bool w, std::uint8_t reg, std::uint8_t base, bool force = false) {
+    std::uint8_t r = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+    if (r != 0x40 || force) byte(r);
+  }
+
+  void mem(std::uint8_t reg, std::uint8_t base, std::int32_t disp) {
+    byte(0x80 | ((reg & 7) << 3) | (base & 7));
+    dword(disp);
+  }
+
+  void push(Reg r) { rex(false, 0, r); byte(0x50 | (r & 7)); }
+  void pop(Reg r) { rex(false, 0, r); byte(0x58 | (r & 7)); }
+  void ret() { byte(0xC3); }
+
+  void mov(Reg dst, Reg src) {
+    rex(true, src, dst);
+    byte(0x89);
+    byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+  }
+
+  void mov_imm(Reg dst, std::uint64_t imm) {
+    rex(true, 0, dst);
+    byte(0xB8 | (dst & 7));
+    qword(imm);
+  }
+
+  void load(Reg dst, Reg base, std::int32_t disp) {
+    rex(true, dst, base); byte(0x8B); mem(dst, base, disp);
+  }
+
+  void store(Reg base, std::int32_t disp, Reg src) {
+    rex(true, src, base); byte(0x89); mem(src, base, disp);
+  }
+
+  void load_byte(Reg dst, Reg base, std::int32_t disp) {
+    rex(false, dst, base); byte(0x0F); byte(0xB6); mem(dst, base, disp);
+  }
+
+  void store_byte(Reg base, std::int32_t disp, Reg src) {
+    rex(false, src, base, src >= RSP); byte(0x88); mem(src, base, disp);
+  }
+
+  void store_byte_imm(Reg base, std::int32_t disp, std::uint8_t imm) {
+    rex(false, 0, base); byte(0xC6); mem(0, base, disp); byte(imm);
+  }
+
+  void cmp_byte_imm(Reg base, std::int32_t disp, std::uint8_t imm) {
+    rex(false, 0, base); byte(0x80); mem(7, base, disp); byte(imm);
+  }
+
+  void xor_byte_imm(Reg base, std::int32_t disp, std::uint8_t imm) {
+    rex(false, 0, base); byte(0x80); mem(6, base, disp); byte(imm);
+  }
+
+  // op r64, [base + disp] for add (0x03), sub (0x2B), cmp (0x3B).
+  void alu(std::uint8_t opcode, Reg dst, Reg base, std::int32_t disp) {
+    rex(true, dst, base); byte(opcode); mem(dst, base, disp);
+  }
+
+  void imul(Reg dst, Reg base, std::int32_t disp) {
+    rex(true, dst, base); byte(0x0F); byte(0xAF); mem(dst, base, disp);
+  }
+
+  // and (0x21) / or (0x09) r32, r32
+  void alu32(std::uint8_t opcode, Reg dst, Reg src) {
+    rex(false, src, dst); byte(opcode); byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+  }
+
+  void cmp_byte(Reg reg, Reg base, std::int32_t disp) {
+    rex(false, reg, base, reg >= RSP); byte(0x3A); mem(reg, base, disp);
+  }
+
+  // sub qword [base + disp], imm32
+  void sub_imm_at(Reg base, std::int32_t disp, std::int32_t imm) {
+    rex(true, 0, base); byte(0x81); mem(5, base, disp); dword(imm);
+  }
+
+  void add_imm(Reg dst, std::int32_t imm) {
+    rex(true, 0, dst); byte(0x81); byte(0xC0 | (dst & 7)); dword(imm);
+  }
+
+  void test(Reg a, Reg b) {
+    rex(true, b, a); byte(0x85); byte(0xC0 | ((b & 7) << 3) | (a & 7));
+  }
+
+  void cmp_imm8(Reg reg, std::uint8_t imm) {
+    rex(false, 0, reg); byte(0x83); byte(0xF8 | (reg & 7)); byte(imm);
+  }
+
+  void setcc(Cond cc, Reg dst) {
+    rex(false, 0, dst, dst >= RSP); byte(0x0F); byte(0x90 | cc); byte(0xC0 | (dst & 7));
+  }
+
+  // SSE2 op xmm, [base + disp]: movsd (0x10), sqrtsd (0x51), addsd (0x58),
+  // mulsd (0x59), subsd (0x5C).
+  void sse(std::uint8_t prefix, std::uint8_t opcode, std::uint8_t xmm, Reg base, std::int32_t disp) {
+    byte(prefix); rex(false, xmm, base); byte(0x0F); byte(opcode); mem(xmm, base, disp);
+  }
+
+  void movsd_store(Reg base, std::int32_t disp, std::uint8_t xmm) {
+    byte(0xF2); rex(false, xmm, base); byte(0x0F); byte(0x11); mem(xmm, base, disp);
+  }
+
+  void inc_dword_at(Reg base) {
+    rex(false, 0, base); byte(0xFF); byte(0x00 | (base & 7));
+  }
+
+  void call(Reg target) {
+    rex(false, 0, target); byte(0xFF); byte(0xD0 | (target & 7));
+  }
+
+  // Returns the position of the rel32 to patch.
+  std::size_t jmp() {
+    byte(0xE9);
+    dword(0);
+    return size() - 4;
+  }
+
+  std::size_t jcc(Cond cc) {
+    byte(0x0F);
+    byte(0x80 | cc);
+    dword(0);
+    return size() - 4;
+  }
+};
+
+}
+
+void* Jit::install(const std::vector<std::uint8_t>& code) {
+  std::size_t page_size = (std::size_t) sysconf(_SC_PAGESIZE);
+  std::size_t size = (code.size() + page_size - 1) / page_size * page_size;
+
+  void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (address == MAP_FAILED) {
+    return nullptr;
+  }
+
+  std::memcpy(address, code.data(), code.size());
+
+  if (mprotect(address, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(address, size);
+    return nullptr;
+  }
+
+  m_pages.push_back((Page) { .address = address, .size = size });
+  return address;
+}
+
+bool Jit::compile(const VirtualMachine* vm, const std::uint8_t* branch,
+    const std::uint8_t* target, Trace& trace) {
+  static_assert(std::is_standard_layout<Value>::value, "Value layout is used by the JIT");
+  static_assert(sizeof(Value) == 16, "Value layout is used by the JIT");
+
+  const std::int32_t SIZE = sizeof(Value);
+  const std::int32_t TYPE = offsetof(Value, m_type);
+  const std::int32_t PAYLOAD = offsetof(Value, m_number);
+
+  const std::uint8_t INTEGER = (std::uint8_t) ValueType::Integer;
+  const std::uint8_t NUMBER = (std::uint8_t) ValueType::Number;
+  const std::uint8_t BOOL = (std::uint8_t) ValueType::Bool;
+  const std::uint8_t STRING = (std::uint8_t) ValueType::String;
+  const std::uint8_t ARRAY = (std::uint8_t) ValueType::Array;
+  const std::uint8_t SYMBOL = (std::uint8_t) ValueType::Symbol;
+  const std::uint8_t OBJECT = (std::uint8_t) ValueType::Object;
+
+  // Slots relative to the stack pointer in RBX.
+  const std::int32_t A = -2 * SIZE;
+  const std::int32_t B = -SIZE;
+
+  const Bytecode* code = vm->m_code;
+  const std::uint8_t* end = branch + VirtualMachine::instruction_size(*branch);
+
+  auto read_qword = [](const std::uint8_t* at) {
+    QwordToBytes qtb;
+    std::copy(at, at + 8, qtb.bytes);
+    return qtb.qword;
+  };
+
+  Assembler as;
+
+  struct Exit {
+    std::size_t at;
+    const std::uint8_t* resume;
+    bool guard;
+  };
+
+  struct Fixup {
+    std::size_t at;
+    const std::uint8_t* target;
+  };
+
+  std::unordered_map<const std::uint8_t*, std::size_t> labels;
+  std::vector<Fixup> fixups;
+  std::vector<Fixup> backedges;
+  std::vector<Exit> exits;
+  std::vector<std::size_t> halts;
+
+  // Native signature: (VirtualMachine* vm, Value** sp, Value* locals,
+  // std::int64_t* fuel).
+  as.push(RBX);
+  as.push(R12);
+  as.push(R13);
+  as.push(R14);
+  as.push(R15);
+  as.mov(R12, RDI);
+  as.mov(R14, RSI);
+  as.load(RBX, RSI, 0);
+  as.mov(R13, RDX);
+  as.mov(R15, RCX);
+
+  auto guard = [&](Cond cc, const std::uint8_t* ip) {
+    exits.push_back((Exit) { .at = as.jcc(cc), .resume = ip, .guard = true });
+  };
+
+  auto guard_type = [&](std::int32_t slot, std::uint8_t type, const std::uint8_t* ip) {
+    as.cmp_byte_imm(RBX, slot + TYPE, type);
+    guard(CC_NE, ip);
+  };
+
+  auto jump_to = [&](std::size_t at, const std::uint8_t* to, const std::uint8_t* ip) {
+    if (to >= target && to <= ip) {
+      backedges.push_back((Fixup) { .at = at, .target = to });
+    } else if (to >= target && to < end) {
+      fixups.push_back((Fixup) { .at = at, .target = to });
+    } else {
+      exits.push_back((Exit) { .at = at, .resume = to, .guard = false });
+    }
+  };
+
+  auto call_step = [&](const std::uint8_t* ip) {
+    as.mov(RDI, R12);
+    as.mov(RSI, RBX);
+    as.mov_imm(RDX, (std::uint64_t) ip);
+    as.mov_imm(RAX, (std::uint64_t) &Jit::step);
+    as.call(RAX);
+    as.test(RAX, RAX);
+    halts.push_back(as.jcc(CC_E));
+    as.mov(RBX, RAX);
+  };
+
+  // Strings, arrays and objects are reference counted, instructions that
+  // copy or drop values are left to the interpreter whenever one of the
+  // slots holds one.
+  struct Slot {
+    Reg base;
+    std::int32_t offset;
+  };
+
+  auto unless_refcounted = [&](std::initializer_list<Slot> slots,
+      const std::uint8_t* ip, const std::function<void()>& fast) {
+    std::vector<std::size_t> slow;
+
+    for (const auto& slot : slots) {
+      as.cmp_byte_imm(slot.base, slot.offset + TYPE, STRING);
+      slow.push_back(as.jcc(CC_E));
+      as.cmp_byte_imm(slot.base, slot.offset + TYPE, ARRAY);
+      slow.push_back(as.jcc(CC_E));
+      as.cmp_byte_imm(slot.base, slot.offset + TYPE, OBJECT);
+      slow.push_back(as.jcc(CC_E));
+    }
+
+    fast();
+    std::size_t done = as.jmp();
+
+    for (auto at : slow) {
+      as.patch_rel32(at, as.size());
+    }
+
+    call_step(ip);
+    as.patch_rel32(done, as.size());
+  };
+
+  // Integer and double fast paths of a binary arithmetic instruction,
+  // other operand types leave the trace. Operands of the Num variants are
+  // known to be numbers, mixed operands and integer overflow are stepped
+  // through the interpreter instead.
+  auto arithmetic = [&](std::uint8_t op, bool numeric, const std::uint8_t* ip) {
+    std::vector<std::size_t> slow;
+
+    auto leave = [&](Cond cc) {
+      if (numeric) {
+        slow.push_back(as.jcc(cc));
+      } else {
+        guard(cc, ip);
+      }
+    };
+
+    as.load_byte(RAX, RBX, A + TYPE);
+    as.load_byte(RCX, RBX, B + TYPE);
+    as.cmp_imm8(RAX, INTEGER);
+    std::size_t not_integer = as.jcc(CC_NE);
+    as.cmp_imm8(RCX, INTEGER);
+    leave(CC_NE);
+
+    as.load(RAX, RBX, A + PAYLOAD);
+    switch (op) {
+      case VirtualMachine::Add: as.alu(0x03, RAX, RBX, B + PAYLOAD); break;
+      case VirtualMachine::Subtract: as.alu(0x2B, RAX, RBX, B + PAYLOAD); break;
+      case VirtualMachine::Multiply: as.imul(RAX, RBX, B + PAYLOAD); break;
+    }
+    leave(CC_O);
+    as.store(RBX, A + PAYLOAD, RAX);
+    std::size_t done = as.jmp();
+
+    as.patch_rel32(not_integer, as.size());
+    as.cmp_imm8(RAX, NUMBER);
+    leave(CC_NE);
+    as.cmp_imm8(RCX, NUMBER);
+    leave(CC_NE);
+
+    as.sse(0xF2, 0x10, 0, RBX, A + PAYLOAD);
+    switch (op) {
+      case VirtualMachine::Add: as.sse(0xF2, 0x58, 0, RBX, B + PAYLOAD); break;
+      case VirtualMachine::Subtract: as.sse(0xF2, 0x5C, 0, RBX, B + PAYLOAD); break;
+      case VirtualMachine::Multiply: as.sse(0xF2, 0x59, 0, RBX, B + PAYLOAD); break;
+    }
+    as.movsd_store(RBX, A + PAYLOAD, 0);
+
+    as.patch_rel32(done, as.size());
+    as.add_imm(RBX, -SIZE);
+
+    if (!slow.empty()) {
+      std::size_t skip = as.jmp();
+
+      for (auto at : slow) {
+        as.patch_rel32(at, as.size());
+      }
+
+      call_step(ip);
+      as.patch_rel32(skip, as.size());
+    }
+  };
+
+  // local = local op operand in place, integer and double fast paths.
+  // Anything else, including integer overflow, calls back into the
+  // interpreter, which also pops the operand when it's on the stack.
+  auto in_place = [&](std::uint8_t op, std::int32_t local, Slot operand, bool pop,
+      const std::uint8_t* ip) {
+    std::vector<std::size_t> slow;
+
+    as.load_byte(RAX, R13, local + TYPE);
+    as.load_byte(RCX, operand.base, operand.offset + TYPE);
+    as.cmp_imm8(RAX, INTEGER);
+    std::size_t not_integer = as.jcc(CC_NE);
+    as.cmp_imm8(RCX, INTEGER);
+    slow.push_back(as.jcc(CC_NE));
+
+    as.load(RAX, R13, local + PAYLOAD);
+    switch (op) {
+      case VirtualMachine::Add: as.alu(0x03, RAX, operand.base, operand.offset + PAYLOAD); break;
+      case VirtualMachine::Subtract: as.alu(0x2B, RAX, operand.base, operand.offset + PAYLOAD); break;
+      case VirtualMachine::Multiply: as.imul(RAX, operand.base, operand.offset + PAYLOAD); break;
+    }
+    slow.push_back(as.jcc(CC_O));
+    as.store(R13, local + PAYLOAD, RAX);
+    std::size_t integer_done = as.jmp();
+
+    as.patch_rel32(not_integer, as.size());
+    as.cmp_imm8(RAX, NUMBER);
+    slow.push_back(as.jcc(CC_NE));
+    as.cmp_imm8(RCX, NUMBER);
+    slow.push_back(as.jcc(CC_NE));
+
+    as.sse(0xF2, 0x10, 0, R13, local + PAYLOAD);
+    switch (op) {
+      case VirtualMachine::Add: as.sse(0xF2, 0x58, 0, operand.base, operand.offset + PAYLOAD); break;
+      case VirtualMachine::Subtract: as.sse(0xF2, 0x5C, 0, operand.base, operand.offset + PAYLOAD); break;
+      case VirtualMachine::Multiply: as.sse(0xF2, 0x59, 0, operand.base, operand.offset + PAYLOAD); break;
+    }
+    as.movsd_store(R13, local + PAYLOAD, 0);
+
+    as.patch_rel32(integer_done, as.size());
+    if (pop) as.add_imm(RBX, -SIZE);
+    std::size_t done = as.jmp();
+
+    for (auto at : slow) {
+      as.patch_rel32(at, as.size());
+    }
+
+    call_step(ip);
+    as.patch_rel32(done, as.size());
+  };
+
+  // Integer and double fast paths of Less/Greater, see arithmetic() for
+  // the Num variants.
+  auto comparison = [&](std::uint8_t op, bool numeric, const std::uint8_t* ip) {
+    std::vector<std::size_t> slow;
+
+    auto leave = [&](Cond cc) {
+      if (numeric) {
+        slow.push_back(as.jcc(cc));
+      } else {
+        guard(cc, ip);
+      }
+    };
+
+    as.load_byte(RAX, RBX, A + TYPE);
+    as.load_byte(RCX, RBX, B + TYPE);
+    as.cmp_imm8(RAX, INTEGER);
+    std::size_t not_integer = as.jcc(CC_NE);
+    as.cmp_imm8(RCX, INTEGER);
+    leave(CC_NE);
+
+    as.load(RAX, RBX, A + PAYLOAD);
+    as.alu(0x3B, RAX, RBX, B + PAYLOAD);
+    as.setcc(op == VirtualMachine::Less ? CC_L : CC_G, RAX);
+    std::size_t done = as.jmp();
+
+    as.patch_rel32(not_integer, as.size());
+    as.cmp_imm8(RAX, NUMBER);
+    leave(CC_NE);
+    as.cmp_imm8(RCX, NUMBER);
+    leave(CC_NE);
+
+    // a < b is b > a, 'above' is false for unordered operands.
+    if (op == VirtualMachine::Less) {
+      as.sse(0xF2, 0x10, 0, RBX, B + PAYLOAD);
+      as.sse(0x66, 0x2E, 0, RBX, A + PAYLOAD);
+    } else {
+      as.sse(0xF2, 0x10, 0, RBX, A + PAYLOAD);
+      as.sse(0x66, 0x2E, 0, RBX, B + PAYLOAD);
+    }
+    as.setcc(CC_A, RAX);
+
+    as.patch_rel32(done, as.size());
+    as.store_byte_imm(RBX, A + TYPE, BOOL);
+    as.store_byte(RBX, A + PAYLOAD, RAX);
+    as.add_imm(RBX, -SIZE);
+
+    if (!slow.empty()) {
+      std::size_t skip = as.jmp();
+
+      for (auto at : slow) {
+        as.patch_rel32(at, as.size());
+      }
+
+      call_step(ip);
+      as.patch_rel32(skip, as.size());
+    }
+  };
+
+  // Superinstructions: a op b with both operands read in place, the
+  // result replaces the value on top of the stack or is pushed. Integer
+  // and double fast paths of the arithmetic and comparison instructions,
+  // everything else, including integer overflow, steps the whole
+  // instruction through the interpreter.
+  auto fused = [&](std::uint8_t op, Slot a, Slot b, bool push, const std::uint8_t* ip) {
+    bool compare = false;
+
+    switch (op) {
+      case VirtualMachine::AddNum: op = VirtualMachine::Add; break;
+      case VirtualMachine::SubNum: op = VirtualMachine::Subtract; break;
+      case VirtualMachine::MulNum: op = VirtualMachine::Multiply; break;
+      case VirtualMachine::LessNum: op = VirtualMachine::Less; break;
+      case VirtualMachine::GreaterNum: op = VirtualMachine::Greater; break;
+    }
+
+    switch (op) {
+      case VirtualMachine::Add:
+      case VirtualMachine::Subtract:
+      case VirtualMachine::Multiply:
+        break;
+      case VirtualMachine::Less:
+      case VirtualMachine::Greater:
+        compare = true;
+        break;
+      default:
+        call_step(ip);
+        return;
+    }
+
+    const std::int32_t result = push ? 0 : B;
+    std::vector<std::size_t> slow;
+
+    as.load_byte(RAX, a.base, a.offset + TYPE);
+    as.load_byte(RCX, b.base, b.offset + TYPE);
+    as.cmp_imm8(RAX, INTEGER);
+    std::size_t not_integer = as.jcc(CC_NE);
+    as.cmp_imm8(RCX, INTEGER);
+    slow.push_back(as.jcc(CC_NE));
+
+    as.load(RAX, a.base, a.offset + PAYLOAD);
+
+    if (compare) {
+      as.alu(0x3B, RAX, b.base, b.offset + PAYLOAD);
+      as.setcc(op == VirtualMachine::Less ? CC_L : CC_G, RAX);
+    } else {
+      switch (op) {
+        case VirtualMachine::Add: as.alu(0x03, RAX, b.base, b.offset + PAYLOAD); break;
+        case VirtualMachine::Subtract: as.alu(0x2B, RAX, b.base, b.offset + PAYLOAD); break;
+        case VirtualMachine::Multiply: as.imul(RAX, b.base, b.offset + PAYLOAD); break;
+      }
+      slow.push_back(as.jcc(CC_O));
+      as.store_byte_imm(RBX, result + TYPE, INTEGER);
+      as.store(RBX, result + PAYLOAD, RAX);
+    }
+
+    std::size_t integer_done = as.jmp();
+
+    as.patch_rel32(not_integer, as.size());
+    as.cmp_imm8(RAX, NUMBER);
+    slow.push_back(as.jcc(CC_NE));
+    as.cmp_imm8(RCX, NUMBER);
+    slow.push_back(as.jcc(CC_NE));
+
+    if (compare) {
+      // a < b is b > a, 'above' is false for unordered operands.
+      Slot x = op == VirtualMachine::Less ? b : a;
+      Slot y = op == VirtualMachine::Less ? a : b;
+
+      as.sse(0xF2, 0x10, 0, x.base, x.offset + PAYLOAD);
+      as.sse(0x66, 0x2E, 0, y.base, y.offset + PAYLOAD);
+      as.setcc(CC_A, RAX);
+    } else {
+      as.sse(0xF2, 0x10, 0, a.base, a.offset + PAYLOAD);
+      switch (op) {
+        case VirtualMachine::Add: as.sse(0xF2, 0x58, 0, b.base, b.offset + PAYLOAD); break;
+        case VirtualMachine::Subtract: as.sse(0xF2, 0x5C, 0, b.base, b.offset + PAYLOAD); break;
+        case VirtualMachine::Multiply: as.sse(0xF2, 0x59, 0, b.base, b.offset + PAYLOAD); break;
+      }
+      as.store_byte_imm(RBX, result + TYPE, NUMBER);
+      as.movsd_store(RBX, result + PAYLOAD, 0);
+    }
+
+    as.patch_rel32(integer_done, as.size());
+
+    if (compare) {
+      as.store_byte_imm(RBX, result + TYPE, BOOL);
+      as.store_byte(RBX, result + PAYLOAD, RAX);
+    }
+
+    if (push) as.add_imm(RBX, SIZE);
+
+    std::size_t done = as.jmp();
+
+    for (auto at : slow) {
+      as.patch_rel32(at, as.size());
+    }
+
+    call_step(ip);
+    as.patch_rel32(done, as.size());
+  };
+
+  std::size_t instructions = 0;
+
+  for (const std::uint8_t* ip = target; ip < end; ip += VirtualMachine::instruction_size(*ip)) {
+    labels[ip] = as.size();
+    instructions++;
+
+    switch (*ip) {
+      case VirtualMachine::Constant16: {
+        Value value = code->get_const(ip[1]);
+
+        if (value.is(ValueType::Integer) || value.is(ValueType::Number) ||
+            value.is(ValueType::Symbol)) {
+          as.store_byte_imm(RBX, TYPE, (std::uint8_t) value.getType());
+          std::uint64_t bits;
+          std::memcpy(&bits, &value.m_number, sizeof(bits));
+
+          as.mov_imm(RAX, bits);
+          as.store(RBX, PAYLOAD, RAX);
+          as.add_imm(RBX, SIZE);
+        } else if (value.is(ValueType::Bool)) {
+          as.store_byte_imm(RBX, TYPE, BOOL);
+          as.store_byte_imm(RBX, PAYLOAD, value.as_bool());
+          as.add_imm(RBX, SIZE);
+        } else {
+          call_step(ip);
+        }
+
+        break;
+      }
+      case VirtualMachine::Pop:
+        unless_refcounted({ { RBX, B } }, ip, [&]() {
+          as.add_imm(RBX, -SIZE);
+        });
+        break;
+      case VirtualMachine::LoadLocal:
+        unless_refcounted({ { R13, ip[1] * SIZE } }, ip, [&]() {
+          as.load(RAX, R13, ip[1] * SIZE);
+          as.load(RCX, R13, ip[1] * SIZE + 8);
+          as.store(RBX, 0, RAX);
+          as.store(RBX, 8, RCX);
+          as.add_imm(RBX, SIZE);
+        });
+        break;
+      case VirtualMachine::StoreLocal:
+        unless_refcounted({ { RBX, B }, { R13, ip[1] * SIZE } }, ip, [&]() {
+          as.load(RAX, RBX, B);
+          as.load(RCX, RBX, B + 8);
+          as.store(R13, ip[1] * SIZE, RAX);
+          as.store(R13, ip[1] * SIZE + 8, RCX);
+        });
+        break;
+      case VirtualMachine::PopLocal:
+        unless_refcounted({ { RBX, B }, { R13, ip[1] * SIZE } }, ip, [&]() {
+          as.load(RAX, RBX, B);
+          as.load(RCX, RBX, B + 8);
+          as.store(R13, ip[1] * SIZE, RAX);
+          as.store(R13, ip[1] * SIZE + 8, RCX);
+          as.add_imm(RBX, -SIZE);
+        });
+        break;
+      case VirtualMachine::IncLocal:
+        // Constants live as long as the program, RDX points at this one.
+        as.mov_imm(RDX, (std::uint64_t) &code->get_const(ip[2]));
+        in_place(VirtualMachine::Add, ip[1] * SIZE, { RDX, 0 }, false, ip);
+        break;
+      case VirtualMachine::AddStoreLocal:
+        in_place(VirtualMachine::Add, ip[1] * SIZE, { RBX, B }, true, ip);
+        break;
+      case VirtualMachine::SubStoreLocal:
+        in_place(VirtualMachine::Subtract, ip[1] * SIZE, { RBX, B }, true, ip);
+        break;
+      case VirtualMachine::MulStoreLocal:
+        in_place(VirtualMachine::Multiply, ip[1] * SIZE, { RBX, B }, true, ip);
+        break;
+      case VirtualMachine::Add:
+      case VirtualMachine::Subtract:
+      case VirtualMachine::Multiply:
+        arithmetic(*ip, false, ip);
+        break;
+      case VirtualMachine::AddNum:
+        arithmetic(VirtualMachine::Add, true, ip);
+        break;
+      case VirtualMachine::SubNum:
+        arithmetic(VirtualMachine::Subtract, true, ip);
+        break;
+      case VirtualMachine::MulNum:
+        arithmetic(VirtualMachine::Multiply, true, ip);
+        break;
+      case VirtualMachine::Less:
+      case VirtualMachine::Greater:
+        comparison(*ip, false, ip);
+        break;
+      case VirtualMachine::LessNum:
+        comparison(VirtualMachine::Less, true, ip);
+        break;
+      case VirtualMachine::GreaterNum:
+        comparison(VirtualMachine::Greater, true, ip);
+        break;
+      case VirtualMachine::Equal:
+        // Integers, symbols and bools only, anything else bails out.
+        // Symbols compare their whole payload, like integers.
+        as.load_byte(RAX, RBX, A + TYPE);
+        as.cmp_byte(RAX, RBX, B + TYPE);
+        guard(CC_NE, ip);
+        as.cmp_imm8(RAX, SYMBOL);
+        {
+          std::size_t symbol = as.jcc(CC_E);
+          as.cmp_imm8(RAX, INTEGER);
+          std::size_t not_integer = as.jcc(CC_NE);
+          as.patch_rel32(symbol, as.size());
+          as.load(RAX, RBX, A + PAYLOAD);
+          as.alu(0x3B, RAX, RBX, B + PAYLOAD);
+          as.setcc(CC_E, RAX);
+          std::size_t done = as.jmp();
+
+          as.patch_rel32(not_integer, as.size());
+          as.cmp_imm8(RAX, BOOL);
+          guard(CC_NE, ip);
+          as.load_byte(RAX, RBX, A + PAYLOAD);
+          as.cmp_byte(RAX, RBX, B + PAYLOAD);
+          as.setcc(CC_E, RAX);
+
+          as.patch_rel32(done, as.size());
+        }
+        as.store_byte_imm(RBX, A + TYPE, BOOL);
+        as.store_byte(RBX, A + PAYLOAD, RAX);
+        as.add_imm(RBX, -SIZE);
+        break;
+      case VirtualMachine::Not:
+        guard_type(B, BOOL, ip);
+        as.xor_byte_imm(RBX, B + PAYLOAD, 1);
+        break;
+      case VirtualMachine::And:
+      case VirtualMachine::Or:
+        guard_type(A, BOOL, ip);
+        guard_type(B, BOOL, ip);
+        as.load_byte(RAX, RBX, A + PAYLOAD);
+        as.load_byte(RCX, RBX, B + PAYLOAD);
+        as.alu32(*ip == VirtualMachine::And ? 0x21 : 0x09, RAX, RCX);
+        as.store_byte(RBX, A + PAYLOAD, RAX);
+        as.add_imm(RBX, -SIZE);
+        break;
+      case VirtualMachine::Jump:
+        jump_to(as.jmp(), code->get_code().data() + read_qword(ip + 1), ip);
+        break;
+      case VirtualMachine::JumpIfFalse:
+      case VirtualMachine::JumpIfTrue:
+        guard_type(B, BOOL, ip);
+        as.add_imm(RBX, -SIZE);
+        as.cmp_byte_imm(RBX, PAYLOAD, 0);
+        jump_to(as.jcc(*ip == VirtualMachine::JumpIfFalse ? CC_E : CC_NE),
+            code->get_code().data() + read_qword(ip + 1), ip);
+        break;
+      case VirtualMachine::JumpIfFalseKeep:
+      case VirtualMachine::JumpIfTrueKeep:
+        guard_type(B, BOOL, ip);
+        as.cmp_byte_imm(RBX, B + PAYLOAD, 0);
+        jump_to(as.jcc(*ip == VirtualMachine::JumpIfFalseKeep ? CC_E : CC_NE),
+            code->get_code().data() + read_qword(ip + 1), ip);
+        break;
+      case VirtualMachine::ForLoop: {
+        // counter += step, then i = counter and jump back while the
+        // counter is short of the limit. Integer overflow ends the loop
+        // like in the interpreter. Bails out if i holds a refcounted value.
+        const std::int32_t counter = ip[9] * SIZE;
+        const std::int32_t limit = counter + SIZE;
+        const std::int32_t step = counter + 2 * SIZE;
+        const std::int32_t var = counter + 3 * SIZE;
+
+        const std::uint8_t* done = ip + VirtualMachine::instruction_size(*ip);
+        std::vector<std::size_t> more;
+
+        for (std::uint8_t type : { STRING, ARRAY, OBJECT }) {
+          as.cmp_byte_imm(R13, var + TYPE, type);
+          guard(CC_E, ip);
+        }
+
+        as.load_byte(RAX, R13, counter + TYPE);
+        as.cmp_imm8(RAX, INTEGER);
+        std::size_t not_integer = as.jcc(CC_NE);
+
+        as.load(RAX, R13, counter + PAYLOAD);
+        as.alu(0x03, RAX, R13, step + PAYLOAD);
+        jump_to(as.jcc(CC_O), done, ip);
+        as.store(R13, counter + PAYLOAD, RAX);
+
+        as.load(RCX, R13, step + PAYLOAD);
+        as.test(RCX, RCX);
+        std::size_t integer_down = as.jcc(CC_L);
+        as.alu(0x3B, RAX, R13, limit + PAYLOAD);
+        more.push_back(as.jcc(CC_L));
+        jump_to(as.jmp(), done, ip);
+
+        as.patch_rel32(integer_down, as.size());
+        as.alu(0x3B, RAX, R13, limit + PAYLOAD);
+        more.push_back(as.jcc(CC_G));
+        jump_to(as.jmp(), done, ip);
+
+        // Doubles, the sign bit of the step gives the direction.
+        as.patch_rel32(not_integer, as.size());
+        as.cmp_imm8(RAX, NUMBER);
+        guard(CC_NE, ip);
+
+        as.sse(0xF2, 0x10, 0, R13, counter + PAYLOAD);
+        as.sse(0xF2, 0x58, 0, R13, step + PAYLOAD);
+        as.movsd_store(R13, counter + PAYLOAD, 0);
+
+        as.load(RCX, R13, step + PAYLOAD);
+        as.test(RCX, RCX);
+        std::size_t double_down = as.jcc(CC_L);
+        as.sse(0xF2, 0x10, 0, R13, limit + PAYLOAD);
+        as.sse(0x66, 0x2E, 0, R13, counter + PAYLOAD);
+        more.push_back(as.jcc(CC_A));
+        jump_to(as.jmp(), done, ip);
+
+        as.patch_rel32(double_down, as.size());
+        as.sse(0x66, 0x2E, 0, R13, limit + PAYLOAD);
+        more.push_back(as.jcc(CC_A));
+        jump_to(as.jmp(), done, ip);
+
+        for (auto at : more) {
+          as.patch_rel32(at, as.size());
+        }
+
+        as.load(RAX, R13, counter);
+        as.load(RCX, R13, counter + 8);
+        as.store(R13, var, RAX);
+        as.store(R13, var + 8, RCX);
+
+        jump_to(as.jmp(), code->get_code().data() + read_qword(ip + 1), ip);
+        break;
+      }
+      case VirtualMachine::BinaryLocalConst:
+        as.mov_imm(RDX, (std::uint64_t) &code->get_const(ip[2]));
+        fused(ip[3], { R13, ip[1] * SIZE }, { RDX, 0 }, true, ip);
+        break;
+      case VirtualMachine::BinaryLocals:
+        fused(ip[3], { R13, ip[1] * SIZE }, { R13, ip[2] * SIZE }, true, ip);
+        break;
+      case VirtualMachine::BinaryConst:
+        as.mov_imm(RDX, (std::uint64_t) &code->get_const(ip[1]));
+        fused(ip[2], { RBX, B }, { RDX, 0 }, false, ip);
+        break;
+      case VirtualMachine::Math: {
+        // sqrt() of a double in place, other functions and operand types
+        // are stepped through the interpreter.
+        if (ip[1] != DU_MATH_SQRT) {
+          call_step(ip);
+          break;
+        }
+
+        as.cmp_byte_imm(RBX, B + TYPE, NUMBER);
+        std::size_t slow = as.jcc(CC_NE);
+        as.sse(0xF2, 0x51, 0, RBX, B + PAYLOAD);
+        as.movsd_store(RBX, B + PAYLOAD, 0);
+        std::size_t done = as.jmp();
+
+        as.patch_rel32(slow, as.size());
+        call_step(ip);
+        as.patch_rel32(done, as.size());
+        break;
+      }
+      case VirtualMachine::Negate:
+      case VirtualMachine::Divide:
+      case VirtualMachine::DivNum:
+      case VirtualMachine::Exp:
+      case VirtualMachine::Print:
+      case VirtualMachine::LoadNull:
+      case VirtualMachine::AllocGlobal:
+      case VirtualMachine::StoreGlobal:
+      case VirtualMachine::LoadGlobal:
+      case VirtualMachine::ArrayLiteral:
+      case VirtualMachine::LoadIndex:
+      case VirtualMachine::StoreIndex:
+      case VirtualMachine::Length:
+      case VirtualMachine::Sum:
+      case VirtualMachine::Min:
+      case VirtualMachine::Max:
+      case VirtualMachine::Fill:
+      case VirtualMachine::Map:
+      case VirtualMachine::Append:
+      case VirtualMachine::NewObject:
+      case VirtualMachine::GetProperty:
+      case VirtualMachine::SetProperty:
+      case VirtualMachine::InitProperty:
+      case VirtualMachine::ForPrep:
+      case VirtualMachine::DivStoreLocal:
+      case VirtualMachine::Math2:
+        call_step(ip);
+        break;
+      default:
+        // Return and anything unknown is left to the interpreter.
+        return false;
+    }
+  }
+
+  // Falling off the loop continues after the backward jump.
+  exits.push_back((Exit) { .at = as.jmp(), .resume = end, .guard = false });
+
+  // Backward jumps charge one iteration's worth of instructions and leave
+  // to the interpreter at the jump target once the fuel runs out.
+  for (const auto& backedge : backedges) {
+    as.patch_rel32(backedge.at, as.size());
+    as.sub_imm_at(R15, 0, (std::int32_t) instructions);
+    exits.push_back((Exit) { .at = as.jcc(CC_LE), .resume = backedge.target, .guard = false });
+    fixups.push_back((Fixup) { .at = as.jmp(), .target = backedge.target });
+  }
+
+  for (const auto& fixup : fixups) {
+    as.patch_rel32(fixup.at, labels.at(fixup.target));
+  }
+
+  std::vector<std::size_t> to_epilogue;
+
+  for (const auto& exit : exits) {
+    as.patch_rel32(exit.at, as.size());
+
+    if (exit.guard) {
+      as.mov_imm(RAX, (std::uint64_t) &trace.bailouts);
+      as.inc_dword_at(RAX);
+    }
+
+    as.store(R14, 0, RBX);
+    as.mov_imm(RAX, (std::uint64_t) exit.resume);
+    to_epilogue.push_back(as.jmp());
+  }
+
+  for (auto at : halts) {
+    as.patch_rel32(at, as.size());
+  }
+
+  // RAX is already nullptr when the VM halted.
+  for (auto at : to_epilogue) {
+    as.patch_rel32(at, as.size());
+  }
+
+  as.pop(R15);
+  as.pop(R14);
+  as.pop(R13);
+  as.pop(R12);
+  as.pop(RBX);
+  as.ret();
+
+  void* native = install(as.code);
+
+  if (native == nullptr) {
+    return false;
+  }
+
+  trace.entry = (NativeLoop) native;
+  return true;
+}
+
+#else
+
+bool Jit::compile(const VirtualMachine*, const std::uint8_t*,
+    const std::uint8_t*, Trace&) {
+  return false;
+}
+
+void* Jit::install(const std::vector<std::uint8_t>&) {
+  return nullptr;
+}
+
+#endif
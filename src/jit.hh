@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class Bytecode;
+class Value;
+class VirtualMachine;
+
+// Baseline JIT for hot loops (Linux x86-64 only).
+//
+// The interpreter reports every taken backward jump. Once a loop has
+// iterated HOT_LOOP_ITERATIONS times its bytecode, from the jump target up
+// to the backward jump, is translated into native code operating directly
+// on the VM stack. Integer, double and bool operations are inlined behind
+// type guards; a failing guard bails out to the interpreter at the guarded
+// instruction. Other instructions call back into the interpreter one at a
+// time. Loops that keep bailing out are blacklisted. Native loops charge
+// the VM's fuel on every iteration and return to the interpreter at the
+// back-edge once it runs out.
+class Jit {
+public:
+  Jit() = default;
+  ~Jit();
+
+  static bool supported();
+
+  // Called when the jump at branch to target is taken. Returns the address
+  // the interpreter should continue at, or nullptr if the loop wasn't run
+  // natively.
+  const std::uint8_t* backedge(VirtualMachine* vm,
+      const std::uint8_t* branch, const std::uint8_t* target);
+
+  // Drops all compiled code, must be called when the VM switches programs.
+  void reset();
+
+private:
+  typedef const std::uint8_t* (*NativeLoop)(VirtualMachine* vm, Value** sp, Value* locals,
+      std::int64_t* fuel);
+
+  static const std::uint32_t HOT_LOOP_ITERATIONS = 1000;
+  static const std::uint32_t MAX_BAILOUTS = 16;
+
+  struct Trace {
+    NativeLoop entry { nullptr };
+
+    std::uint32_t entries { 0 };
+    std::uint32_t bailouts { 0 };
+  };
+
+  bool compile(const VirtualMachine* vm, const std::uint8_t* branch,
+      const std::uint8_t* target, Trace& trace);
+  void* install(const std::vector<std::uint8_t>& code);
+
+  static Value* step(VirtualMachine* vm, Value* sp, const std::uint8_t* ip);
+
+  std::unordered_map<const std::uint8_t*, std::uint32_t> m_counters;
+  std::unordered_map<const std::uint8_t*, Trace> m_traces;
+
+  struct Page {
+    void* address;
+    std::size_t size;
+  };
+
+  std::vector<Page> m_pages;
+};
@@ -27,6 +27,7 @@ std::ostream& operator <<(std::ostream& os, TokenType type) {
     TT_CASE(os, LeftRound)
     TT_CASE(os, RightRound)
     TT_CASE(os, Semicolon)
+    TT_CASE(os, Colon)
     TT_CASE(os, Dot)
     TT_CASE(os, Comma)
     TT_CASE(os, Minus)
@@ -46,10 +47,12 @@ std::ostream& operator <<(std::ostream& os, TokenType type) {
     TT_CASE(os, LessEq)
     TT_CASE(os, GreaterEq)
     TT_CASE(os, BangEq)
+    TT_CASE(os, DotDot)
     TT_CASE(os, Function)
     TT_CASE(os, Return)
     TT_CASE(os, Let)
     TT_CASE(os, For)
+    TT_CASE(os, In)
     TT_CASE(os, While)
     TT_CASE(os, If)
     TT_CASE(os, Else)
@@ -62,7 +65,9 @@ std::ostream& operator <<(std::ostream& os, TokenType type) {
     TT_CASE(os, Continue)
     TT_CASE(os, Break)
     TT_CASE(os, NumberLiteral)
+    TT_CASE(os, IntegerLiteral)
     TT_CASE(os, StringLiteral)
+    TT_CASE(os, SymbolLiteral)
     TT_CASE(os, Null)
     TT_CASE(os, Identifer)
     TT_CASE(os, Error)
@@ -85,6 +90,7 @@ Lexer::~Lexer() {
 
 void Lexer::reset() {
   delete [] m_source;
+  m_source = nullptr;
 
   m_position = 0;
   m_line = 1;
@@ -99,8 +105,6 @@ bool Lexer::from_file(const char* path) {
   std::ifstream stream(path);
 
   if (!stream) {
-    std::cerr << "Lexer::from_file(): File '" << path << "' does not exist!\n";
-    stream.close();
     return false;
   }
 
@@ -124,6 +128,22 @@ bool Lexer::from_source(const char* source) {
   return true;
 }
 
+Token Lexer::peek() {
+  char* cursor = m_cursor;
+  char peek = m_peek;
+  std::size_t line = m_line;
+  std::size_t position = m_position;
+
+  Token token = next();
+
+  m_cursor = cursor;
+  m_peek = peek;
+  m_line = line;
+  m_position = position;
+
+  return token;
+}
+
 Token Lexer::next() {
   do {
     advance();
@@ -147,7 +167,8 @@ Token Lexer::next() {
     case '(': return make_token(TokenType::LeftRound);
     case ')': return make_token(TokenType::RightRound);
     case ';': return make_token(TokenType::Semicolon);
-    case '.': return make_token(TokenType::Dot);
+    case ':': return make_token(TokenType::Colon);
+    case '.': return match_token('.', TokenType::DotDot, TokenType::Dot);
     case ',': return make_token(TokenType::Comma);
     case '-': return match_token('=', TokenType::MinusEq, TokenType::Minus);
     case '*': {
@@ -165,6 +186,16 @@ Token Lexer::next() {
     case '!': return match_token('=', TokenType::BangEq, TokenType::Bang);
     case '=': return match_token('=', TokenType::EqEq, TokenType::Eq);
     case '\'': return string();
+    case '@': {
+      if (!std::isalpha(m_peek) && m_peek != '_') break;
+
+      advance();
+
+      Token token = identifer();
+      token.type = TokenType::SymbolLiteral;
+
+      return token;
+    }
   }
 
   return make_token(TokenType::Error, "Unexpected symbol");
@@ -185,7 +216,12 @@ Token Lexer::keyword_or_identifer() {
       }
       break;
     case 'l': return keyword(1, 2, "et", TokenType::Let);
-    case 'i': return keyword(1, 1, "f", TokenType::If);
+    case 'i':
+      switch (m_peek) {
+        case 'f': return keyword(1, 1, "f", TokenType::If);
+        case 'n': return keyword(1, 1, "n", TokenType::In);
+      }
+      break;
     case 'p': return keyword(1, 4, "rint", TokenType::Print);
     case 'w': return keyword(1, 4, "hile", TokenType::While);
     case 'e': return keyword(1, 3, "lse", TokenType::Else);
@@ -208,7 +244,8 @@ Token Lexer::keyword(std::size_t start, std::size_t len,
   bool match = !std::strncmp(str, m_cursor + start,
       std::strlen(str));
 
-  char after = *(m_cursor + start + len);
+  // Only read past the keyword if it matched, it may end the source.
+  char after = match ? *(m_cursor + start + len) : '\0';
 
   if (match && !std::isalpha(after) && !std::isdigit(after) && after != '_') {
     Token token = make_token(type);
@@ -263,23 +300,31 @@ Token Lexer::string() {
 
 Token Lexer::number() {
   double value = 0;
+  std::int64_t integer = 0;
   bool decimal = false;
+  bool overflow = false;
   int n_decimals = 0;
 
   Token token = make_token(0.0);
 
   while (std::isdigit(*m_cursor) || *m_cursor == '.') {
     if (*m_cursor == '.') {
-      if (decimal) break;
+      // Only a '.' followed by a digit is a decimal point.
+      if (decimal || !std::isdigit(m_peek)) break;
 
       decimal = true;
       advance();
     }
 
-    double digit = (*m_cursor) - '0';
+    int digit = (*m_cursor) - '0';
     value = 10 * value + digit;
 
-    if (decimal) n_decimals++;
+    if (decimal) {
+      n_decimals++;
+    } else if (!overflow) {
+      overflow = __builtin_mul_overflow(integer, 10, &integer) ||
+                 __builtin_add_overflow(integer, digit, &integer);
+    }
 
     advance();
   }
@@ -287,6 +332,14 @@ Token Lexer::number() {
   m_peek = *(--m_cursor);
   m_position--;
 
+  // Literals without a decimal point are integers unless they don't fit
+  // into 64 bits.
+  if (!decimal && !overflow) {
+    token.type = TokenType::IntegerLiteral;
+    token.as_integer = integer;
+    return token;
+  }
+
   token.as_number = value * pow(10, -n_decimals);
   return token;
 }
@@ -306,11 +359,14 @@ void Lexer::advance(bool skip_line) {
       m_position = 0;
     }
 
-    m_cursor++;
+    // Never move past the terminating '\0'.
+    if (*m_cursor != '\0') {
+      m_cursor++;
+    }
   }
 
   m_position++;
-  m_peek = *(m_cursor + 1);
+  m_peek = *m_cursor != '\0' ? *(m_cursor + 1) : '\0';
 }
 
 bool Lexer::is_newline(char ch) const {
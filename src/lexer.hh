@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <ostream>
 #include <vector>
 #include <string>
@@ -7,17 +8,18 @@
 enum class TokenType {
   // 1 character tokens
   LeftCurly, RightCurly, LeftSquare, RightSquare, LeftRound, RightRound,
-  Semicolon, Dot, Comma, Minus, Star, Plus, Slash, Eq, Less, Greater, Bang,
+  Semicolon, Colon, Dot, Comma, Minus, Star, Plus, Slash, Eq, Less, Greater, Bang,
 
   // 2 character tokens
   MinusEq, StarEq, PlusEq, SlashEq, EqEq, StarStar, LessEq, GreaterEq, BangEq,
+  DotDot,
 
   // Keywords
-  Function, Return, Let, For, While, If, Else, And, Or, Not, True, False, Print,
+  Function, Return, Let, For, In, While, If, Else, And, Or, Not, True, False, Print,
   Continue, Break,
 
   // Literals
-  NumberLiteral, StringLiteral, Null,
+  NumberLiteral, IntegerLiteral, StringLiteral, SymbolLiteral, Null,
 
   Identifer,
 
@@ -36,6 +38,7 @@ struct Token {
   union {
     const char* as_string;
     double as_number { 0 };
+    std::int64_t as_integer;
   };
 
   std::size_t line { 0 };
@@ -52,6 +55,9 @@ public:
 
   Token next();
 
+  // Returns the token next() would return, without consuming it.
+  Token peek();
+
 private:
   void reset();
 
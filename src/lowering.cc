@@ -0,0 +1,698 @@
+#include "lowering.hh"
+#include "value.hh"
+#include "virtual_machine.hh"
+
+#include <cstring>
+
+using namespace ast;
+
+// Unchecked variant of a binary instruction whose operands are numbers.
+static std::uint8_t numeric(std::uint8_t op) {
+  switch (op) {
+    case VirtualMachine::Add: return VirtualMachine::AddNum;
+    case VirtualMachine::Subtract: return VirtualMachine::SubNum;
+    case VirtualMachine::Multiply: return VirtualMachine::MulNum;
+    case VirtualMachine::Divide: return VirtualMachine::DivNum;
+    case VirtualMachine::Less: return VirtualMachine::LessNum;
+    case VirtualMachine::Greater: return VirtualMachine::GreaterNum;
+  }
+
+  return op;
+}
+
+LoweringBase::LoweringBase(Bytecode& code, std::ostream& out) : m_code(code), m_out(out) {
+}
+
+Lowering::Lowering(Bytecode& code, std::ostream& out) : LoweringBase(code, out) {
+}
+
+void Lowering::set_superinstructions(bool enabled) {
+  m_superinstructions = enabled;
+}
+
+bool Lowering::lower(Stmt* program) {
+  statements(program);
+
+  emit_byte(VirtualMachine::Return, here() > 0 ? m_code.get_line(here() - 1) : 0);
+
+  return !m_had_error;
+}
+
+void Lowering::statements(Stmt* stmt) {
+  for (; stmt; stmt = stmt->next) {
+    statement(stmt);
+  }
+}
+
+void Lowering::statement(Stmt* stmt) {
+  switch (stmt->kind) {
+    case StmtKind::Expression:
+      expression(stmt->a);
+
+      // The value of an expression statement is discarded.
+      emit_byte(VirtualMachine::Pop, stmt->line);
+      break;
+    case StmtKind::Print:
+      expression(stmt->a);
+      emit_byte(VirtualMachine::Print, stmt->line);
+      break;
+    case StmtKind::Let:
+      // The value is left where the local lives.
+      if (stmt->a) {
+        expression(stmt->a);
+      } else {
+        emit_byte(VirtualMachine::LoadNull, stmt->line);
+      }
+
+      declare(stmt->local, stmt->line);
+      break;
+    case StmtKind::Global: {
+      std::size_t pname = resolve_string(stmt->name);
+
+      emit_byte(VirtualMachine::AllocGlobal, stmt->line);
+      emit_const(pname, stmt->line);
+
+      if (stmt->a) {
+        expression(stmt->a);
+      } else {
+        emit_byte(VirtualMachine::LoadNull, stmt->line);
+      }
+
+      emit_byte(VirtualMachine::StoreGlobal, stmt->line);
+      emit_const(pname, stmt->line);
+      break;
+    }
+    case StmtKind::Assign:
+      assignment(stmt);
+      break;
+    case StmtKind::StoreIndex:
+      expression(stmt->a);
+      expression(stmt->b);
+      expression(stmt->c);
+      emit_byte(VirtualMachine::StoreIndex, stmt->line);
+      break;
+    case StmtKind::StoreProperty:
+      expression(stmt->a);
+      expression(stmt->c);
+      emit_property(VirtualMachine::SetProperty, resolve_symbol(stmt->name),
+          m_code.push_property_site(), stmt->line);
+      break;
+    case StmtKind::Block:
+      block(stmt);
+      break;
+    case StmtKind::If:
+      if_statement(stmt);
+      break;
+    case StmtKind::While:
+      while_statement(stmt);
+      break;
+    case StmtKind::For:
+      for_statement(stmt);
+      break;
+    case StmtKind::Break:
+    case StmtKind::Continue:
+      loop_control(stmt);
+      break;
+    case StmtKind::Return:
+      if (stmt->a == nullptr) {
+        emit_byte(VirtualMachine::LoadNull, stmt->line);
+      } else if (stmt->a->kind == ExprKind::Call) {
+        // A call that produces the returned value replaces the current
+        // frame and never comes back here.
+        call(stmt->a, true);
+        break;
+      } else {
+        expression(stmt->a);
+      }
+
+      emit_byte(VirtualMachine::Return, stmt->line);
+      break;
+    case StmtKind::Function:
+      function(stmt);
+      break;
+  }
+}
+
+void Lowering::block(Stmt* block) {
+  std::size_t locals = m_locals;
+
+  statements(block->body);
+
+  pop_locals(locals, block->line);
+  m_locals = locals;
+}
+
+void Lowering::if_statement(Stmt* stmt) {
+  expression(stmt->a);
+
+  emit_byte(VirtualMachine::JumpIfFalse, stmt->line);
+  std::size_t next_block_target = emit_qword(0, stmt->line);
+
+  block(stmt->body);
+
+  if (stmt->orelse == nullptr) {
+    patch(next_block_target);
+    return;
+  }
+
+  emit_byte(VirtualMachine::Jump, stmt->line);
+  std::size_t endif_jump = emit_qword(0, stmt->line);
+
+  patch(next_block_target);
+
+  // A Block, or the If of 'else if'.
+  statement(stmt->orelse);
+
+  patch(endif_jump);
+}
+
+// Loops are rotated so that each iteration executes a single conditional
+// branch:
+//
+//     <condition>
+//     JumpIfFalse else
+//   body:
+//     <block>
+//   continue:
+//     <condition>
+//     JumpIfTrue body
+//   else:
+//     <else block>
+//   break:
+void Lowering::while_statement(Stmt* stmt) {
+  expression(stmt->a);
+
+  emit_byte(VirtualMachine::JumpIfFalse, stmt->line);
+  std::size_t loop_else_target = emit_qword(0, stmt->line);
+
+  std::size_t loop_body = here();
+
+  m_loops.push_back((Loop) { .locals = m_locals });
+  block(stmt->body);
+  Loop loop = m_loops.back();
+  m_loops.pop_back();
+
+  for (auto address : loop.continue_jumps) {
+    patch(address);
+  }
+
+  expression(stmt->a);
+
+  emit_byte(VirtualMachine::JumpIfTrue, stmt->line);
+  emit_qword(loop_body, stmt->line);
+
+  patch(loop_else_target);
+
+  if (stmt->orelse) {
+    block(stmt->orelse);
+  }
+
+  for (auto address : loop.break_jumps) {
+    patch(address);
+  }
+}
+
+// 'for i in a..b step s { ... }' keeps the counter, limit and step in
+// hidden locals next to i. ForPrep checks the range once, ForLoop at the
+// bottom of the body advances the counter, copies it into i and jumps
+// back in one instruction.
+void Lowering::for_statement(Stmt* stmt) {
+  std::size_t locals = m_locals;
+
+  expression(stmt->a);
+  expression(stmt->b);
+
+  if (stmt->c) {
+    expression(stmt->c);
+  } else {
+    Expr one {};
+    one.kind = ExprKind::Integer;
+    one.integer = 1;
+
+    emit_byte(VirtualMachine::Constant16, stmt->line);
+    emit_const(constant(&one), stmt->line);
+  }
+
+  emit_byte(VirtualMachine::LoadNull, stmt->line);
+
+  std::size_t slot = m_locals;
+  m_locals += 3;
+  declare(stmt->local, stmt->line);
+
+  emit_byte(VirtualMachine::ForPrep, stmt->line);
+  emit_byte(slot, stmt->line);
+
+  emit_byte(VirtualMachine::JumpIfFalse, stmt->line);
+  std::size_t exit = emit_qword(0, stmt->line);
+
+  std::size_t loop_body = here();
+
+  m_loops.push_back((Loop) { .locals = m_locals });
+  block(stmt->body);
+  Loop loop = m_loops.back();
+  m_loops.pop_back();
+
+  for (auto address : loop.continue_jumps) {
+    patch(address);
+  }
+
+  std::size_t line = stmt->body->line;
+
+  emit_byte(VirtualMachine::ForLoop, line);
+  emit_qword(loop_body, line);
+  emit_byte(slot, line);
+
+  patch(exit);
+
+  for (auto address : loop.break_jumps) {
+    patch(address);
+  }
+
+  pop_locals(locals, line);
+  m_locals = locals;
+}
+
+void Lowering::loop_control(Stmt* stmt) {
+  // The parser doesn't let control statements outside loops through.
+  if (m_loops.empty()) return;
+
+  Loop& loop = m_loops.back();
+
+  // Jumping out of the body skips the Pops at the end of its blocks.
+  pop_locals(loop.locals, stmt->line);
+
+  emit_byte(VirtualMachine::Jump, stmt->line);
+
+  if (stmt->kind == StmtKind::Break) {
+    loop.break_jumps.push_back(emit_qword(0, stmt->line));
+  } else {
+    loop.continue_jumps.push_back(emit_qword(0, stmt->line));
+  }
+}
+
+// Functions are globals. The body is emitted in place and jumped over:
+//
+//     AllocGlobal name
+//     Jump end
+//   entry:
+//     <body>
+//     LoadNull
+//     Return
+//   end:
+//     Constant16 <function>
+//     StoreGlobal name
+//
+// Arguments are the first locals of the body's frame.
+void Lowering::function(Stmt* stmt) {
+  Function function { stmt->name, (std::uint8_t) stmt->count, 0, 0 };
+  std::size_t pname = resolve_string(function.name);
+
+  emit_byte(VirtualMachine::AllocGlobal, stmt->line);
+  emit_const(pname, stmt->line);
+
+  emit_byte(VirtualMachine::Jump, stmt->line);
+  std::size_t end_target = emit_qword(0, stmt->line);
+
+  function.entry = here();
+
+  std::size_t enclosing_locals = m_locals;
+  std::vector<Loop> enclosing_loops;
+
+  std::swap(m_loops, enclosing_loops);
+  m_locals = 0;
+
+  for (std::size_t i = 0; i < stmt->count; ++i) {
+    declare(stmt->params[i], stmt->line);
+  }
+
+  statements(stmt->body);
+
+  // Return drops the frame, locals don't have to be popped.
+  std::size_t line = here() > function.entry ? m_code.get_line(here() - 1) : stmt->line;
+
+  emit_byte(VirtualMachine::LoadNull, line);
+  emit_byte(VirtualMachine::Return, line);
+
+  m_locals = enclosing_locals;
+  std::swap(m_loops, enclosing_loops);
+
+  patch(end_target);
+
+  std::size_t pfunction = m_code.push_const(Value::function(m_code.push_function(function)));
+
+  emit_byte(VirtualMachine::Constant16, line);
+  emit_const(pfunction, line);
+  emit_byte(VirtualMachine::StoreGlobal, line);
+  emit_const(pname, line);
+}
+
+// Assignments to locals update the slot in place:
+//
+//     x = y;        <y> PopLocal x
+//     x += y;       <y> AddStoreLocal x
+//     x += 1;       IncLocal x 1
+//     x = x + 1;    IncLocal x 1
+//
+// Globals are loaded, combined and stored back.
+void Lowering::assignment(Stmt* stmt) {
+  std::uint8_t op = stmt->op;
+  Expr* value = stmt->a;
+
+  if (stmt->local == nullptr) {
+    std::size_t pname = resolve_string(stmt->name);
+
+    if (op) {
+      emit_byte(VirtualMachine::LoadGlobal, stmt->line);
+      emit_const(pname, stmt->line);
+    }
+
+    expression(value);
+
+    if (op) emit_byte(op, stmt->line);
+
+    emit_byte(VirtualMachine::StoreGlobal, stmt->line);
+    emit_const(pname, stmt->line);
+    return;
+  }
+
+  std::size_t slot = stmt->local->slot;
+
+  // 'x = x + y;' with a constant or variable y is 'x += y;'. Loading y
+  // has no side effects, so it can go first.
+  if (!op && value->kind == ExprKind::Binary && value->a->kind == ExprKind::Local &&
+      value->a->local == stmt->local &&
+      (is_trivial(value->b) || value->b->kind == ExprKind::Global)) {
+    switch (value->op) {
+      case VirtualMachine::Add:
+      case VirtualMachine::Subtract:
+      case VirtualMachine::Multiply:
+      case VirtualMachine::Divide:
+        op = value->op;
+        value = value->b;
+        break;
+    }
+  }
+
+  if (!op) {
+    expression(value);
+    emit_byte(VirtualMachine::PopLocal, stmt->line);
+    emit_byte(slot, stmt->line);
+    return;
+  }
+
+  // Adding or subtracting a number constant doesn't need the stack.
+  bool minus = op == VirtualMachine::Subtract;
+
+  if ((op == VirtualMachine::Add || minus) &&
+      (value->kind == ExprKind::Number ||
+       (value->kind == ExprKind::Integer && !(minus && value->integer == INT64_MIN)))) {
+    Expr increment = *value;
+
+    if (minus && increment.kind == ExprKind::Integer) increment.integer = -increment.integer;
+    if (minus && increment.kind == ExprKind::Number) increment.number = -increment.number;
+
+    emit_byte(VirtualMachine::IncLocal, stmt->line);
+    emit_byte(slot, stmt->line);
+    emit_const(constant(&increment), stmt->line);
+    return;
+  }
+
+  expression(value);
+
+  switch (op) {
+    case VirtualMachine::Add: emit_byte(VirtualMachine::AddStoreLocal, stmt->line); break;
+    case VirtualMachine::Subtract: emit_byte(VirtualMachine::SubStoreLocal, stmt->line); break;
+    case VirtualMachine::Multiply: emit_byte(VirtualMachine::MulStoreLocal, stmt->line); break;
+    case VirtualMachine::Divide: emit_byte(VirtualMachine::DivStoreLocal, stmt->line); break;
+  }
+
+  emit_byte(slot, stmt->line);
+}
+
+void Lowering::expression(Expr* expr) {
+  switch (expr->kind) {
+    case ExprKind::Integer:
+    case ExprKind::Number:
+    case ExprKind::Bool:
+    case ExprKind::String:
+    case ExprKind::Symbol:
+      emit_byte(VirtualMachine::Constant16, expr->line);
+      emit_const(constant(expr), expr->line);
+      break;
+    case ExprKind::Local:
+      emit_byte(VirtualMachine::LoadLocal, expr->line);
+      emit_byte(expr->local->slot, expr->line);
+      break;
+    case ExprKind::Global:
+      emit_byte(VirtualMachine::LoadGlobal, expr->line);
+      emit_const(resolve_string(expr->name), expr->line);
+      break;
+    case ExprKind::Unary:
+      expression(expr->a);
+      emit_byte(expr->op, expr->line);
+      break;
+    case ExprKind::Binary: {
+      std::uint8_t op = expr->numeric ? numeric(expr->op) : expr->op;
+      bool fuse = m_superinstructions;
+
+      // A local and a literal or two locals are read by a single
+      // superinstruction, a literal right operand is combined with the
+      // value on the stack.
+      if (fuse && expr->a->kind == ExprKind::Local && expr->b->kind == ExprKind::Local) {
+        emit_byte(VirtualMachine::BinaryLocals, expr->line);
+        emit_byte(expr->a->local->slot, expr->line);
+        emit_byte(expr->b->local->slot, expr->line);
+      } else if (fuse && expr->a->kind == ExprKind::Local && is_literal(expr->b)) {
+        emit_byte(VirtualMachine::BinaryLocalConst, expr->line);
+        emit_byte(expr->a->local->slot, expr->line);
+        emit_const(constant(expr->b), expr->line);
+      } else if (fuse && is_literal(expr->b)) {
+        expression(expr->a);
+        emit_byte(VirtualMachine::BinaryConst, expr->line);
+        emit_const(constant(expr->b), expr->line);
+      } else {
+        expression(expr->a);
+        expression(expr->b);
+      }
+
+      emit_byte(op, expr->line);
+      break;
+    }
+    case ExprKind::And:
+    case ExprKind::Or: {
+      // Both 'or' and 'and' short-circuit: once the left operand decides
+      // the result it's left on the stack and the right operand is jumped
+      // over. Otherwise the right operand is combined with the left one by
+      // Or/And, which still type checks it. A chain of the same operator
+      // jumps straight to its end.
+      std::vector<Expr*> chain;
+
+      for (Expr* link = expr; link->kind == expr->kind; link = link->a) {
+        chain.push_back(link);
+      }
+
+      bool is_and = expr->kind == ExprKind::And;
+      std::vector<std::size_t> end_jumps;
+
+      expression(chain.back()->a);
+
+      for (auto link = chain.rbegin(); link != chain.rend(); ++link) {
+        emit_byte(is_and ? VirtualMachine::JumpIfFalseKeep : VirtualMachine::JumpIfTrueKeep,
+            (*link)->line);
+        end_jumps.push_back(emit_qword(0, (*link)->line));
+
+        expression((*link)->b);
+        emit_byte(is_and ? VirtualMachine::And : VirtualMachine::Or, (*link)->line);
+      }
+
+      for (auto address : end_jumps) {
+        patch(address);
+      }
+
+      break;
+    }
+    case ExprKind::Call:
+      call(expr, false);
+      break;
+    case ExprKind::Intrinsic:
+      arguments(expr->list);
+      emit_byte(expr->op, expr->line);
+
+      // The operator of map() and the math function are part of the
+      // instruction.
+      if (expr->op == VirtualMachine::Map || expr->op == VirtualMachine::Math ||
+          expr->op == VirtualMachine::Math2) {
+        emit_byte(expr->arith, expr->line);
+      }
+
+      break;
+    case ExprKind::Index:
+      expression(expr->a);
+      expression(expr->b);
+      emit_byte(VirtualMachine::LoadIndex, expr->line);
+      break;
+    case ExprKind::Property:
+    case ExprKind::Field:
+      if (!expr->has_site) {
+        expr->site = m_code.push_property_site();
+        expr->has_site = true;
+      }
+
+      expression(expr->a);
+      emit_property(expr->kind == ExprKind::Property ? VirtualMachine::GetProperty :
+                                                       VirtualMachine::InitProperty,
+          resolve_symbol(expr->name), expr->site, expr->line);
+      break;
+    case ExprKind::Array:
+      arguments(expr->list);
+      emit_byte(VirtualMachine::ArrayLiteral, expr->line);
+      emit_byte(expr->count, expr->line);
+      break;
+    case ExprKind::Object:
+      emit_byte(VirtualMachine::NewObject, expr->line);
+
+      for (Expr* field = expr->list; field; field = field->next) {
+        expression(field);
+      }
+
+      break;
+    case ExprKind::Tee:
+      expression(expr->a);
+
+      // StoreLocal leaves the value on the stack.
+      emit_byte(VirtualMachine::StoreLocal, expr->line);
+      emit_byte(expr->local->slot, expr->line);
+      break;
+  }
+}
+
+void Lowering::call(Expr* expr, bool tail) {
+  expression(expr->a);
+  std::size_t argc = arguments(expr->list);
+
+  emit_byte(tail ? VirtualMachine::TailCall : VirtualMachine::Call, expr->line);
+  emit_byte(argc, expr->line);
+}
+
+std::size_t Lowering::arguments(Expr* list) {
+  std::size_t count = 0;
+
+  for (Expr* arg = list; arg; arg = arg->next) {
+    expression(arg);
+    count++;
+  }
+
+  return count;
+}
+
+void Lowering::declare(Local* local, std::size_t line) {
+  if (m_locals > UINT8_MAX) {
+    error(line, "Too many locals");
+  }
+
+  local->slot = m_locals++;
+}
+
+void Lowering::pop_locals(std::size_t keep, std::size_t line) {
+  for (std::size_t i = keep; i < m_locals; ++i) {
+    emit_byte(VirtualMachine::Pop, line);
+  }
+}
+
+std::size_t LoweringBase::resolve_string(const std::string& name) {
+  auto it = m_strings.find(name);
+
+  if (it == m_strings.end()) {
+    std::size_t address = m_code.push_const(name);
+    m_strings[name] = address;
+    return address;
+  }
+
+  return it->second;
+}
+
+std::size_t LoweringBase::resolve_symbol(const std::string& name) {
+  auto it = m_symbols.find(name);
+
+  if (it == m_symbols.end()) {
+    std::size_t address = m_code.push_const(Value::symbol(SymbolTable::intern(name)));
+    m_symbols[name] = address;
+    return address;
+  }
+
+  return it->second;
+}
+
+// Constant index of a literal. Numbers and bools are shared by their bits,
+// so lowering a condition twice doesn't grow the constant table.
+std::size_t LoweringBase::constant(const Expr* literal) {
+  std::string key(1, (char) literal->kind);
+
+  switch (literal->kind) {
+    case ExprKind::String: return resolve_string(literal->name);
+    case ExprKind::Symbol: return resolve_symbol(literal->name);
+    case ExprKind::Integer: key.append((const char*) &literal->integer, sizeof(std::int64_t)); break;
+    case ExprKind::Number: key.append((const char*) &literal->number, sizeof(double)); break;
+    default: key += (char) literal->boolean; break;
+  }
+
+  auto it = m_numbers.find(key);
+
+  if (it != m_numbers.end()) {
+    return it->second;
+  }
+
+  std::size_t address;
+
+  switch (literal->kind) {
+    case ExprKind::Integer: address = m_code.push_const(literal->integer); break;
+    case ExprKind::Number: address = m_code.push_const(literal->number); break;
+    default: address = m_code.push_const(literal->boolean); break;
+  }
+
+  m_numbers[key] = address;
+  return address;
+}
+
+std::size_t LoweringBase::emit_byte(std::uint8_t byte, std::size_t line) {
+  return m_code.push_byte(byte, line);
+}
+
+std::size_t LoweringBase::emit_qword(std::size_t qword, std::size_t line) {
+  return m_code.push_qword(qword, line);
+}
+
+// Constant operands are a single byte.
+void LoweringBase::emit_const(std::size_t address, std::size_t line) {
+  if (address > UINT8_MAX) {
+    error(line, "Too many constants");
+  }
+
+  emit_byte(address, line);
+}
+
+// Property instructions name a constant and a site of their own.
+void Lowering::emit_property(std::uint8_t op, std::size_t name, std::size_t site, std::size_t line) {
+  if (site > UINT16_MAX) {
+    error(line, "Too many property accesses");
+  }
+
+  emit_byte(op, line);
+  emit_const(name, line);
+  emit_byte(site & 0xFF, line);
+  emit_byte(site >> 8, line);
+}
+
+std::size_t LoweringBase::here() const {
+  return m_code.get_code().size();
+}
+
+// Points the jump operand at address to the next instruction.
+void LoweringBase::patch(std::size_t address) {
+  m_code.set_qword(address, here());
+}
+
+void LoweringBase::error(std::size_t line, const char* msg) {
+  m_had_error = true;
+  m_out << "Error at: " << line << " - " << msg << "\n";
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.hh"
+
+class Bytecode;
+
+// Constant pool, code and error reporting shared by the stack and the
+// register backend.
+class LoweringBase {
+protected:
+  LoweringBase(Bytecode& code, std::ostream& out);
+
+  std::size_t resolve_string(const std::string& name);
+  std::size_t resolve_symbol(const std::string& name);
+  std::size_t constant(const ast::Expr* literal);
+
+  std::size_t emit_byte(std::uint8_t byte, std::size_t line);
+  std::size_t emit_qword(std::size_t qword, std::size_t line);
+  void emit_const(std::size_t address, std::size_t line);
+  std::size_t here() const;
+  void patch(std::size_t address);
+
+  void error(std::size_t line, const char* msg);
+
+  Bytecode& m_code;
+  std::ostream& m_out;
+
+  std::unordered_map<std::string, std::size_t> m_strings;
+  std::unordered_map<std::string, std::size_t> m_symbols;
+  // Kind and bits of number and bool literals -> constant index
+  std::unordered_map<std::string, std::size_t> m_numbers;
+
+  bool m_had_error { false };
+};
+
+// Translates the syntax tree of a program into bytecode. Locals get their
+// stack slots here, in declaration order: a frame's slots are its
+// parameters followed by the locals of the enclosing blocks.
+class Lowering : LoweringBase {
+public:
+  Lowering(Bytecode& code, std::ostream& out);
+
+  // Emits VirtualMachine::BinaryLocalConst and BinaryLocals for binary
+  // operators whose operands allow it, off by default.
+  void set_superinstructions(bool enabled);
+
+  // False if the program exceeds one of the bytecode's limits, which is
+  // reported to out.
+  bool lower(ast::Stmt* program);
+
+private:
+  struct Loop {
+    // Live locals at the top of the body, break and continue pop the ones
+    // above.
+    std::size_t locals;
+
+    std::vector<std::size_t> break_jumps;
+    std::vector<std::size_t> continue_jumps;
+  };
+
+  void statements(ast::Stmt* stmt);
+  void statement(ast::Stmt* stmt);
+  void block(ast::Stmt* block);
+  void if_statement(ast::Stmt* stmt);
+  void while_statement(ast::Stmt* stmt);
+  void for_statement(ast::Stmt* stmt);
+  void loop_control(ast::Stmt* stmt);
+  void function(ast::Stmt* stmt);
+  void assignment(ast::Stmt* stmt);
+
+  void expression(ast::Expr* expr);
+  void call(ast::Expr* expr, bool tail);
+  std::size_t arguments(ast::Expr* list);
+
+  void declare(ast::Local* local, std::size_t line);
+  void pop_locals(std::size_t keep, std::size_t line);
+
+  void emit_property(std::uint8_t op, std::size_t name, std::size_t site, std::size_t line);
+
+  // Slots in use in the current frame.
+  std::size_t m_locals { 0 };
+  std::vector<Loop> m_loops;
+
+  bool m_superinstructions { false };
+};
@@ -1,27 +1,271 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <sysexits.h>
+#include <vector>
 
-#include "virtual_machine.hh"
+#include "batch.hh"
+#include "c_emitter.hh"
+#include "cache.hh"
 #include "compiler.hh"
+#include "daemon.hh"
+#include "op_profile.hh"
+#include "output.hh"
+#include "scheduler.hh"
+#include "virtual_machine.hh"
 
-int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    std::cerr << "Usage: dukkha <file.du>\n";
-    return EX_USAGE;
+struct SnapshotTarget {
+  // Where --snapshot writes the image, nullptr without it.
+  const char* path;
+  bool taken;
+};
+
+// The snapshot() built-in. With --snapshot it writes the image and ends the
+// program, which continues from the image with snapshot() returning true.
+// Otherwise it returns false.
+static void snapshot(VirtualMachine& vm, Arguments args, Value& result, void* data) {
+  SnapshotTarget& target = *static_cast<SnapshotTarget*>(data);
+
+  result = false;
+
+  if (target.path == nullptr) return;
+
+  result = true;
+
+  std::ofstream out(target.path, std::ios::binary | std::ios::trunc);
+
+  target.taken = vm.snapshot(out, result);
+
+  if (target.taken && !out.flush()) {
+    vm.error() << "Can't write snapshot to '" << target.path << "'.\n";
+    target.taken = false;
+  }
+
+  if (!target.taken) {
+    std::remove(target.path);
+    return;
   }
 
+  vm.halt();
+}
+
+// Runs program, or the one restored from image if program is null.
+static int run_program(Program program, const char* image, const char* snapshot_path, bool jit,
+    OpProfile* profile, bool discard_output) {
+  // Formats everything, but writes nothing.
+  Output discard(Output::Target::Null);
+  SnapshotTarget target { snapshot_path, false };
+
+  VirtualMachine vm;
+  vm.set_jit(jit);
+  vm.set_profile(profile);
+  vm.define("snapshot", 0, snapshot, &target);
+
+  if (discard_output) vm.set_output(discard);
+
+  if (program) {
+    vm.load(program);
+  } else {
+    std::ifstream in(image, std::ios::binary);
+
+    if (!in || !vm.restore(in)) {
+      std::cout << "Error: can't read image '" << image << "'\n";
+      return EX_SOFTWARE;
+    }
+  }
+
+  bool finished = vm.run() == VirtualMachine::Status::Finished;
+
+  if (snapshot_path != nullptr && !target.taken && finished) {
+    std::cout << "Error: the program finished without calling snapshot()\n";
+    return EX_SOFTWARE;
+  }
+
+  return finished || target.taken ? EX_OK : EX_SOFTWARE;
+}
+
+static int run_file(const char* path, const char* snapshot_path, bool jit, bool emit_c, int level,
+    Bytecode::Format format, Cache* cache, OpProfile* profile, bool discard_output) {
   Bytecode code;
 
   Compiler compiler;
-  bool compiled = compiler.from_file(argv[1], code);
+  compiler.set_cache(cache);
+  compiler.set_level(level);
+
+  // The C emitter translates stack code.
+  compiler.set_format(emit_c ? Bytecode::Format::Stack : format);
+
+  bool compiled = compiler.from_file(path, code);
 
   if (!compiled) return EX_SOFTWARE;
 
+  if (emit_c) {
+    CEmitter emitter;
+    return emitter.emit(code, std::cout) ? EX_OK : EX_SOFTWARE;
+  }
+
   /* code.dump_data(); */
   /* code.dump_text(); */
 
-  VirtualMachine vm;
-  vm.execute(&code);
+  Program program = std::make_shared<const Bytecode>(std::move(code));
+
+  return run_program(program, nullptr, snapshot_path, jit, profile, discard_output);
+}
+
+int main(int argc, char* argv[]) {
+  bool jit = false;
+  bool emit_c = false;
+  bool batch = false;
+  bool serve = false;
+  bool client = false;
+  bool usage = false;
+  bool use_cache = true;
+  bool cache_stats = false;
+  bool profile_ops = false;
+  bool discard_output = false;
+  const char* snapshot_path = nullptr;
+  const char* image = nullptr;
+  int level = Compiler::DEFAULT_LEVEL;
+  Bytecode::Format format = Bytecode::Format::Stack;
+  std::string cache_dir = Cache::default_directory();
+  std::string socket = default_socket();
+  std::int64_t quantum = Scheduler::DEFAULT_QUANTUM;
+
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--jit")) {
+      jit = true;
+    } else if (!std::strcmp(argv[i], "--no-jit")) {
+      jit = false;
+    } else if (!std::strcmp(argv[i], "--emit-c")) {
+      emit_c = true;
+    } else if (!std::strcmp(argv[i], "--batch")) {
+      batch = true;
+    } else if (!std::strcmp(argv[i], "--serve")) {
+      serve = true;
+    } else if (!std::strcmp(argv[i], "--client")) {
+      client = true;
+    } else if (!std::strcmp(argv[i], "--socket") && i + 1 < argc) {
+      socket = argv[++i];
+    } else if (!std::strcmp(argv[i], "--no-cache")) {
+      use_cache = false;
+    } else if (!std::strcmp(argv[i], "--cache-stats")) {
+      cache_stats = true;
+    } else if (!std::strcmp(argv[i], "--profile-ops")) {
+      profile_ops = true;
+    } else if (!std::strcmp(argv[i], "--discard-output")) {
+      discard_output = true;
+    } else if (!std::strcmp(argv[i], "--snapshot") && i + 1 < argc) {
+      snapshot_path = argv[++i];
+    } else if (!std::strcmp(argv[i], "--image") && i + 1 < argc) {
+      image = argv[++i];
+    } else if (!std::strcmp(argv[i], "--cache-dir") && i + 1 < argc) {
+      cache_dir = argv[++i];
+    } else if (!std::strcmp(argv[i], "-O0") || !std::strcmp(argv[i], "-O1") ||
+               !std::strcmp(argv[i], "-O2")) {
+      level = argv[i][2] - '0';
+    } else if (!std::strcmp(argv[i], "--vm=stack")) {
+      format = Bytecode::Format::Stack;
+    } else if (!std::strcmp(argv[i], "--vm=register")) {
+      format = Bytecode::Format::Register;
+    } else if (!std::strcmp(argv[i], "--quantum") && i + 1 < argc) {
+      quantum = std::strtoll(argv[++i], nullptr, 10);
+
+      if (quantum <= 0) {
+        usage = true;
+        break;
+      }
+    } else if (argv[i][0] != '-' || !std::strcmp(argv[i], "-")) {
+      paths.push_back(argv[i]);
+    } else {
+      usage = true;
+      break;
+    }
+  }
+
+  bool snapshots = snapshot_path != nullptr || image != nullptr;
+  // Options that only make sense for a script run by this process.
+  bool local = emit_c || profile_ops || discard_output || snapshots;
+
+  if (batch + serve + client > 1) {
+    usage = true;
+  } else if (batch) {
+    usage = usage || local;
+  } else if (serve) {
+    usage = usage || local || !paths.empty();
+  } else if (client) {
+    usage = usage || local || paths.size() != 1;
+  } else {
+    usage = usage || (emit_c && image != nullptr) || paths.size() != (image != nullptr ? 0 : 1);
+  }
+
+  if (usage) {
+    std::cerr << "Usage: dukkha [options] <file.du>\n"
+                 "       dukkha [options] --image <image>\n"
+                 "       dukkha --batch [options] [<file.du>...]\n"
+                 "       dukkha --emit-c [options] <file.du>\n"
+                 "       dukkha --serve [options]\n"
+                 "       dukkha --client [--socket <path>] <file.du> | -\n"
+                 "Options: --jit | --no-jit, -O0 | -O1 | -O2, --vm=stack | --vm=register,\n"
+                 "         --cache-dir <dir> | --no-cache, --cache-stats,\n"
+                 "         --quantum <instructions> (--batch and --serve), --profile-ops, --discard-output,\n"
+                 "         --snapshot <image>, --socket <path> (--serve and --client)\n";
+    return EX_USAGE;
+  }
+
+  // Clients leave everything to the server, they don't even touch the cache.
+  if (client) {
+    return run_client(socket, paths[0]);
+  }
+
+  std::unique_ptr<Cache> cache;
+
+  if (use_cache) {
+    cache.reset(new Cache(cache_dir));
+  }
+
+  int status;
+
+  if (batch) {
+    // Without files on the command line the batch is read from stdin, one
+    // path per line.
+    if (paths.empty()) {
+      std::string line;
+
+      while (std::getline(std::cin, line)) {
+        if (!line.empty()) paths.push_back(line);
+      }
+    }
+
+    status = run_batch(paths, jit, level, format, cache.get(), quantum);
+  } else if (serve) {
+    status = run_server(socket, jit, level, format, cache.get(), quantum);
+  } else {
+    // The JIT would hide the loops that matter most from the profile.
+    OpProfile profile;
+
+    bool profiled_jit = jit && !profile_ops;
+
+    if (image != nullptr) {
+      status = run_program(nullptr, image, snapshot_path, profiled_jit,
+          profile_ops ? &profile : nullptr, discard_output);
+    } else {
+      status = run_file(paths[0].c_str(), snapshot_path, profiled_jit, emit_c, level, format,
+          cache.get(), profile_ops ? &profile : nullptr, discard_output);
+    }
+
+    if (profile_ops) profile.report(std::cerr);
+  }
+
+  if (cache_stats && cache) {
+    std::cerr << "cache: " << cache->hits() << " hits, " << cache->misses() << " misses, "
+              << cache->evictions() << " evictions\n";
+  }
 
-  return EX_OK;
+  return status;
 }
@@ -0,0 +1,128 @@
+#include "op_profile.hh"
+#include "virtual_machine.hh"
+
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+
+static const char* name(std::uint8_t op) {
+  switch (op) {
+    case VirtualMachine::Return: return "Return";
+    case VirtualMachine::Constant16: return "Constant16";
+    case VirtualMachine::Pop: return "Pop";
+    case VirtualMachine::Negate: return "Negate";
+    case VirtualMachine::Add: return "Add";
+    case VirtualMachine::Subtract: return "Subtract";
+    case VirtualMachine::Multiply: return "Multiply";
+    case VirtualMachine::Exp: return "Exp";
+    case VirtualMachine::Divide: return "Divide";
+    case VirtualMachine::Not: return "Not";
+    case VirtualMachine::And: return "And";
+    case VirtualMachine::Or: return "Or";
+    case VirtualMachine::Equal: return "Equal";
+    case VirtualMachine::Greater: return "Greater";
+    case VirtualMachine::Less: return "Less";
+    case VirtualMachine::AddNum: return "AddNum";
+    case VirtualMachine::SubNum: return "SubNum";
+    case VirtualMachine::MulNum: return "MulNum";
+    case VirtualMachine::DivNum: return "DivNum";
+    case VirtualMachine::LessNum: return "LessNum";
+    case VirtualMachine::GreaterNum: return "GreaterNum";
+    case VirtualMachine::Print: return "Print";
+    case VirtualMachine::LoadNull: return "LoadNull";
+    case VirtualMachine::AllocGlobal: return "AllocGlobal";
+    case VirtualMachine::StoreGlobal: return "StoreGlobal";
+    case VirtualMachine::LoadGlobal: return "LoadGlobal";
+    case VirtualMachine::StoreLocal: return "StoreLocal";
+    case VirtualMachine::LoadLocal: return "LoadLocal";
+    case VirtualMachine::PopLocal: return "PopLocal";
+    case VirtualMachine::IncLocal: return "IncLocal";
+    case VirtualMachine::AddStoreLocal: return "AddStoreLocal";
+    case VirtualMachine::SubStoreLocal: return "SubStoreLocal";
+    case VirtualMachine::MulStoreLocal: return "MulStoreLocal";
+    case VirtualMachine::DivStoreLocal: return "DivStoreLocal";
+    case VirtualMachine::Jump: return "Jump";
+    case VirtualMachine::JumpIfFalse: return "JumpIfFalse";
+    case VirtualMachine::JumpIfTrue: return "JumpIfTrue";
+    case VirtualMachine::JumpIfFalseKeep: return "JumpIfFalseKeep";
+    case VirtualMachine::JumpIfTrueKeep: return "JumpIfTrueKeep";
+    case VirtualMachine::Call: return "Call";
+    case VirtualMachine::TailCall: return "TailCall";
+    case VirtualMachine::ArrayLiteral: return "ArrayLiteral";
+    case VirtualMachine::LoadIndex: return "LoadIndex";
+    case VirtualMachine::StoreIndex: return "StoreIndex";
+    case VirtualMachine::Length: return "Length";
+    case VirtualMachine::Sum: return "Sum";
+    case VirtualMachine::Min: return "Min";
+    case VirtualMachine::Max: return "Max";
+    case VirtualMachine::Fill: return "Fill";
+    case VirtualMachine::Map: return "Map";
+    case VirtualMachine::Append: return "Append";
+    case VirtualMachine::NewObject: return "NewObject";
+    case VirtualMachine::GetProperty: return "GetProperty";
+    case VirtualMachine::SetProperty: return "SetProperty";
+    case VirtualMachine::InitProperty: return "InitProperty";
+    case VirtualMachine::ForPrep: return "ForPrep";
+    case VirtualMachine::ForLoop: return "ForLoop";
+    case VirtualMachine::BinaryLocalConst: return "BinaryLocalConst";
+    case VirtualMachine::BinaryLocals: return "BinaryLocals";
+    case VirtualMachine::BinaryConst: return "BinaryConst";
+    case VirtualMachine::Math: return "Math";
+    case VirtualMachine::Math2: return "Math2";
+    default: return "?";
+  }
+}
+
+void OpProfile::record(std::size_t address, std::uint8_t op) {
+  m_dispatches++;
+  m_singles[op]++;
+
+  if (address != m_next) m_length = 0;
+
+  if (m_length >= 1) m_pairs[m_history[1] << 8 | op]++;
+  if (m_length >= 2) m_triples[m_history[0] << 16 | m_history[1] << 8 | op]++;
+
+  m_history[0] = m_history[1];
+  m_history[1] = op;
+  m_length = std::min<std::size_t>(m_length + 1, 2);
+  m_next = address + VirtualMachine::instruction_size(op);
+}
+
+std::uint64_t OpProfile::dispatches() const {
+  return m_dispatches;
+}
+
+// Sequences are packed into their key one opcode per byte, oldest first.
+static void top(std::ostream& out, const char* title,
+    const std::unordered_map<std::uint32_t, std::uint64_t>& counts, std::size_t length,
+    std::uint64_t total, std::size_t count) {
+  std::vector<std::pair<std::uint32_t, std::uint64_t>> sorted(counts.begin(), counts.end());
+
+  std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::uint32_t, std::uint64_t>& a,
+                                             const std::pair<std::uint32_t, std::uint64_t>& b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  });
+
+  out << title << ":\n";
+
+  for (std::size_t i = 0; i < sorted.size() && i < count; ++i) {
+    out << std::setw(12) << sorted[i].second << std::setw(7) << std::fixed << std::setprecision(2)
+        << 100.0 * sorted[i].second / total << "% ";
+
+    for (std::size_t k = length; k-- > 0;) {
+      out << " " << name(sorted[i].first >> (8 * k) & 0xFF);
+    }
+
+    out << "\n";
+  }
+}
+
+void OpProfile::report(std::ostream& out, std::size_t count) const {
+  out << "dispatches: " << m_dispatches << "\n";
+
+  if (m_dispatches == 0) return;
+
+  top(out, "instructions", m_singles, 1, m_dispatches, count);
+  top(out, "pairs", m_pairs, 2, m_dispatches, count);
+  top(out, "triples", m_triples, 3, m_dispatches, count);
+}
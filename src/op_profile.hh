@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+
+// Counts executed stack VM instructions and the sequences of two and three
+// of them that ran back to back, `dukkha --profile-ops`. Only instructions
+// that are also adjacent in the code form a sequence, a taken jump, call
+// or return starts a new one, so every reported sequence could be fused
+// into a single instruction. Used to pick the superinstructions, see
+// VirtualMachine::Instruction.
+class OpProfile {
+public:
+  // Called before the instruction at address executes.
+  void record(std::size_t address, std::uint8_t op);
+
+  std::uint64_t dispatches() const;
+
+  // The count most frequent instructions, pairs and triples.
+  void report(std::ostream& out, std::size_t count = 15) const;
+
+private:
+  std::uint64_t m_dispatches { 0 };
+
+  std::unordered_map<std::uint32_t, std::uint64_t> m_singles;
+  std::unordered_map<std::uint32_t, std::uint64_t> m_pairs;
+  std::unordered_map<std::uint32_t, std::uint64_t> m_triples;
+
+  // Previous two instructions of the current sequence, newest last, and
+  // the address the next one has to be at to extend it.
+  std::uint8_t m_history[2];
+  std::size_t m_length { 0 };
+  std::size_t m_next { SIZE_MAX };
+};
@@ -0,0 +1,928 @@
+#include "optimizer.hh"
+#include "runtime.h"
+#include "virtual_machine.hh"
+
+#include <cstring>
+#include <unordered_map>
+
+using namespace ast;
+
+void PassManager::add(passes::Pass pass) {
+  m_passes.push_back(pass);
+}
+
+void PassManager::run(Stmt*& program, Arena& arena) const {
+  for (passes::Pass pass : m_passes) {
+    pass(program, arena);
+  }
+}
+
+PassManager PassManager::for_level(int level) {
+  PassManager manager;
+
+  if (level >= 1) {
+    manager.add(passes::fold_constants);
+    manager.add(passes::eliminate_dead_code);
+  }
+
+  if (level >= 2) {
+    // Copies go first, they make equal expressions read the same locals.
+    manager.add(passes::propagate_copies);
+    manager.add(passes::eliminate_common_subexpressions);
+  }
+
+  // Last, the others may add locals and remove assignments.
+  if (level >= 1) {
+    manager.add(passes::infer_types);
+  }
+
+  return manager;
+}
+
+// Calls f with the head of every statement list directly nested in stmt.
+template<typename F>
+static void for_each_list(Stmt* stmt, F f) {
+  switch (stmt->kind) {
+    case StmtKind::Block:
+    case StmtKind::Function:
+      f(stmt->body);
+      break;
+    case StmtKind::If:
+    case StmtKind::While:
+    case StmtKind::For:
+      for_each_list(stmt->body, f);
+      if (stmt->orelse) for_each_list(stmt->orelse, f);
+      break;
+    default:
+      break;
+  }
+}
+
+static bool is_bool(const Expr* expr, bool value) {
+  return expr->kind == ExprKind::Bool && expr->boolean == value;
+}
+
+namespace passes {
+
+static bool is_number(const Expr* expr) {
+  return expr->kind == ExprKind::Integer || expr->kind == ExprKind::Number;
+}
+
+static Value literal(const Expr* expr) {
+  return expr->kind == ExprKind::Integer ? Value(expr->integer) : Value(expr->number);
+}
+
+// Turns expr into the literal value, a number.
+static void set_literal(Expr* expr, const Value& value) {
+  if (value.is(ValueType::Integer)) {
+    expr->kind = ExprKind::Integer;
+    expr->integer = value.as_integer();
+  } else {
+    expr->kind = ExprKind::Number;
+    expr->number = value.as_number();
+  }
+
+  expr->a = nullptr;
+  expr->list = nullptr;
+  expr->count = 0;
+}
+
+// Operands first, so that 'sqrt(abs(-4))' folds all the way. Results are
+// computed by the VM's own operations, folded code prints the same.
+static void fold(Expr* expr) {
+  if (expr->a) fold(expr->a);
+  if (expr->b) fold(expr->b);
+
+  for (Expr* item = expr->list; item; item = item->next) {
+    fold(item);
+  }
+
+  if (expr->kind == ExprKind::Unary && expr->op == VirtualMachine::Negate && is_number(expr->a)) {
+    std::int64_t result;
+
+    if (expr->a->kind == ExprKind::Integer && du_sub_int(0, expr->a->integer, &result)) {
+      set_literal(expr, Value(result));
+    } else {
+      set_literal(expr, Value(-literal(expr->a).to_double()));
+    }
+  }
+
+  bool math = expr->kind == ExprKind::Intrinsic &&
+              (expr->op == VirtualMachine::Math || expr->op == VirtualMachine::Math2);
+
+  if (math && is_number(expr->list) && (!expr->list->next || is_number(expr->list->next))) {
+    Value b = expr->list->next ? literal(expr->list->next) : Value();
+    set_literal(expr, VirtualMachine::math(expr->arith, literal(expr->list), b));
+  }
+}
+
+static void fold(Stmt*& list) {
+  for (Stmt* stmt = list; stmt; stmt = stmt->next) {
+    for (Expr* expr : { stmt->a, stmt->b, stmt->c }) {
+      if (expr) fold(expr);
+    }
+
+    for_each_list(stmt, [](Stmt*& nested) { fold(nested); });
+  }
+}
+
+void fold_constants(Stmt*& program, Arena&) {
+  fold(program);
+}
+
+static void dead_code(Stmt*& list);
+
+static bool terminates(const Stmt* stmt) {
+  switch (stmt->kind) {
+    case StmtKind::Break:
+    case StmtKind::Continue:
+    case StmtKind::Return:
+      return true;
+    case StmtKind::Block:
+      for (const Stmt* item = stmt->body; item; item = item->next) {
+        if (terminates(item)) return true;
+      }
+
+      return false;
+    case StmtKind::If:
+      return stmt->orelse && terminates(stmt->body) && terminates(stmt->orelse);
+    default:
+      return false;
+  }
+}
+
+// What stmt turns into, nullptr if it goes away.
+static Stmt* simplify(Stmt* stmt) {
+  switch (stmt->kind) {
+    case StmtKind::Expression:
+      return is_trivial(stmt->a) ? nullptr : stmt;
+    case StmtKind::Block:
+    case StmtKind::Function:
+      dead_code(stmt->body);
+      return stmt;
+    case StmtKind::If:
+      if (stmt->a->kind == ExprKind::Bool) {
+        Stmt* taken = stmt->a->boolean ? stmt->body : stmt->orelse;
+        return taken ? simplify(taken) : nullptr;
+      }
+
+      simplify(stmt->body);
+      if (stmt->orelse) stmt->orelse = simplify(stmt->orelse);
+      return stmt;
+    case StmtKind::While:
+      if (is_bool(stmt->a, false)) {
+        return stmt->orelse ? simplify(stmt->orelse) : nullptr;
+      }
+
+      simplify(stmt->body);
+      if (stmt->orelse) simplify(stmt->orelse);
+      return stmt;
+    case StmtKind::For:
+      simplify(stmt->body);
+      return stmt;
+    default:
+      return stmt;
+  }
+}
+
+static void dead_code(Stmt*& list) {
+  Stmt** link = &list;
+
+  while (*link) {
+    Stmt* next = (*link)->next;
+    Stmt* stmt = simplify(*link);
+
+    if (stmt == nullptr) {
+      *link = next;
+      continue;
+    }
+
+    *link = stmt;
+
+    // Nothing after it in the same block runs.
+    stmt->next = terminates(stmt) ? nullptr : next;
+    link = &stmt->next;
+  }
+}
+
+void eliminate_dead_code(Stmt*& program, Arena&) {
+  dead_code(program);
+}
+
+typedef std::unordered_map<Local*, Local*> Copies;
+
+// Reads of a copy become reads of its source, except reads of keep.
+static void rewrite_reads(Expr* expr, const Copies& copies, Local* keep) {
+  if (expr->kind == ExprKind::Local) {
+    auto it = copies.find(expr->local);
+
+    if (it != copies.end() && expr->local != keep) {
+      expr->local = it->second;
+    }
+
+    return;
+  }
+
+  if (expr->a) rewrite_reads(expr->a, copies, keep);
+  if (expr->b) rewrite_reads(expr->b, copies, keep);
+
+  for (Expr* item = expr->list; item; item = item->next) {
+    rewrite_reads(item, copies, keep);
+  }
+}
+
+static void kill(Copies& copies, Local* local) {
+  for (auto it = copies.begin(); it != copies.end(); ) {
+    if (it->first == local || it->second == local) {
+      it = copies.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+static void copies(Stmt*& list) {
+  Copies known;
+
+  for (Stmt* stmt = list; stmt; stmt = stmt->next) {
+    // The target of an assignment stays, 'x = x + 1;' keeps updating x in
+    // place.
+    Local* keep = stmt->kind == StmtKind::Assign ? stmt->local : nullptr;
+
+    // Conditions and ranges are evaluated once, before any branch.
+    switch (stmt->kind) {
+      case StmtKind::While:
+      case StmtKind::Block:
+      case StmtKind::Function:
+        break;
+      default:
+        for (Expr* expr : { stmt->a, stmt->b, stmt->c }) {
+          if (expr) rewrite_reads(expr, known, keep);
+        }
+    }
+
+    switch (stmt->kind) {
+      case StmtKind::Let:
+        if (stmt->a && stmt->a->kind == ExprKind::Local) {
+          known[stmt->local] = stmt->a->local;
+        }
+
+        break;
+      case StmtKind::Assign:
+        if (stmt->local) {
+          kill(known, stmt->local);
+
+          if (!stmt->op && stmt->a->kind == ExprKind::Local && stmt->a->local != stmt->local) {
+            known[stmt->local] = stmt->a->local;
+          }
+        }
+
+        break;
+      case StmtKind::Expression:
+      case StmtKind::Print:
+      case StmtKind::Global:
+      case StmtKind::StoreIndex:
+      case StmtKind::StoreProperty:
+        break;
+      default:
+        // Nested blocks start over, and nothing is known after them.
+        for_each_list(stmt, copies);
+        known.clear();
+        break;
+    }
+  }
+}
+
+void propagate_copies(Stmt*& program, Arena&) {
+  copies(program);
+}
+
+// The value of expr is never an array or an object. Those are mutable, two
+// uses of 'a + b' can't share one when a and b are arrays.
+static bool is_scalar(const Expr* expr) {
+  switch (expr->kind) {
+    case ExprKind::Local:
+      return false;
+    case ExprKind::Unary:
+      return true;
+    case ExprKind::Binary:
+      switch (expr->op) {
+        case VirtualMachine::Add: return is_scalar(expr->a) || is_scalar(expr->b);
+        case VirtualMachine::Multiply: return is_scalar(expr->a) && is_scalar(expr->b);
+        default: return true;
+      }
+    default:
+      return is_literal(expr);
+  }
+}
+
+// Arithmetic over literals and locals, reading at least one local.
+static bool is_pure(const Expr* expr, bool& reads_local) {
+  switch (expr->kind) {
+    case ExprKind::Local:
+      reads_local = true;
+      return true;
+    case ExprKind::Unary:
+      return is_pure(expr->a, reads_local);
+    case ExprKind::Binary:
+      return is_pure(expr->a, reads_local) && is_pure(expr->b, reads_local);
+    default:
+      return is_literal(expr);
+  }
+}
+
+static bool is_candidate(const Expr* expr) {
+  bool reads_local = false;
+
+  return (expr->kind == ExprKind::Unary || expr->kind == ExprKind::Binary) &&
+         is_pure(expr, reads_local) && reads_local && is_scalar(expr);
+}
+
+static bool reads(const Expr* expr, const Local* local) {
+  switch (expr->kind) {
+    case ExprKind::Local: return expr->local == local;
+    case ExprKind::Unary: return reads(expr->a, local);
+    case ExprKind::Binary: return reads(expr->a, local) || reads(expr->b, local);
+    default: return false;
+  }
+}
+
+// Equal expressions hash equally.
+static std::size_t hash(const Expr* expr) {
+  std::size_t h = (std::size_t) expr->kind * 31 + expr->op;
+  std::uint64_t bits = 0;
+
+  switch (expr->kind) {
+    case ExprKind::Integer: bits = expr->integer; break;
+    case ExprKind::Number: std::memcpy(&bits, &expr->number, sizeof(double)); break;
+    case ExprKind::Bool: bits = expr->boolean; break;
+    case ExprKind::String:
+    case ExprKind::Symbol:
+      for (const char* c = expr->name; *c; ++c) bits = bits * 131 + *c;
+      break;
+    case ExprKind::Local: bits = (std::uintptr_t) expr->local; break;
+    default:
+      if (expr->a) bits = hash(expr->a);
+      if (expr->b) bits = bits * 1000003 ^ hash(expr->b);
+  }
+
+  return h * 1000003 ^ bits;
+}
+
+struct Occurrence {
+  // Where the expression hangs in the tree.
+  Expr** slot;
+
+  // Statement of the run and position in evaluation order.
+  std::size_t stmt;
+  std::size_t order;
+
+  // Only evaluated for some values of an 'and' or 'or'.
+  bool conditional;
+};
+
+// Finds candidates in the order they are evaluated.
+class Occurrences {
+public:
+  void collect(Expr** slot, std::size_t stmt) {
+    m_stmt = stmt;
+    visit(slot, false, false);
+  }
+
+  std::vector<Occurrence> list;
+
+private:
+  void visit(Expr** slot, bool conditional, bool kept) {
+    Expr* expr = *slot;
+
+    if (!kept && is_candidate(expr)) {
+      list.push_back((Occurrence) { slot, m_stmt, m_order, conditional });
+    }
+
+    m_order++;
+
+    switch (expr->kind) {
+      case ExprKind::And:
+      case ExprKind::Or:
+        visit(&expr->a, conditional, false);
+        visit(&expr->b, true, false);
+        break;
+      case ExprKind::Tee:
+        // Already in a local.
+        visit(&expr->a, conditional, true);
+        break;
+      default:
+        if (expr->a) visit(&expr->a, conditional, false);
+        if (expr->b) visit(&expr->b, conditional, false);
+
+        for (Expr** item = &expr->list; *item; item = &(*item)->next) {
+          visit(item, conditional, false);
+        }
+    }
+  }
+
+  std::size_t m_stmt { 0 };
+  std::size_t m_order { 0 };
+};
+
+static bool is_straight_line(StmtKind kind) {
+  switch (kind) {
+    case StmtKind::Expression:
+    case StmtKind::Print:
+    case StmtKind::Let:
+    case StmtKind::Global:
+    case StmtKind::Assign:
+    case StmtKind::StoreIndex:
+    case StmtKind::StoreProperty:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Replaces the expression in slot, keeping its place in a list.
+static void replace(Expr** slot, Expr* with) {
+  with->next = (*slot)->next;
+  (*slot)->next = nullptr;
+  *slot = with;
+}
+
+// Eliminates common subexpressions of a run of statements that execute one
+// after the other, run holds the links to them. The first statement in
+// the run an expression is evaluated in gets a hidden local declared in
+// front of it:
+//
+//     let x = (a - b) * 2;     let (cse);
+//     print a - b;         =>  let x = ((cse) = a - b) * 2;
+//                              print (cse);
+//
+// An assignment to one of its locals starts the expression over. Saving
+// the value costs a LoadNull, a StoreLocal and a Pop, the rewrite is only
+// done if more instructions than that are saved. The largest savings go
+// first, the rest is looked at again after each rewrite.
+static void common_subexpressions(std::vector<Stmt**>& run, Arena& arena) {
+  while (true) {
+    Occurrences occurrences;
+
+    for (std::size_t i = 0; i < run.size(); ++i) {
+      Stmt* stmt = *run[i];
+
+      for (Expr** slot : { &stmt->a, &stmt->b, &stmt->c }) {
+        if (*slot) occurrences.collect(slot, i);
+      }
+    }
+
+    const std::vector<Occurrence>& list = occurrences.list;
+
+    std::unordered_map<std::size_t, std::vector<std::size_t>> groups;
+
+    for (std::size_t i = 0; i < list.size(); ++i) {
+      groups[hash(*list[i].slot)].push_back(i);
+    }
+
+    std::size_t best_saving = 3;
+    std::size_t best_first = 0;
+    std::vector<std::size_t> best_uses;
+
+    for (auto& group : groups) {
+      std::vector<std::size_t>& members = group.second;
+
+      while (!members.empty()) {
+        const Expr* expr = *list[members[0]].slot;
+        std::size_t cost = ast::cost(expr);
+
+        std::vector<std::size_t> equal;
+        std::vector<std::size_t> rest;
+
+        for (std::size_t i : members) {
+          (ast::equal(expr, *list[i].slot) ? equal : rest).push_back(i);
+        }
+
+        members.swap(rest);
+
+        // The first unconditional occurrence is saved, the ones up to the
+        // next assignment to one of its locals use it.
+        bool saved = false;
+        std::size_t first = 0;
+        std::vector<std::size_t> uses;
+
+        for (std::size_t k = 0; k <= equal.size(); ++k) {
+          bool killed = k == equal.size();
+
+          if (!killed && saved) {
+            for (std::size_t stmt = list[first].stmt; stmt < list[equal[k]].stmt && !killed; ++stmt) {
+              Stmt* assign = *run[stmt];
+              killed = assign->kind == StmtKind::Assign && assign->local && reads(expr, assign->local);
+            }
+          }
+
+          if (killed && saved) {
+            std::size_t saving = uses.size() * (cost - 1);
+
+            if (saving > best_saving) {
+              best_saving = saving;
+              best_first = first;
+              best_uses = uses;
+            }
+
+            saved = false;
+            uses.clear();
+          }
+
+          if (k == equal.size()) break;
+
+          if (saved) {
+            uses.push_back(equal[k]);
+          } else if (!list[equal[k]].conditional) {
+            saved = true;
+            first = equal[k];
+          }
+        }
+      }
+    }
+
+    if (best_uses.empty()) return;
+
+    const Occurrence& first = list[best_first];
+
+    Local* local = arena.make<Local>();
+    local->name = "(cse)";
+
+    Stmt* let = arena.make<Stmt>();
+    let->kind = StmtKind::Let;
+    let->local = local;
+    let->line = (*run[first.stmt])->line;
+
+    // Later uses first, a use can hang off the next of an earlier one.
+    for (auto use = best_uses.rbegin(); use != best_uses.rend(); ++use) {
+      Expr* load = arena.make<Expr>();
+      load->kind = ExprKind::Local;
+      load->local = local;
+      load->line = (*list[*use].slot)->line;
+
+      replace(list[*use].slot, load);
+    }
+
+    Expr* tee = arena.make<Expr>();
+    tee->kind = ExprKind::Tee;
+    tee->local = local;
+    tee->a = *first.slot;
+    tee->line = tee->a->line;
+
+    replace(first.slot, tee);
+
+    let->next = *run[first.stmt];
+    *run[first.stmt] = let;
+    run[first.stmt] = &let->next;
+  }
+}
+
+static void common_subexpressions(Stmt*& list, Arena& arena) {
+  std::vector<Stmt**> run;
+
+  for (Stmt** link = &list; *link; link = &(*link)->next) {
+    Stmt* stmt = *link;
+
+    if (is_straight_line(stmt->kind)) {
+      run.push_back(link);
+      continue;
+    }
+
+    // The condition of an if, the range of a for and a returned value are
+    // evaluated once, at the end of the run.
+    bool last = stmt->kind == StmtKind::If || stmt->kind == StmtKind::For ||
+                stmt->kind == StmtKind::Return;
+
+    if (last) run.push_back(link);
+
+    common_subexpressions(run, arena);
+
+    if (last) link = run.back();
+    run.clear();
+
+    for_each_list(stmt, [&arena](Stmt*& nested) {
+      common_subexpressions(nested, arena);
+    });
+  }
+
+  common_subexpressions(run, arena);
+}
+
+void eliminate_common_subexpressions(Stmt*& program, Arena& arena) {
+  common_subexpressions(program, arena);
+}
+
+// Types a value may have, as a set.
+enum : std::uint8_t {
+  INTEGER = 1,
+  NUMBER = 2,
+  OTHER = 4,
+  ANY = INTEGER | NUMBER | OTHER,
+};
+
+static bool is_number(std::uint8_t types) {
+  return !(types & OTHER);
+}
+
+// Types of the locals at a point of the program. Locals that aren't in
+// the map may hold anything.
+struct TypeEnv {
+  bool reachable { true };
+  std::unordered_map<const Local*, std::uint8_t> locals;
+
+  bool operator ==(const TypeEnv& other) const {
+    return reachable == other.reachable && locals == other.locals;
+  }
+
+  std::uint8_t of(const Local* local) const {
+    auto found = locals.find(local);
+    return found != locals.end() ? found->second : ANY;
+  }
+
+  // Either this or other got here.
+  void join(const TypeEnv& other) {
+    if (!other.reachable) return;
+
+    if (!reachable) {
+      *this = other;
+      return;
+    }
+
+    for (auto it = locals.begin(); it != locals.end();) {
+      auto found = other.locals.find(it->first);
+
+      if (found == other.locals.end()) {
+        it = locals.erase(it);
+      } else {
+        it->second |= found->second;
+        ++it;
+      }
+    }
+  }
+};
+
+class TypeInference {
+public:
+  void statements(Stmt* list) {
+    for (Stmt* stmt = list; stmt; stmt = stmt->next) {
+      if (!m_env.reachable) return;
+      statement(stmt);
+    }
+  }
+
+private:
+  struct Loop {
+    // States break and continue jump from.
+    TypeEnv breaks;
+    TypeEnv continues;
+  };
+
+  static TypeEnv unreachable() {
+    TypeEnv env;
+    env.reachable = false;
+    return env;
+  }
+
+  static std::uint8_t arithmetic(std::uint8_t op, std::uint8_t a, std::uint8_t b) {
+    if (op == VirtualMachine::Divide) return NUMBER;
+
+    if (is_number(a) && is_number(b)) {
+      // Integers overflow into doubles.
+      return NUMBER | (a & b & INTEGER);
+    }
+
+    // Strings and arrays can be added and repeated, anything else that
+    // isn't a number is an error.
+    return op == VirtualMachine::Add || op == VirtualMachine::Multiply ? ANY : INTEGER | NUMBER;
+  }
+
+  // Math intrinsics return numbers or fail.
+  std::uint8_t math(Expr* expr) {
+    std::uint8_t a = expression(expr->list);
+    std::uint8_t b = expr->list->next ? expression(expr->list->next) : ANY;
+
+    switch (expr->arith) {
+      case DU_MATH_FLOOR:
+      case DU_MATH_CEIL:
+      case DU_MATH_ROUND:
+        // Doubles too large for an integer stay doubles.
+        return INTEGER | NUMBER;
+      case DU_MATH_ABS:
+        return a & (INTEGER | OTHER) ? INTEGER | NUMBER : NUMBER;
+      case DU_MATH_MIN:
+      case DU_MATH_MAX:
+        return NUMBER | (a & b & INTEGER);
+      default:
+        return NUMBER;
+    }
+  }
+
+  std::uint8_t expression(Expr* expr) {
+    switch (expr->kind) {
+      case ExprKind::Integer:
+        return INTEGER;
+      case ExprKind::Number:
+        return NUMBER;
+      case ExprKind::Bool:
+      case ExprKind::String:
+      case ExprKind::Symbol:
+        return OTHER;
+      case ExprKind::Local:
+        return m_env.of(expr->local);
+      case ExprKind::Tee: {
+        std::uint8_t type = expression(expr->a);
+        m_env.locals[expr->local] = type;
+        return type;
+      }
+      case ExprKind::Unary: {
+        std::uint8_t type = expression(expr->a);
+
+        if (expr->op != VirtualMachine::Negate) return OTHER;
+        return type & (INTEGER | OTHER) ? INTEGER | NUMBER : NUMBER;
+      }
+      case ExprKind::Binary: {
+        std::uint8_t a = expression(expr->a);
+        std::uint8_t b = expression(expr->b);
+
+        switch (expr->op) {
+          case VirtualMachine::Add:
+          case VirtualMachine::Subtract:
+          case VirtualMachine::Multiply:
+          case VirtualMachine::Divide:
+            expr->numeric = is_number(a) && is_number(b);
+            return arithmetic(expr->op, a, b);
+          case VirtualMachine::Exp:
+            return is_number(a) && is_number(b) ? NUMBER | (a & b & INTEGER) : INTEGER | NUMBER;
+          case VirtualMachine::Less:
+          case VirtualMachine::Greater:
+            expr->numeric = is_number(a) && is_number(b);
+            return OTHER;
+          default:
+            return OTHER;
+        }
+      }
+      case ExprKind::Intrinsic:
+        if (expr->op == VirtualMachine::Math || expr->op == VirtualMachine::Math2) {
+          return math(expr);
+        }
+
+        for (Expr* item = expr->list; item; item = item->next) {
+          expression(item);
+        }
+
+        return ANY;
+      case ExprKind::And:
+      case ExprKind::Or: {
+        expression(expr->a);
+
+        // The right operand may not run.
+        TypeEnv skipped = m_env;
+        expression(expr->b);
+        m_env.join(skipped);
+
+        return OTHER;
+      }
+      default:
+        if (expr->a) expression(expr->a);
+        if (expr->b) expression(expr->b);
+
+        for (Expr* item = expr->list; item; item = item->next) {
+          expression(item);
+        }
+
+        return expr->kind == ExprKind::Array || expr->kind == ExprKind::Object ? OTHER : ANY;
+    }
+  }
+
+  void statement(Stmt* stmt) {
+    switch (stmt->kind) {
+      case StmtKind::Let:
+        m_env.locals[stmt->local] = stmt->a ? expression(stmt->a) : OTHER;
+        break;
+      case StmtKind::Assign: {
+        std::uint8_t type = expression(stmt->a);
+
+        if (stmt->local) {
+          if (stmt->op) type = arithmetic(stmt->op, m_env.of(stmt->local), type);
+          m_env.locals[stmt->local] = type;
+        }
+
+        break;
+      }
+      case StmtKind::Block:
+        statements(stmt->body);
+        break;
+      case StmtKind::If: {
+        expression(stmt->a);
+
+        TypeEnv orelse = m_env;
+        statement(stmt->body);
+        std::swap(m_env, orelse);
+        if (stmt->orelse) statement(stmt->orelse);
+        m_env.join(orelse);
+        break;
+      }
+      case StmtKind::While: {
+        TypeEnv entry = m_env;
+        TypeEnv head = entry;
+        Loop loop;
+
+        // Types only widen, the head settles after a few rounds.
+        while (true) {
+          m_env = head;
+          expression(stmt->a);
+          TypeEnv exit = m_env;
+
+          loop = Loop { unreachable(), unreachable() };
+          body(stmt->body, loop);
+
+          m_env.join(loop.continues);
+          m_env.join(entry);
+
+          if (m_env == head) {
+            m_env = exit;
+            break;
+          }
+
+          head = m_env;
+        }
+
+        if (stmt->orelse) statement(stmt->orelse);
+        m_env.join(loop.breaks);
+        break;
+      }
+      case StmtKind::For: {
+        std::uint8_t a = expression(stmt->a);
+        std::uint8_t b = expression(stmt->b);
+        std::uint8_t c = stmt->c ? expression(stmt->c) : INTEGER;
+
+        // Integer ranges count with integers, any other range with doubles.
+        std::uint8_t counter = (a & b & c & INTEGER ? INTEGER : 0) |
+                               ((a | b | c) & (NUMBER | OTHER) ? NUMBER : 0);
+
+        TypeEnv entry = m_env;
+        entry.locals[stmt->local] = counter;
+        TypeEnv head = entry;
+        Loop loop;
+
+        while (true) {
+          m_env = head;
+
+          loop = Loop { unreachable(), unreachable() };
+          body(stmt->body, loop);
+
+          m_env.join(loop.continues);
+          m_env.locals[stmt->local] = counter;
+          m_env.join(entry);
+
+          if (m_env == head) break;
+
+          head = m_env;
+        }
+
+        // The variable goes out of scope.
+        m_env.join(loop.breaks);
+        break;
+      }
+      case StmtKind::Break:
+      case StmtKind::Continue:
+        if (!m_loops.empty()) {
+          Loop& loop = *m_loops.back();
+          (stmt->kind == StmtKind::Break ? loop.breaks : loop.continues).join(m_env);
+        }
+
+        m_env = unreachable();
+        break;
+      case StmtKind::Return:
+        if (stmt->a) expression(stmt->a);
+        m_env = unreachable();
+        break;
+      case StmtKind::Function: {
+        // Parameters may be anything and the body runs in its own frame.
+        TypeInference function;
+        function.statements(stmt->body);
+        break;
+      }
+      default:
+        if (stmt->a) expression(stmt->a);
+        if (stmt->b) expression(stmt->b);
+        if (stmt->c) expression(stmt->c);
+        break;
+    }
+  }
+
+  void body(Stmt* block, Loop& loop) {
+    m_loops.push_back(&loop);
+    statement(block);
+    m_loops.pop_back();
+  }
+
+  TypeEnv m_env;
+  std::vector<Loop*> m_loops;
+};
+
+void infer_types(Stmt*& program, Arena&) {
+  TypeInference().statements(program);
+}
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+
+#include "ast.hh"
+
+// Rewrites of the syntax tree between parsing and lowering. A pass may
+// replace, remove or insert statements and expressions, new nodes come
+// from the arena the tree was built in.
+namespace passes {
+
+typedef void (*Pass)(ast::Stmt*& program, Arena& arena);
+
+// Evaluates math intrinsics whose arguments are number literals, and the
+// negation of number literals, at compile time: 'sqrt(2)' becomes a
+// constant and 'abs(-3)' the integer 3.
+void fold_constants(ast::Stmt*& program, Arena& arena);
+
+// Drops statements that can't run or have no effect: the rest of a block
+// after break, continue and return, 'if' and 'while' branches on a false
+// condition and expression statements that only read a literal or a local.
+void eliminate_dead_code(ast::Stmt*& program, Arena& arena);
+
+// 'let b = a;' and 'b = a;' make later reads of b read a, until either is
+// assigned again. Doesn't look past control flow.
+void propagate_copies(ast::Stmt*& program, Arena& arena);
+
+// Arithmetic over locals evaluated more than once in straight-line code is
+// kept in a hidden local the first time and read back afterwards.
+void eliminate_common_subexpressions(ast::Stmt*& program, Arena& arena);
+
+// Tracks which locals can only hold numbers and marks arithmetic and
+// comparisons of two numbers, which are lowered to instructions that
+// don't check their operands. Loops are iterated until the types settle.
+void infer_types(ast::Stmt*& program, Arena& arena);
+
+}
+
+// Runs a sequence of passes over a program.
+class PassManager {
+public:
+  void add(passes::Pass pass);
+  void run(ast::Stmt*& program, Arena& arena) const;
+
+  // -O0 lowers the tree as parsed, -O1 folds constants, removes dead code
+  // and infers types and -O2 also propagates copies and eliminates common
+  // subexpressions.
+  static PassManager for_level(int level);
+
+private:
+  std::vector<passes::Pass> m_passes;
+};
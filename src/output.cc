@@ -0,0 +1,210 @@
+#include "output.hh"
+#include "value.hh"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+
+Output::Output(int fd, Target target) : m_target(target), m_fd(fd), m_stream(this) {
+}
+
+Output::Output(Target target) : m_target(target), m_stream(this) {
+}
+
+Output::~Output() {
+  if (!m_buffer.empty()) flush();
+}
+
+char* Output::reserve(std::size_t size) {
+  if ((std::size_t) (epptr() - pptr()) < size) {
+    flush();
+  }
+
+  return pptr();
+}
+
+// Like std::cout, write errors are ignored.
+static void write_all(int fd, const char* data, std::size_t size) {
+  while (size > 0) {
+    ssize_t written = ::write(fd, data, size);
+
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+
+    data += written;
+    size -= written;
+  }
+}
+
+void Output::drain(const char* data, std::size_t size) {
+  switch (m_target) {
+    case Target::Descriptor:
+      write_all(m_fd, data, size);
+      break;
+    case Target::Framed: {
+      // An empty frame ends the output.
+      if (size == 0) break;
+
+      std::uint32_t header = (std::uint32_t) size;
+
+      write_all(m_fd, reinterpret_cast<const char*>(&header), sizeof(header));
+      write_all(m_fd, data, size);
+      break;
+    }
+    case Target::Memory:
+      m_memory.append(data, size);
+      break;
+    case Target::Null:
+      break;
+  }
+}
+
+void Output::flush() {
+  if (m_buffer.empty()) {
+    m_buffer.resize(BUFFER_SIZE);
+  } else {
+    drain(pbase(), pptr() - pbase());
+  }
+
+  setp(m_buffer.data(), m_buffer.data() + m_buffer.size());
+}
+
+void Output::put(char c) {
+  *reserve(1) = c;
+  pbump(1);
+}
+
+void Output::write(const char* data, std::size_t size) {
+  if (size >= BUFFER_SIZE) {
+    flush();
+    drain(data, size);
+    return;
+  }
+
+  std::memcpy(reserve(size), data, size);
+  pbump((int) size);
+}
+
+void Output::write(const std::string& str) {
+  write(str.data(), str.size());
+}
+
+void Output::write_integer(std::int64_t value) {
+  char digits[20];
+  std::size_t count = 0;
+
+  // The magnitude of INT64_MIN only fits unsigned.
+  std::uint64_t magnitude = value < 0 ? 0 - (std::uint64_t) value : value;
+
+  do {
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude > 0);
+
+  char* out = reserve(count + 1);
+  char* start = out;
+
+  if (value < 0) *out++ = '-';
+
+  while (count > 0) {
+    *out++ = digits[--count];
+  }
+
+  pbump((int) (out - start));
+}
+
+void Output::write_number(double value) {
+  // %g prints whole numbers below a million like integers, -0 aside.
+  if (value > -1e6 && value < 1e6 && value == std::trunc(value) && !(value == 0 && std::signbit(value))) {
+    write_integer((std::int64_t) value);
+    return;
+  }
+
+  // Long enough for "-1.23457e+308".
+  const std::size_t size = 32;
+  int count = std::snprintf(reserve(size), size, "%g", value);
+
+  pbump(count);
+}
+
+void Output::write_value(const Value& value) {
+  switch (value.getType()) {
+    case ValueType::Number: write_number(value.as_number()); break;
+    case ValueType::Integer: write_integer(value.as_integer()); break;
+    case ValueType::Bool: write(value.as_bool() ? "true" : "false", value.as_bool() ? 4 : 5); break;
+    case ValueType::String: write(value.as_string()); break;
+    case ValueType::Null: write("null", 4); break;
+    case ValueType::Function:
+    case ValueType::Native: write("<function>", 10); break;
+    case ValueType::Symbol: write(SymbolTable::name(value.as_symbol())); break;
+    case ValueType::Array: {
+      const ArrayObject& array = value.as_array();
+
+      put('[');
+
+      for (std::size_t i = 0; i < array.size(); ++i) {
+        if (i > 0) write(", ", 2);
+        write_value(array.get(i));
+      }
+
+      put(']');
+      break;
+    }
+    case ValueType::Object: {
+      const ObjectObject& object = value.as_object();
+
+      put('{');
+
+      for (std::size_t i = 0; i < object.slots.size(); ++i) {
+        if (i > 0) write(", ", 2);
+        write(SymbolTable::name(object.shape->name(i)));
+        write(": ", 2);
+        write_value(object.slots[i]);
+      }
+
+      put('}');
+      break;
+    }
+    default: write("<error>", 7); break;
+  }
+}
+
+std::ostream& Output::stream() {
+  return m_stream;
+}
+
+const std::string& Output::str() {
+  flush();
+  return m_memory;
+}
+
+void Output::clear() {
+  flush();
+  m_memory.clear();
+}
+
+int Output::overflow(int c) {
+  flush();
+
+  if (c != traits_type::eof()) {
+    *pptr() = (char) c;
+    pbump(1);
+  }
+
+  return traits_type::not_eof(c);
+}
+
+int Output::sync() {
+  flush();
+  return 0;
+}
+
+std::streamsize Output::xsputn(const char* data, std::streamsize size) {
+  write(data, size);
+  return size;
+}
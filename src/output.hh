@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+class Value;
+
+// Buffered destination of a VM's print statements and runtime errors.
+//
+// Everything written goes into a BUFFER_SIZE buffer that is handed to the
+// target when it fills up, on flush() and when the Output is destroyed.
+// The target is a file descriptor, memory (for embedding and tests) or
+// nothing at all (for benchmarks). Framed descriptors get every chunk
+// preceded by its size as a 32-bit integer, so a reader can tell output
+// apart from what follows it, see daemon.hh. Printed values are formatted straight
+// into the buffer; stream() writes into the same buffer, so messages
+// formatted with iostreams stay in order with them. An Output isn't
+// thread safe, every VM running at the same time needs its own.
+class Output : private std::streambuf {
+public:
+  static const std::size_t BUFFER_SIZE = 64 * 1024;
+
+  enum class Target {
+    Descriptor,
+    Framed,
+    Memory,
+    Null,
+  };
+
+  // Writes to the file descriptor fd, which is left open. target is
+  // Descriptor or Framed.
+  explicit Output(int fd, Target target = Target::Descriptor);
+  // A Memory or Null output.
+  explicit Output(Target target);
+  ~Output();
+
+  Output(const Output&) = delete;
+  Output& operator =(const Output&) = delete;
+
+  void put(char c);
+  void write(const char* data, std::size_t size);
+  void write(const std::string& str);
+  void write_integer(std::int64_t value);
+  // Like operator <<(std::ostream&, double): six significant digits.
+  void write_number(double value);
+  // Like operator <<(std::ostream&, const Value&).
+  void write_value(const Value& value);
+
+  // For messages formatted with iostreams.
+  std::ostream& stream();
+
+  void flush();
+
+  // Everything a Memory output got since the last clear().
+  const std::string& str();
+  void clear();
+
+private:
+  // Room for size more bytes in the buffer.
+  char* reserve(std::size_t size);
+  // Hands data to the target.
+  void drain(const char* data, std::size_t size);
+
+  int overflow(int c) override;
+  int sync() override;
+  std::streamsize xsputn(const char* data, std::streamsize size) override;
+
+  Target m_target;
+  int m_fd { -1 };
+
+  // Allocated on the first write, VMs that never print don't pay for it.
+  std::vector<char> m_buffer;
+  std::string m_memory;
+
+  std::ostream m_stream;
+};
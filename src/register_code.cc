@@ -0,0 +1,112 @@
+#include "register_code.hh"
+
+namespace reg {
+
+std::size_t instruction_size(std::uint8_t op) {
+  switch (op) {
+    case Return:
+    case LoadNull:
+    case AllocGlobal:
+    case Print:
+    case NewObject:
+      return 2;
+    case Move:
+    case LoadConst:
+    case LoadGlobal:
+    case StoreGlobal:
+    case Negate:
+    case Not:
+    case Call:
+    case TailCall:
+    case Length:
+    case Sum:
+    case Min:
+    case Max:
+      return 3;
+    case Map:
+    case Math2:
+      return 5;
+    case GetProperty:
+    case SetProperty:
+    case InitProperty:
+      return 6;
+    case Jump:
+      return 9;
+    case JumpIfFalse:
+    case JumpIfTrue:
+    case JumpIfFalseKeep:
+    case JumpIfTrueKeep:
+    case ForPrep:
+    case ForLoop:
+      return 10;
+    default:
+      // Three operands.
+      return 4;
+  }
+}
+
+const char* name(std::uint8_t op) {
+  switch (op) {
+    case Return: return "ret";
+    case Move: return "mov";
+    case LoadConst: return "ldk";
+    case LoadNull: return "lnull";
+    case AllocGlobal: return "allocg";
+    case LoadGlobal: return "ldg";
+    case StoreGlobal: return "stg";
+    case Negate: return "neg";
+    case Not: return "not";
+    case Add: return "add";
+    case Subtract: return "sub";
+    case Multiply: return "mul";
+    case Divide: return "div";
+    case Exp: return "exp";
+    case And: return "and";
+    case Or: return "or";
+    case Equal: return "eq";
+    case Less: return "lt";
+    case Greater: return "gt";
+    case AddConst: return "addk";
+    case SubtractConst: return "subk";
+    case MultiplyConst: return "mulk";
+    case DivideConst: return "divk";
+    case EqualConst: return "eqk";
+    case LessConst: return "ltk";
+    case GreaterConst: return "gtk";
+    case AddNum: return "addn";
+    case SubNum: return "subn";
+    case MulNum: return "muln";
+    case DivNum: return "divn";
+    case LessNum: return "ltn";
+    case GreaterNum: return "gtn";
+    case Print: return "cout";
+    case Jump: return "jmp";
+    case JumpIfFalse: return "jf";
+    case JumpIfTrue: return "jt";
+    case JumpIfFalseKeep: return "jfk";
+    case JumpIfTrueKeep: return "jtk";
+    case Call: return "call";
+    case TailCall: return "tcall";
+    case ArrayLiteral: return "arr";
+    case LoadIndex: return "loadi";
+    case StoreIndex: return "sti";
+    case Length: return "len";
+    case Sum: return "sum";
+    case Min: return "min";
+    case Max: return "max";
+    case Fill: return "fill";
+    case Append: return "apnd";
+    case Map: return "map";
+    case NewObject: return "newo";
+    case GetProperty: return "getp";
+    case SetProperty: return "setp";
+    case InitProperty: return "initp";
+    case ForPrep: return "forprep";
+    case ForLoop: return "forloop";
+    case Math: return "math";
+    case Math2: return "math2";
+    default: return nullptr;
+  }
+}
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Instruction set of the register VM, selected with --vm=register. A
+// frame's registers are the slots of the stack VM's frame: arguments
+// first, then locals in declaration order, then temporaries. Operands are
+// single bytes, registers (A, B, C), constants (K) and counts, except for
+// 16 bit property sites and 64 bit jump addresses. Instructions are
+// attributed to the same lines as their stack VM counterparts, so both
+// report errors on the same line.
+namespace reg {
+
+enum Instruction : std::uint8_t {
+  Return,         // A          return rA, ends the program at the top level
+  Move,           // A B        rA = rB
+  LoadConst,      // A K        rA = K
+  LoadNull,       // A          rA = null
+
+  AllocGlobal,    // K          declare the global named K
+  LoadGlobal,     // A K        rA = global K
+  StoreGlobal,    // A K        global K = rA
+
+  Negate,         // A B        rA = -rB
+  Not,            // A B        rA = not rB
+
+  Add,            // A B C      rA = rB + rC
+  Subtract,
+  Multiply,
+  Divide,
+  Exp,
+  And,
+  Or,
+  Equal,
+  Less,
+  Greater,
+
+  // A B K, rA = rB op K
+  AddConst,
+  SubtractConst,
+  MultiplyConst,
+  DivideConst,
+  EqualConst,
+  LessConst,
+  GreaterConst,
+
+  // A B C, operands the compiler proved to be numbers
+  AddNum,
+  SubNum,
+  MulNum,
+  DivNum,
+  LessNum,
+  GreaterNum,
+
+  Print,          // A
+
+  Jump,           // addr
+  JumpIfFalse,    // A addr
+  JumpIfTrue,     // A addr
+  // A addr, rA must be a bool: the left operand of and/or
+  JumpIfFalseKeep,
+  JumpIfTrueKeep,
+
+  Call,           // A argc     rA = rA(rA+1, ..., rA+argc)
+  TailCall,       // A argc     return rA(rA+1, ..., rA+argc)
+
+  ArrayLiteral,   // A B count  rA = [rB, ..., rB+count-1]
+  LoadIndex,      // A B C      rA = rB[rC]
+  StoreIndex,     // A B C      rA[rB] = rC
+  Length,         // A B        rA = len(rB)
+  Sum,
+  Min,
+  Max,
+  Fill,           // A B C      rA = fill(rB, rC)
+  Append,         // A B C      rA = push(rB, rC)
+  Map,            // A B C op   rA = map(rB, op, rC)
+
+  NewObject,      // A          rA = {}
+  GetProperty,    // A B K site rA = rB.K
+  SetProperty,    // A K site B rA.K = rB
+  InitProperty,   // A K site B rA.K = rB, in an object literal
+
+  // A addr, rA to rA+3 are the counter, limit, step and variable of a
+  // numeric for loop. ForPrep jumps to addr if the body doesn't run at
+  // all, ForLoop jumps back to addr for the next iteration.
+  ForPrep,
+  ForLoop,
+
+  // Math intrinsics, f is one of the DU_MATH_ constants of runtime.h
+  Math,           // A B f      rA = f(rB)
+  Math2,          // A B C f    rA = f(rB, rC)
+};
+
+// Size of an instruction including its operands.
+std::size_t instruction_size(std::uint8_t op);
+
+const char* name(std::uint8_t op);
+
+}
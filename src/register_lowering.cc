@@ -0,0 +1,651 @@
+#include "register_lowering.hh"
+#include "register_code.hh"
+#include "value.hh"
+#include "virtual_machine.hh"
+
+using namespace ast;
+
+// Register instruction of a stack VM arithmetic or comparison
+// instruction, and of its variant with a constant right operand.
+static std::uint8_t register_op(std::uint8_t op) {
+  switch (op) {
+    case VirtualMachine::Add: return reg::Add;
+    case VirtualMachine::Subtract: return reg::Subtract;
+    case VirtualMachine::Multiply: return reg::Multiply;
+    case VirtualMachine::Divide: return reg::Divide;
+    case VirtualMachine::Exp: return reg::Exp;
+    case VirtualMachine::Equal: return reg::Equal;
+    case VirtualMachine::Less: return reg::Less;
+    case VirtualMachine::Greater: return reg::Greater;
+    case VirtualMachine::Negate: return reg::Negate;
+    case VirtualMachine::Not: return reg::Not;
+    case VirtualMachine::Length: return reg::Length;
+    case VirtualMachine::Sum: return reg::Sum;
+    case VirtualMachine::Min: return reg::Min;
+    case VirtualMachine::Max: return reg::Max;
+    case VirtualMachine::Fill: return reg::Fill;
+    case VirtualMachine::Append: return reg::Append;
+    default: return reg::Map;
+  }
+}
+
+// 0 if there's no such variant.
+static std::uint8_t constant_op(std::uint8_t op) {
+  switch (op) {
+    case VirtualMachine::Add: return reg::AddConst;
+    case VirtualMachine::Subtract: return reg::SubtractConst;
+    case VirtualMachine::Multiply: return reg::MultiplyConst;
+    case VirtualMachine::Divide: return reg::DivideConst;
+    case VirtualMachine::Equal: return reg::EqualConst;
+    case VirtualMachine::Less: return reg::LessConst;
+    case VirtualMachine::Greater: return reg::GreaterConst;
+    default: return 0;
+  }
+}
+
+static std::uint8_t numeric_op(std::uint8_t op) {
+  switch (op) {
+    case VirtualMachine::Add: return reg::AddNum;
+    case VirtualMachine::Subtract: return reg::SubNum;
+    case VirtualMachine::Multiply: return reg::MulNum;
+    case VirtualMachine::Divide: return reg::DivNum;
+    case VirtualMachine::Less: return reg::LessNum;
+    default: return reg::GreaterNum;
+  }
+}
+
+RegisterLowering::RegisterLowering(Bytecode& code, std::ostream& out) : LoweringBase(code, out) {
+}
+
+bool RegisterLowering::lower(Stmt* program) {
+  m_code.set_format(Bytecode::Format::Register);
+
+  statements(program);
+
+  // The top level ignores the register.
+  emit(reg::Return, 0, here() > 0 ? m_code.get_line(here() - 1) : 0);
+
+  return !m_had_error;
+}
+
+void RegisterLowering::statements(Stmt* stmt) {
+  for (; stmt; stmt = stmt->next) {
+    statement(stmt);
+
+    // Temporaries don't outlive a statement.
+    m_top = m_locals;
+  }
+}
+
+void RegisterLowering::statement(Stmt* stmt) {
+  switch (stmt->kind) {
+    case StmtKind::Expression:
+      expression(stmt->a, temporary(stmt->line));
+      break;
+    case StmtKind::Print:
+      emit(reg::Print, operand(stmt->a), stmt->line);
+      break;
+    case StmtKind::Let: {
+      std::size_t slot = temporary(stmt->line);
+
+      if (stmt->a) {
+        expression(stmt->a, slot);
+      } else {
+        emit(reg::LoadNull, slot, stmt->line);
+      }
+
+      declare(stmt->local, stmt->line);
+      break;
+    }
+    case StmtKind::Global: {
+      std::size_t pname = resolve_string(stmt->name);
+      std::size_t value;
+
+      emit_byte(reg::AllocGlobal, stmt->line);
+      emit_const(pname, stmt->line);
+
+      if (stmt->a) {
+        value = operand(stmt->a);
+      } else {
+        value = temporary(stmt->line);
+        emit(reg::LoadNull, value, stmt->line);
+      }
+
+      emit(reg::StoreGlobal, value, pname, stmt->line);
+      break;
+    }
+    case StmtKind::Assign:
+      assignment(stmt);
+      break;
+    case StmtKind::StoreIndex: {
+      std::size_t array = operand(stmt->a);
+      std::size_t index = operand(stmt->b);
+      std::size_t value = operand(stmt->c);
+
+      emit(reg::StoreIndex, array, index, value, stmt->line);
+      break;
+    }
+    case StmtKind::StoreProperty: {
+      std::size_t object = operand(stmt->a);
+      std::size_t value = operand(stmt->c);
+
+      emit_property(reg::SetProperty, object, resolve_symbol(stmt->name),
+          m_code.push_property_site(), value, stmt->line);
+      break;
+    }
+    case StmtKind::Block:
+      block(stmt);
+      break;
+    case StmtKind::If:
+      if_statement(stmt);
+      break;
+    case StmtKind::While:
+      while_statement(stmt);
+      break;
+    case StmtKind::For:
+      for_statement(stmt);
+      break;
+    case StmtKind::Break:
+    case StmtKind::Continue:
+      // The parser doesn't let control statements outside loops through.
+      if (m_loops.empty()) break;
+
+      emit_byte(reg::Jump, stmt->line);
+
+      if (stmt->kind == StmtKind::Break) {
+        m_loops.back().break_jumps.push_back(emit_qword(0, stmt->line));
+      } else {
+        m_loops.back().continue_jumps.push_back(emit_qword(0, stmt->line));
+      }
+
+      break;
+    case StmtKind::Return:
+      if (stmt->a == nullptr) {
+        std::size_t value = temporary(stmt->line);
+
+        emit(reg::LoadNull, value, stmt->line);
+        emit(reg::Return, value, stmt->line);
+      } else if (stmt->a->kind == ExprKind::Call) {
+        call(stmt->a, temporary(stmt->line), true);
+      } else {
+        emit(reg::Return, operand(stmt->a), stmt->line);
+      }
+
+      break;
+    case StmtKind::Function:
+      function(stmt);
+      break;
+  }
+}
+
+// Locals of a block go out of scope at its end, their registers are
+// reused without clearing them.
+void RegisterLowering::block(Stmt* block) {
+  std::size_t locals = m_locals;
+
+  statements(block->body);
+
+  m_locals = m_top = locals;
+}
+
+void RegisterLowering::if_statement(Stmt* stmt) {
+  std::size_t next_block_target = emit_jump(reg::JumpIfFalse, operand(stmt->a), stmt->line);
+  m_top = m_locals;
+
+  block(stmt->body);
+
+  if (stmt->orelse == nullptr) {
+    patch(next_block_target);
+    return;
+  }
+
+  emit_byte(reg::Jump, stmt->line);
+  std::size_t endif_jump = emit_qword(0, stmt->line);
+
+  patch(next_block_target);
+
+  // A Block, or the If of 'else if'.
+  statement(stmt->orelse);
+
+  patch(endif_jump);
+}
+
+// Rotated like the stack backend's loops.
+void RegisterLowering::while_statement(Stmt* stmt) {
+  std::size_t loop_else_target = emit_jump(reg::JumpIfFalse, operand(stmt->a), stmt->line);
+  m_top = m_locals;
+
+  std::size_t loop_body = here();
+
+  m_loops.push_back(Loop());
+  block(stmt->body);
+  Loop loop = m_loops.back();
+  m_loops.pop_back();
+
+  for (auto address : loop.continue_jumps) {
+    patch(address);
+  }
+
+  m_code.set_qword(emit_jump(reg::JumpIfTrue, operand(stmt->a), stmt->line), loop_body);
+  m_top = m_locals;
+
+  patch(loop_else_target);
+
+  if (stmt->orelse) {
+    block(stmt->orelse);
+  }
+
+  for (auto address : loop.break_jumps) {
+    patch(address);
+  }
+}
+
+// The counter, limit and step are kept in hidden locals right below the
+// variable, like on the stack VM.
+void RegisterLowering::for_statement(Stmt* stmt) {
+  std::size_t locals = m_locals;
+
+  std::size_t base = temporary(stmt->line);
+  expression(stmt->a, base);
+  expression(stmt->b, temporary(stmt->line));
+
+  std::size_t step = temporary(stmt->line);
+
+  if (stmt->c) {
+    expression(stmt->c, step);
+  } else {
+    Expr one {};
+    one.kind = ExprKind::Integer;
+    one.integer = 1;
+
+    emit(reg::LoadConst, step, constant(&one), stmt->line);
+  }
+
+  // ForPrep sets the variable before the first iteration.
+  m_locals = m_top;
+  temporary(stmt->line);
+  declare(stmt->local, stmt->line);
+
+  std::size_t exit = emit_jump(reg::ForPrep, base, stmt->line);
+  std::size_t loop_body = here();
+
+  m_loops.push_back(Loop());
+  block(stmt->body);
+  Loop loop = m_loops.back();
+  m_loops.pop_back();
+
+  for (auto address : loop.continue_jumps) {
+    patch(address);
+  }
+
+  m_code.set_qword(emit_jump(reg::ForLoop, base, stmt->body->line), loop_body);
+
+  patch(exit);
+
+  for (auto address : loop.break_jumps) {
+    patch(address);
+  }
+
+  m_locals = m_top = locals;
+}
+
+// Laid out like on the stack VM, arguments are the first registers of the
+// body's frame.
+void RegisterLowering::function(Stmt* stmt) {
+  Function function { stmt->name, (std::uint8_t) stmt->count, 0, 0 };
+  std::size_t pname = resolve_string(function.name);
+
+  emit_byte(reg::AllocGlobal, stmt->line);
+  emit_const(pname, stmt->line);
+
+  emit_byte(reg::Jump, stmt->line);
+  std::size_t end_target = emit_qword(0, stmt->line);
+
+  function.entry = here();
+
+  std::size_t enclosing_locals = m_locals;
+  std::vector<Loop> enclosing_loops;
+
+  std::swap(m_loops, enclosing_loops);
+  m_locals = m_top = 0;
+
+  for (std::size_t i = 0; i < stmt->count; ++i) {
+    temporary(stmt->line);
+    declare(stmt->params[i], stmt->line);
+  }
+
+  statements(stmt->body);
+
+  std::size_t line = here() > function.entry ? m_code.get_line(here() - 1) : stmt->line;
+  std::size_t result = temporary(line);
+
+  emit(reg::LoadNull, result, line);
+  emit(reg::Return, result, line);
+
+  m_locals = m_top = enclosing_locals;
+  std::swap(m_loops, enclosing_loops);
+
+  patch(end_target);
+
+  std::size_t pfunction = m_code.push_const(Value::function(m_code.push_function(function)));
+  std::size_t value = temporary(line);
+
+  if (pfunction > UINT8_MAX) {
+    error(line, "Too many constants");
+  }
+
+  emit(reg::LoadConst, value, pfunction, line);
+  emit(reg::StoreGlobal, value, pname, line);
+}
+
+// Locals are updated in place, 'x += 1;' is a single AddConst.
+void RegisterLowering::assignment(Stmt* stmt) {
+  std::uint8_t op = stmt->op;
+
+  if (stmt->local != nullptr) {
+    std::size_t slot = stmt->local->slot;
+
+    if (op) {
+      binary(op, nullptr, stmt->a, false, slot, stmt->line);
+    } else {
+      expression(stmt->a, slot);
+    }
+
+    return;
+  }
+
+  std::size_t pname = resolve_string(stmt->name);
+
+  if (op) {
+    std::size_t value = temporary(stmt->line);
+
+    emit(reg::LoadGlobal, value, pname, stmt->line);
+    binary(op, nullptr, stmt->a, false, value, stmt->line);
+    emit(reg::StoreGlobal, value, pname, stmt->line);
+  } else {
+    emit(reg::StoreGlobal, operand(stmt->a), pname, stmt->line);
+  }
+}
+
+void RegisterLowering::expression(Expr* expr, std::size_t target) {
+  std::size_t top = m_top;
+
+  switch (expr->kind) {
+    case ExprKind::Integer:
+    case ExprKind::Number:
+    case ExprKind::Bool:
+    case ExprKind::String:
+    case ExprKind::Symbol: {
+      std::size_t address = constant(expr);
+
+      if (address > UINT8_MAX) {
+        error(expr->line, "Too many constants");
+      }
+
+      emit(reg::LoadConst, target, address, expr->line);
+      break;
+    }
+    case ExprKind::Local:
+      if (expr->local->slot != target) {
+        emit(reg::Move, target, expr->local->slot, expr->line);
+      }
+
+      break;
+    case ExprKind::Global:
+      emit(reg::LoadGlobal, target, resolve_string(expr->name), expr->line);
+      break;
+    case ExprKind::Unary:
+      emit(register_op(expr->op), target, operand(expr->a), expr->line);
+      break;
+    case ExprKind::Binary:
+      binary(expr->op, expr->a, expr->b, expr->numeric, target, expr->line);
+      break;
+    case ExprKind::And:
+    case ExprKind::Or:
+      logical(expr, target);
+      break;
+    case ExprKind::Call:
+      call(expr, target, false);
+      break;
+    case ExprKind::Intrinsic: {
+      std::size_t a = operand(expr->list);
+
+      switch (expr->op) {
+        case VirtualMachine::Fill:
+        case VirtualMachine::Append:
+          emit(register_op(expr->op), target, a, operand(expr->list->next), expr->line);
+          break;
+        case VirtualMachine::Map:
+          emit(reg::Map, target, a, operand(expr->list->next), expr->line);
+          emit_byte(expr->arith, expr->line);
+          break;
+        case VirtualMachine::Math:
+          emit(reg::Math, target, a, expr->line);
+          emit_byte(expr->arith, expr->line);
+          break;
+        case VirtualMachine::Math2:
+          emit(reg::Math2, target, a, operand(expr->list->next), expr->line);
+          emit_byte(expr->arith, expr->line);
+          break;
+        default:
+          emit(register_op(expr->op), target, a, expr->line);
+          break;
+      }
+
+      break;
+    }
+    case ExprKind::Index: {
+      std::size_t array = operand(expr->a);
+      emit(reg::LoadIndex, target, array, operand(expr->b), expr->line);
+      break;
+    }
+    case ExprKind::Property:
+      if (!expr->has_site) {
+        expr->site = m_code.push_property_site();
+        expr->has_site = true;
+      }
+
+      emit(reg::GetProperty, target, operand(expr->a), expr->line);
+      emit_const(resolve_symbol(expr->name), expr->line);
+
+      if (expr->site > UINT16_MAX) {
+        error(expr->line, "Too many property accesses");
+      }
+
+      emit_byte(expr->site & 0xFF, expr->line);
+      emit_byte(expr->site >> 8, expr->line);
+      break;
+    case ExprKind::Array: {
+      std::size_t first = m_top;
+
+      for (Expr* element = expr->list; element; element = element->next) {
+        expression(element, temporary(element->line));
+      }
+
+      emit(reg::ArrayLiteral, target, first, expr->count, expr->line);
+      break;
+    }
+    case ExprKind::Object: {
+      // The fields may read the local that is assigned.
+      std::size_t object = target < m_locals ? temporary(expr->line) : target;
+
+      emit(reg::NewObject, object, expr->line);
+
+      for (Expr* field = expr->list; field; field = field->next) {
+        if (!field->has_site) {
+          field->site = m_code.push_property_site();
+          field->has_site = true;
+        }
+
+        emit_property(reg::InitProperty, object, resolve_symbol(field->name), field->site,
+            operand(field->a), field->line);
+      }
+
+      if (object != target) {
+        emit(reg::Move, target, object, expr->line);
+      }
+
+      break;
+    }
+    case ExprKind::Field:
+      // Lowered by its Object.
+      break;
+    case ExprKind::Tee:
+      expression(expr->a, expr->local->slot);
+
+      if (expr->local->slot != target) {
+        emit(reg::Move, target, expr->local->slot, expr->line);
+      }
+
+      break;
+  }
+
+  m_top = top;
+}
+
+std::size_t RegisterLowering::operand(Expr* expr) {
+  if (expr->kind == ExprKind::Local) {
+    return expr->local->slot;
+  }
+
+  std::size_t value = temporary(expr->line);
+  expression(expr, value);
+
+  return value;
+}
+
+// target = a op b. a is target itself for compound assignments, where it
+// is null. Literal right operands are folded into the instruction.
+void RegisterLowering::binary(std::uint8_t op, Expr* a, Expr* b, bool numeric, std::size_t target,
+    std::size_t line) {
+  std::size_t top = m_top;
+  std::size_t left = a ? operand(a) : target;
+
+  if (is_literal(b) && constant_op(op)) {
+    std::size_t address = constant(b);
+
+    if (address > UINT8_MAX) {
+      error(line, "Too many constants");
+    }
+
+    emit(constant_op(op), target, left, address, line);
+  } else {
+    std::size_t right = operand(b);
+    emit(numeric ? numeric_op(op) : register_op(op), target, left, right, line);
+  }
+
+  m_top = top;
+}
+
+// Like on the stack VM, a left operand that decides the result skips the
+// rest of the chain and the others are combined by And/Or, which type
+// checks them.
+void RegisterLowering::logical(Expr* expr, std::size_t target) {
+  std::vector<Expr*> chain;
+
+  for (Expr* link = expr; link->kind == expr->kind; link = link->a) {
+    chain.push_back(link);
+  }
+
+  bool is_and = expr->kind == ExprKind::And;
+  std::vector<std::size_t> end_jumps;
+
+  // The right operands may read the local that is assigned.
+  std::size_t result = target < m_locals ? temporary(expr->line) : target;
+
+  expression(chain.back()->a, result);
+
+  for (auto link = chain.rbegin(); link != chain.rend(); ++link) {
+    std::size_t top = m_top;
+
+    end_jumps.push_back(emit_jump(is_and ? reg::JumpIfFalseKeep : reg::JumpIfTrueKeep, result,
+        (*link)->line));
+    emit(is_and ? reg::And : reg::Or, result, result, operand((*link)->b), (*link)->line);
+
+    m_top = top;
+  }
+
+  for (auto address : end_jumps) {
+    patch(address);
+  }
+
+  if (result != target) {
+    emit(reg::Move, target, result, expr->line);
+  }
+}
+
+// The callee and the arguments go to consecutive registers on top, the
+// callee's is target if target is the last temporary.
+void RegisterLowering::call(Expr* expr, std::size_t target, bool tail) {
+  std::size_t top = m_top;
+  std::size_t callee = target >= m_locals && target + 1 == m_top ? target : temporary(expr->line);
+  std::size_t argc = 0;
+
+  expression(expr->a, callee);
+
+  for (Expr* arg = expr->list; arg; arg = arg->next) {
+    expression(arg, temporary(arg->line));
+    argc++;
+  }
+
+  emit(tail ? reg::TailCall : reg::Call, callee, argc, expr->line);
+
+  if (!tail && callee != target) {
+    emit(reg::Move, target, callee, expr->line);
+  }
+
+  m_top = top;
+}
+
+std::size_t RegisterLowering::temporary(std::size_t line) {
+  if (m_top > UINT8_MAX) {
+    error(line, "Too many registers");
+  }
+
+  return m_top++;
+}
+
+// The local's register is the last one allocated.
+void RegisterLowering::declare(Local* local, std::size_t line) {
+  if (m_top - 1 > UINT8_MAX) {
+    error(line, "Too many locals");
+  }
+
+  local->slot = m_top - 1;
+  m_locals = m_top;
+}
+
+void RegisterLowering::emit(std::uint8_t op, std::size_t a, std::size_t line) {
+  emit_byte(op, line);
+  emit_byte(a, line);
+}
+
+void RegisterLowering::emit(std::uint8_t op, std::size_t a, std::size_t b, std::size_t line) {
+  emit(op, a, line);
+  emit_byte(b, line);
+}
+
+void RegisterLowering::emit(std::uint8_t op, std::size_t a, std::size_t b, std::size_t c,
+    std::size_t line) {
+  emit(op, a, b, line);
+  emit_byte(c, line);
+}
+
+void RegisterLowering::emit_property(std::uint8_t op, std::size_t a, std::size_t name,
+    std::size_t site, std::size_t b, std::size_t line) {
+  if (site > UINT16_MAX) {
+    error(line, "Too many property accesses");
+  }
+
+  emit(op, a, line);
+  emit_const(name, line);
+  emit_byte(site & 0xFF, line);
+  emit_byte(site >> 8, line);
+  emit_byte(b, line);
+}
+
+// Returns the address of the jump's target, to be patched.
+std::size_t RegisterLowering::emit_jump(std::uint8_t op, std::size_t a, std::size_t line) {
+  emit(op, a, line);
+  return emit_qword(0, line);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "ast.hh"
+#include "lowering.hh"
+
+class Bytecode;
+
+// Translates the syntax tree of a program into register code, see
+// register_code.hh. Locals live in the registers the stack backend would
+// give them as slots, temporaries are allocated above the live locals and
+// freed in reverse order, so the arguments of a call can always be put in
+// the registers right above the callee.
+class RegisterLowering : LoweringBase {
+public:
+  RegisterLowering(Bytecode& code, std::ostream& out);
+
+  // False if the program exceeds one of the bytecode's limits, which is
+  // reported to out.
+  bool lower(ast::Stmt* program);
+
+private:
+  struct Loop {
+    std::vector<std::size_t> break_jumps;
+    std::vector<std::size_t> continue_jumps;
+  };
+
+  void statements(ast::Stmt* stmt);
+  void statement(ast::Stmt* stmt);
+  void block(ast::Stmt* block);
+  void if_statement(ast::Stmt* stmt);
+  void while_statement(ast::Stmt* stmt);
+  void for_statement(ast::Stmt* stmt);
+  void function(ast::Stmt* stmt);
+  void assignment(ast::Stmt* stmt);
+
+  // Evaluates expr into register target.
+  void expression(ast::Expr* expr, std::size_t target);
+  // Register holding the value of expr: a local's own register or a new
+  // temporary.
+  std::size_t operand(ast::Expr* expr);
+  void binary(std::uint8_t op, ast::Expr* a, ast::Expr* b, bool numeric, std::size_t target,
+      std::size_t line);
+  void logical(ast::Expr* expr, std::size_t target);
+  void call(ast::Expr* expr, std::size_t target, bool tail);
+
+  std::size_t temporary(std::size_t line);
+  void declare(ast::Local* local, std::size_t line);
+
+  void emit(std::uint8_t op, std::size_t a, std::size_t line);
+  void emit(std::uint8_t op, std::size_t a, std::size_t b, std::size_t line);
+  void emit(std::uint8_t op, std::size_t a, std::size_t b, std::size_t c, std::size_t line);
+  // Property instructions name a constant and a site of their own.
+  void emit_property(std::uint8_t op, std::size_t a, std::size_t name, std::size_t site,
+      std::size_t b, std::size_t line);
+  std::size_t emit_jump(std::uint8_t op, std::size_t a, std::size_t line);
+
+  // Registers holding locals, temporaries are allocated from m_top up.
+  std::size_t m_locals { 0 };
+  std::size_t m_top { 0 };
+  std::vector<Loop> m_loops;
+};
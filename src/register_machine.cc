@@ -0,0 +1,487 @@
+#include "virtual_machine.hh"
+#include "register_code.hh"
+
+#include <algorithm>
+
+// Interpreter of register code, see register_code.hh. It shares globals,
+// call frames, property caches and the value operations with the stack
+// VM. Registers are addressed relative to m_fp and m_sp stays past the
+// current frame's registers, everything above it is null. Operands are
+// read before the instruction runs, so errors point past it like in the
+// stack VM.
+
+static Value (VirtualMachine::*binary(std::uint8_t op))(const Value&, const Value&) {
+  switch (op) {
+    case reg::Add: case reg::AddConst: return &VirtualMachine::add;
+    case reg::Subtract: case reg::SubtractConst: return &VirtualMachine::sub;
+    case reg::Multiply: case reg::MultiplyConst: return &VirtualMachine::mul;
+    case reg::Divide: case reg::DivideConst: return &VirtualMachine::div;
+    case reg::Exp: return &VirtualMachine::exp;
+    case reg::And: return &VirtualMachine::logical_and;
+    case reg::Or: return &VirtualMachine::logical_or;
+    case reg::Equal: case reg::EqualConst: return &VirtualMachine::logical_equals;
+    case reg::Less: case reg::LessConst: return &VirtualMachine::logical_less;
+    default: return &VirtualMachine::logical_greater;
+  }
+}
+
+// Stack VM instruction of the reductions, map() and the Num operations.
+static std::uint8_t stack_op(std::uint8_t op) {
+  switch (op) {
+    case reg::Sum: return VirtualMachine::Sum;
+    case reg::Min: return VirtualMachine::Min;
+    case reg::Max: return VirtualMachine::Max;
+    case reg::AddNum: return VirtualMachine::AddNum;
+    case reg::SubNum: return VirtualMachine::SubNum;
+    case reg::MulNum: return VirtualMachine::MulNum;
+    case reg::DivNum: return VirtualMachine::DivNum;
+    case reg::LessNum: return VirtualMachine::LessNum;
+    default: return VirtualMachine::GreaterNum;
+  }
+}
+
+bool VirtualMachine::dispatch_register(std::uint8_t op) {
+  const std::uint8_t* code = m_code->get_code().data();
+
+  switch (op) {
+    case reg::Return:
+      return ret_register(m_fp[*m_ip++]);
+    case reg::Move: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      m_ip += 2;
+
+      a = b;
+      break;
+    }
+    case reg::LoadConst: {
+      Value& a = m_fp[*m_ip++];
+      a = read_const();
+      break;
+    }
+    case reg::LoadNull:
+      m_fp[*m_ip++] = Value();
+      break;
+    case reg::AllocGlobal:
+      alloc_global(read_const());
+      break;
+    case reg::LoadGlobal: {
+      Value& a = m_fp[*m_ip++];
+      const Value* value = find_global(read_const());
+
+      if (value != nullptr) {
+        a = *value;
+      }
+
+      break;
+    }
+    case reg::StoreGlobal: {
+      const Value& a = m_fp[*m_ip++];
+      store_global(read_const(), a);
+      break;
+    }
+    case reg::Negate:
+    case reg::Not: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      m_ip += 2;
+
+      a = op == reg::Negate ? neg(b) : logical_not(b);
+      break;
+    }
+    case reg::Add:
+    case reg::Subtract:
+    case reg::Multiply:
+    case reg::Divide:
+    case reg::Exp:
+    case reg::And:
+    case reg::Or:
+    case reg::Equal:
+    case reg::Less:
+    case reg::Greater: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      const Value& c = m_fp[m_ip[2]];
+      m_ip += 3;
+
+      a = (this->*binary(op))(b, c);
+      break;
+    }
+    case reg::AddConst:
+    case reg::SubtractConst:
+    case reg::MultiplyConst:
+    case reg::DivideConst:
+    case reg::EqualConst:
+    case reg::LessConst:
+    case reg::GreaterConst: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      const Value& c = m_code->get_const(m_ip[2]);
+      m_ip += 3;
+
+      a = (this->*binary(op))(b, c);
+      break;
+    }
+    case reg::AddNum:
+    case reg::SubNum:
+    case reg::MulNum:
+    case reg::DivNum:
+    case reg::LessNum:
+    case reg::GreaterNum: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      const Value& c = m_fp[m_ip[2]];
+      m_ip += 3;
+
+      a = numeric(stack_op(op), b, c);
+      break;
+    }
+    case reg::Print:
+      print(m_fp[*m_ip++]);
+      break;
+    case reg::Jump:
+      m_ip = code + read_qword();
+      break;
+    case reg::JumpIfFalse:
+    case reg::JumpIfTrue: {
+      bool a = m_fp[*m_ip++].as_bool();
+      std::size_t target = read_qword();
+
+      if (a == (op == reg::JumpIfTrue)) {
+        m_ip = code + target;
+      }
+
+      break;
+    }
+    case reg::JumpIfFalseKeep:
+    case reg::JumpIfTrueKeep: {
+      const Value& a = m_fp[*m_ip++];
+      std::size_t target = read_qword();
+      bool is_and = op == reg::JumpIfFalseKeep;
+
+      if (!a.is(ValueType::Bool)) {
+        error() << "Unexpected operand type: " << a.getType() << (is_and ? " and" : " or") << " ...\n";
+      } else if (a.as_bool() != is_and) {
+        m_ip = code + target;
+      }
+
+      break;
+    }
+    case reg::Call:
+    case reg::TailCall: {
+      Value* callee = &m_fp[m_ip[0]];
+      std::size_t argc = m_ip[1];
+      m_ip += 2;
+
+      if (op == reg::Call) {
+        call_register(callee, argc);
+      } else {
+        tail_call_register(callee, argc);
+      }
+
+      break;
+    }
+    case reg::ArrayLiteral: {
+      Value& a = m_fp[m_ip[0]];
+      const Value* elements = &m_fp[m_ip[1]];
+      std::size_t count = m_ip[2];
+      m_ip += 3;
+
+      ArrayObject* array = new ArrayObject();
+
+      bool packed = std::all_of(elements, elements + count, [](const Value& v) {
+        return v.is(ValueType::Number);
+      });
+
+      if (packed) {
+        array->numbers.reserve(count);
+
+        for (std::size_t i = 0; i < count; ++i) {
+          array->numbers.push_back(elements[i].as_number());
+        }
+      } else {
+        array->unpack();
+        array->values.assign(elements, elements + count);
+      }
+
+      a = Value(array);
+      break;
+    }
+    case reg::LoadIndex: {
+      Value& a = m_fp[m_ip[0]];
+      Value array = m_fp[m_ip[1]];
+      const Value& index = m_fp[m_ip[2]];
+      m_ip += 3;
+
+      // o[@x] is o.x with a computed name.
+      if (array.is(ValueType::Object)) {
+        const Value* value = check_key(index) ? array.as_object().get(index.as_symbol()) : nullptr;
+
+        if (value != nullptr) {
+          a = *value;
+        } else if (!m_halt) {
+          error() << "Object has no property '" << index << "'\n";
+        }
+
+        break;
+      }
+
+      ArrayObject* elements = array_operand(array, "index");
+
+      if (elements != nullptr && check_index(*elements, index)) {
+        a = elements->get(index.as_integer());
+      }
+
+      break;
+    }
+    case reg::StoreIndex: {
+      const Value& array = m_fp[m_ip[0]];
+      const Value& index = m_fp[m_ip[1]];
+      const Value& value = m_fp[m_ip[2]];
+      m_ip += 3;
+
+      if (array.is(ValueType::Object)) {
+        if (check_key(index)) {
+          array.as_object().set(index.as_symbol(), value);
+        }
+
+        break;
+      }
+
+      ArrayObject* elements = array_operand(array, "index");
+
+      if (elements != nullptr && check_index(*elements, index)) {
+        elements->set(index.as_integer(), value);
+      }
+
+      break;
+    }
+    case reg::Length: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      m_ip += 2;
+
+      if (b.is(ValueType::String)) {
+        a = Value((std::int64_t) b.as_string().size());
+      } else if (b.is(ValueType::Array)) {
+        a = Value((std::int64_t) b.as_array().size());
+      } else {
+        error() << "Unexpected operand type: len(" << b.getType() << ")\n";
+      }
+
+      break;
+    }
+    case reg::Sum:
+    case reg::Min:
+    case reg::Max: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      m_ip += 2;
+
+      ArrayObject* array = array_operand(b, op == reg::Sum ? "sum" : op == reg::Min ? "min" : "max");
+
+      if (array != nullptr) {
+        a = reduce(stack_op(op), *array);
+      }
+
+      break;
+    }
+    case reg::Fill:
+    case reg::Append: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      const Value& c = m_fp[m_ip[2]];
+      m_ip += 3;
+
+      ArrayObject* array = array_operand(b, op == reg::Fill ? "fill" : "push");
+
+      if (array != nullptr) {
+        if (op == reg::Fill) {
+          array->fill(c);
+        } else {
+          array->push(c);
+        }
+
+        a = Value();
+      }
+
+      break;
+    }
+    case reg::Map: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      const Value& c = m_fp[m_ip[2]];
+      std::uint8_t arith = m_ip[3];
+      m_ip += 4;
+
+      ArrayObject* array = array_operand(b, "map");
+
+      if (array != nullptr) {
+        a = map(arith, *array, c);
+      }
+
+      break;
+    }
+    case reg::NewObject:
+      m_fp[*m_ip++] = Value(new ObjectObject());
+      break;
+    case reg::Math: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      std::uint8_t function = m_ip[2];
+      m_ip += 3;
+
+      a = math_op(function, b, Value());
+      break;
+    }
+    case reg::Math2: {
+      Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      const Value& c = m_fp[m_ip[2]];
+      std::uint8_t function = m_ip[3];
+      m_ip += 4;
+
+      a = math_op(function, b, c);
+      break;
+    }
+    case reg::GetProperty: {
+      Value& a = m_fp[m_ip[0]];
+      Value object = m_fp[m_ip[1]];
+      m_ip += 2;
+
+      const Value& name = read_const();
+      PropertyCache& cache = read_site();
+
+      if (!object.is(ValueType::Object)) {
+        error() << "Can't read property '" << name << "' of " << object.getType() << "\n";
+        break;
+      }
+
+      ObjectObject& o = object.as_object();
+      PropertyCache::Entry entry = lookup_property(cache, o.shape, name, false);
+
+      if (entry.shape == nullptr) {
+        error() << "Object has no property '" << name << "'\n";
+        break;
+      }
+
+      a = o.slots[entry.slot];
+      break;
+    }
+    case reg::SetProperty:
+    case reg::InitProperty: {
+      const Value& object = m_fp[*m_ip++];
+      const Value& name = read_const();
+      PropertyCache& cache = read_site();
+      const Value& value = m_fp[*m_ip++];
+
+      set_property(cache, object, name, value);
+      break;
+    }
+    case reg::ForPrep:
+    case reg::ForLoop: {
+      Value* loop = &m_fp[*m_ip++];
+      std::size_t target = read_qword();
+
+      // ForPrep leaves the loop if the body doesn't run, ForLoop goes back
+      // for another iteration.
+      if (op == reg::ForPrep ? !for_prep(loop) : for_loop(loop)) {
+        m_ip = code + target;
+      }
+
+      break;
+    }
+    default: error() << "Unexpected op: " << (std::size_t) op << "\n";
+  }
+
+  return true;
+}
+
+void VirtualMachine::call_register(Value* callee, std::size_t argc) {
+  if (callee->is(ValueType::Native)) {
+    call_native(callee, argc);
+    return;
+  }
+
+  Value* top = m_sp;
+
+  // callee() finds the callee below the arguments on top of the stack.
+  m_sp = callee + 1 + argc;
+  const Function* function = this->callee(argc);
+  m_sp = top;
+
+  if (function == nullptr) return;
+
+  Value* base = callee + 1;
+
+  if (m_frame_count == m_frames.size() || !fits(base, *function)) {
+    error() << "Stack overflow\n";
+    return;
+  }
+
+  m_frames[m_frame_count++] = (CallFrame) { .return_ip = m_ip, .base = m_fp, .top = top };
+
+  // Registers above the callee are free in the caller, the callee's frame
+  // covers them so they're cleared when it returns.
+  m_fp = base;
+  m_sp = std::max(base + function->max_stack, top);
+  m_ip = m_code->get_code().data() + function->entry;
+}
+
+// Like tail_call(): callee and arguments are moved down over the frame's
+// callee and the rest of the frame is cleared.
+void VirtualMachine::tail_call_register(Value* callee, std::size_t argc) {
+  if (callee->is(ValueType::Native)) {
+    call_native(callee, argc);
+
+    if (!m_halt) ret_register(std::move(*callee));
+    return;
+  }
+
+  Value* top = m_sp;
+
+  m_sp = callee + 1 + argc;
+  const Function* function = this->callee(argc);
+  m_sp = top;
+
+  if (function == nullptr) return;
+
+  if (!fits(m_fp, *function)) {
+    error() << "Stack overflow\n";
+    return;
+  }
+
+  Value* to = m_fp - 1;
+
+  for (std::size_t i = 0; i <= argc; ++i) {
+    to[i] = std::move(callee[i]);
+  }
+
+  while (m_sp > to + argc + 1) {
+    *--m_sp = Value();
+  }
+
+  m_sp = std::max(m_fp + function->max_stack, top);
+  m_ip = m_code->get_code().data() + function->entry;
+}
+
+// Returns false once the top level returns.
+bool VirtualMachine::ret_register(Value result) {
+  if (m_frame_count == 0) {
+    return false;
+  }
+
+  // Drops the frame, the arguments and the callee.
+  while (m_sp > m_fp - 1) {
+    *--m_sp = Value();
+  }
+
+  const CallFrame& frame = m_frames[--m_frame_count];
+
+  *m_sp = std::move(result);
+
+  m_ip = frame.return_ip;
+  m_fp = frame.base;
+  m_sp = frame.top;
+  return true;
+}
@@ -0,0 +1,669 @@
+/*
+ * Runtime shared by the virtual machine and C programs generated by
+ * `dukkha --emit-c`. This header has to stay valid C99 and C++14.
+ *
+ * The first part holds the numeric kernels used by both, including the SSE2
+ * kernels of the bulk array operations. The second part, enabled with
+ * DUKKHA_C_RUNTIME, is the value runtime of generated programs.
+ */
+#ifndef DUKKHA_RUNTIME_H
+#define DUKKHA_RUNTIME_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Must match the order of ValueType. */
+enum {
+  DU_NUMBER,
+  DU_INTEGER,
+  DU_BOOL,
+  DU_SYMBOL,
+  DU_OBJECT,
+  DU_STRING,
+  DU_NULL,
+  DU_FUNCTION,
+  DU_ARRAY,
+  DU_NATIVE,
+  DU_ERROR
+};
+
+/* Integer kernels return false if the result doesn't fit into 64 bits, in
+ * which case the operation is redone with doubles. */
+static inline bool du_add_int(int64_t a, int64_t b, int64_t* result) {
+  return !__builtin_add_overflow(a, b, result);
+}
+
+static inline bool du_sub_int(int64_t a, int64_t b, int64_t* result) {
+  return !__builtin_sub_overflow(a, b, result);
+}
+
+static inline bool du_mul_int(int64_t a, int64_t b, int64_t* result) {
+  return !__builtin_mul_overflow(a, b, result);
+}
+
+/* Exponentiation by squaring, power must not be negative. */
+static inline bool du_pow_int(int64_t base, int64_t power, int64_t* result) {
+  int64_t acc = 1;
+
+  while (power > 0) {
+    if ((power & 1) && __builtin_mul_overflow(acc, base, &acc)) return false;
+
+    power >>= 1;
+
+    if (power > 0 && __builtin_mul_overflow(base, base, &base)) return false;
+  }
+
+  *result = acc;
+  return true;
+}
+
+/* Kernels over packed doubles. Sums are accumulated in several lanes, so
+ * the result may differ from a left to right sum in the last bits. min and
+ * max ignore NaNs and return +/-INFINITY for arrays of NaNs. */
+static inline double du_sum_doubles(const double* a, size_t n) {
+  size_t i = 0;
+  double sum = 0.0;
+
+#ifdef __SSE2__
+  __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+  double lanes[2];
+
+  for (; i + 4 <= n; i += 4) {
+    acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+    acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+  }
+
+  _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+  sum = lanes[0] + lanes[1];
+#endif
+
+  for (; i < n; ++i) sum += a[i];
+
+  return sum;
+}
+
+static inline double du_min_doubles(const double* a, size_t n) {
+  size_t i = 0;
+  double min = INFINITY;
+
+#ifdef __SSE2__
+  /* minpd returns its second operand if either one is NaN. */
+  __m128d acc = _mm_set1_pd(INFINITY);
+  double lanes[2];
+
+  for (; i + 2 <= n; i += 2) acc = _mm_min_pd(_mm_loadu_pd(a + i), acc);
+
+  _mm_storeu_pd(lanes, acc);
+  min = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+#endif
+
+  for (; i < n; ++i) if (a[i] < min) min = a[i];
+
+  return min;
+}
+
+static inline double du_max_doubles(const double* a, size_t n) {
+  size_t i = 0;
+  double max = -INFINITY;
+
+#ifdef __SSE2__
+  __m128d acc = _mm_set1_pd(-INFINITY);
+  double lanes[2];
+
+  for (; i + 2 <= n; i += 2) acc = _mm_max_pd(_mm_loadu_pd(a + i), acc);
+
+  _mm_storeu_pd(lanes, acc);
+  max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+#endif
+
+  for (; i < n; ++i) if (a[i] > max) max = a[i];
+
+  return max;
+}
+
+/* out[i] = a[i] op b[i * b_step], op is one of '+', '-', '*', '/'. b_step
+ * is 0 to combine every element with b[0], or 1. out may alias a. */
+#ifdef __SSE2__
+#define DU_MAP_LOOP(simd, op) do { \
+    __m128d scalar = _mm_set1_pd(b[0]); \
+    for (; i + 2 <= n; i += 2) { \
+      __m128d y = b_step ? _mm_loadu_pd(b + i) : scalar; \
+      _mm_storeu_pd(out + i, simd(_mm_loadu_pd(a + i), y)); \
+    } \
+    for (; i < n; ++i) out[i] = a[i] op b[i * b_step]; \
+  } while (0)
+#else
+#define DU_MAP_LOOP(simd, op) do { \
+    for (; i < n; ++i) out[i] = a[i] op b[i * b_step]; \
+  } while (0)
+#endif
+
+static inline void du_map_doubles(double* out, const double* a, const double* b,
+    size_t b_step, size_t n, char op) {
+  size_t i = 0;
+
+  if (n == 0) return;
+
+  switch (op) {
+    case '+': DU_MAP_LOOP(_mm_add_pd, +); break;
+    case '-': DU_MAP_LOOP(_mm_sub_pd, -); break;
+    case '*': DU_MAP_LOOP(_mm_mul_pd, *); break;
+    default: DU_MAP_LOOP(_mm_div_pd, /); break;
+  }
+}
+
+#undef DU_MAP_LOOP
+
+/* Functions of the math intrinsics, the operand of the Math (one argument)
+ * and Math2 (two arguments) instructions. */
+enum {
+  DU_MATH_SQRT,
+  DU_MATH_FLOOR,
+  DU_MATH_CEIL,
+  DU_MATH_ROUND,
+  DU_MATH_ABS,
+  DU_MATH_LOG,
+  DU_MATH_EXP,
+  DU_MATH_SIN,
+  DU_MATH_COS,
+  DU_MATH_TAN,
+  DU_MATH_ATAN,
+
+  DU_MATH_MIN,
+  DU_MATH_MAX
+};
+
+static inline const char* du_math_name(int function) {
+  switch (function) {
+    case DU_MATH_SQRT: return "sqrt";
+    case DU_MATH_FLOOR: return "floor";
+    case DU_MATH_CEIL: return "ceil";
+    case DU_MATH_ROUND: return "round";
+    case DU_MATH_ABS: return "abs";
+    case DU_MATH_LOG: return "log";
+    case DU_MATH_EXP: return "exp";
+    case DU_MATH_SIN: return "sin";
+    case DU_MATH_COS: return "cos";
+    case DU_MATH_TAN: return "tan";
+    case DU_MATH_ATAN: return "atan";
+    case DU_MATH_MIN: return "min";
+    default: return "max";
+  }
+}
+
+static inline double du_math_double(int function, double x) {
+  switch (function) {
+    case DU_MATH_SQRT: return sqrt(x);
+    case DU_MATH_FLOOR: return floor(x);
+    case DU_MATH_CEIL: return ceil(x);
+    case DU_MATH_ROUND: return round(x);
+    case DU_MATH_ABS: return fabs(x);
+    case DU_MATH_LOG: return log(x);
+    case DU_MATH_EXP: return exp(x);
+    case DU_MATH_SIN: return sin(x);
+    case DU_MATH_COS: return cos(x);
+    case DU_MATH_TAN: return tan(x);
+    default: return atan(x);
+  }
+}
+
+/* floor, ceil and round of a double are integers, unless the result
+ * doesn't fit into 64 bits (or is NaN) and stays a double. */
+static inline bool du_round_int(int function, double x, int64_t* result) {
+  double r = du_math_double(function, x);
+
+  if (!(r >= -9223372036854775808.0 && r < 9223372036854775808.0)) return false;
+
+  *result = (int64_t) r;
+  return true;
+}
+
+#ifdef DUKKHA_C_RUNTIME
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint8_t type;
+
+  union {
+    double number;
+    int64_t integer;
+    bool boolean;
+    const char* string;
+  } as;
+} du_value;
+
+typedef struct {
+  const char* name;
+  bool defined;
+  du_value value;
+} du_global;
+
+typedef struct {
+  const char* name;
+  int arity;
+} du_function;
+
+typedef struct {
+  size_t ret;
+  du_value* fp;
+} du_frame;
+
+static inline const char* du_type_name(uint8_t type) {
+  switch (type) {
+    case DU_NUMBER: return "number";
+    case DU_INTEGER: return "integer";
+    case DU_BOOL: return "bool";
+    case DU_SYMBOL: return "symbol";
+    case DU_OBJECT: return "object";
+    case DU_STRING: return "string";
+    case DU_NULL: return "null";
+    case DU_FUNCTION: return "function";
+    case DU_ARRAY: return "array";
+    case DU_NATIVE: return "function";
+    default: return "<error>";
+  }
+}
+
+static inline void du_error(int line, int offset, const char* format, ...) {
+  va_list args;
+
+  fflush(stdout);
+  printf("Runtime error on %d:%d: ", line, offset);
+
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+
+  exit(70);
+}
+
+static inline du_value du_null(void) {
+  du_value v;
+  v.type = DU_NULL;
+  return v;
+}
+
+static inline du_value du_integer(int64_t i) {
+  du_value v;
+  v.type = DU_INTEGER;
+  v.as.integer = i;
+  return v;
+}
+
+static inline du_value du_number(double d) {
+  du_value v;
+  v.type = DU_NUMBER;
+  v.as.number = d;
+  return v;
+}
+
+static inline du_value du_bool(bool b) {
+  du_value v;
+  v.type = DU_BOOL;
+  v.as.boolean = b;
+  return v;
+}
+
+static inline du_value du_string(const char* s) {
+  du_value v;
+  v.type = DU_STRING;
+  v.as.string = s;
+  return v;
+}
+
+static inline bool du_is_numeric(du_value v) {
+  return v.type == DU_INTEGER || v.type == DU_NUMBER;
+}
+
+static inline double du_to_double(du_value v) {
+  return v.type == DU_INTEGER ? (double) v.as.integer : v.as.number;
+}
+
+static inline bool du_both_int(du_value a, du_value b) {
+  return a.type == DU_INTEGER && b.type == DU_INTEGER;
+}
+
+static inline void du_binary_error(du_value a, du_value b, const char* op, int line, int offset) {
+  du_error(line, offset, "Unexpected operand types: %s%s%s\n",
+      du_type_name(a.type), op, du_type_name(b.type));
+}
+
+static inline void du_logical_error(du_value a, du_value b, const char* op, int line, int offset) {
+  du_error(line, offset, "Unexpected operand type: %s %s %s\n",
+      du_type_name(a.type), op, du_type_name(b.type));
+}
+
+static inline du_value du_neg(du_value a, int line, int offset) {
+  int64_t r;
+
+  if (a.type == DU_INTEGER && du_sub_int(0, a.as.integer, &r)) return du_integer(r);
+  if (du_is_numeric(a)) return du_number(-du_to_double(a));
+
+  du_error(line, offset, "Unexpected operand type: -%s\n", du_type_name(a.type));
+  return a;
+}
+
+static inline du_value du_add(du_value a, du_value b, int line, int offset) {
+  int64_t r;
+
+  if (du_both_int(a, b) && du_add_int(a.as.integer, b.as.integer, &r)) return du_integer(r);
+  if (du_is_numeric(a) && du_is_numeric(b)) return du_number(du_to_double(a) + du_to_double(b));
+
+  if (a.type == DU_STRING && b.type == DU_STRING) {
+    size_t la = strlen(a.as.string), lb = strlen(b.as.string);
+    char* s = (char*) malloc(la + lb + 1);
+
+    memcpy(s, a.as.string, la);
+    memcpy(s + la, b.as.string, lb + 1);
+    return du_string(s);
+  }
+
+  du_binary_error(a, b, "+", line, offset);
+  return a;
+}
+
+static inline du_value du_sub(du_value a, du_value b, int line, int offset) {
+  int64_t r;
+
+  if (du_both_int(a, b) && du_sub_int(a.as.integer, b.as.integer, &r)) return du_integer(r);
+  if (du_is_numeric(a) && du_is_numeric(b)) return du_number(du_to_double(a) - du_to_double(b));
+
+  du_binary_error(a, b, "-", line, offset);
+  return a;
+}
+
+static inline du_value du_mul(du_value a, du_value b, int line, int offset) {
+  int64_t r;
+
+  if (du_both_int(a, b) && du_mul_int(a.as.integer, b.as.integer, &r)) return du_integer(r);
+  if (du_is_numeric(a) && du_is_numeric(b)) return du_number(du_to_double(a) * du_to_double(b));
+
+  if (a.type == DU_STRING && du_is_numeric(b)) {
+    int64_t count = b.type == DU_INTEGER ? b.as.integer : (int64_t) b.as.number;
+    size_t len = strlen(a.as.string);
+    char* s = (char*) malloc(len * (count > 0 ? count : 0) + 1);
+    int64_t i;
+
+    for (i = 0; i < count; ++i) memcpy(s + i * len, a.as.string, len);
+
+    s[len * (count > 0 ? count : 0)] = '\0';
+    return du_string(s);
+  }
+
+  if (du_is_numeric(a) && b.type == DU_STRING) return du_mul(b, a, line, offset);
+
+  du_binary_error(a, b, "*", line, offset);
+  return a;
+}
+
+static inline du_value du_div(du_value a, du_value b, int line, int offset) {
+  if (du_is_numeric(a) && du_is_numeric(b)) return du_number(du_to_double(a) / du_to_double(b));
+
+  du_binary_error(a, b, "/", line, offset);
+  return a;
+}
+
+static inline du_value du_exp(du_value a, du_value b, int line, int offset) {
+  int64_t r;
+
+  if (du_both_int(a, b) && b.as.integer >= 0 && du_pow_int(a.as.integer, b.as.integer, &r)) {
+    return du_integer(r);
+  }
+
+  if (du_is_numeric(a) && du_is_numeric(b)) return du_number(pow(du_to_double(a), du_to_double(b)));
+
+  du_binary_error(a, b, "**", line, offset);
+  return a;
+}
+
+static inline du_value du_not(du_value a, int line, int offset) {
+  if (a.type == DU_BOOL) return du_bool(!a.as.boolean);
+
+  du_error(line, offset, "Unexpected operand type: not %s\n", du_type_name(a.type));
+  return a;
+}
+
+static inline du_value du_and(du_value a, du_value b, int line, int offset) {
+  if (a.type == DU_BOOL && b.type == DU_BOOL) return du_bool(a.as.boolean && b.as.boolean);
+
+  du_logical_error(a, b, "and", line, offset);
+  return a;
+}
+
+static inline du_value du_or(du_value a, du_value b, int line, int offset) {
+  if (a.type == DU_BOOL && b.type == DU_BOOL) return du_bool(a.as.boolean || b.as.boolean);
+
+  du_logical_error(a, b, "or", line, offset);
+  return a;
+}
+
+static inline du_value du_equal(du_value a, du_value b, int line, int offset) {
+  if (a.type == DU_BOOL && b.type == DU_BOOL) return du_bool(a.as.boolean == b.as.boolean);
+  if (a.type == DU_SYMBOL && b.type == DU_SYMBOL) return du_bool(a.as.string == b.as.string);
+  if (du_both_int(a, b)) return du_bool(a.as.integer == b.as.integer);
+  if (du_is_numeric(a) && du_is_numeric(b)) return du_bool(du_to_double(a) == du_to_double(b));
+
+  du_logical_error(a, b, "==", line, offset);
+  return a;
+}
+
+static inline du_value du_greater(du_value a, du_value b, int line, int offset) {
+  if (du_both_int(a, b)) return du_bool(a.as.integer > b.as.integer);
+  if (du_is_numeric(a) && du_is_numeric(b)) return du_bool(du_to_double(a) > du_to_double(b));
+
+  du_logical_error(a, b, ">", line, offset);
+  return a;
+}
+
+static inline du_value du_less(du_value a, du_value b, int line, int offset) {
+  if (du_both_int(a, b)) return du_bool(a.as.integer < b.as.integer);
+  if (du_is_numeric(a) && du_is_numeric(b)) return du_bool(du_to_double(a) < du_to_double(b));
+
+  du_logical_error(a, b, "<", line, offset);
+  return a;
+}
+
+/* AddNum..GreaterNum: the compiler proved both operands are numbers. */
+static inline du_value du_add_num(du_value a, du_value b) {
+  int64_t r;
+
+  if (du_both_int(a, b) && du_add_int(a.as.integer, b.as.integer, &r)) return du_integer(r);
+  return du_number(du_to_double(a) + du_to_double(b));
+}
+
+static inline du_value du_sub_num(du_value a, du_value b) {
+  int64_t r;
+
+  if (du_both_int(a, b) && du_sub_int(a.as.integer, b.as.integer, &r)) return du_integer(r);
+  return du_number(du_to_double(a) - du_to_double(b));
+}
+
+static inline du_value du_mul_num(du_value a, du_value b) {
+  int64_t r;
+
+  if (du_both_int(a, b) && du_mul_int(a.as.integer, b.as.integer, &r)) return du_integer(r);
+  return du_number(du_to_double(a) * du_to_double(b));
+}
+
+static inline du_value du_div_num(du_value a, du_value b) {
+  return du_number(du_to_double(a) / du_to_double(b));
+}
+
+static inline du_value du_less_num(du_value a, du_value b) {
+  if (du_both_int(a, b)) return du_bool(a.as.integer < b.as.integer);
+  return du_bool(du_to_double(a) < du_to_double(b));
+}
+
+static inline du_value du_greater_num(du_value a, du_value b) {
+  if (du_both_int(a, b)) return du_bool(a.as.integer > b.as.integer);
+  return du_bool(du_to_double(a) > du_to_double(b));
+}
+
+/* Math and Math2, see VirtualMachine::math(). */
+static inline du_value du_math(du_value a, int function, int line, int offset) {
+  int64_t r;
+
+  if (!du_is_numeric(a)) {
+    du_error(line, offset, "Unexpected operand type: %s(%s)\n", du_math_name(function),
+        du_type_name(a.type));
+  }
+
+  switch (function) {
+    case DU_MATH_FLOOR:
+    case DU_MATH_CEIL:
+    case DU_MATH_ROUND:
+      if (a.type == DU_INTEGER) return a;
+      if (du_round_int(function, a.as.number, &r)) return du_integer(r);
+      break;
+    case DU_MATH_ABS:
+      if (a.type == DU_INTEGER && a.as.integer != INT64_MIN) {
+        return du_integer(a.as.integer < 0 ? -a.as.integer : a.as.integer);
+      }
+      break;
+  }
+
+  return du_number(du_math_double(function, du_to_double(a)));
+}
+
+static inline du_value du_math2(du_value a, du_value b, int function, int line, int offset) {
+  bool min = function == DU_MATH_MIN;
+
+  if (!du_is_numeric(a) || !du_is_numeric(b)) {
+    du_error(line, offset, "Unexpected operand types: %s(%s, %s)\n", du_math_name(function),
+        du_type_name(a.type), du_type_name(b.type));
+  }
+
+  if (du_both_int(a, b)) {
+    return (a.as.integer < b.as.integer) == min ? a : b;
+  }
+
+  return du_number(min ? fmin(du_to_double(a), du_to_double(b)) : fmax(du_to_double(a), du_to_double(b)));
+}
+
+/* Condition of JumpIfFalseKeep/JumpIfTrueKeep. */
+static inline bool du_keep_bool(du_value a, const char* op, int line, int offset) {
+  if (a.type != DU_BOOL) {
+    du_error(line, offset, "Unexpected operand type: %s %s ...\n", du_type_name(a.type), op);
+  }
+
+  return a.as.boolean;
+}
+
+/* ForPrep: checks the range of the loop at base (counter, limit, step and
+   variable) and reports whether the first iteration runs. */
+static inline bool du_for_prep(du_value* base, int line, int offset) {
+  du_value* counter = &base[0];
+  du_value* limit = &base[1];
+  du_value* step = &base[2];
+
+  if (!du_is_numeric(*counter) || !du_is_numeric(*limit) || !du_is_numeric(*step)) {
+    du_error(line, offset, "Unexpected range types: %s..%s step %s\n", du_type_name(counter->type),
+        du_type_name(limit->type), du_type_name(step->type));
+  }
+
+  if (counter->type != DU_INTEGER || limit->type != DU_INTEGER || step->type != DU_INTEGER) {
+    *counter = du_number(du_to_double(*counter));
+    *limit = du_number(du_to_double(*limit));
+    *step = du_number(du_to_double(*step));
+  }
+
+  if (du_to_double(*step) == 0) {
+    du_error(line, offset, "Range step must not be zero\n");
+  }
+
+  bool enter = du_to_double(*step) > 0 ? du_less(*counter, *limit, line, offset).as.boolean
+                                       : du_greater(*counter, *limit, line, offset).as.boolean;
+
+  if (enter) base[3] = *counter;
+  return enter;
+}
+
+/* ForLoop: advances the counter, an integer counter that overflows is past
+   any limit. */
+static inline bool du_for_loop(du_value* base) {
+  bool more;
+
+  if (base[0].type == DU_INTEGER) {
+    int64_t next;
+
+    if (!du_add_int(base[0].as.integer, base[2].as.integer, &next)) return false;
+
+    base[0].as.integer = next;
+    more = base[2].as.integer > 0 ? next < base[1].as.integer : next > base[1].as.integer;
+  } else {
+    base[0].as.number += base[2].as.number;
+    more = base[2].as.number > 0 ? base[0].as.number < base[1].as.number
+                                 : base[0].as.number > base[1].as.number;
+  }
+
+  if (more) base[3] = base[0];
+  return more;
+}
+
+static inline void du_print(du_value a, const du_function* functions) {
+  switch (a.type) {
+    case DU_NUMBER: printf("%g\n", a.as.number); break;
+    case DU_INTEGER: printf("%" PRId64 "\n", a.as.integer); break;
+    case DU_BOOL: printf("%s\n", a.as.boolean ? "true" : "false"); break;
+    case DU_STRING: printf("%s\n", a.as.string); break;
+    case DU_SYMBOL: printf("%s\n", a.as.string); break;
+    case DU_NULL: printf("null\n"); break;
+    case DU_FUNCTION: printf("<function %s>\n", functions[a.as.integer].name); break;
+    default: printf("<error>\n"); break;
+  }
+}
+
+static inline void du_alloc_global(du_global* g, int line, int offset) {
+  if (g->defined) {
+    du_error(line, offset, "Name '%s' has already been defined.\n", g->name);
+  }
+
+  g->defined = true;
+  g->value = du_null();
+}
+
+static inline void du_store_global(du_global* g, du_value value, int line, int offset) {
+  if (!g->defined) {
+    du_error(line, offset, "Name '%s' is not known.\n", g->name);
+  }
+
+  g->value = value;
+}
+
+static inline du_value du_load_global(du_global* g, int line, int offset) {
+  if (!g->defined) {
+    du_error(line, offset, "Name '%s' is not known.\n", g->name);
+  }
+
+  return g->value;
+}
+
+/* Checks the callee of Call/TailCall, returns its index in functions. */
+static inline int64_t du_callee(du_value callee, int argc, const du_function* functions,
+    int line, int offset) {
+  if (callee.type != DU_FUNCTION) {
+    du_error(line, offset, "Can't call a value of type %s.\n", du_type_name(callee.type));
+  }
+
+  if (functions[callee.as.integer].arity != argc) {
+    du_error(line, offset, "Function '%s' expects %d arguments, got %d.\n",
+        functions[callee.as.integer].name, functions[callee.as.integer].arity, argc);
+  }
+
+  return callee.as.integer;
+}
+
+#endif /* DUKKHA_C_RUNTIME */
+
+#endif /* DUKKHA_RUNTIME_H */
@@ -0,0 +1,108 @@
+#include "scheduler.hh"
+
+#include <algorithm>
+
+Scheduler::Scheduler(std::size_t threads, std::int64_t quantum) : m_quantum(quantum) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (std::size_t i = 0; i < threads; ++i) {
+    m_threads.emplace_back(&Scheduler::work, this);
+  }
+}
+
+Scheduler::~Scheduler() {
+  wait();
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+
+  m_wake.notify_all();
+
+  for (auto& thread : m_threads) {
+    thread.join();
+  }
+}
+
+std::size_t Scheduler::size() const {
+  return m_threads.size();
+}
+
+void Scheduler::spawn(Program program, Output& out, bool jit, Done done) {
+  std::unique_ptr<Task> task(new Task());
+  task->done = std::move(done);
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_idle_vms.empty()) {
+      task->vm = std::move(m_idle_vms.back());
+      m_idle_vms.pop_back();
+    }
+  }
+
+  if (!task->vm) {
+    task->vm.reset(new VirtualMachine());
+  }
+
+  task->vm->set_jit(jit);
+  task->vm->set_output(out);
+  task->vm->load(program);
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_ready.push_back(std::move(task));
+    m_pending++;
+  }
+
+  m_wake.notify_one();
+}
+
+void Scheduler::wait() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_idle.wait(lock, [this]() { return m_pending == 0; });
+}
+
+void Scheduler::work() {
+  while (true) {
+    std::unique_ptr<Task> task;
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [this]() { return m_stop || !m_ready.empty(); });
+
+      if (m_ready.empty()) {
+        return;
+      }
+
+      task = std::move(m_ready.front());
+      m_ready.pop_front();
+    }
+
+    VirtualMachine::Status status = task->vm->run(m_quantum);
+
+    if (status == VirtualMachine::Status::Yielded) {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_ready.push_back(std::move(task));
+      }
+
+      m_wake.notify_one();
+      continue;
+    }
+
+    task->done(status);
+    task->vm->reset();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_idle_vms.push_back(std::move(task->vm));
+
+    if (--m_pending == 0) {
+      m_idle.notify_all();
+    }
+  }
+}
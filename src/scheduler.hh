@@ -0,0 +1,62 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "output.hh"
+#include "virtual_machine.hh"
+
+// M:N scheduler multiplexing many VM instances over a few OS threads.
+//
+// Every spawned program gets its own VM. Workers take the task at the front
+// of a single run queue, run it for one quantum of instructions and put it
+// back at the end if it yielded, so a long running loop only delays other
+// tasks by one quantum per round. VMs of finished tasks are kept and
+// reused for new ones.
+class Scheduler {
+public:
+  static const std::int64_t DEFAULT_QUANTUM = 10000;
+
+  // Called on a worker thread once the task finished or failed.
+  typedef std::function<void(VirtualMachine::Status status)> Done;
+
+  // Starts one worker per hardware thread if threads is 0.
+  explicit Scheduler(std::size_t threads = 0, std::int64_t quantum = DEFAULT_QUANTUM);
+  ~Scheduler();
+
+  std::size_t size() const;
+
+  // The task's prints and errors go to out, which has to outlive it.
+  void spawn(Program program, Output& out, bool jit, Done done);
+
+  // Blocks until every spawned task is done.
+  void wait();
+
+private:
+  struct Task {
+    std::unique_ptr<VirtualMachine> vm;
+    Done done;
+  };
+
+  void work();
+
+  std::int64_t m_quantum;
+
+  std::deque<std::unique_ptr<Task>> m_ready;
+  std::vector<std::unique_ptr<VirtualMachine>> m_idle_vms;
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_idle;
+
+  // Tasks spawned but not done.
+  std::size_t m_pending { 0 };
+  bool m_stop { false };
+};
@@ -0,0 +1,380 @@
+// VirtualMachine::snapshot() and restore(), see virtual_machine.hh.
+//
+// An image is the program's bytecode image followed by the address to
+// resume at, the top level's stack and the globals. Values are written as
+// their type and payload. Strings and symbols are written by value and
+// natives by name. Arrays and objects are numbered in the order they are
+// first written; later references only write the number, so shared and
+// cyclic structures come back as they were.
+#include "compiler.hh"
+#include "register_code.hh"
+#include "verifier.hh"
+#include "virtual_machine.hh"
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+static const char SNAPSHOT_MAGIC[4] = { 'D', 'U', 'K', 'S' };
+
+namespace {
+
+class ImageWriter {
+public:
+  explicit ImageWriter(std::ostream& out) : m_out(out) {}
+
+  template<typename T>
+  void raw(T value) {
+    m_out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void string(const std::string& str) {
+    raw<std::uint64_t>(str.size());
+    m_out.write(str.data(), str.size());
+  }
+
+  void value(const Value& value) {
+    raw<std::uint8_t>((std::uint8_t) value.getType());
+
+    switch (value.getType()) {
+      case ValueType::Number: raw<double>(value.as_number()); break;
+      case ValueType::Integer: raw<std::int64_t>(value.as_integer()); break;
+      case ValueType::Bool: raw<std::uint8_t>(value.as_bool()); break;
+      case ValueType::String: string(value.as_string()); break;
+      case ValueType::Symbol: string(SymbolTable::name(value.as_symbol())); break;
+      case ValueType::Function: raw<std::uint64_t>(value.as_function()); break;
+      case ValueType::Native: string(value.as_native().name); break;
+      case ValueType::Array: {
+        const ArrayObject& array = value.as_array();
+        if (!reference(&array)) break;
+
+        raw<std::uint8_t>(array.packed);
+        raw<std::uint64_t>(array.size());
+
+        if (array.packed) {
+          m_out.write(reinterpret_cast<const char*>(array.numbers.data()),
+              array.numbers.size() * sizeof(double));
+        } else {
+          for (const Value& element : array.values) this->value(element);
+        }
+
+        break;
+      }
+      case ValueType::Object: {
+        const ObjectObject& object = value.as_object();
+        if (!reference(&object)) break;
+
+        raw<std::uint64_t>(object.slots.size());
+
+        for (std::size_t i = 0; i < object.slots.size(); ++i) {
+          string(SymbolTable::name(object.shape->name(i)));
+          this->value(object.slots[i]);
+        }
+
+        break;
+      }
+      default: break;
+    }
+  }
+
+private:
+  // Writes the number of object, true if this is its first reference and
+  // its contents have to follow.
+  bool reference(const void* object) {
+    auto found = m_ids.find(object);
+
+    if (found != m_ids.end()) {
+      raw<std::uint64_t>(found->second);
+      return false;
+    }
+
+    std::uint64_t id = m_ids.size();
+    m_ids[object] = id;
+
+    raw<std::uint64_t>(id);
+    return true;
+  }
+
+  std::ostream& m_out;
+  std::unordered_map<const void*, std::uint64_t> m_ids;
+};
+
+class ImageReader {
+public:
+  ImageReader(std::istream& in, const std::deque<Native>& natives, std::size_t functions)
+    : m_in(in), m_natives(natives), m_functions(functions) {}
+
+  template<typename T>
+  bool raw(T& value) {
+    return (bool) m_in.read(reinterpret_cast<char*>(&value), sizeof(value));
+  }
+
+  bool string(std::string& str) {
+    std::uint64_t size;
+    if (!raw(size)) return false;
+
+    str.resize(size);
+    return size == 0 || (bool) m_in.read(&str[0], size);
+  }
+
+  bool value(Value& value) {
+    std::uint8_t type;
+    if (!raw(type)) return false;
+
+    switch ((ValueType) type) {
+      case ValueType::Number: {
+        double number;
+        if (!raw(number)) return false;
+        value = number;
+        return true;
+      }
+      case ValueType::Integer: {
+        std::int64_t integer;
+        if (!raw(integer)) return false;
+        value = integer;
+        return true;
+      }
+      case ValueType::Bool: {
+        std::uint8_t boolean;
+        if (!raw(boolean)) return false;
+        value = (bool) boolean;
+        return true;
+      }
+      case ValueType::String: {
+        std::string str;
+        if (!string(str)) return false;
+        value = str;
+        return true;
+      }
+      case ValueType::Symbol: {
+        std::string name;
+        if (!string(name)) return false;
+        value = Value::symbol(SymbolTable::intern(name));
+        return true;
+      }
+      case ValueType::Function: {
+        std::uint64_t index;
+        if (!raw(index) || index >= m_functions) return false;
+        value = Value::function(index);
+        return true;
+      }
+      case ValueType::Native: {
+        std::string name;
+        if (!string(name)) return false;
+
+        // The last definition of a name wins, like in define().
+        for (auto native = m_natives.rbegin(); native != m_natives.rend(); ++native) {
+          if (native->name == name) {
+            value = Value(&*native);
+            return true;
+          }
+        }
+
+        return false;
+      }
+      case ValueType::Array: return array(value);
+      case ValueType::Object: return object(value);
+      case ValueType::Null:
+      case ValueType::Error:
+        value = Value((ValueType) type);
+        return true;
+      default:
+        return false;
+    }
+  }
+
+private:
+  // Reads the number of an array or object. New ones are registered before
+  // their contents are read, so references to them from inside resolve.
+  bool reference(std::uint64_t& id, Value& value, ValueType type) {
+    if (!raw(id) || id > m_objects.size()) return false;
+
+    if (id < m_objects.size()) {
+      if (!m_objects[id].is(type)) return false;
+      value = m_objects[id];
+    }
+
+    return true;
+  }
+
+  bool array(Value& value) {
+    std::uint64_t id;
+    if (!reference(id, value, ValueType::Array)) return false;
+    if (id < m_objects.size()) return true;
+
+    ArrayObject* array = new ArrayObject();
+    m_objects.emplace_back(array);
+    value = m_objects.back();
+
+    std::uint8_t packed;
+    std::uint64_t size;
+
+    if (!raw(packed) || !raw(size)) return false;
+
+    array->packed = packed;
+
+    if (packed) {
+      array->numbers.resize(size);
+      return (bool) m_in.read(reinterpret_cast<char*>(array->numbers.data()), size * sizeof(double));
+    }
+
+    array->values.resize(size);
+
+    for (Value& element : array->values) {
+      if (!this->value(element)) return false;
+    }
+
+    return true;
+  }
+
+  bool object(Value& value) {
+    std::uint64_t id;
+    if (!reference(id, value, ValueType::Object)) return false;
+    if (id < m_objects.size()) return true;
+
+    ObjectObject* object = new ObjectObject();
+    m_objects.emplace_back(object);
+    value = m_objects.back();
+
+    std::uint64_t size;
+    if (!raw(size)) return false;
+
+    for (std::uint64_t i = 0; i < size; ++i) {
+      std::string name;
+      Value slot;
+
+      if (!string(name) || !this->value(slot)) return false;
+
+      std::uint32_t symbol = SymbolTable::intern(name);
+      if (object->shape->find(symbol) >= 0) return false;
+
+      object->shape = object->shape->with(symbol);
+      object->slots.push_back(slot);
+    }
+
+    return true;
+  }
+
+  std::istream& m_in;
+  const std::deque<Native>& m_natives;
+  std::size_t m_functions;
+
+  std::vector<Value> m_objects;
+};
+
+}
+
+bool VirtualMachine::snapshot(std::ostream& out, const Value& result) {
+  if (m_frame_count > 0) {
+    error() << "Snapshots can only be taken at the top level.\n";
+    return false;
+  }
+
+  // Stack code is saved up to the native's result, above it are the
+  // arguments the call drops. Register code keeps all of its registers.
+  const Value* top = m_code->get_format() == Bytecode::Format::Register ? m_sp : &result + 1;
+
+  std::ostringstream code;
+  m_code->write(code);
+
+  ImageWriter writer(out);
+
+  out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  writer.raw<std::uint32_t>(Compiler::VERSION);
+  writer.string(code.str());
+
+  writer.raw<std::uint64_t>(m_ip - m_code->get_code().data());
+  writer.raw<std::uint64_t>(top - m_stack.data());
+
+  for (const Value* value = m_stack.data(); value < top; ++value) {
+    writer.value(*value);
+  }
+
+  writer.raw<std::uint64_t>(m_globals.size());
+
+  for (const auto& global : m_globals) {
+    writer.string(global.first);
+    writer.value(global.second);
+  }
+
+  return true;
+}
+
+bool VirtualMachine::restore(std::istream& in) {
+  char magic[sizeof(SNAPSHOT_MAGIC)];
+  std::uint32_t version;
+  std::string image;
+
+  // Function values can't be read before the bytecode.
+  ImageReader header(in, m_natives, 0);
+
+  if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), SNAPSHOT_MAGIC) ||
+      !header.raw(version) || version != Compiler::VERSION || !header.string(image)) {
+    return false;
+  }
+
+  std::shared_ptr<Bytecode> code = std::make_shared<Bytecode>();
+  std::istringstream code_in(image);
+  std::ostringstream errors;
+
+  if (!code->read(code_in) || !Verifier(*code, errors).verify()) return false;
+
+  std::uint64_t ip, depth, count;
+  if (!header.raw(ip) || !header.raw(depth)) return false;
+
+  // Execution continues right after a call.
+  bool registers = code->get_format() == Bytecode::Format::Register;
+  std::size_t at = 0;
+  std::uint8_t op = 0;
+
+  while (at < ip && at < code->get_code().size()) {
+    op = code->get_byte(at);
+    std::size_t size = registers ? reg::instruction_size(op) : instruction_size(op);
+
+    if (size == 0) return false;
+    at += size;
+  }
+
+  if (at != ip || ip >= code->get_code().size()) return false;
+  if (op != (registers ? (std::uint8_t) reg::Call : (std::uint8_t) Call)) return false;
+  if (registers ? depth != code->get_max_stack() : depth > code->get_max_stack()) return false;
+
+  ImageReader values(in, m_natives, code->get_functions().size());
+
+  std::vector<Value> stack(depth);
+
+  for (Value& value : stack) {
+    if (!values.value(value)) return false;
+  }
+
+  if (!values.raw(count)) return false;
+
+  std::unordered_map<std::string, Value> globals;
+
+  for (std::uint64_t i = 0; i < count; ++i) {
+    std::string name;
+    Value value;
+
+    if (!values.string(name) || !values.value(value)) return false;
+    globals[name] = value;
+  }
+
+  // Anything after the image means it isn't one.
+  if (in.peek() != std::istream::traits_type::eof()) return false;
+
+  reset();
+
+  for (auto& global : globals) {
+    m_globals[global.first] = std::move(global.second);
+  }
+
+  load(Program(code));
+
+  m_ip = code->get_code().data() + ip;
+  std::move(stack.begin(), stack.end(), m_stack.begin());
+  m_sp = m_stack.data() + depth;
+
+  return true;
+}
@@ -0,0 +1,118 @@
+#include "thread_pool.hh"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(std::size_t threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (std::size_t i = 0; i < threads; ++i) {
+    m_queues.emplace_back(new Queue());
+  }
+
+  for (std::size_t i = 0; i < threads; ++i) {
+    m_threads.emplace_back(&ThreadPool::work, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+
+  m_wake.notify_all();
+
+  for (auto& thread : m_threads) {
+    thread.join();
+  }
+}
+
+std::size_t ThreadPool::size() const {
+  return m_threads.size();
+}
+
+void ThreadPool::submit(Job job) {
+  std::size_t worker;
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    worker = m_next++ % m_queues.size();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_queues[worker]->mutex);
+    m_queues[worker]->jobs.push_back(std::move(job));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pending++;
+    m_queued++;
+  }
+
+  m_wake.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_idle.wait(lock, [this]() { return m_pending == 0; });
+}
+
+bool ThreadPool::take(std::size_t worker, Job& job) {
+  {
+    Queue& own = *m_queues[worker];
+    std::lock_guard<std::mutex> lock(own.mutex);
+
+    if (!own.jobs.empty()) {
+      job = std::move(own.jobs.back());
+      own.jobs.pop_back();
+      return true;
+    }
+  }
+
+  for (std::size_t i = 1; i < m_queues.size(); ++i) {
+    Queue& victim = *m_queues[(worker + i) % m_queues.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+
+    if (!victim.jobs.empty()) {
+      job = std::move(victim.jobs.front());
+      victim.jobs.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ThreadPool::work(std::size_t worker) {
+  Job job;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [this]() { return m_stop || m_queued > 0; });
+
+      if (m_queued == 0) {
+        return;
+      }
+
+      // Claim one of the queued jobs, take() is then bound to find it.
+      m_queued--;
+    }
+
+    while (!take(worker, job)) {
+      std::this_thread::yield();
+    }
+
+    job(worker);
+    job = nullptr;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (--m_pending == 0) {
+      m_idle.notify_all();
+    }
+  }
+}
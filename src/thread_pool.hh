@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker owns a deque of jobs, takes new
+// work from the back of its own deque and steals from the front of the
+// others once it runs dry. Jobs get the index of the worker running them,
+// so callers can keep per-worker state (VMs, compilers) and reuse it
+// across jobs.
+class ThreadPool {
+public:
+  typedef std::function<void(std::size_t worker)> Job;
+
+  // Starts one worker per hardware thread if threads is 0.
+  explicit ThreadPool(std::size_t threads = 0);
+  ~ThreadPool();
+
+  std::size_t size() const;
+
+  void submit(Job job);
+
+  // Blocks until every submitted job has finished.
+  void wait();
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+  };
+
+  void work(std::size_t worker);
+  bool take(std::size_t worker, Job& job);
+
+  std::vector<std::unique_ptr<Queue>> m_queues;
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_idle;
+
+  // Jobs submitted but not finished, and jobs not claimed by a worker yet.
+  std::size_t m_pending { 0 };
+  std::size_t m_queued { 0 };
+  std::size_t m_next { 0 };
+  bool m_stop { false };
+};
@@ -3,17 +3,52 @@
 std::ostream& operator <<(std::ostream& os, ValueType type) {
   switch (type) {
     case ValueType::Number: os << "number"; break;
+    case ValueType::Integer: os << "integer"; break;
     case ValueType::Bool: os << "bool"; break;
     case ValueType::Symbol: os << "symbol"; break;
     case ValueType::Object: os << "object"; break;
     case ValueType::String: os << "string"; break;
     case ValueType::Null: os << "null"; break;
+    case ValueType::Function: os << "function"; break;
+    case ValueType::Array: os << "array"; break;
+    // Scripts can't tell natives from their own functions.
+    case ValueType::Native: os << "function"; break;
     case ValueType::Error: os << "<error>"; break;
   }
 
   return os;
 }
 
+SymbolTable& SymbolTable::instance() {
+  static SymbolTable* table = new SymbolTable();
+  return *table;
+}
+
+std::uint32_t SymbolTable::intern(const std::string& name) {
+  SymbolTable& table = instance();
+  std::lock_guard<std::mutex> lock(table.m_mutex);
+
+  auto symbol = table.m_symbols.find(name);
+
+  if (symbol != table.m_symbols.end()) {
+    return symbol->second;
+  }
+
+  std::uint32_t id = (std::uint32_t) table.m_names.size();
+
+  table.m_names.push_back(name);
+  table.m_symbols[name] = id;
+
+  return id;
+}
+
+std::string SymbolTable::name(std::uint32_t symbol) {
+  SymbolTable& table = instance();
+  std::lock_guard<std::mutex> lock(table.m_mutex);
+
+  return table.m_names[symbol];
+}
+
 Value::Value(ValueType type) {
   m_type = type;
 }
@@ -23,6 +58,11 @@ Value::Value(double value) {
   m_number = value;
 }
 
+Value::Value(std::int64_t value) {
+  m_type = ValueType::Integer;
+  m_integer = value;
+}
+
 Value::Value(bool value) {
   m_type = ValueType::Bool;
   m_bool = value;
@@ -30,25 +70,52 @@ Value::Value(bool value) {
 
 Value::Value(const char* str) {
   m_type = ValueType::String;
-  m_string = new std::string(str);
+  m_string = new StringObject(str);
 }
 
 Value::Value(const std::string& str) {
   m_type = ValueType::String;
-  m_string = new std::string(str);
+  m_string = new StringObject(str);
 }
 
-Value::~Value() {
-  if (is(ValueType::String)) {
-    // TODO: Free m_string somehow...
-    /* delete m_string; */
-  }
+Value::Value(ArrayObject* array) {
+  m_type = ValueType::Array;
+  m_array = array;
+}
+
+Value::Value(ObjectObject* object) {
+  m_type = ValueType::Object;
+  m_object = object;
+}
+
+Value::Value(const Native* native) {
+  m_type = ValueType::Native;
+  m_native = native;
+}
+
+Value Value::function(std::size_t index) {
+  Value value(ValueType::Function);
+  value.m_integer = index;
+
+  return value;
+}
+
+Value Value::symbol(std::uint32_t symbol) {
+  // The whole payload is set, so symbols compare like integers.
+  Value value(ValueType::Symbol);
+  value.m_integer = symbol;
+
+  return value;
 }
 
 bool Value::is(ValueType type) const {
   return m_type == type;
 }
 
+bool Value::is_numeric() const {
+  return ::is_numeric(m_type);
+}
+
 ValueType Value::getType() const {
   return m_type;
 }
@@ -58,21 +125,186 @@ double Value::as_number() const {
   return m_number;
 }
 
+std::int64_t Value::as_integer() const {
+  return m_integer;
+}
+
+double Value::to_double() const {
+  return m_type == ValueType::Integer ? (double) m_integer : m_number;
+}
+
 bool Value::as_bool() const {
   // TODO: assert?
   return m_bool;
 }
 
 const std::string& Value::as_string() const {
-  return *m_string;
+  return m_string->str;
+}
+
+std::size_t Value::as_function() const {
+  return m_integer;
+}
+
+const Native& Value::as_native() const {
+  return *m_native;
+}
+
+std::uint32_t Value::as_symbol() const {
+  return (std::uint32_t) m_integer;
+}
+
+ArrayObject& Value::as_array() const {
+  return *m_array;
+}
+
+ObjectObject& Value::as_object() const {
+  return *m_object;
+}
+
+const Shape* Shape::root() {
+  static const Shape* root = new Shape();
+  return root;
+}
+
+const Shape* Shape::with(std::uint32_t name) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  auto transition = m_transitions.find(name);
+
+  if (transition != m_transitions.end()) {
+    return transition->second;
+  }
+
+  Shape* shape = new Shape();
+  shape->m_names = m_names;
+  shape->m_names.push_back(name);
+
+  m_transitions[name] = shape;
+  return shape;
+}
+
+int Shape::find(std::uint32_t name) const {
+  for (std::size_t i = 0; i < m_names.size(); ++i) {
+    if (m_names[i] == name) return (int) i;
+  }
+
+  return -1;
+}
+
+std::size_t Shape::size() const {
+  return m_names.size();
+}
+
+std::uint32_t Shape::name(std::size_t slot) const {
+  return m_names[slot];
+}
+
+const Value* ObjectObject::get(std::uint32_t name) const {
+  int slot = shape->find(name);
+  return slot < 0 ? nullptr : &slots[slot];
+}
+
+void ObjectObject::set(std::uint32_t name, const Value& value) {
+  int slot = shape->find(name);
+
+  if (slot < 0) {
+    shape = shape->with(name);
+    slots.push_back(value);
+  } else {
+    slots[slot] = value;
+  }
+}
+
+std::size_t ArrayObject::size() const {
+  return packed ? numbers.size() : values.size();
+}
+
+Value ArrayObject::get(std::size_t index) const {
+  return packed ? Value(numbers[index]) : values[index];
+}
+
+void ArrayObject::set(std::size_t index, const Value& value) {
+  if (packed && !value.is(ValueType::Number)) {
+    unpack();
+  }
+
+  if (packed) {
+    numbers[index] = value.as_number();
+  } else {
+    values[index] = value;
+  }
+}
+
+void ArrayObject::push(const Value& value) {
+  if (packed && !value.is(ValueType::Number)) {
+    unpack();
+  }
+
+  if (packed) {
+    numbers.push_back(value.as_number());
+  } else {
+    values.push_back(value);
+  }
+}
+
+void ArrayObject::fill(const Value& value) {
+  std::size_t count = size();
+
+  if (value.is(ValueType::Number)) {
+    numbers.assign(count, value.as_number());
+    values.clear();
+    packed = true;
+  } else {
+    unpack();
+    values.assign(count, value);
+  }
+}
+
+void ArrayObject::unpack() {
+  if (!packed) return;
+
+  values.assign(numbers.begin(), numbers.end());
+  numbers.clear();
+  numbers.shrink_to_fit();
+
+  packed = false;
 }
 
 std::ostream& operator <<(std::ostream& os, const Value& value) {
   switch (value.getType()) {
     case ValueType::Number: os << value.as_number(); break;
-    case ValueType::Bool: os << std::boolalpha << value.as_bool(); break;
+    case ValueType::Integer: os << value.as_integer(); break;
+    case ValueType::Bool: os << (value.as_bool() ? "true" : "false"); break;
     case ValueType::String: os << value.as_string(); break;
     case ValueType::Null: os << "null"; break;
+    case ValueType::Function:
+    case ValueType::Native: os << "<function>"; break;
+    case ValueType::Symbol: os << SymbolTable::name(value.as_symbol()); break;
+    case ValueType::Array: {
+      const ArrayObject& array = value.as_array();
+
+      os << "[";
+
+      for (std::size_t i = 0; i < array.size(); ++i) {
+        os << (i > 0 ? ", " : "") << array.get(i);
+      }
+
+      os << "]";
+      break;
+    }
+    case ValueType::Object: {
+      const ObjectObject& object = value.as_object();
+
+      os << "{";
+
+      for (std::size_t i = 0; i < object.slots.size(); ++i) {
+        os << (i > 0 ? ", " : "") << SymbolTable::name(object.shape->name(i)) << ": " << object.slots[i];
+      }
+
+      os << "}";
+      break;
+    }
     default: os << "<error>"; break;
   }
 
@@ -1,16 +1,26 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
 #include <ostream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 enum class ValueType : std::uint8_t {
-  // TODO: float and int
   Number,
+  Integer,
   Bool,
   Symbol,
   Object,
   String,
   Null,
+  Function,
+  Array,
+  // Host function registered with VirtualMachine::define().
+  Native,
 
   // Used internally.
   Error
@@ -18,31 +28,241 @@ enum class ValueType : std::uint8_t {
 
 std::ostream& operator <<(std::ostream& os, ValueType type);
 
+constexpr bool is_numeric(ValueType type) {
+  return type == ValueType::Integer || type == ValueType::Number;
+}
+
+// Type of the result of an arithmetic operation on two numeric operands.
+// Integers stay integers only when both operands are integers, otherwise
+// they are promoted to doubles. Integer results that overflow are promoted
+// at runtime.
+constexpr ValueType promote(ValueType a, ValueType b) {
+  return (a == ValueType::Integer && b == ValueType::Integer) ?
+    ValueType::Integer : ValueType::Number;
+}
+
+static_assert(promote(ValueType::Integer, ValueType::Integer) == ValueType::Integer,
+    "int op int must stay int");
+static_assert(promote(ValueType::Integer, ValueType::Number) == ValueType::Number,
+    "int op double must promote to double");
+static_assert(promote(ValueType::Number, ValueType::Integer) == ValueType::Number,
+    "double op int must promote to double");
+static_assert(promote(ValueType::Number, ValueType::Number) == ValueType::Number,
+    "double op double must stay double");
+
+// Strings are immutable and shared between copies of a value. The
+// reference count is atomic, so values (and the bytecode constants they
+// come from) can be shared by VMs running on different threads.
+struct StringObject {
+  explicit StringObject(const std::string& str) : str(str) {}
+
+  std::atomic<std::uint32_t> refs { 1 };
+  const std::string str;
+};
+
+// Symbols are interned names. A symbol value is the 32-bit index of its
+// name in a process wide table, so comparing and hashing symbols never
+// touches the name. The table only grows and is shared by all threads.
+class SymbolTable {
+public:
+  static std::uint32_t intern(const std::string& name);
+  static std::string name(std::uint32_t symbol);
+
+private:
+  static SymbolTable& instance();
+
+  std::mutex m_mutex;
+  std::deque<std::string> m_names;
+  std::unordered_map<std::string, std::uint32_t> m_symbols;
+};
+
+struct ArrayObject;
+struct ObjectObject;
+struct Native;
+
 class Value {
 public:
   Value(ValueType type = ValueType::Null);
   Value(double value);
+  Value(std::int64_t value);
   Value(bool value);
   Value(const char* str);
   Value(const std::string& str);
 
+  // Takes over the reference of a new array.
+  explicit Value(ArrayObject* array);
+  explicit Value(ObjectObject* object);
+  // Natives are owned by the VM that defined them, not by their values.
+  explicit Value(const Native* native);
+
+  // Function number index of the program's function table.
+  static Value function(std::size_t index);
+  static Value symbol(std::uint32_t symbol);
+
+  Value(const Value& other);
+  Value(Value&& other) noexcept;
+  Value& operator =(const Value& other);
+  Value& operator =(Value&& other) noexcept;
+
   ~Value();
 
   bool is(ValueType type) const;
+  bool is_numeric() const;
 
   ValueType getType() const;
 
   double as_number() const;
+  std::int64_t as_integer() const;
   bool as_bool() const;
   const std::string& as_string() const;
+  std::size_t as_function() const;
+  std::uint32_t as_symbol() const;
+  ArrayObject& as_array() const;
+  ObjectObject& as_object() const;
+  const Native& as_native() const;
+
+  // Numeric value as a double, promoting integers.
+  double to_double() const;
 private:
+  friend class Jit;
+
+  void retain() const;
+  void release();
+
   ValueType m_type;
 
   union {
     double m_number;
+    std::int64_t m_integer;
     bool m_bool;
-    std::string* m_string { nullptr };
+    StringObject* m_string { nullptr };
+    ArrayObject* m_array;
+    ObjectObject* m_object;
+    const Native* m_native;
   };
 };
 
+// Arrays are mutable and shared by reference between copies of a value.
+// While every element is a double they are packed into numbers, which the
+// bulk operations work on directly. Storing anything else unpacks them into
+// values for good.
+struct ArrayObject {
+  std::atomic<std::uint32_t> refs { 1 };
+
+  bool packed { true };
+  std::vector<double> numbers;
+  std::vector<Value> values;
+
+  std::size_t size() const;
+
+  Value get(std::size_t index) const;
+  void set(std::size_t index, const Value& value);
+  void push(const Value& value);
+
+  // Sets every element to value, packs the array again if it's a double.
+  void fill(const Value& value);
+
+  void unpack();
+};
+
+// Hidden class of an object: the names (symbols) of its fields in the
+// order they were added. A field's slot is its position in that order, so objects
+// with the same shape store the same field at the same index. Shapes form
+// a tree rooted at the empty shape, adding a field follows (or creates)
+// a transition to a child. Shapes live as long as the process and are
+// shared by all threads.
+class Shape {
+public:
+  static const Shape* root();
+
+  // Shape with name added as the last field.
+  const Shape* with(std::uint32_t name) const;
+
+  // Slot of name, or -1 if there is no such field.
+  int find(std::uint32_t name) const;
+
+  std::size_t size() const;
+  std::uint32_t name(std::size_t slot) const;
+
+private:
+  Shape() = default;
+
+  std::vector<std::uint32_t> m_names;
+
+  mutable std::mutex m_mutex;
+  mutable std::unordered_map<std::uint32_t, const Shape*> m_transitions;
+};
+
+// Objects are mutable and shared by reference, their values are stored in
+// a flat slot array laid out by the shape.
+struct ObjectObject {
+  std::atomic<std::uint32_t> refs { 1 };
+
+  const Shape* shape { Shape::root() };
+  std::vector<Value> slots;
+
+  // Slow paths of property access, the VM caches their result per site.
+  const Value* get(std::uint32_t name) const;
+  void set(std::uint32_t name, const Value& value);
+};
+
+inline void Value::retain() const {
+  if (m_type == ValueType::String) {
+    m_string->refs.fetch_add(1, std::memory_order_relaxed);
+  } else if (m_type == ValueType::Array) {
+    m_array->refs.fetch_add(1, std::memory_order_relaxed);
+  } else if (m_type == ValueType::Object) {
+    m_object->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+inline void Value::release() {
+  if (m_type == ValueType::String &&
+      m_string->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete m_string;
+  } else if (m_type == ValueType::Array &&
+      m_array->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete m_array;
+  } else if (m_type == ValueType::Object &&
+      m_object->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete m_object;
+  }
+}
+
+inline Value::Value(const Value& other) : m_type(other.m_type) {
+  m_integer = other.m_integer;
+  retain();
+}
+
+inline Value::Value(Value&& other) noexcept : m_type(other.m_type) {
+  m_integer = other.m_integer;
+  other.m_type = ValueType::Null;
+}
+
+inline Value& Value::operator =(const Value& other) {
+  other.retain();
+  release();
+
+  m_type = other.m_type;
+  m_integer = other.m_integer;
+
+  return *this;
+}
+
+inline Value& Value::operator =(Value&& other) noexcept {
+  if (this != &other) {
+    release();
+
+    m_type = other.m_type;
+    m_integer = other.m_integer;
+    other.m_type = ValueType::Null;
+  }
+
+  return *this;
+}
+
+inline Value::~Value() {
+  release();
+}
+
 std::ostream& operator <<(std::ostream& os, const Value& value);
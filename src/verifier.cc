@@ -0,0 +1,508 @@
+#include "verifier.hh"
+#include "register_code.hh"
+#include "runtime.h"
+#include "virtual_machine.hh"
+
+#include <algorithm>
+#include <cstdint>
+
+// min and max take two arguments, the other functions one.
+static bool math_function(bool binary, std::uint8_t function) {
+  return binary ? function == DU_MATH_MIN || function == DU_MATH_MAX : function < DU_MATH_MIN;
+}
+
+Verifier::Verifier(Bytecode& code, std::ostream& out) : m_code(code), m_out(out) {
+}
+
+bool Verifier::verify() {
+  const std::vector<std::uint8_t>& code = m_code.m_code;
+
+  bool registers = m_code.m_format == Bytecode::Format::Register;
+  auto size = registers ? reg::instruction_size : VirtualMachine::instruction_size;
+  std::uint8_t last = registers ? (std::uint8_t) reg::Math2 : (std::uint8_t) VirtualMachine::Math2;
+
+  m_code.m_verified = false;
+  m_starts.assign(code.size(), false);
+
+  for (std::size_t i = 0; i < code.size(); i += size(code[i])) {
+    if (code[i] > last) return error(i, "unknown instruction");
+    if (i + size(code[i]) > code.size()) return error(i, "truncated instruction");
+
+    m_starts[i] = true;
+  }
+
+  for (const Value& value : m_code.m_consts) {
+    if (value.is(ValueType::Function) && value.as_function() >= m_code.m_functions.size()) {
+      return error(0, "constant refers to a missing function");
+    }
+  }
+
+  if (code.empty()) return error(0, "no code");
+
+  auto walk = registers ? &Verifier::register_frame : &Verifier::frame;
+
+  if (!(this->*walk)(0, 0, true, m_code.m_max_stack)) return false;
+
+  for (Function& function : m_code.m_functions) {
+    if (function.entry >= code.size() || !m_starts[function.entry]) {
+      return error(function.entry, "function entry isn't an instruction");
+    }
+
+    if (!(this->*walk)(function.entry, function.arity, false, function.max_stack)) return false;
+  }
+
+  m_code.m_verified = true;
+  return true;
+}
+
+bool Verifier::frame(std::size_t entry, std::size_t depth, bool top_level, std::size_t& max_depth) {
+  const std::vector<std::uint8_t>& code = m_code.m_code;
+
+  // Stack depth on entry to every instruction reached so far, -1 if none.
+  std::vector<long> depths(code.size(), -1);
+  std::vector<std::size_t> pending { entry };
+
+  depths[entry] = depth;
+  max_depth = depth;
+
+  auto constant = [&](std::size_t index) -> const Value* {
+    return index < m_code.m_consts.size() ? &m_code.m_consts[index] : nullptr;
+  };
+
+  auto qword = [&](std::size_t address) {
+    QwordToBytes qtb;
+    std::copy(&code[address], &code[address] + 8, qtb.bytes);
+    return qtb.qword;
+  };
+
+  while (!pending.empty()) {
+    std::size_t at = pending.back();
+    pending.pop_back();
+
+    std::uint8_t op = code[at];
+    std::size_t size = VirtualMachine::instruction_size(op);
+    std::size_t stack = depths[at];
+
+    // Values the instruction pops and pushes.
+    std::size_t pops = 0;
+    std::size_t pushes = 0;
+
+    // Slots of the locals it addresses, counted from the frame's base.
+    std::size_t locals = 0;
+
+    bool falls_through = true;
+    std::size_t target = SIZE_MAX;
+
+    switch (op) {
+      case VirtualMachine::Return:
+        pops = top_level ? 0 : 1;
+        falls_through = false;
+        break;
+      case VirtualMachine::Constant16:
+        if (!constant(code[at + 1])) return error(at, "constant out of range");
+        pushes = 1;
+        break;
+      case VirtualMachine::Pop:
+      case VirtualMachine::Print:
+        pops = 1;
+        break;
+      case VirtualMachine::Negate:
+      case VirtualMachine::Not:
+      case VirtualMachine::Length:
+      case VirtualMachine::Sum:
+      case VirtualMachine::Min:
+      case VirtualMachine::Max:
+        pops = 1;
+        pushes = 1;
+        break;
+      case VirtualMachine::Add:
+      case VirtualMachine::Subtract:
+      case VirtualMachine::Multiply:
+      case VirtualMachine::Exp:
+      case VirtualMachine::Divide:
+      case VirtualMachine::And:
+      case VirtualMachine::Or:
+      case VirtualMachine::Equal:
+      case VirtualMachine::Greater:
+      case VirtualMachine::Less:
+      case VirtualMachine::AddNum:
+      case VirtualMachine::SubNum:
+      case VirtualMachine::MulNum:
+      case VirtualMachine::DivNum:
+      case VirtualMachine::LessNum:
+      case VirtualMachine::GreaterNum:
+      case VirtualMachine::LoadIndex:
+      case VirtualMachine::Fill:
+      case VirtualMachine::Append:
+        pops = 2;
+        pushes = 1;
+        break;
+      case VirtualMachine::LoadNull:
+      case VirtualMachine::NewObject:
+        pushes = 1;
+        break;
+      case VirtualMachine::AllocGlobal:
+      case VirtualMachine::StoreGlobal:
+      case VirtualMachine::LoadGlobal: {
+        const Value* name = constant(code[at + 1]);
+
+        if (!name || !name->is(ValueType::String)) return error(at, "global name isn't a string constant");
+
+        pops = op == VirtualMachine::StoreGlobal ? 1 : 0;
+        pushes = op == VirtualMachine::LoadGlobal ? 1 : 0;
+        break;
+      }
+      case VirtualMachine::StoreLocal:
+        // Stores the value on top and keeps it.
+        locals = code[at + 1] + 1;
+        pops = 1;
+        pushes = 1;
+        break;
+      case VirtualMachine::IncLocal:
+        if (!constant(code[at + 2])) return error(at, "constant out of range");
+        locals = code[at + 1] + 1;
+        break;
+      case VirtualMachine::LoadLocal:
+        locals = code[at + 1] + 1;
+        pushes = 1;
+        break;
+      case VirtualMachine::PopLocal:
+      case VirtualMachine::AddStoreLocal:
+      case VirtualMachine::SubStoreLocal:
+      case VirtualMachine::MulStoreLocal:
+      case VirtualMachine::DivStoreLocal:
+        // The local is below the value that is popped.
+        locals = code[at + 1] + 2;
+        pops = 1;
+        break;
+      case VirtualMachine::Jump:
+        target = qword(at + 1);
+        falls_through = false;
+        break;
+      case VirtualMachine::JumpIfFalse:
+      case VirtualMachine::JumpIfTrue:
+        target = qword(at + 1);
+        pops = 1;
+        break;
+      case VirtualMachine::JumpIfFalseKeep:
+      case VirtualMachine::JumpIfTrueKeep:
+        target = qword(at + 1);
+        pops = 1;
+        pushes = 1;
+        break;
+      case VirtualMachine::Call:
+        pops = code[at + 1] + 1;
+        pushes = 1;
+        break;
+      case VirtualMachine::TailCall:
+        if (top_level) return error(at, "tail call outside of a function");
+        pops = code[at + 1] + 1;
+        falls_through = false;
+        break;
+      case VirtualMachine::ArrayLiteral:
+        pops = code[at + 1];
+        pushes = 1;
+        break;
+      case VirtualMachine::StoreIndex:
+        pops = 3;
+        break;
+      case VirtualMachine::Map:
+        switch (code[at + 1]) {
+          case VirtualMachine::Add:
+          case VirtualMachine::Subtract:
+          case VirtualMachine::Multiply:
+          case VirtualMachine::Divide:
+            break;
+          default:
+            return error(at, "map() of an unknown operator");
+        }
+
+        pops = 2;
+        pushes = 1;
+        break;
+      case VirtualMachine::GetProperty:
+      case VirtualMachine::SetProperty:
+      case VirtualMachine::InitProperty: {
+        const Value* name = constant(code[at + 1]);
+
+        if (!name || !name->is(ValueType::Symbol)) return error(at, "property name isn't a symbol constant");
+
+        if ((std::size_t) (code[at + 2] | (code[at + 3] << 8)) >= m_code.m_property_sites) {
+          return error(at, "property site out of range");
+        }
+
+        pops = op == VirtualMachine::GetProperty ? 1 : 2;
+        pushes = op == VirtualMachine::SetProperty ? 0 : 1;
+        break;
+      }
+      case VirtualMachine::ForPrep:
+        // Counter, limit, step and variable.
+        locals = code[at + 1] + 4;
+        pushes = 1;
+        break;
+      case VirtualMachine::ForLoop:
+        target = qword(at + 1);
+        locals = code[at + 9] + 4;
+        break;
+      case VirtualMachine::BinaryLocalConst:
+      case VirtualMachine::BinaryLocals:
+      case VirtualMachine::BinaryConst:
+        switch (code[at + size - 1]) {
+          case VirtualMachine::Add:
+          case VirtualMachine::Subtract:
+          case VirtualMachine::Multiply:
+          case VirtualMachine::Exp:
+          case VirtualMachine::Divide:
+          case VirtualMachine::Equal:
+          case VirtualMachine::Greater:
+          case VirtualMachine::Less:
+          case VirtualMachine::AddNum:
+          case VirtualMachine::SubNum:
+          case VirtualMachine::MulNum:
+          case VirtualMachine::DivNum:
+          case VirtualMachine::LessNum:
+          case VirtualMachine::GreaterNum:
+            break;
+          default:
+            return error(at, "superinstruction of an unknown operator");
+        }
+
+        if (op == VirtualMachine::BinaryConst) {
+          if (!constant(code[at + 1])) return error(at, "constant out of range");
+          pops = 1;
+        } else if (op == VirtualMachine::BinaryLocalConst) {
+          if (!constant(code[at + 2])) return error(at, "constant out of range");
+          locals = code[at + 1] + 1;
+        } else {
+          locals = std::max(code[at + 1], code[at + 2]) + 1;
+        }
+
+        pushes = 1;
+        break;
+      case VirtualMachine::Math:
+      case VirtualMachine::Math2:
+        if (!math_function(op == VirtualMachine::Math2, code[at + 1])) {
+          return error(at, "unknown math function");
+        }
+
+        pops = op == VirtualMachine::Math2 ? 2 : 1;
+        pushes = 1;
+        break;
+    }
+
+    if (stack < pops) return error(at, "stack underflow");
+    if (stack < locals) return error(at, "local out of range");
+
+    std::size_t next_depth = stack - pops + pushes;
+
+    if (next_depth > max_depth) max_depth = next_depth;
+
+    std::size_t successors[2];
+    std::size_t count = 0;
+
+    if (falls_through) successors[count++] = at + size;
+    if (target != SIZE_MAX) successors[count++] = target;
+
+    for (std::size_t i = 0; i < count; ++i) {
+      std::size_t next = successors[i];
+
+      if (next >= code.size()) {
+        return error(at, next == at + size ? "falls off the end of the code" : "jump out of the code");
+      }
+
+      if (!m_starts[next]) return error(at, "jump into the middle of an instruction");
+
+      if (depths[next] < 0) {
+        depths[next] = next_depth;
+        pending.push_back(next);
+      } else if ((std::size_t) depths[next] != next_depth) {
+        return error(next, "stack depth differs between paths");
+      }
+    }
+  }
+
+  return true;
+}
+
+// Register code has no stack to keep balanced, a frame's size is the
+// highest register any of its instructions addresses.
+bool Verifier::register_frame(std::size_t entry, std::size_t arity, bool top_level,
+    std::size_t& max_depth) {
+  const std::vector<std::uint8_t>& code = m_code.m_code;
+
+  std::vector<bool> reached(code.size(), false);
+  std::vector<std::size_t> pending { entry };
+
+  reached[entry] = true;
+  max_depth = arity;
+
+  auto constant = [&](std::size_t index) -> const Value* {
+    return index < m_code.m_consts.size() ? &m_code.m_consts[index] : nullptr;
+  };
+
+  auto qword = [&](std::size_t address) {
+    QwordToBytes qtb;
+    std::copy(&code[address], &code[address] + 8, qtb.bytes);
+    return qtb.qword;
+  };
+
+  auto site = [&](std::size_t address) {
+    return (std::size_t) (code[address] | (code[address + 1] << 8)) < m_code.m_property_sites;
+  };
+
+  while (!pending.empty()) {
+    std::size_t at = pending.back();
+    pending.pop_back();
+
+    std::uint8_t op = code[at];
+    std::size_t size = reg::instruction_size(op);
+
+    // Registers the instruction addresses are [first, last).
+    std::size_t first = code[at + 1];
+    std::size_t last = first + 1;
+
+    bool falls_through = true;
+    std::size_t target = SIZE_MAX;
+
+    auto registers = [&](std::size_t a, std::size_t b) {
+      last = std::max({ last, a + 1, b + 1 });
+    };
+
+    switch (op) {
+      case reg::Return:
+        // The top level's result is ignored.
+        if (top_level) last = 0;
+        falls_through = false;
+        break;
+      case reg::LoadNull:
+      case reg::Print:
+      case reg::NewObject:
+        break;
+      case reg::AllocGlobal:
+      case reg::LoadGlobal:
+      case reg::StoreGlobal: {
+        const Value* name = constant(code[at + (op == reg::AllocGlobal ? 1 : 2)]);
+
+        if (!name || !name->is(ValueType::String)) return error(at, "global name isn't a string constant");
+
+        if (op == reg::AllocGlobal) last = 0;
+        break;
+      }
+      case reg::LoadConst:
+        if (!constant(code[at + 2])) return error(at, "constant out of range");
+        break;
+      case reg::Move:
+      case reg::Negate:
+      case reg::Not:
+      case reg::Length:
+      case reg::Sum:
+      case reg::Min:
+      case reg::Max:
+        registers(code[at + 2], 0);
+        break;
+      case reg::AddConst:
+      case reg::SubtractConst:
+      case reg::MultiplyConst:
+      case reg::DivideConst:
+      case reg::EqualConst:
+      case reg::LessConst:
+      case reg::GreaterConst:
+        if (!constant(code[at + 3])) return error(at, "constant out of range");
+        registers(code[at + 2], 0);
+        break;
+      case reg::Jump:
+        target = qword(at + 1);
+        falls_through = false;
+        last = 0;
+        break;
+      case reg::JumpIfFalse:
+      case reg::JumpIfTrue:
+      case reg::JumpIfFalseKeep:
+      case reg::JumpIfTrueKeep:
+        target = qword(at + 2);
+        break;
+      case reg::Call:
+      case reg::TailCall:
+        if (op == reg::TailCall && top_level) return error(at, "tail call outside of a function");
+        last = first + code[at + 2] + 1;
+        falls_through = op == reg::Call;
+        break;
+      case reg::ArrayLiteral:
+        last = std::max(last, (std::size_t) code[at + 2] + code[at + 3]);
+        break;
+      case reg::Map:
+        switch (code[at + 4]) {
+          case VirtualMachine::Add:
+          case VirtualMachine::Subtract:
+          case VirtualMachine::Multiply:
+          case VirtualMachine::Divide:
+            break;
+          default:
+            return error(at, "map() of an unknown operator");
+        }
+
+        registers(code[at + 2], code[at + 3]);
+        break;
+      case reg::GetProperty:
+      case reg::SetProperty:
+      case reg::InitProperty: {
+        bool get = op == reg::GetProperty;
+        const Value* name = constant(code[at + (get ? 3 : 2)]);
+
+        if (!name || !name->is(ValueType::Symbol)) return error(at, "property name isn't a symbol constant");
+        if (!site(at + (get ? 4 : 3))) return error(at, "property site out of range");
+
+        registers(code[at + (get ? 2 : 5)], 0);
+        break;
+      }
+      case reg::Math:
+      case reg::Math2:
+        if (!math_function(op == reg::Math2, code[at + size - 1])) {
+          return error(at, "unknown math function");
+        }
+
+        registers(code[at + 2], op == reg::Math2 ? code[at + 3] : 0);
+        break;
+      case reg::ForPrep:
+      case reg::ForLoop:
+        // Counter, limit, step and variable.
+        target = qword(at + 2);
+        last = first + 4;
+        break;
+      default:
+        // Three registers.
+        registers(code[at + 2], code[at + 3]);
+        break;
+    }
+
+    max_depth = std::max(max_depth, last);
+
+    std::size_t successors[2];
+    std::size_t count = 0;
+
+    if (falls_through) successors[count++] = at + size;
+    if (target != SIZE_MAX) successors[count++] = target;
+
+    for (std::size_t i = 0; i < count; ++i) {
+      std::size_t next = successors[i];
+
+      if (next >= code.size()) {
+        return error(at, next == at + size ? "falls off the end of the code" : "jump out of the code");
+      }
+
+      if (!m_starts[next]) return error(at, "jump into the middle of an instruction");
+
+      if (!reached[next]) {
+        reached[next] = true;
+        pending.push_back(next);
+      }
+    }
+  }
+
+  return true;
+}
+
+bool Verifier::error(std::size_t address, const char* msg) {
+  m_out << "Invalid bytecode at $" << address << ": " << msg << "\n";
+  return false;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+class Bytecode;
+
+// Checks bytecode before it is run: every instruction is known and
+// complete, jumps land on instructions, constants, locals, property sites
+// and functions referenced by operands exist, and the stack has the same
+// depth on every path into an instruction. Code reachable from the top
+// level and from each function is walked separately, frames are verified
+// one at a time. Register code is checked the same way, except that
+// instead of stack depths the registers its operands address are
+// collected.
+//
+// Verified bytecode records the maximum depth of every frame, which lets
+// the VM check for stack overflow once per call instead of once per push.
+class Verifier {
+public:
+  Verifier(Bytecode& code, std::ostream& out);
+
+  // False if the bytecode is invalid, the first problem is reported to out.
+  bool verify();
+
+private:
+  // Walks the frame entered at entry with depth values on its stack and
+  // sets max_depth to the deepest its stack gets.
+  bool frame(std::size_t entry, std::size_t depth, bool top_level, std::size_t& max_depth);
+  // Same for register code, max_depth is the number of registers the
+  // frame uses.
+  bool register_frame(std::size_t entry, std::size_t arity, bool top_level, std::size_t& max_depth);
+
+  bool error(std::size_t address, const char* msg);
+
+  Bytecode& m_code;
+  std::ostream& m_out;
+
+  // Addresses instructions start at.
+  std::vector<bool> m_starts;
+};
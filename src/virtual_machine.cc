@@ -1,6 +1,12 @@
 #include "virtual_machine.hh"
+#include "jit.hh"
+#include "op_profile.hh"
+#include "output.hh"
+#include "register_code.hh"
+#include "runtime.h"
 #include "value.hh"
 
+#include <algorithm>
 #include <cstdlib>
 #include <iomanip>
 #include <cmath>
@@ -9,10 +15,22 @@
 #include <sstream>
 #include <iostream>
 
+#include <unistd.h>
+
+static_assert(DU_INTEGER == (int) ValueType::Integer && DU_STRING == (int) ValueType::String &&
+    DU_NULL == (int) ValueType::Null && DU_FUNCTION == (int) ValueType::Function && DU_ARRAY == (int) ValueType::Array &&
+    DU_NATIVE == (int) ValueType::Native,
+    "runtime.h type tags must match ValueType");
+
 void Bytecode::clear() {
   m_code.clear();
   m_consts.clear();
+  m_functions.clear();
+  m_property_sites = 0;
   m_lines.clear();
+  m_format = Format::Stack;
+  m_verified = false;
+  m_max_stack = 0;
 }
 
 std::size_t Bytecode::push_byte(std::uint8_t byte, std::size_t line) {
@@ -22,6 +40,11 @@ std::size_t Bytecode::push_byte(std::uint8_t byte, std::size_t line) {
   return m_code.size() - 1;
 }
 
+void Bytecode::truncate(std::size_t address) {
+  m_code.resize(address);
+  m_lines.resize(address);
+}
+
 std::size_t Bytecode::push_qword(std::size_t qword, std::size_t line) {
 
   std::size_t address = m_code.size();
@@ -33,8 +56,6 @@ std::size_t Bytecode::push_qword(std::size_t qword, std::size_t line) {
     m_lines.push_back(line);
   }
 
-  m_lines.push_back(line);
-
   return address;
 }
 
@@ -43,6 +64,15 @@ std::size_t Bytecode::push_const(Value value) {
   return m_consts.size() - 1;
 }
 
+std::size_t Bytecode::push_function(Function function) {
+  m_functions.push_back(function);
+  return m_functions.size() - 1;
+}
+
+std::size_t Bytecode::push_property_site() {
+  return m_property_sites++;
+}
+
 void Bytecode::set_byte(std::size_t address, std::uint8_t byte) {
   m_code[address] = byte;
 }
@@ -52,26 +82,237 @@ void Bytecode::set_qword(std::size_t address, std::size_t qword) {
   std::copy(qtb.bytes, qtb.bytes + 8, m_code.begin() + address);
 }
 
-std::uint8_t Bytecode::get_byte(std::size_t address) {
+std::uint8_t Bytecode::get_byte(std::size_t address) const {
   return m_code[address];
 }
 
-std::size_t Bytecode::get_qword(std::size_t address) {
+std::size_t Bytecode::get_qword(std::size_t address) const {
   QwordToBytes qtb;
   std::copy(m_code.begin() + address, m_code.begin() + address + 8, qtb.bytes);
 
   return qtb.qword;
 }
 
-Value Bytecode::get_const(std::size_t address) const {
+std::size_t Bytecode::get_line(std::size_t address) const {
+  return m_lines[address];
+}
+
+const Value& Bytecode::get_const(std::size_t address) const {
   return m_consts[address];
 }
 
+const Function& Bytecode::get_function(std::size_t index) const {
+  return m_functions[index];
+}
+
+const std::vector<Function>& Bytecode::get_functions() const {
+  return m_functions;
+}
+
+std::size_t Bytecode::get_property_sites() const {
+  return m_property_sites;
+}
+
 const std::vector<std::uint8_t>& Bytecode::get_code() const {
   return m_code;
 }
 
-void Bytecode::dump_data() {
+void Bytecode::set_format(Format format) {
+  m_format = format;
+}
+
+Bytecode::Format Bytecode::get_format() const {
+  return m_format;
+}
+
+bool Bytecode::is_verified() const {
+  return m_verified;
+}
+
+std::size_t Bytecode::get_max_stack() const {
+  return m_max_stack;
+}
+
+static const char BYTECODE_MAGIC[4] = { 'D', 'U', 'K', 'B' };
+
+template<typename T>
+static void write_raw(std::ostream& out, T value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+static bool read_raw(std::istream& in, T& value) {
+  return (bool) in.read(reinterpret_cast<char*>(&value), sizeof(value));
+}
+
+void Bytecode::write(std::ostream& out) const {
+  out.write(BYTECODE_MAGIC, sizeof(BYTECODE_MAGIC));
+  write_raw<std::uint8_t>(out, (std::uint8_t) m_format);
+
+  write_raw<std::uint64_t>(out, m_consts.size());
+
+  for (const Value& value : m_consts) {
+    write_raw<std::uint8_t>(out, (std::uint8_t) value.getType());
+
+    switch (value.getType()) {
+      case ValueType::Number: write_raw<double>(out, value.as_number()); break;
+      case ValueType::Integer: write_raw<std::int64_t>(out, value.as_integer()); break;
+      case ValueType::Bool: write_raw<std::uint8_t>(out, value.as_bool()); break;
+      case ValueType::Function: write_raw<std::uint64_t>(out, value.as_function()); break;
+      case ValueType::String: {
+        const std::string& str = value.as_string();
+
+        write_raw<std::uint64_t>(out, str.size());
+        out.write(str.data(), str.size());
+        break;
+      }
+      case ValueType::Symbol: {
+        // Symbol numbers are only meaningful within one process.
+        std::string name = SymbolTable::name(value.as_symbol());
+
+        write_raw<std::uint64_t>(out, name.size());
+        out.write(name.data(), name.size());
+        break;
+      }
+      default: break;
+    }
+  }
+
+  write_raw<std::uint64_t>(out, m_functions.size());
+
+  for (const Function& function : m_functions) {
+    write_raw<std::uint64_t>(out, function.name.size());
+    out.write(function.name.data(), function.name.size());
+    write_raw<std::uint8_t>(out, function.arity);
+    write_raw<std::uint64_t>(out, function.entry);
+  }
+
+  write_raw<std::uint64_t>(out, m_property_sites);
+
+  write_raw<std::uint64_t>(out, m_code.size());
+  out.write(reinterpret_cast<const char*>(m_code.data()), m_code.size());
+
+  for (std::size_t line : m_lines) {
+    write_raw<std::uint32_t>(out, line);
+  }
+}
+
+bool Bytecode::read(std::istream& in) {
+  char magic[sizeof(BYTECODE_MAGIC)];
+  std::uint64_t count;
+
+  clear();
+
+  if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), BYTECODE_MAGIC)) {
+    return false;
+  }
+
+  std::uint8_t format;
+
+  if (!read_raw(in, format) || format > (std::uint8_t) Format::Register) return false;
+  m_format = (Format) format;
+
+  if (!read_raw(in, count)) return false;
+
+  for (std::uint64_t i = 0; i < count; ++i) {
+    std::uint8_t type;
+
+    if (!read_raw(in, type)) return false;
+
+    switch ((ValueType) type) {
+      case ValueType::Number: {
+        double number;
+        if (!read_raw(in, number)) return false;
+        m_consts.emplace_back(number);
+        break;
+      }
+      case ValueType::Integer: {
+        std::int64_t integer;
+        if (!read_raw(in, integer)) return false;
+        m_consts.emplace_back(integer);
+        break;
+      }
+      case ValueType::Bool: {
+        std::uint8_t boolean;
+        if (!read_raw(in, boolean)) return false;
+        m_consts.emplace_back((bool) boolean);
+        break;
+      }
+      case ValueType::String: {
+        std::uint64_t size;
+        if (!read_raw(in, size)) return false;
+
+        std::string str(size, '\0');
+        if (!in.read(&str[0], size)) return false;
+        m_consts.emplace_back(str);
+        break;
+      }
+      case ValueType::Symbol: {
+        std::uint64_t size;
+        if (!read_raw(in, size)) return false;
+
+        std::string name(size, '\0');
+        if (!in.read(&name[0], size)) return false;
+        m_consts.push_back(Value::symbol(SymbolTable::intern(name)));
+        break;
+      }
+      case ValueType::Function: {
+        std::uint64_t index;
+        if (!read_raw(in, index)) return false;
+        m_consts.push_back(Value::function(index));
+        break;
+      }
+      case ValueType::Null: m_consts.emplace_back(); break;
+      default: return false;
+    }
+  }
+
+  if (!read_raw(in, count)) return false;
+
+  for (std::uint64_t i = 0; i < count; ++i) {
+    Function function;
+    std::uint64_t size, entry;
+
+    if (!read_raw(in, size)) return false;
+
+    function.name.resize(size);
+    if (!in.read(&function.name[0], size)) return false;
+
+    if (!read_raw(in, function.arity) || !read_raw(in, entry)) return false;
+    function.entry = entry;
+
+    m_functions.push_back(function);
+  }
+
+  if (!read_raw(in, count)) return false;
+  m_property_sites = count;
+
+  if (!read_raw(in, count)) return false;
+
+  m_code.resize(count);
+  m_lines.resize(count);
+
+  if (!in.read(reinterpret_cast<char*>(m_code.data()), count)) return false;
+
+  for (std::size_t& line : m_lines) {
+    std::uint32_t value;
+    if (!read_raw(in, value)) return false;
+    line = value;
+  }
+
+  for (const Value& value : m_consts) {
+    if (value.is(ValueType::Function) && value.as_function() >= m_functions.size()) return false;
+  }
+
+  for (const Function& function : m_functions) {
+    if (function.entry >= m_code.size()) return false;
+  }
+
+  // Anything after the image means it isn't one.
+  return in.peek() == std::istream::traits_type::eof();
+}
+
+void Bytecode::dump_data() const {
   std::cout << ".rodata:\n";
   for (std::size_t i = 0; i < m_consts.size(); ++i) {
     std::cout << std::setfill('0');
@@ -79,9 +320,32 @@ void Bytecode::dump_data() {
   }
 }
 
-void Bytecode::dump_text() {
+void Bytecode::dump_text() const {
   std::cout << ".text:\n";
 
+  // Register code: the operands as numbers, jump targets as addresses.
+  if (m_format == Format::Register) {
+    for (std::size_t i = 0; i < m_code.size(); i += reg::instruction_size(m_code[i])) {
+      std::uint8_t op = m_code[i];
+      std::size_t size = reg::instruction_size(op);
+      bool jump = size >= 9;
+
+      std::cout << std::setfill('0');
+      std::cout << "$" << std::setw(5) << i << ":" << std::setw(3) << m_lines[i] << " ";
+      std::cout << (reg::name(op) ? reg::name(op) : "???");
+
+      for (std::size_t k = 1; k < (jump ? size - 8 : size); ++k) {
+        std::cout << " " << (std::size_t) m_code[i + k];
+      }
+
+      if (jump) std::cout << " $" << get_qword(i + size - 8);
+
+      std::cout << "\n";
+    }
+
+    return;
+  }
+
   for (std::size_t i = 0; i < m_code.size(); ++i) {
     std::uint8_t op = m_code[i];
 
@@ -101,10 +365,25 @@ void Bytecode::dump_text() {
       case VirtualMachine::Greater: std::cout << "gt\n"; break;
       case VirtualMachine::Less: std::cout << "lt\n"; break;
       case VirtualMachine::Exp: std::cout << "exp\n"; break;
+      case VirtualMachine::AddNum: std::cout << "addn\n"; break;
+      case VirtualMachine::SubNum: std::cout << "subn\n"; break;
+      case VirtualMachine::MulNum: std::cout << "muln\n"; break;
+      case VirtualMachine::DivNum: std::cout << "divn\n"; break;
+      case VirtualMachine::LessNum: std::cout << "ltn\n"; break;
+      case VirtualMachine::GreaterNum: std::cout << "gtn\n"; break;
       case VirtualMachine::LoadNull: std::cout << "lnull\n"; break;
       case VirtualMachine::Print: std::cout << "cout\n"; break;
       case VirtualMachine::Pop: std::cout << "pop\n"; break;
       case VirtualMachine::Return: std::cout << "ret\n"; break;
+      case VirtualMachine::LoadIndex: std::cout << "loadi\n"; break;
+      case VirtualMachine::StoreIndex: std::cout << "sti\n"; break;
+      case VirtualMachine::Length: std::cout << "len\n"; break;
+      case VirtualMachine::Sum: std::cout << "sum\n"; break;
+      case VirtualMachine::Min: std::cout << "min\n"; break;
+      case VirtualMachine::Max: std::cout << "max\n"; break;
+      case VirtualMachine::Fill: std::cout << "fill\n"; break;
+      case VirtualMachine::Append: std::cout << "apnd\n"; break;
+      case VirtualMachine::NewObject: std::cout << "newo\n"; break;
 
       case VirtualMachine::AllocGlobal:
         std::cout << "alcg $" << (std::size_t) m_code[++i] << "\n";
@@ -121,6 +400,25 @@ void Bytecode::dump_text() {
       case VirtualMachine::LoadLocal:
         std::cout << "loadl %" << (std::size_t) m_code[++i] << "\n";
         break;
+      case VirtualMachine::PopLocal:
+        std::cout << "popl %" << (std::size_t) m_code[++i] << "\n";
+        break;
+      case VirtualMachine::IncLocal:
+        std::cout << "incl %" << (std::size_t) m_code[i + 1] << " $" << (std::size_t) m_code[i + 2] << "\n";
+        i += 2;
+        break;
+      case VirtualMachine::AddStoreLocal:
+        std::cout << "addl %" << (std::size_t) m_code[++i] << "\n";
+        break;
+      case VirtualMachine::SubStoreLocal:
+        std::cout << "subl %" << (std::size_t) m_code[++i] << "\n";
+        break;
+      case VirtualMachine::MulStoreLocal:
+        std::cout << "mull %" << (std::size_t) m_code[++i] << "\n";
+        break;
+      case VirtualMachine::DivStoreLocal:
+        std::cout << "divl %" << (std::size_t) m_code[++i] << "\n";
+        break;
       case VirtualMachine::Jump: {
         auto addr = get_qword(i + 1);
         i += 8;
@@ -133,34 +431,223 @@ void Bytecode::dump_text() {
         std::cout << "jmpf $" << addr << "\n";
         break;
       }
+      case VirtualMachine::JumpIfTrue: {
+        auto addr = get_qword(i + 1);
+        i += 8;
+        std::cout << "jmpt $" << addr << "\n";
+        break;
+      }
+      case VirtualMachine::JumpIfFalseKeep: {
+        auto addr = get_qword(i + 1);
+        i += 8;
+        std::cout << "jmpfk $" << addr << "\n";
+        break;
+      }
+      case VirtualMachine::JumpIfTrueKeep: {
+        auto addr = get_qword(i + 1);
+        i += 8;
+        std::cout << "jmptk $" << addr << "\n";
+        break;
+      }
       case VirtualMachine::Constant16:
         std::cout << "push $" << (std::size_t) m_code[++i] << "\n";
         break;
+      case VirtualMachine::Call:
+        std::cout << "call " << (std::size_t) m_code[++i] << "\n";
+        break;
+      case VirtualMachine::TailCall:
+        std::cout << "tcall " << (std::size_t) m_code[++i] << "\n";
+        break;
+      case VirtualMachine::ArrayLiteral:
+        std::cout << "arr " << (std::size_t) m_code[++i] << "\n";
+        break;
+      case VirtualMachine::Map:
+        std::cout << "map " << (std::size_t) m_code[++i] << "\n";
+        break;
+      case VirtualMachine::ForPrep:
+        std::cout << "forp %" << (std::size_t) m_code[++i] << "\n";
+        break;
+      case VirtualMachine::ForLoop: {
+        auto addr = get_qword(i + 1);
+        std::cout << "forl %" << (std::size_t) m_code[i + 9] << " $" << addr << "\n";
+        i += 9;
+        break;
+      }
+      case VirtualMachine::BinaryLocalConst: {
+        std::cout << "binlk %" << (std::size_t) m_code[i + 1] << " $" << (std::size_t) m_code[i + 2]
+                  << " " << (std::size_t) m_code[i + 3] << "\n";
+        i += 3;
+        break;
+      }
+      case VirtualMachine::BinaryLocals: {
+        std::cout << "binll %" << (std::size_t) m_code[i + 1] << " %" << (std::size_t) m_code[i + 2]
+                  << " " << (std::size_t) m_code[i + 3] << "\n";
+        i += 3;
+        break;
+      }
+      case VirtualMachine::BinaryConst: {
+        std::cout << "bink $" << (std::size_t) m_code[i + 1] << " " << (std::size_t) m_code[i + 2] << "\n";
+        i += 2;
+        break;
+      }
+      case VirtualMachine::Math:
+      case VirtualMachine::Math2:
+        std::cout << (op == VirtualMachine::Math ? "math " : "math2 ") << du_math_name(m_code[++i]) << "\n";
+        break;
+      case VirtualMachine::GetProperty:
+      case VirtualMachine::SetProperty:
+      case VirtualMachine::InitProperty: {
+        std::size_t site = m_code[i + 2] | (m_code[i + 3] << 8);
+
+        std::cout << (op == VirtualMachine::GetProperty ? "getp" :
+                      op == VirtualMachine::SetProperty ? "setp" : "initp")
+                  << " $" << (std::size_t) m_code[i + 1] << " #" << site << "\n";
+        i += 3;
+        break;
+      }
     }
   }
 }
 
-VirtualMachine::VirtualMachine() {
-  m_stack.reserve(256);
+std::size_t VirtualMachine::instruction_size(std::uint8_t op) {
+  switch (op) {
+    case Constant16:
+    case AllocGlobal:
+    case StoreGlobal:
+    case LoadGlobal:
+    case StoreLocal:
+    case LoadLocal:
+    case PopLocal:
+    case AddStoreLocal:
+    case SubStoreLocal:
+    case MulStoreLocal:
+    case DivStoreLocal:
+    case Call:
+    case TailCall:
+    case ArrayLiteral:
+    case Map:
+    case ForPrep:
+    case Math:
+    case Math2:
+      return 2;
+    case IncLocal:
+    case BinaryConst:
+      return 3;
+    case GetProperty:
+    case BinaryLocalConst:
+    case BinaryLocals:
+    case SetProperty:
+    case InitProperty:
+      return 4;
+    case Jump:
+    case JumpIfFalse:
+    case JumpIfTrue:
+    case JumpIfFalseKeep:
+    case JumpIfTrueKeep:
+      return 9;
+    case ForLoop:
+      return 10;
+    default:
+      return 1;
+  }
+}
+
+bool VirtualMachine::is_jump(std::uint8_t op) {
+  switch (op) {
+    case Jump:
+    case JumpIfFalse:
+    case JumpIfTrue:
+    case JumpIfFalseKeep:
+    case JumpIfTrueKeep:
+    case ForLoop:
+      return true;
+    default:
+      return false;
+  }
+}
+
+VirtualMachine::VirtualMachine() : m_stdout(new Output(STDOUT_FILENO)) {
+  m_out = m_stdout.get();
+
+  m_stack.resize(STACK_SIZE);
+  m_frames.resize(FRAMES_SIZE);
+  m_sp = m_stack.data();
+  m_fp = m_stack.data();
 }
 
 VirtualMachine::~VirtualMachine() {
 }
 
+void VirtualMachine::set_jit(bool enabled) {
+  if (enabled && Jit::supported()) {
+    m_jit.reset(new Jit());
+  } else {
+    m_jit.reset();
+  }
+}
+
+void VirtualMachine::set_profile(OpProfile* profile) {
+  m_profile = profile;
+}
+
+void VirtualMachine::set_output(Output& out) {
+  m_out = &out;
+}
+
+Output& VirtualMachine::output() {
+  return *m_out;
+}
+
+void VirtualMachine::define(const std::string& name, std::uint8_t arity,
+    NativeFunction function, void* data) {
+  m_natives.push_back((Native) { name, arity, function, data });
+  m_globals[name] = Value(&m_natives.back());
+}
+
+void VirtualMachine::reset() {
+  m_globals.clear();
+
+  // Later definitions of a name win, like in define().
+  for (const Native& native : m_natives) {
+    m_globals[native.name] = Value(&native);
+  }
+
+  std::fill(m_stack.begin(), m_stack.end(), Value());
+
+  m_sp = m_stack.data();
+  m_fp = m_stack.data();
+  m_frame_count = 0;
+  m_ip = nullptr;
+  m_halt = false;
+  m_code = nullptr;
+  m_program.reset();
+
+  if (m_jit) {
+    m_jit->reset();
+  }
+}
+
+// The stack of every frame was checked to fit when it was entered.
 void VirtualMachine::push(Value value) {
-  m_stack.push_back(value);
+  *m_sp++ = std::move(value);
 }
 
 Value VirtualMachine::pop() {
-  Value value = m_stack.back();
-  m_stack.pop_back();
-
-  return value;
+  // Moving out leaves a null behind, so nothing above m_sp owns a string.
+  return std::move(*--m_sp);
 }
 
 Value VirtualMachine::neg(const Value& a) {
-  if (a.is(ValueType::Number)) {
-    return -a.as_number();
+  if (a.is(ValueType::Integer)) {
+    std::int64_t result;
+
+    if (du_sub_int(0, a.as_integer(), &result)) {
+      return result;
+    }
+  }
+
+  if (a.is_numeric()) {
+    return -a.to_double();
   }
 
   error() << "Unexpected operand type: -" << a.getType() << "\n";
@@ -168,14 +655,38 @@ Value VirtualMachine::neg(const Value& a) {
 }
 
 Value VirtualMachine::add(const Value& a, const Value& b) {
-  if (a.getType() == b.getType()) {
-    if (a.getType() == ValueType::Number) {
-      return a.as_number() + b.as_number();
-    } else if (a.getType() == ValueType::String) {
-      return a.as_string() + b.as_string();
+  if (promote(a.getType(), b.getType()) == ValueType::Integer) {
+    std::int64_t result;
+
+    if (du_add_int(a.as_integer(), b.as_integer(), &result)) {
+      return result;
     }
   }
 
+  if (a.is_numeric() && b.is_numeric()) {
+    return a.to_double() + b.to_double();
+  } else if (a.is(ValueType::String) && b.is(ValueType::String)) {
+    return a.as_string() + b.as_string();
+  } else if (a.is(ValueType::Array) && b.is(ValueType::Array)) {
+    const ArrayObject& x = a.as_array();
+    const ArrayObject& y = b.as_array();
+    ArrayObject* result = new ArrayObject();
+
+    if (x.packed && y.packed) {
+      result->numbers.reserve(x.size() + y.size());
+      result->numbers.insert(result->numbers.end(), x.numbers.begin(), x.numbers.end());
+      result->numbers.insert(result->numbers.end(), y.numbers.begin(), y.numbers.end());
+    } else {
+      result->unpack();
+      result->values.reserve(x.size() + y.size());
+
+      for (std::size_t i = 0; i < x.size(); ++i) result->values.push_back(x.get(i));
+      for (std::size_t i = 0; i < y.size(); ++i) result->values.push_back(y.get(i));
+    }
+
+    return Value(result);
+  }
+
   error() << "Unexpected operand types: " << a.getType()
           << "+" << b.getType() << "\n";
 
@@ -183,8 +694,16 @@ Value VirtualMachine::add(const Value& a, const Value& b) {
 }
 
 Value VirtualMachine::sub(const Value& a, const Value& b) {
-  if (a.is(ValueType::Number) && b.is(ValueType::Number)) {
-    return a.as_number() - b.as_number();
+  if (promote(a.getType(), b.getType()) == ValueType::Integer) {
+    std::int64_t result;
+
+    if (du_sub_int(a.as_integer(), b.as_integer(), &result)) {
+      return result;
+    }
+  }
+
+  if (a.is_numeric() && b.is_numeric()) {
+    return a.to_double() - b.to_double();
   }
 
   error() << "Unexpected operand types: " << a.getType()
@@ -193,17 +712,49 @@ Value VirtualMachine::sub(const Value& a, const Value& b) {
 }
 
 Value VirtualMachine::mul(const Value& a, const Value& b) {
-  if (a.is(ValueType::Number) && b.is(ValueType::Number)) {
-      return a.as_number() * b.as_number();
-  } else if (a.is(ValueType::String) && b.is(ValueType::Number)) {
-    std::stringstream ss("");
+  if (promote(a.getType(), b.getType()) == ValueType::Integer) {
+    std::int64_t result;
+
+    if (du_mul_int(a.as_integer(), b.as_integer(), &result)) {
+      return result;
+    }
+  }
+
+  if (a.is_numeric() && b.is_numeric()) {
+    return a.to_double() * b.to_double();
+  } else if (a.is(ValueType::String) && b.is_numeric()) {
+    std::int64_t count = b.is(ValueType::Integer) ?
+      b.as_integer() : (std::int64_t) b.as_number();
+
+    std::string result;
+    result.reserve(a.as_string().size() * std::max(count, (std::int64_t) 0));
+
+    for (std::int64_t i = 0; i < count; ++i) {
+      result += a.as_string();
+    }
+
+    return Value(result);
+  } else if (a.is(ValueType::Array) && b.is_numeric()) {
+    std::int64_t count = b.is(ValueType::Integer) ?
+      b.as_integer() : (std::int64_t) b.as_number();
 
-    for (std::size_t i = 0; i < b.as_number(); ++i) {
-      ss << a.as_string();
+    const ArrayObject& array = a.as_array();
+    ArrayObject* result = new ArrayObject();
+
+    if (!array.packed) {
+      result->unpack();
+    }
+
+    for (std::int64_t i = 0; i < count; ++i) {
+      if (array.packed) {
+        result->numbers.insert(result->numbers.end(), array.numbers.begin(), array.numbers.end());
+      } else {
+        result->values.insert(result->values.end(), array.values.begin(), array.values.end());
+      }
     }
 
-    return Value(ss.str());
-  } else if (a.is(ValueType::Number) && b.is(ValueType::String)) {
+    return Value(result);
+  } else if (a.is_numeric() && (b.is(ValueType::String) || b.is(ValueType::Array))) {
     return mul(b, a);
   }
 
@@ -213,8 +764,9 @@ Value VirtualMachine::mul(const Value& a, const Value& b) {
 }
 
 Value VirtualMachine::div(const Value& a, const Value& b) {
-  if (a.is(ValueType::Number) && b.is(ValueType::Number)) {
-    return a.as_number() / b.as_number();
+  // Division always produces a double, like Python's true division.
+  if (a.is_numeric() && b.is_numeric()) {
+    return a.to_double() / b.to_double();
   }
 
   error() << "Unexpected operand types: " << a.getType()
@@ -223,8 +775,16 @@ Value VirtualMachine::div(const Value& a, const Value& b) {
 }
 
 Value VirtualMachine::exp(const Value& a, const Value& b) {
-  if (a.is(ValueType::Number) && b.is(ValueType::Number)) {
-    return std::pow(a.as_number(), b.as_number());
+  if (promote(a.getType(), b.getType()) == ValueType::Integer && b.as_integer() >= 0) {
+    std::int64_t result;
+
+    if (du_pow_int(a.as_integer(), b.as_integer(), &result)) {
+      return result;
+    }
+  }
+
+  if (a.is_numeric() && b.is_numeric()) {
+    return std::pow(a.to_double(), b.to_double());
   }
 
   error() << "Unexpected operand types: " << a.getType()
@@ -264,8 +824,12 @@ Value VirtualMachine::logical_or(const Value& a, const Value& b) {
 Value VirtualMachine::logical_equals(const Value& a, const Value& b) {
   if (a.is(ValueType::Bool) && b.is(ValueType::Bool)) {
     return a.as_bool() == b.as_bool();
-  } else if (a.is(ValueType::Number) && b.is(ValueType::Number)) {
-    return a.as_number() == b.as_number();
+  } else if (a.is(ValueType::Symbol) && b.is(ValueType::Symbol)) {
+    return a.as_symbol() == b.as_symbol();
+  } else if (promote(a.getType(), b.getType()) == ValueType::Integer) {
+    return a.as_integer() == b.as_integer();
+  } else if (a.is_numeric() && b.is_numeric()) {
+    return a.to_double() == b.to_double();
   }
 
   error() << "Unexpected operand type: " << a.getType()
@@ -274,8 +838,10 @@ Value VirtualMachine::logical_equals(const Value& a, const Value& b) {
 }
 
 Value VirtualMachine::logical_greater(const Value& a, const Value& b) {
-  if (a.is(ValueType::Number) && b.is(ValueType::Number)) {
-    return a.as_number() > b.as_number();
+  if (promote(a.getType(), b.getType()) == ValueType::Integer) {
+    return a.as_integer() > b.as_integer();
+  } else if (a.is_numeric() && b.is_numeric()) {
+    return a.to_double() > b.to_double();
   }
 
   error() << "Unexpected operand type: " << a.getType()
@@ -284,12 +850,14 @@ Value VirtualMachine::logical_greater(const Value& a, const Value& b) {
 }
 
 Value VirtualMachine::logical_less(const Value& a, const Value& b) {
-  if (a.is(ValueType::Number) && b.is(ValueType::Number)) {
-    return a.as_number() < b.as_number();
+  if (promote(a.getType(), b.getType()) == ValueType::Integer) {
+    return a.as_integer() < b.as_integer();
+  } else if (a.is_numeric() && b.is_numeric()) {
+    return a.to_double() < b.to_double();
   }
 
   error() << "Unexpected operand type: " << a.getType()
-          << " > " << b.getType() << "\n";
+          << " < " << b.getType() << "\n";
   return Value(ValueType::Error);
 }
 
@@ -323,195 +891,1048 @@ void VirtualMachine::store_global(const Value& name, const Value& value) {
 
 
 void VirtualMachine::load_global(const Value& name) {
+  const Value* value = find_global(name);
+
+  if (value != nullptr) {
+    push(*value);
+  }
+}
+
+const Value* VirtualMachine::find_global(const Value& name) {
   if (!name.is(ValueType::String)) {
     error() << "Unexpected global name type: " << name.getType() << ".\n";
-    return;
+    return nullptr;
   }
 
   auto global = m_globals.find(name.as_string());
 
   if (global == m_globals.end()) {
     error() << "Name '" << name << "' is not known" << ".\n";
-    return;
+    return nullptr;
   }
 
-  push(global->second);
+  return &global->second;
+}
+
+Value VirtualMachine::execute(Program program) {
+  load(program);
+  return run() == Status::Finished ? Value(true) : Value(ValueType::Error);
 }
 
 Value VirtualMachine::execute(const Bytecode* code) {
+  load(code);
+  return run() == Status::Finished ? Value(true) : Value(ValueType::Error);
+}
+
+void VirtualMachine::load(Program program) {
+  m_program = program;
+  load(m_program.get());
+}
+
+void VirtualMachine::load(const Bytecode* code) {
+  if (m_jit && m_code != code) {
+    m_jit->reset();
+  }
+
+  if (m_code != code || m_property_caches.size() != code->get_property_sites()) {
+    m_property_caches.assign(code->get_property_sites(), PropertyCache());
+  }
+
   m_code = code;
   m_ip = code->get_code().data();
+  m_sp = m_stack.data();
+  m_fp = m_stack.data();
+  m_frame_count = 0;
+  m_halt = false;
+
+  // Handlers don't check their operands or the stack, see Verifier.
+  if (!code->is_verified()) {
+    m_out->stream() << "Error: bytecode wasn't verified\n";
+    m_halt = true;
+  } else if (code->get_max_stack() > m_stack.size()) {
+    error() << "Stack overflow\n";
+  } else if (code->get_format() == Bytecode::Format::Register) {
+    // The top level's registers are in use from the start.
+    m_sp = m_fp + code->get_max_stack();
+  }
+}
 
-  auto read_const = [&]() {
-    return code->get_const(*m_ip++);
-  };
+VirtualMachine::Status VirtualMachine::run(std::int64_t fuel) {
+  m_fuel = fuel;
 
-  auto read_qword = [&]() {
-    QwordToBytes qtb;
+  bool registers = m_code != nullptr && m_code->get_format() == Bytecode::Format::Register;
 
-    std::copy(m_ip, m_ip + 8, qtb.bytes);
-    m_ip += 8;
+  while (m_ip != nullptr && !m_halt) {
+    if (m_fuel-- <= 0) {
+      return Status::Yielded;
+    }
 
-    return qtb.qword;
-  };
+    if (m_profile != nullptr && !registers) {
+      m_profile->record(m_ip - m_code->get_code().data(), *m_ip);
+    }
 
-  while (m_ip != nullptr && !m_halt) {
-    std::uint8_t op = *m_ip++;
+    if (!(registers ? dispatch_register(*m_ip++) : dispatch(*m_ip++))) {
+      m_ip = nullptr;
+      m_out->flush();
+      return Status::Finished;
+    }
+  }
 
-    switch (op) {
-      case Return:
-        return true;
-      case Constant16: {
-        Value value = read_const();
-        push(value);
-        break;
-      }
-      case Pop: {
-        pop();
-        break;
-      }
-      case Negate:
-        push(neg(pop())); break;
-      case Add: {
-        Value b = pop();
-        Value a = pop();
-        push(add(a, b));
+  halt();
+  m_out->flush();
+  return Status::Error;
+}
 
-        break;
-      }
-      case Subtract: {
-        Value b = pop();
-        Value a = pop();
-        push(sub(a, b));
+const Value& VirtualMachine::read_const() {
+  return m_code->get_const(*m_ip++);
+}
 
-        break;
-      }
-      case Divide: {
-        Value b = pop();
-        Value a = pop();
-        push(div(a, b));
+std::size_t VirtualMachine::read_qword() {
+  QwordToBytes qtb;
 
-        break;
-      }
-      case Multiply: {
-        Value b = pop();
-        Value a = pop();
-        push(mul(a, b));
+  std::copy(m_ip, m_ip + 8, qtb.bytes);
+  m_ip += 8;
 
-        break;
-      }
-      case Exp: {
-        Value b = pop();
-        Value a = pop();
-        push(exp(a, b));
+  return qtb.qword;
+}
+
+// Property sites are numbered with 16 bits, low byte first.
+VirtualMachine::PropertyCache& VirtualMachine::read_site() {
+  std::size_t site = m_ip[0] | (m_ip[1] << 8);
+  m_ip += 2;
+
+  return m_property_caches[site];
+}
+
+void VirtualMachine::jump(std::size_t address, std::size_t size) {
+  const std::uint8_t* target = m_code->get_code().data() + address;
+
+  if (m_jit && target < m_ip) {
+    const std::uint8_t* resume = m_jit->backedge(this, m_ip - size, target);
+
+    if (resume != nullptr || m_halt) {
+      m_ip = resume;
+      return;
+    }
+  }
+
+  m_ip = target;
+}
+
+// Result of one of the AddNum..GreaterNum instructions. Integers stay
+// integers unless the result overflows, like add() and friends.
+Value VirtualMachine::numeric(std::uint8_t op, const Value& a, const Value& b) {
+  if (a.is(ValueType::Integer) && b.is(ValueType::Integer)) {
+    std::int64_t x = a.as_integer();
+    std::int64_t y = b.as_integer();
+    std::int64_t result;
+
+    switch (op) {
+      case VirtualMachine::AddNum: if (du_add_int(x, y, &result)) return result; break;
+      case VirtualMachine::SubNum: if (du_sub_int(x, y, &result)) return result; break;
+      case VirtualMachine::MulNum: if (du_mul_int(x, y, &result)) return result; break;
+      case VirtualMachine::LessNum: return x < y;
+      case VirtualMachine::GreaterNum: return x > y;
+    }
+  }
+
+  double x = a.to_double();
+  double y = b.to_double();
+
+  switch (op) {
+    case VirtualMachine::AddNum: return x + y;
+    case VirtualMachine::SubNum: return x - y;
+    case VirtualMachine::MulNum: return x * y;
+    case VirtualMachine::DivNum: return x / y;
+    case VirtualMachine::LessNum: return x < y;
+    default: return x > y;
+  }
+}
+
+Value VirtualMachine::binary_op(std::uint8_t op, const Value& a, const Value& b) {
+  switch (op) {
+    case Add: return add(a, b);
+    case Subtract: return sub(a, b);
+    case Multiply: return mul(a, b);
+    case Divide: return div(a, b);
+    case Exp: return exp(a, b);
+    case Equal: return logical_equals(a, b);
+    case Less: return logical_less(a, b);
+    case Greater: return logical_greater(a, b);
+    default: return numeric(op, a, b);
+  }
+}
+
+// Functions print with their name, unlike in arrays and objects.
+void VirtualMachine::print(const Value& value) {
+  if (value.is(ValueType::Function) || value.is(ValueType::Native)) {
+    m_out->write("<function ", 10);
+    m_out->write(value.is(ValueType::Native) ? value.as_native().name :
+        m_code->get_function(value.as_function()).name);
+    m_out->put('>');
+  } else {
+    m_out->write_value(value);
+  }
+
+  m_out->put('\n');
+}
+
+Value VirtualMachine::math(std::uint8_t function, const Value& a, const Value& b) {
+  std::int64_t result;
+
+  switch (function) {
+    case DU_MATH_FLOOR:
+    case DU_MATH_CEIL:
+    case DU_MATH_ROUND:
+      if (a.is(ValueType::Integer)) return a;
+      if (du_round_int(function, a.as_number(), &result)) return result;
+      break;
+    case DU_MATH_ABS:
+      if (a.is(ValueType::Integer) && a.as_integer() != INT64_MIN) {
+        return a.as_integer() < 0 ? -a.as_integer() : a.as_integer();
+      }
+      break;
+    case DU_MATH_MIN:
+    case DU_MATH_MAX: {
+      bool min = function == DU_MATH_MIN;
+
+      if (a.is(ValueType::Integer) && b.is(ValueType::Integer)) {
+        return (a.as_integer() < b.as_integer()) == min ? a : b;
+      }
+
+      return min ? std::fmin(a.to_double(), b.to_double()) : std::fmax(a.to_double(), b.to_double());
+    }
+  }
+
+  return du_math_double(function, a.to_double());
+}
+
+Value VirtualMachine::math_op(std::uint8_t function, const Value& a, const Value& b) {
+  bool binary = function == DU_MATH_MIN || function == DU_MATH_MAX;
+
+  if (a.is_numeric() && (!binary || b.is_numeric())) {
+    return math(function, a, b);
+  }
+
+  if (binary) {
+    error() << "Unexpected operand types: " << du_math_name(function) << "(" << a.getType()
+            << ", " << b.getType() << ")\n";
+  } else {
+    error() << "Unexpected operand type: " << du_math_name(function) << "(" << a.getType() << ")\n";
+  }
+
+  return Value(ValueType::Error);
+}
+
+// Executes the instruction op, m_ip points right after its opcode.
+// Returns false once the program returns.
+bool VirtualMachine::dispatch(std::uint8_t op) {
+  switch (op) {
+    case Return:
+      return ret();
+    case Constant16: {
+      push(read_const());
+      break;
+    }
+    case Pop: {
+      pop();
+      break;
+    }
+    case Negate:
+      push(neg(pop())); break;
+    case Add: {
+      Value b = pop();
+      Value a = pop();
+      push(add(a, b));
+
+      break;
+    }
+    case Subtract: {
+      Value b = pop();
+      Value a = pop();
+      push(sub(a, b));
+
+      break;
+    }
+    case Divide: {
+      Value b = pop();
+      Value a = pop();
+      push(div(a, b));
+
+      break;
+    }
+    case Multiply: {
+      Value b = pop();
+      Value a = pop();
+      push(mul(a, b));
+
+      break;
+    }
+    case Exp: {
+      Value b = pop();
+      Value a = pop();
+      push(exp(a, b));
+
+      break;
+    }
+    case Not: {
+      Value a = pop();
+      push(logical_not(a));
+      break;
+    }
+    case And: {
+      Value b = pop();
+      Value a = pop();
+      push(logical_and(a, b));
+      break;
+    }
+    case Or: {
+      Value b = pop();
+      Value a = pop();
+      push(logical_or(a, b));
+      break;
+    }
+    case Equal: {
+      Value b = pop();
+      Value a = pop();
+      push(logical_equals(a, b));
+      break;
+    }
+    case Greater: {
+      Value b = pop();
+      Value a = pop();
+      push(logical_greater(a, b));
+      break;
+    }
+    case Less: {
+      Value b = pop();
+      Value a = pop();
+      push(logical_less(a, b));
+      break;
+    }
+    case AddNum:
+    case SubNum:
+    case MulNum:
+    case DivNum:
+    case LessNum:
+    case GreaterNum: {
+      Value b = pop();
+      m_sp[-1] = numeric(op, m_sp[-1], b);
+      break;
+    }
+    case Print:
+      print(pop());
+      break;
+    case LoadNull: {
+      push(Value());
+      break;
+    }
+    case AllocGlobal: {
+      const Value& name = read_const();
+      alloc_global(name);
+      break;
+    }
+    case StoreGlobal: {
+      Value value = pop();
+      const Value& name = read_const();
+
+      store_global(name, value);
+      break;
+    }
+    case LoadGlobal: {
+      const Value& name = read_const();
+      load_global(name);
+      break;
+    }
+    case StoreLocal: {
+      auto stack_offset = *m_ip++;
+      m_fp[stack_offset] = m_sp[-1];
+      break;
+    }
+    case LoadLocal: {
+      auto stack_offset = *m_ip++;
+      push(m_fp[stack_offset]);
+      break;
+    }
+    case PopLocal: {
+      auto stack_offset = *m_ip++;
+      m_fp[stack_offset] = pop();
+      break;
+    }
+    case IncLocal: {
+      Value& local = m_fp[*m_ip++];
+      local = add(local, read_const());
+      break;
+    }
+    case AddStoreLocal: {
+      Value& local = m_fp[*m_ip++];
+      local = add(local, pop());
+      break;
+    }
+    case SubStoreLocal: {
+      Value& local = m_fp[*m_ip++];
+      local = sub(local, pop());
+      break;
+    }
+    case MulStoreLocal: {
+      Value& local = m_fp[*m_ip++];
+      local = mul(local, pop());
+      break;
+    }
+    case DivStoreLocal: {
+      Value& local = m_fp[*m_ip++];
+      local = div(local, pop());
+      break;
+    }
+    case Call: {
+      auto argc = *m_ip++;
+      call(argc);
+      break;
+    }
+    case TailCall: {
+      auto argc = *m_ip++;
+      tail_call(argc);
+      break;
+    }
+    case ArrayLiteral: {
+      std::size_t count = *m_ip++;
+      Value* elements = m_sp - count;
+      ArrayObject* array = new ArrayObject();
+
+      bool packed = std::all_of(elements, m_sp, [](const Value& v) {
+        return v.is(ValueType::Number);
+      });
+
+      if (packed) {
+        array->numbers.reserve(count);
+
+        for (Value* v = elements; v != m_sp; ++v) {
+          array->numbers.push_back(v->as_number());
+        }
+      } else {
+        array->unpack();
+        array->values.assign(std::make_move_iterator(elements), std::make_move_iterator(m_sp));
+      }
+
+      while (m_sp > elements) {
+        *--m_sp = Value();
+      }
+
+      push(Value(array));
+      break;
+    }
+    case LoadIndex: {
+      Value index = pop();
+      Value array = pop();
+
+      // o[@x] is o.x with a computed name.
+      if (array.is(ValueType::Object)) {
+        const Value* value = check_key(index) ? array.as_object().get(index.as_symbol()) : nullptr;
+
+        if (value != nullptr) {
+          push(*value);
+        } else if (!m_halt) {
+          error() << "Object has no property '" << index << "'\n";
+        }
 
         break;
       }
-      case Not: {
-        Value a = pop();
-        push(logical_not(a));
-        break;
-      }
-      case And: {
-        Value b = pop();
-        Value a = pop();
-        push(logical_and(a, b));
-        break;
-      }
-      case Or: {
-        Value b = pop();
-        Value a = pop();
-        push(logical_or(a, b));
-        break;
-      }
-      case Equal: {
-        Value b = pop();
-        Value a = pop();
-        push(logical_equals(a, b));
-        break;
-      }
-      case Greater: {
-        Value b = pop();
-        Value a = pop();
-        push(logical_greater(a, b));
-        break;
-      }
-      case Less: {
-        Value b = pop();
-        Value a = pop();
-        push(logical_less(a, b));
-        break;
-      }
-      case Print: {
-        Value a = pop();
-        std::cout << a << "\n";
+
+      ArrayObject* a = array_operand(array, "index");
+
+      if (a != nullptr && check_index(*a, index)) {
+        push(a->get(index.as_integer()));
+      }
+
+      break;
+    }
+    case StoreIndex: {
+      Value value = pop();
+      Value index = pop();
+      Value array = pop();
+
+      if (array.is(ValueType::Object)) {
+        if (check_key(index)) {
+          array.as_object().set(index.as_symbol(), value);
+        }
+
         break;
       }
-      case LoadNull: {
+
+      ArrayObject* a = array_operand(array, "index");
+
+      if (a != nullptr && check_index(*a, index)) {
+        a->set(index.as_integer(), value);
+      }
+
+      break;
+    }
+    case Length: {
+      Value a = pop();
+
+      if (a.is(ValueType::String)) {
+        push((std::int64_t) a.as_string().size());
+      } else if (a.is(ValueType::Array)) {
+        push((std::int64_t) a.as_array().size());
+      } else {
+        error() << "Unexpected operand type: len(" << a.getType() << ")\n";
+      }
+
+      break;
+    }
+    case Sum:
+    case Min:
+    case Max: {
+      Value a = pop();
+      ArrayObject* array = array_operand(a, op == Sum ? "sum" : op == Min ? "min" : "max");
+
+      if (array != nullptr) {
+        push(reduce(op, *array));
+      }
+
+      break;
+    }
+    case Fill: {
+      Value value = pop();
+      Value a = pop();
+      ArrayObject* array = array_operand(a, "fill");
+
+      if (array != nullptr) {
+        array->fill(value);
         push(Value());
-        break;
       }
-      case AllocGlobal: {
-        Value name = read_const();
-        alloc_global(name);
-        break;
+
+      break;
+    }
+    case Map: {
+      auto arith = *m_ip++;
+      Value b = pop();
+      Value a = pop();
+      ArrayObject* array = array_operand(a, "map");
+
+      if (array != nullptr) {
+        push(map(arith, *array, b));
       }
-      case StoreGlobal: {
-        Value value = pop();
-        Value name = read_const();
 
-        store_global(name, value);
-        break;
+      break;
+    }
+    case Append: {
+      Value value = pop();
+      Value a = pop();
+      ArrayObject* array = array_operand(a, "push");
+
+      if (array != nullptr) {
+        array->push(value);
+        push(Value());
       }
-      case LoadGlobal: {
-        Value name = read_const();
-        load_global(name);
+
+      break;
+    }
+    case NewObject: {
+      push(Value(new ObjectObject()));
+      break;
+    }
+    case Math: {
+      std::uint8_t function = *m_ip++;
+      m_sp[-1] = math_op(function, m_sp[-1], Value());
+      break;
+    }
+    case Math2: {
+      std::uint8_t function = *m_ip++;
+      Value b = pop();
+      m_sp[-1] = math_op(function, m_sp[-1], b);
+      break;
+    }
+    case GetProperty: {
+      const Value& name = read_const();
+      PropertyCache& cache = read_site();
+      Value object = pop();
+
+      if (!object.is(ValueType::Object)) {
+        error() << "Can't read property '" << name << "' of " << object.getType() << "\n";
         break;
       }
-      case StoreLocal: {
-        auto stack_offset = *m_ip++;
-        m_stack[stack_offset] = m_stack.back();
+
+      ObjectObject& o = object.as_object();
+      PropertyCache::Entry entry = lookup_property(cache, o.shape, name, false);
+
+      if (entry.shape == nullptr) {
+        error() << "Object has no property '" << name << "'\n";
         break;
       }
-      case LoadLocal: {
-        auto stack_offset = *m_ip++;
-        push(m_stack[stack_offset]);
-        break;
+
+      push(o.slots[entry.slot]);
+      break;
+    }
+    case SetProperty: {
+      const Value& name = read_const();
+      PropertyCache& cache = read_site();
+      Value value = pop();
+      Value object = pop();
+
+      set_property(cache, object, name, value);
+      break;
+    }
+    case InitProperty: {
+      // Like SetProperty, but keeps the object for the next field of the
+      // literal.
+      const Value& name = read_const();
+      PropertyCache& cache = read_site();
+      Value value = pop();
+
+      set_property(cache, m_sp[-1], name, value);
+      break;
+    }
+    case Jump: {
+      auto offset = read_qword();
+      jump(offset);
+      break;
+    }
+    case JumpIfFalse: {
+      auto offset = read_qword();
+
+      if (!pop().as_bool()) {
+        jump(offset);
       }
-      case Jump: {
-        auto offset = read_qword();
-        m_ip = code->get_code().data() + offset;
-        break;
+
+      break;
+    }
+    case JumpIfTrue: {
+      auto offset = read_qword();
+
+      if (pop().as_bool()) {
+        jump(offset);
       }
-      case JumpIfFalse: {
-        auto offset = read_qword();
 
-        if (!pop().as_bool()) {
-          m_ip = code->get_code().data() + offset;
-        }
+      break;
+    }
+    case JumpIfFalseKeep: {
+      auto offset = read_qword();
+      const Value& a = m_sp[-1];
+
+      if (!a.is(ValueType::Bool)) {
+        error() << "Unexpected operand type: " << a.getType() << " and ...\n";
+      } else if (!a.as_bool()) {
+        jump(offset);
+      }
 
-        break;
+      break;
+    }
+    case JumpIfTrueKeep: {
+      auto offset = read_qword();
+      const Value& a = m_sp[-1];
+
+      if (!a.is(ValueType::Bool)) {
+        error() << "Unexpected operand type: " << a.getType() << " or ...\n";
+      } else if (a.as_bool()) {
+        jump(offset);
       }
-      default: error() << "Unexpected op: " << (std::size_t) op << "\n";
+
+      break;
+    }
+    case ForPrep: {
+      auto stack_offset = *m_ip++;
+      push(for_prep(m_fp + stack_offset));
+      break;
     }
+    case ForLoop: {
+      auto offset = read_qword();
+      auto stack_offset = *m_ip++;
+
+      if (for_loop(m_fp + stack_offset)) {
+        jump(offset, 10);
+      }
+
+      break;
+    }
+    case BinaryLocalConst: {
+      const Value& a = m_fp[m_ip[0]];
+      const Value& b = m_code->get_const(m_ip[1]);
+      std::uint8_t arith = m_ip[2];
+      m_ip += 3;
+
+      push(binary_op(arith, a, b));
+      break;
+    }
+    case BinaryLocals: {
+      const Value& a = m_fp[m_ip[0]];
+      const Value& b = m_fp[m_ip[1]];
+      std::uint8_t arith = m_ip[2];
+      m_ip += 3;
+
+      push(binary_op(arith, a, b));
+      break;
+    }
+    case BinaryConst: {
+      const Value& b = m_code->get_const(m_ip[0]);
+      std::uint8_t arith = m_ip[1];
+      m_ip += 2;
+
+      m_sp[-1] = binary_op(arith, m_sp[-1], b);
+      break;
+    }
+    default: error() << "Unexpected op: " << (std::size_t) op << "\n";
   }
 
-  halt();
-  return Value(ValueType::Error);
+  return true;
+}
+
+// Checks the loop's range before the first iteration. Integer ranges
+// count with integers, anything else is converted to doubles. Returns
+// whether the body runs at all, in which case the variable is set.
+bool VirtualMachine::for_prep(Value* loop) {
+  Value& counter = loop[0];
+  Value& limit = loop[1];
+  Value& step = loop[2];
+
+  if (!counter.is_numeric() || !limit.is_numeric() || !step.is_numeric()) {
+    error() << "Unexpected range types: " << counter.getType() << ".." << limit.getType()
+            << " step " << step.getType() << "\n";
+    return false;
+  }
+
+  if (!counter.is(ValueType::Integer) || !limit.is(ValueType::Integer) ||
+      !step.is(ValueType::Integer)) {
+    counter = counter.to_double();
+    limit = limit.to_double();
+    step = step.to_double();
+  }
+
+  if (step.to_double() == 0) {
+    error() << "Range step must not be zero\n";
+    return false;
+  }
+
+  bool enter = step.to_double() > 0 ? logical_less(counter, limit).as_bool()
+                                     : logical_greater(counter, limit).as_bool();
+
+  if (enter) {
+    loop[3] = counter;
+  }
+
+  return enter;
+}
+
+// Advances the counter, returns whether there is another iteration. An
+// integer counter that overflows is past any limit.
+bool VirtualMachine::for_loop(Value* loop) {
+  Value& counter = loop[0];
+  const Value& limit = loop[1];
+  const Value& step = loop[2];
+
+  bool more;
+
+  if (counter.is(ValueType::Integer)) {
+    std::int64_t next;
+
+    if (!du_add_int(counter.as_integer(), step.as_integer(), &next)) {
+      return false;
+    }
+
+    counter = next;
+    more = step.as_integer() > 0 ? next < limit.as_integer() : next > limit.as_integer();
+  } else {
+    double next = counter.as_number() + step.as_number();
+
+    counter = next;
+    more = step.as_number() > 0 ? next < limit.as_number() : next > limit.as_number();
+  }
+
+  if (more) {
+    loop[3] = counter;
+  }
+
+  return more;
+}
+
+const Function* VirtualMachine::callee(std::size_t argc) {
+  const Value& value = m_sp[-(std::ptrdiff_t) argc - 1];
+
+  if (!value.is(ValueType::Function)) {
+    error() << "Can't call a value of type " << value.getType() << ".\n";
+    return nullptr;
+  }
+
+  const Function& function = m_code->get_function(value.as_function());
+
+  if (function.arity != argc) {
+    error() << "Function '" << function.name << "' expects " << (std::size_t) function.arity
+            << " arguments, got " << argc << ".\n";
+    return nullptr;
+  }
+
+  return &function;
+}
+
+bool VirtualMachine::fits(const Value* base, const Function& function) const {
+  return function.max_stack <= (std::size_t) (m_stack.data() + m_stack.size() - base);
+}
+
+void VirtualMachine::call(std::size_t argc) {
+  Value* callee = m_sp - argc - 1;
+
+  if (callee->is(ValueType::Native)) {
+    call_native(callee, argc);
+
+    while (m_sp > callee + 1) {
+      *--m_sp = Value();
+    }
+
+    return;
+  }
+
+  const Function* function = this->callee(argc);
+
+  if (function == nullptr) return;
+
+  if (m_frame_count == m_frames.size() || !fits(m_sp - argc, *function)) {
+    error() << "Stack overflow\n";
+    return;
+  }
+
+  m_frames[m_frame_count++] = (CallFrame) { .return_ip = m_ip, .base = m_fp };
+
+  m_fp = m_sp - argc;
+  m_ip = m_code->get_code().data() + function->entry;
+}
+
+// Replaces the current frame: callee and arguments are moved down over the
+// frame's callee and everything above it is dropped.
+void VirtualMachine::tail_call(std::size_t argc) {
+  // Natives don't need a frame, the caller returns their result.
+  if (m_sp[-(std::ptrdiff_t) argc - 1].is(ValueType::Native)) {
+    call(argc);
+
+    if (!m_halt) ret();
+    return;
+  }
+
+  const Function* function = callee(argc);
+
+  if (function == nullptr) return;
+
+  if (!fits(m_fp, *function)) {
+    error() << "Stack overflow\n";
+    return;
+  }
+
+  Value* from = m_sp - argc - 1;
+  Value* to = m_fp - 1;
+
+  for (std::size_t i = 0; i <= argc; ++i) {
+    to[i] = std::move(from[i]);
+  }
+
+  while (m_sp > to + argc + 1) {
+    *--m_sp = Value();
+  }
+
+  m_ip = m_code->get_code().data() + function->entry;
+}
+
+void VirtualMachine::call_native(Value* callee, std::size_t argc) {
+  const Native& native = callee->as_native();
+
+  if (native.arity != Native::VARIADIC && native.arity != argc) {
+    error() << "Function '" << native.name << "' expects " << (std::size_t) native.arity
+            << " arguments, got " << argc << ".\n";
+    return;
+  }
+
+  // Natives aren't reference counted, the callee can be overwritten while
+  // native is still in use.
+  *callee = Value();
+  native.function(*this, Arguments(callee + 1, argc), *callee, native.data);
+}
+
+// Returns false once the top level returns.
+bool VirtualMachine::ret() {
+  if (m_frame_count == 0) {
+    return false;
+  }
+
+  Value result = pop();
+
+  // Drops locals, arguments and the callee.
+  while (m_sp > m_fp - 1) {
+    *--m_sp = Value();
+  }
+
+  const CallFrame& frame = m_frames[--m_frame_count];
+
+  m_ip = frame.return_ip;
+  m_fp = frame.base;
+
+  *m_sp++ = std::move(result);
+  return true;
+}
+
+VirtualMachine::PropertyCache::Entry VirtualMachine::lookup_property(PropertyCache& cache,
+    const Shape* shape, const Value& name, bool add) {
+  for (std::size_t i = 0; i < cache.count; ++i) {
+    if (cache.entries[i].shape == shape) {
+      return cache.entries[i];
+    }
+  }
+
+  int slot = shape->find(name.as_symbol());
+  PropertyCache::Entry entry { shape, nullptr, (std::uint32_t) slot };
+
+  if (slot < 0 && add) {
+    entry.transition = shape->with(name.as_symbol());
+    entry.slot = (std::uint32_t) shape->size();
+  } else if (slot < 0) {
+    entry.shape = nullptr;
+    return entry;
+  }
+
+  if (cache.count < PropertyCache::WAYS) {
+    cache.entries[cache.count++] = entry;
+  }
+
+  return entry;
+}
+
+void VirtualMachine::set_property(PropertyCache& cache, const Value& object,
+    const Value& name, const Value& value) {
+  if (!object.is(ValueType::Object)) {
+    error() << "Can't set property '" << name << "' of " << object.getType() << "\n";
+    return;
+  }
+
+  ObjectObject& o = object.as_object();
+  PropertyCache::Entry entry = lookup_property(cache, o.shape, name, true);
+
+  if (entry.transition != nullptr) {
+    o.shape = entry.transition;
+    o.slots.push_back(value);
+  } else {
+    o.slots[entry.slot] = value;
+  }
+}
+
+ArrayObject* VirtualMachine::array_operand(const Value& value, const char* what) {
+  if (!value.is(ValueType::Array)) {
+    error() << "Unexpected operand type: " << what << "(" << value.getType() << ")\n";
+    return nullptr;
+  }
+
+  return &value.as_array();
+}
+
+bool VirtualMachine::check_index(const ArrayObject& array, const Value& index) {
+  if (!index.is(ValueType::Integer)) {
+    error() << "Unexpected index type: " << index.getType() << "\n";
+    return false;
+  }
+
+  if (index.as_integer() < 0 || (std::size_t) index.as_integer() >= array.size()) {
+    error() << "Index " << index.as_integer() << " out of bounds for array of length "
+            << array.size() << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+bool VirtualMachine::check_key(const Value& key) {
+  if (!key.is(ValueType::Symbol)) {
+    error() << "Unexpected key type: " << key.getType() << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+Value VirtualMachine::reduce(std::uint8_t op, const ArrayObject& array) {
+  if (array.size() == 0) {
+    if (op == Sum) {
+      return (std::int64_t) 0;
+    }
+
+    error() << (op == Min ? "min" : "max") << "() of an empty array\n";
+    return Value(ValueType::Error);
+  }
+
+  if (array.packed) {
+    const double* numbers = array.numbers.data();
+    std::size_t n = array.numbers.size();
+
+    switch (op) {
+      case Sum: return du_sum_doubles(numbers, n);
+      case Min: return du_min_doubles(numbers, n);
+      default: return du_max_doubles(numbers, n);
+    }
+  }
+
+  Value result = array.values[0];
+
+  for (std::size_t i = 1; i < array.values.size() && !m_halt; ++i) {
+    const Value& v = array.values[i];
+
+    switch (op) {
+      case Sum: result = add(result, v); break;
+      case Min: if (logical_less(v, result).as_bool()) result = v; break;
+      default: if (logical_greater(v, result).as_bool()) result = v; break;
+    }
+  }
+
+  return result;
+}
+
+Value VirtualMachine::map(std::uint8_t op, const ArrayObject& a, const Value& b) {
+  bool array = b.is(ValueType::Array);
+  std::size_t n = a.size();
+
+  if (array && b.as_array().size() != n) {
+    error() << "map() of arrays of length " << n << " and " << b.as_array().size() << "\n";
+    return Value(ValueType::Error);
+  }
+
+  char symbol = op == Add ? '+' : op == Subtract ? '-' : op == Multiply ? '*' : '/';
+
+  ArrayObject* result = new ArrayObject();
+
+  if (a.packed && (array ? b.as_array().packed : b.is_numeric())) {
+    double scalar = array ? 0 : b.to_double();
+
+    result->numbers.resize(n);
+    du_map_doubles(result->numbers.data(), a.numbers.data(),
+        array ? b.as_array().numbers.data() : &scalar, array ? 1 : 0, n, symbol);
+
+    return Value(result);
+  }
+
+  Value (VirtualMachine::*apply)(const Value&, const Value&) =
+    op == Add ? &VirtualMachine::add : op == Subtract ? &VirtualMachine::sub :
+    op == Multiply ? &VirtualMachine::mul : &VirtualMachine::div;
+
+  // Takes over the new array, so it's freed if an element fails.
+  Value value(result);
+  result->unpack();
+  result->values.reserve(n);
+
+  for (std::size_t i = 0; i < n && !m_halt; ++i) {
+    result->values.push_back((this->*apply)(a.get(i), array ? b.as_array().get(i) : b));
+  }
+
+  return value;
 }
 
 void VirtualMachine::halt() {
-  m_stack.clear();
+  m_sp = m_stack.data();
   m_ip = nullptr;
   m_halt = true;
   m_code = nullptr;
 }
 
 std::ostream& VirtualMachine::error() {
+  // m_ip is past the failing instruction, its last byte has its line.
   std::size_t offset = (std::size_t) (m_ip - m_code->m_code.data());
-  std::cout << "Runtime error on " << m_code->m_lines[offset] << ":" << offset << ": ";
+  std::ostream& out = m_out->stream();
+  out << "Runtime error on " << m_code->m_lines[offset > 0 ? offset - 1 : 0] << ":" << offset << ": ";
 
   m_halt = true;
 
-  return std::cout;
+  return out;
 }
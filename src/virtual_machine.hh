@@ -1,6 +1,9 @@
 #pragma once
 
 #include <cstdint>
+#include <deque>
+#include <istream>
+#include <memory>
 #include <string>
 #include <vector>
 #include <ostream>
@@ -8,6 +11,10 @@
 
 #include "value.hh"
 
+class Jit;
+class OpProfile;
+class Output;
+
 struct QwordToBytes {
   union {
     std::uint8_t bytes[8];
@@ -15,38 +22,129 @@ struct QwordToBytes {
   };
 };
 
+struct Function {
+  std::string name;
+  std::uint8_t arity;
+
+  // Address of the first instruction of the body.
+  std::size_t entry;
+
+  // Deepest the frame's stack gets, arguments included, or the number of
+  // registers it uses. Set by the Verifier.
+  std::size_t max_stack;
+};
+
+class VirtualMachine;
+
+// Arguments of a native function: a view of the caller's stack, valid until
+// the function returns.
+class Arguments {
+public:
+  Arguments(const Value* data, std::size_t size) : m_data(data), m_size(size) {}
+
+  std::size_t size() const { return m_size; }
+  const Value& operator [](std::size_t index) const { return m_data[index]; }
+
+  const Value* begin() const { return m_data; }
+  const Value* end() const { return m_data + m_size; }
+
+private:
+  const Value* m_data;
+  std::size_t m_size;
+};
+
+// Host function callable from scripts, see VirtualMachine::define(). The
+// result is written in place of the callee and is null on entry. Errors are
+// reported with vm.error(), which stops the program once the function
+// returns. data is the pointer given to define().
+typedef void (*NativeFunction)(VirtualMachine& vm, Arguments args, Value& result, void* data);
+
+struct Native {
+  // Natives defined with this arity take any number of arguments.
+  static const std::uint8_t VARIADIC = 0xFF;
+
+  std::string name;
+  std::uint8_t arity;
+  NativeFunction function;
+  void* data;
+};
+
 class Bytecode {
 public:
+  // Instruction set of the code: the stack VM's Instructions or the
+  // register VM's reg::Instructions.
+  enum class Format : std::uint8_t {
+    Stack,
+    Register,
+  };
+
   Bytecode() = default;
   ~Bytecode() = default;
 
   void clear();
 
   std::size_t push_byte(std::uint8_t byte, std::size_t line);
+  // Drops the code from address on.
+  void truncate(std::size_t address);
   // TODO: size_t -> std::uint64_t?
   std::size_t push_qword(std::size_t qword, std::size_t line);
   std::size_t push_const(Value value);
+  std::size_t push_function(Function function);
+
+  // Numbers a new property access site, VMs keep an inline cache for each.
+  std::size_t push_property_site();
 
   void set_byte(std::size_t address, std::uint8_t byte);
   void set_qword(std::size_t address, std::size_t qword);
 
-  std::uint8_t get_byte(std::size_t address);
-  std::size_t get_qword(std::size_t address);
+  std::uint8_t get_byte(std::size_t address) const;
+  std::size_t get_qword(std::size_t address) const;
+  std::size_t get_line(std::size_t address) const;
 
-  Value get_const(std::size_t address) const;
+  const Value& get_const(std::size_t address) const;
+  const Function& get_function(std::size_t index) const;
+  const std::vector<Function>& get_functions() const;
+  std::size_t get_property_sites() const;
 
   const std::vector<std::uint8_t>& get_code() const;
 
-  void dump_data();
-  void dump_text();
+  void set_format(Format format);
+  Format get_format() const;
+
+  // Set once a Verifier accepted the code, VMs only run verified code.
+  bool is_verified() const;
+  // Deepest the top level frame's stack gets, the number of registers it
+  // uses in register code.
+  std::size_t get_max_stack() const;
+
+  void dump_data() const;
+  void dump_text() const;
+
+  // Binary image used by the compilation cache. Images are only meant to be
+  // read back on the machine that wrote them; read() returns false on
+  // truncated or foreign input.
+  void write(std::ostream& out) const;
+  bool read(std::istream& in);
 private:
   friend class VirtualMachine;
+  friend class Verifier;
 
   std::vector<std::size_t> m_lines;
   std::vector<Value> m_consts;
+  std::vector<Function> m_functions;
+  std::size_t m_property_sites { 0 };
   std::vector<std::uint8_t> m_code;
+  Format m_format { Format::Stack };
+
+  bool m_verified { false };
+  std::size_t m_max_stack { 0 };
 };
 
+// A compiled program. Bytecode is never modified after compilation, so one
+// Program can be executed by any number of VMs at the same time, on any
+// number of threads.
+typedef std::shared_ptr<const Bytecode> Program;
+
 class VirtualMachine {
 public:
   enum Instruction : std::uint8_t {
@@ -70,6 +168,15 @@ public:
     Greater,
     Less,
 
+    // Operands the compiler proved to be numbers, see
+    // passes::infer_types(). Only integers and doubles are told apart.
+    AddNum,
+    SubNum,
+    MulNum,
+    DivNum,
+    LessNum,
+    GreaterNum,
+
     Print,
 
     LoadNull,
@@ -81,13 +188,79 @@ public:
     StoreLocal,
     LoadLocal,
 
+    // Assignments to locals, the slot is updated in place.
+    PopLocal,
+    IncLocal,
+    AddStoreLocal,
+    SubStoreLocal,
+    MulStoreLocal,
+    DivStoreLocal,
+
     Jump,
     JumpIfFalse,
+    JumpIfTrue,
+    JumpIfFalseKeep,
+    JumpIfTrueKeep,
+
+    // Functions
+    Call,
+    TailCall,
+
+    // Arrays
+    ArrayLiteral,
+    LoadIndex,
+    StoreIndex,
+    Length,
+    Sum,
+    Min,
+    Max,
+    Fill,
+    Map,
+    Append,
+
+    // Objects
+    NewObject,
+    GetProperty,
+    SetProperty,
+    InitProperty,
+
+    // Numeric for loops, the operand addresses the loop's counter, limit,
+    // step and variable, four consecutive locals.
+    ForPrep,
+    ForLoop,
+
+    // Superinstructions, the most frequent sequences --profile-ops found
+    // in the benchmarks: 'LoadLocal a; Constant16 k; op', 'LoadLocal a;
+    // LoadLocal b; op' and 'Constant16 k; op' in a single dispatch. The
+    // last operand is op, one of the arithmetic and comparison
+    // instructions or their Num variants.
+    BinaryLocalConst,
+    BinaryLocals,
+    BinaryConst,
+
+    // Math intrinsics, sqrt(x) and friends and min(a, b)/max(a, b) of two
+    // numbers. The operand is the function, one of the DU_MATH_ constants
+    // of runtime.h.
+    Math,
+    Math2,
+  };
+
+  enum class Status {
+    Finished,
+    Yielded,
+    Error,
   };
 
+  // Fuel that never runs out in practice.
+  static const std::int64_t UNLIMITED = INT64_MAX;
+
   VirtualMachine();
   ~VirtualMachine();
 
+  // Size of an instruction including its operands.
+  static std::size_t instruction_size(std::uint8_t op);
+  static bool is_jump(std::uint8_t op);
+
   Value neg(const Value& a);
   Value add(const Value& a, const Value& b);
   Value sub(const Value& a, const Value& b);
@@ -103,11 +276,68 @@ public:
   Value logical_greater(const Value& a, const Value& b);
   Value logical_less(const Value& a, const Value& b);
 
+  // Math intrinsic function of numbers, b is only used by min and max.
+  // Integers stay integers where the result is one: floor, ceil, round,
+  // abs and min/max of two integers. Also folds calls with literal
+  // arguments at compile time, see passes::fold_constants().
+  static Value math(std::uint8_t function, const Value& a, const Value& b);
+
   void alloc_global(const Value& name);
   void store_global(const Value& name, const Value& value);
   void load_global(const Value& name);
+  // nullptr after reporting an error if there's no such global.
+  const Value* find_global(const Value& name);
+
+  // Enables the baseline JIT for hot loops if the platform supports it.
+  void set_jit(bool enabled);
+
+  // Records every stack code instruction the interpreter executes into
+  // profile, nullptr turns profiling off. Loops running as JIT compiled
+  // code aren't recorded.
+  void set_profile(OpProfile* profile);
+
+  // Where print statements and runtime errors go, a buffered Output of
+  // stdout by default. Output is flushed whenever a program finishes or
+  // fails.
+  void set_output(Output& out);
+  Output& output();
 
+  // Defines the global name as a native function taking arity arguments
+  // (or Native::VARIADIC), which scripts call like their own functions.
+  // Natives survive reset() and stay defined for every program the VM runs,
+  // unless a script assigns the global.
+  void define(const std::string& name, std::uint8_t arity, NativeFunction function,
+      void* data = nullptr);
+
+  // Image of the program suspended at the top level, taken by a native it
+  // called: the bytecode, the stack, globals and everything they reference,
+  // symbols by name. result is the native's result, which is saved as it
+  // is, a VM restoring the image continues right after the call with it.
+  // Natives are saved by name and have to be defined on the restoring VM.
+  // Like bytecode images, snapshots are only meant to be read back on the
+  // machine that wrote them. Reports an error and returns false when
+  // called from inside a function. See snapshot.cc.
+  bool snapshot(std::ostream& out, const Value& result);
+  // Replaces the VM's program, globals and stack with the image's, run()
+  // continues the program. False on truncated or foreign input.
+  bool restore(std::istream& in);
+
+  // Forgets globals and the last program, so the VM can run another one.
+  void reset();
+
+  // Runs a program to completion.
   Value execute(const Bytecode* code);
+  Value execute(Program program);
+
+  // Resumable execution: load() prepares a program, every run() executes
+  // at most fuel instructions and returns Yielded if the program isn't done
+  // yet. All state is kept in the VM, the next run() continues where the
+  // last one stopped. JIT compiled loops are charged per iteration and
+  // yield at their back-edge. Running a program that already finished or
+  // failed is an Error.
+  void load(const Bytecode* code);
+  void load(Program program);
+  Status run(std::int64_t fuel = UNLIMITED);
 
   void halt();
   std::ostream& error();
@@ -115,12 +345,132 @@ public:
   void push(Value value);
   Value pop();
 private:
+  friend class Jit;
+
+  static const std::size_t STACK_SIZE = 1024;
+  static const std::size_t FRAMES_SIZE = 256;
+
+  struct CallFrame {
+    const std::uint8_t* return_ip;
+    Value* base;
+    // Past the caller's registers, register code only.
+    Value* top;
+  };
+
+  // Polymorphic inline cache of a property access site: the slot of the
+  // property for the last few shapes seen there. Stores that add a
+  // property also cache the shape the object transitions to. Sites that
+  // see more shapes than that go through the shape every time.
+  struct PropertyCache {
+    static const std::size_t WAYS = 4;
+
+    struct Entry {
+      const Shape* shape;
+      // Set if the store adds the property.
+      const Shape* transition;
+      std::uint32_t slot;
+    };
+
+    Entry entries[WAYS];
+    std::size_t count { 0 };
+  };
+
+  bool dispatch(std::uint8_t op);
+  // Executes a reg::Instruction, see register_machine.cc.
+  bool dispatch_register(std::uint8_t op);
+  // size is the size of the jump instruction m_ip is right after.
+  void jump(std::size_t address, std::size_t size = 9);
+
+  // Print writes value and a newline.
+  void print(const Value& value);
+
+  // Result of one of the AddNum..GreaterNum instructions.
+  static Value numeric(std::uint8_t op, const Value& a, const Value& b);
+  // Result of the binary instruction op of a superinstruction.
+  Value binary_op(std::uint8_t op, const Value& a, const Value& b);
+  // Result of Math and Math2, b is only used by the latter.
+  Value math_op(std::uint8_t function, const Value& a, const Value& b);
+
+  bool for_prep(Value* loop);
+  bool for_loop(Value* loop);
+
+  // Callee and arguments are on top of the stack.
+  const Function* callee(std::size_t argc);
+  // Whether the stack has room for a frame of function at base.
+  bool fits(const Value* base, const Function& function) const;
+  void call(std::size_t argc);
+  void tail_call(std::size_t argc);
+  bool ret();
+
+  // Calls the native callee with the argc values above it as arguments and
+  // replaces the callee with the result. The arguments are left in place.
+  void call_native(Value* callee, std::size_t argc);
+
+  // Calls and returns of register code. The callee and its arguments are
+  // in consecutive registers starting at callee, the result replaces the
+  // callee.
+  void call_register(Value* callee, std::size_t argc);
+  void tail_call_register(Value* callee, std::size_t argc);
+  bool ret_register(Value result);
+
+  // Checks the operand of an array instruction, returns nullptr after
+  // reporting an error if it isn't an array.
+  ArrayObject* array_operand(const Value& value, const char* what);
+  bool check_index(const ArrayObject& array, const Value& index);
+  // Properties of an object can be indexed by symbols.
+  bool check_key(const Value& key);
+
+  // Cached slot of name in shape. add creates a transition if there's no
+  // such property, otherwise the entry's shape is nullptr.
+  PropertyCache::Entry lookup_property(PropertyCache& cache, const Shape* shape,
+      const Value& name, bool add);
+  void set_property(PropertyCache& cache, const Value& object, const Value& name,
+      const Value& value);
+
+  // Sum, Min and Max of an array.
+  Value reduce(std::uint8_t op, const ArrayObject& array);
+
+  // New array of a[i] op b, b is either a scalar or an array as long as a.
+  Value map(std::uint8_t op, const ArrayObject& a, const Value& b);
+
+  const Value& read_const();
+  std::size_t read_qword();
+  PropertyCache& read_site();
+
   void error(const char* msg);
 
   bool m_halt = false;
   std::unordered_map<std::string, Value> m_globals;
 
+  // Values point at natives, a deque never moves them.
+  std::deque<Native> m_natives;
+
+  Output* m_out;
+  std::unique_ptr<Output> m_stdout;
+
   const Bytecode* m_code { nullptr };
+  // Keeps m_code alive while executing a Program.
+  Program m_program;
   const std::uint8_t* m_ip { nullptr };
+
+  // Instructions left in the current run().
+  std::int64_t m_fuel { 0 };
+
+  // Preallocated, m_sp points past the top of the stack.
   std::vector<Value> m_stack;
+
+  // Preallocated as well, calls never allocate. Locals are addressed
+  // relative to m_fp, the base of the current frame: its first argument,
+  // right above the callee. The top level frame starts at the bottom of
+  // the stack.
+  std::vector<CallFrame> m_frames;
+  std::size_t m_frame_count { 0 };
+  Value* m_fp { nullptr };
+  Value* m_sp { nullptr };
+
+  // One per property access site of m_code.
+  std::vector<PropertyCache> m_property_caches;
+
+  std::unique_ptr<Jit> m_jit;
+  OpProfile* m_profile { nullptr };
 };